@@ -0,0 +1,107 @@
+/* KallistiOS ##version##
+
+   kos/adpcm.h
+*/
+
+#ifndef __KOS_ADPCM_H
+#define __KOS_ADPCM_H
+
+/** \file   kos/adpcm.h
+    \brief  Yamaha ADPCM encoding and decoding.
+
+    This file provides an encoder and a decoder for the 4-bit Yamaha ADPCM
+    format that the AICA plays. The encoder tracks exactly what the AICA will
+    decode, so errors don't build up over time.
+
+    There are two encoders. kos_adpcm_encode() picks the closest code for each
+    sample, and is fast enough to run on the Dreamcast. kos_adpcm_search()
+    also looks at how each code affects the next few samples, which gives
+    less noise but takes many times longer.
+
+    All of the functions work on one channel at a time, and take a stride so
+    that interleaved PCM can be read or written directly. The state is carried
+    from one call to the next, so a long sound can be converted a piece at a
+    time. The utils/wav2adpcm program uses the same code on the host.
+*/
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \brief  The most samples that kos_adpcm_search() can look ahead. */
+#define KOS_ADPCM_DEPTH_MAX     8
+
+/** \brief  Encoder or decoder state of one channel.
+
+    Both sides start from the same state, set with kos_adpcm_reset().
+
+    \headerfile kos/adpcm.h
+*/
+typedef struct kos_adpcm_state {
+    int16_t history;        /**< \brief Last decoded sample. */
+    int16_t step_size;      /**< \brief Current step size. */
+} kos_adpcm_state_t;
+
+/** \brief  Set a channel's state to the start of a sound.
+
+    \param  s           The state to reset.
+*/
+void kos_adpcm_reset(kos_adpcm_state_t *s);
+
+/** \brief  Encode samples with the fast encoder.
+
+    Samples are packed two to a byte, the first one in the low nibble. If
+    count is odd, the high nibble of the last byte is left as 0, and the next
+    call starts on a new byte.
+
+    \param  s           The channel's state.
+    \param  out         Where to put the (count + 1) / 2 bytes of ADPCM.
+    \param  pcm         The first 16-bit sample to encode.
+    \param  count       The number of samples to encode.
+    \param  stride      The distance between samples in pcm, for example 2
+                        for one channel of interleaved stereo.
+*/
+void kos_adpcm_encode(kos_adpcm_state_t *s, uint8_t *out, const int16_t *pcm,
+                      size_t count, int stride);
+
+/** \brief  Encode samples with the searching encoder.
+
+    This works like kos_adpcm_encode(), but chooses each code by trying the
+    likely codes for the next depth samples as well, and keeping the one that
+    leads to the smallest squared error. Each extra sample of depth makes it
+    about twice as slow.
+
+    To give the same results as encoding everything in one call, the search
+    may look at the samples after the ones being encoded, up to avail samples
+    from pcm. avail should be count (at the end of the sound) or at least
+    count + depth.
+
+    \param  s           The channel's state.
+    \param  out         Where to put the (count + 1) / 2 bytes of ADPCM.
+    \param  pcm         The first 16-bit sample to encode.
+    \param  count       The number of samples to encode.
+    \param  avail       The number of samples that may be read from pcm.
+    \param  stride      The distance between samples in pcm.
+    \param  depth       How many samples to look at for each code, from 1 to
+                        KOS_ADPCM_DEPTH_MAX.
+*/
+void kos_adpcm_search(kos_adpcm_state_t *s, uint8_t *out, const int16_t *pcm,
+                      size_t count, size_t avail, int stride, int depth);
+
+/** \brief  Decode samples.
+
+    \param  s           The channel's state.
+    \param  out         Where to put the count 16-bit samples.
+    \param  in          The ADPCM data, two samples to a byte, the first one
+                        in the low nibble.
+    \param  count       The number of samples to decode.
+    \param  stride      The distance between samples in out.
+*/
+void kos_adpcm_decode(kos_adpcm_state_t *s, int16_t *out, const uint8_t *in,
+                      size_t count, int stride);
+
+__END_DECLS
+
+#endif /* !__KOS_ADPCM_H */
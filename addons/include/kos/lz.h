@@ -0,0 +1,212 @@
+/* KallistiOS ##version##
+
+   kos/lz.h
+*/
+
+#ifndef __KOS_LZ_H
+#define __KOS_LZ_H
+
+/** \file   kos/lz.h
+    \brief  Fast LZ compression.
+
+    This file provides a small, fast compressor in the LZ family, meant for
+    things like save games on the VMU, network payloads, and cached assets.
+    Decompression is much faster than compression, and doesn't allocate any
+    memory.
+
+    Compressed blocks are in the LZ4 block format. There are two ways of using
+    them:
+
+    - The one-shot functions compress and decompress a whole buffer at once.
+      The caller has to keep track of the sizes.
+    - The stream functions split the data into blocks of a fixed size (from
+      512 bytes, the size of a VMU block, to 64KB). They work in memory that
+      the caller provides, which holds one block. Streams have a small header
+      and mark their end, so they can be decompressed without knowing their
+      size.
+
+    The utils/koslz program reads and writes the same stream format on the
+    host, so data can be compressed at build time and decompressed on the
+    Dreamcast, or the other way around.
+*/
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** \brief  The most that size bytes can grow when compressed.
+
+    A buffer of this size is always big enough for kos_lz_compress().
+*/
+#define KOS_LZ_BOUND(size)      ((size) + (size) / 255 + 16)
+
+/** \brief  The extra space needed to decompress in place.
+
+    To decompress a block without a second buffer, load the csize compressed
+    bytes at the end of a buffer that is this much bigger than the
+    decompressed data, and decompress to the start of the buffer.
+*/
+#define KOS_LZ_INPLACE_MARGIN(csize)    (((csize) >> 8) + 32)
+
+/** \brief  Smallest block size for streams. */
+#define KOS_LZ_BLOCK_MIN        512
+
+/** \brief  Largest block size for streams. */
+#define KOS_LZ_BLOCK_MAX        65536
+
+/** \brief  Size of the work memory of a compression stream. */
+#define KOS_LZ_ENC_WORK_SIZE(block)     (16384 + 2 * (block) + 4)
+
+/** \brief  Size of the work memory of a decompression stream. */
+#define KOS_LZ_DEC_WORK_SIZE(block)     (2 * (block))
+
+/** \brief  Compress a buffer.
+
+    This function compresses size bytes into dst. Nothing is written past
+    dst + dstmax; if the compressed data wouldn't fit, 0 is returned. To always
+    succeed, dstmax must be at least KOS_LZ_BOUND(size).
+
+    This function allocates 16KB of work memory while it runs.
+
+    \param  src         The data to compress.
+    \param  size        The number of bytes to compress.
+    \param  dst         Where to put the compressed data.
+    \param  dstmax      How many bytes fit in dst.
+    \return             The size of the compressed data, 0 if it didn't fit in
+                        dst, or -1 if the work memory couldn't be allocated.
+*/
+int kos_lz_compress(const void *src, size_t size, void *dst, size_t dstmax);
+
+/** \brief  Decompress a buffer.
+
+    This function decompresses data that was compressed with
+    kos_lz_compress(). It doesn't allocate any memory, and never reads or
+    writes outside of the buffers it is given, even if the data is corrupt.
+
+    The data can be decompressed in place, see KOS_LZ_INPLACE_MARGIN().
+
+    \param  src         The compressed data.
+    \param  size        The size of the compressed data.
+    \param  dst         Where to put the decompressed data.
+    \param  dstmax      How many bytes fit in dst.
+    \return             The size of the decompressed data, or -1 if the data
+                        is corrupt or doesn't fit in dst.
+*/
+int kos_lz_decompress(const void *src, size_t size, void *dst, size_t dstmax);
+
+/** \brief  Output function of a stream.
+
+    Streams pass their output to a function of this type, in pieces of at most
+    one block (plus 4 bytes when compressing).
+
+    \param  data        The data pointer given when starting the stream.
+    \param  buf         The output.
+    \param  size        The size of the output.
+    \return             0 on success, or -1 to stop the stream with an error.
+*/
+typedef int (*kos_lz_write_t)(void *data, const uint8_t *buf, size_t size);
+
+/** \brief  Compression or decompression stream.
+
+    The contents of this structure should not be changed. Use the kos_lz_enc_*
+    or kos_lz_dec_* functions to set it up and use it.
+
+    \headerfile kos/lz.h
+*/
+typedef struct kos_lz_stream {
+    kos_lz_write_t write;   /**< \brief Output function. */
+    void *data;             /**< \brief Output function's data pointer. */
+    uint8_t *work;          /**< \brief Work memory. */
+    size_t work_size;       /**< \brief Size of the work memory. */
+    size_t block_size;      /**< \brief Size of a block. */
+    size_t fill;            /**< \brief Bytes waiting in the work memory. */
+    size_t need;            /**< \brief Bytes needed for the next step. */
+    uint32_t pos;           /**< \brief Position in the input. */
+    int state;              /**< \brief Where the stream is. */
+} kos_lz_stream_t;
+
+/** \brief  Start compressing a stream.
+
+    The header of the stream is written right away.
+
+    \param  s           The stream to set up.
+    \param  block_size  The block size: a power of two from KOS_LZ_BLOCK_MIN
+                        to KOS_LZ_BLOCK_MAX. Larger blocks compress better.
+    \param  work        KOS_LZ_ENC_WORK_SIZE(block_size) bytes of memory,
+                        aligned to 4 bytes, which must stay valid until
+                        kos_lz_enc_finish() is called.
+    \param  write       The function to pass the compressed data to.
+    \param  data        A pointer to pass to write.
+    \retval 0           On success.
+    \retval -1          If block_size is invalid or write failed.
+*/
+int kos_lz_enc_start(kos_lz_stream_t *s, size_t block_size, void *work,
+                     kos_lz_write_t write, void *data);
+
+/** \brief  Compress data into a stream.
+
+    The data is compressed and written a block at a time, as each block is
+    filled.
+
+    \param  s           The stream.
+    \param  buf         The data to compress.
+    \param  size        The size of the data.
+    \retval 0           On success.
+    \retval -1          If the stream's write function failed.
+*/
+int kos_lz_enc_write(kos_lz_stream_t *s, const void *buf, size_t size);
+
+/** \brief  Finish compressing a stream.
+
+    This function compresses what is left and writes the end of the stream.
+
+    \param  s           The stream.
+    \retval 0           On success.
+    \retval -1          If the stream's write function failed.
+*/
+int kos_lz_enc_finish(kos_lz_stream_t *s);
+
+/** \brief  Start decompressing a stream.
+
+    \param  s           The stream to set up.
+    \param  work        Memory for the stream, which must stay valid until
+                        kos_lz_dec_finish() is called. Streams with blocks of
+                        up to n bytes can be decompressed with
+                        KOS_LZ_DEC_WORK_SIZE(n) bytes.
+    \param  work_size   The size of work.
+    \param  write       The function to pass the decompressed data to.
+    \param  data        A pointer to pass to write.
+    \retval 0           On success.
+    \retval -1          If work is too small for any stream.
+*/
+int kos_lz_dec_start(kos_lz_stream_t *s, void *work, size_t work_size,
+                     kos_lz_write_t write, void *data);
+
+/** \brief  Decompress data from a stream.
+
+    The compressed data can be passed in pieces of any size. Each block is
+    decompressed and written as soon as all of it has been passed in. Data past
+    the end of the stream is ignored.
+
+    \param  s           The stream.
+    \param  buf         The compressed data.
+    \param  size        The size of the compressed data.
+    \retval 0           On success.
+    \retval -1          If the data is corrupt, its blocks are too big for the
+                        work memory, or the stream's write function failed.
+*/
+int kos_lz_dec_write(kos_lz_stream_t *s, const void *buf, size_t size);
+
+/** \brief  Finish decompressing a stream.
+
+    \param  s           The stream.
+    \retval 0           If the end of the stream was reached.
+    \retval -1          If the stream is incomplete or had an error.
+*/
+int kos_lz_dec_finish(kos_lz_stream_t *s);
+
+__END_DECLS
+
+#endif /* !__KOS_LZ_H */
@@ -0,0 +1,198 @@
+/* KallistiOS ##version##
+
+   adpcm.c
+
+   Yamaha ADPCM encoder and decoder. The decoder is the same as in the sound
+   mixer and in wav2adpcm, and both encoders model it exactly, including its
+   high pass filter. Nothing in the fast paths needs a division, which is slow
+   on the SH4.
+*/
+
+#include <kos/adpcm.h>
+
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+
+/* How the step size changes after each code magnitude, in 1/256ths */
+static const int step_table[8] = {
+    230, 230, 230, 230, 307, 409, 512, 614
+};
+
+void kos_adpcm_reset(kos_adpcm_state_t *s) {
+    s->history = 0;
+    s->step_size = 127;
+}
+
+/* What the decoder predicts before it applies the next code */
+static inline int predict(int history) {
+    return history * 254 / 256;
+}
+
+/* Apply one code to the state, and return the decoded sample */
+static inline int step(int code, int *history, int *step_size) {
+    int delta = code & 7;
+    int diff = ((1 + (delta << 1)) * *step_size) >> 3;
+    int newval = predict(*history);
+    int nstep = (step_table[delta] * *step_size) >> 8;
+
+    diff = CLAMP(diff, 0, 32767);
+
+    if(code & 8)
+        newval -= diff;
+    else
+        newval += diff;
+
+    *step_size = CLAMP(nstep, 127, 24576);
+    *history = newval = CLAMP(newval, -32768, 32767);
+    return newval;
+}
+
+/* The code that gets closest to sample in one step. The magnitude is
+   4 * |difference| / step_size, worked out with comparisons. */
+static inline int nearest(int sample, int history, int step_size) {
+    int d = sample - predict(history);
+    int a = (d < 0 ? -d : d) << 2;
+    int t = step_size, code = 0;
+
+    while(code < 7 && a >= t) {
+        code++;
+        t += step_size;
+    }
+
+    return d < 0 ? code | 8 : code;
+}
+
+/* The codes worth trying for a sample: the nearest one and its neighbours.
+   Returns how many there are. */
+static inline int candidates(int sample, int history, int step_size,
+                             int codes[4]) {
+    int code = nearest(sample, history, step_size);
+    int mag = code & 7, sign = code & 8, n = 0;
+
+    codes[n++] = code;
+
+    if(mag > 0)
+        codes[n++] = sign | (mag - 1);
+    else
+        codes[n++] = sign ^ 8;
+
+    if(mag < 7)
+        codes[n++] = sign | (mag + 1);
+
+    return n;
+}
+
+static inline void put(uint8_t *out, size_t i, int code) {
+    if(i & 1)
+        out[i >> 1] |= code << 4;
+    else
+        out[i >> 1] = code;
+}
+
+void kos_adpcm_encode(kos_adpcm_state_t *s, uint8_t *out, const int16_t *pcm,
+                      size_t count, int stride) {
+    int history = s->history, step_size = s->step_size;
+    int lo, hi;
+
+    for(; count >= 2; count -= 2) {
+        lo = nearest(pcm[0], history, step_size);
+        step(lo, &history, &step_size);
+        hi = nearest(pcm[stride], history, step_size);
+        step(hi, &history, &step_size);
+        *out++ = lo | (hi << 4);
+        pcm += stride * 2;
+    }
+
+    if(count) {
+        lo = nearest(pcm[0], history, step_size);
+        step(lo, &history, &step_size);
+        *out = lo;
+    }
+
+    s->history = history;
+    s->step_size = step_size;
+}
+
+/* The smallest squared error over the next n samples, starting from a state.
+   Branches that can't beat limit are cut off, in which case the result is at
+   least limit. */
+static int64_t search(const int16_t *pcm, int n, int stride, int history,
+                      int step_size, int64_t limit) {
+    int codes[4], count, i, h, st, v;
+    int64_t err, best = limit;
+
+    count = candidates(pcm[0], history, step_size, codes);
+
+    for(i = 0; i < count; i++) {
+        h = history;
+        st = step_size;
+        v = pcm[0] - step(codes[i], &h, &st);
+        err = (int64_t)v * v;
+
+        if(err >= best)
+            continue;
+
+        if(n > 1)
+            err += search(pcm + stride, n - 1, stride, h, st, best - err);
+
+        if(err < best)
+            best = err;
+    }
+
+    return best;
+}
+
+void kos_adpcm_search(kos_adpcm_state_t *s, uint8_t *out, const int16_t *pcm,
+                      size_t count, size_t avail, int stride, int depth) {
+    int history = s->history, step_size = s->step_size;
+    int codes[4], n, i, nc, h, st, v, code;
+    int64_t err, best;
+    size_t pos;
+
+    depth = CLAMP(depth, 1, KOS_ADPCM_DEPTH_MAX);
+
+    if(avail < count)
+        avail = count;
+
+    for(pos = 0; pos < count; pos++, pcm += stride) {
+        n = avail - pos < (size_t)depth ? (int)(avail - pos) : depth;
+        nc = candidates(pcm[0], history, step_size, codes);
+        code = codes[0];
+        best = INT64_MAX;
+
+        for(i = 0; i < nc; i++) {
+            h = history;
+            st = step_size;
+            v = pcm[0] - step(codes[i], &h, &st);
+            err = (int64_t)v * v;
+
+            if(err >= best)
+                continue;
+
+            if(n > 1)
+                err += search(pcm + stride, n - 1, stride, h, st, best - err);
+
+            if(err < best) {
+                best = err;
+                code = codes[i];
+            }
+        }
+
+        step(code, &history, &step_size);
+        put(out, pos, code);
+    }
+
+    s->history = history;
+    s->step_size = step_size;
+}
+
+void kos_adpcm_decode(kos_adpcm_state_t *s, int16_t *out, const uint8_t *in,
+                      size_t count, int stride) {
+    int history = s->history, step_size = s->step_size;
+    size_t i;
+
+    for(i = 0; i < count; i++, out += stride)
+        *out = step((in[i >> 1] >> ((i & 1) << 2)) & 15, &history, &step_size);
+
+    s->history = history;
+    s->step_size = step_size;
+}
@@ -0,0 +1,527 @@
+/* KallistiOS ##version##
+
+   lz.c
+
+   Fast LZ compression, see kos/lz.h. This file only uses the C library, so
+   that utils/koslz can build it on the host too.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <kos/lz.h>
+
+/* Limits of the LZ4 block format */
+#define MINMATCH        4
+#define LASTLITERALS    5       /* The last bytes of a block are literals */
+#define MFLIMIT         12      /* No match can start this close to the end */
+#define MAXOFFSET       65535
+
+/* The encoder's hash table has this many entries of 4 bytes */
+#define HASH_BITS       12
+#define HASH_SIZE       (4 << HASH_BITS)
+
+/* Stream format: a header of "KLZ", the version, the log2 of the block size
+   and 3 reserved bytes. Then the blocks, each with a 4-byte little-endian
+   header holding the size of the block's data, and a flag for blocks stored
+   uncompressed. A header of 0 ends the stream. */
+#define STREAM_MAGIC    "KLZ\x01"
+#define STREAM_HDR      8
+#define BLOCK_HDR       4
+#define BLOCK_RAW       0x80000000
+
+/* Stream states */
+#define ST_HEADER       0
+#define ST_BLOCK_HDR    1
+#define ST_BLOCK        2
+#define ST_BLOCK_RAW    3
+#define ST_END          4
+#define ST_ERROR        5
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Write a sequence of literals followed by a match (if mlen isn't 0). Returns
+   NULL if it doesn't fit before oend. */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                             size_t litlen, size_t off, size_t mlen) {
+    uint8_t *token;
+    size_t n;
+
+    n = 1 + litlen;
+
+    if(litlen >= 15)
+        n += (litlen - 15) / 255 + 1;
+
+    if(mlen) {
+        n += 2;
+
+        if(mlen - MINMATCH >= 15)
+            n += (mlen - MINMATCH - 15) / 255 + 1;
+    }
+
+    if((size_t)(oend - op) < n)
+        return NULL;
+
+    token = op++;
+
+    if(litlen >= 15) {
+        *token = 15 << 4;
+
+        for(n = litlen - 15; n >= 255; n -= 255)
+            *op++ = 255;
+
+        *op++ = n;
+    }
+    else {
+        *token = litlen << 4;
+    }
+
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if(!mlen)
+        return op;
+
+    *op++ = off;
+    *op++ = off >> 8;
+    mlen -= MINMATCH;
+
+    if(mlen >= 15) {
+        *token |= 15;
+
+        for(n = mlen - 15; n >= 255; n -= 255)
+            *op++ = 255;
+
+        *op++ = n;
+    }
+    else {
+        *token |= mlen;
+    }
+
+    return op;
+}
+
+/* Compress a block. The hash table holds positions offset by base, so that
+   entries left over from earlier blocks of a stream can be told apart without
+   clearing the table; the caller has to make sure base + size doesn't wrap.
+   Returns the compressed size, or 0 if it doesn't fit in dstmax. */
+static size_t compress_block(uint32_t *table, uint32_t base,
+                             const uint8_t *src, size_t size,
+                             uint8_t *dst, size_t dstmax) {
+    uint8_t *op = dst, *oend = dst + dstmax;
+    size_t ip = 0, anchor = 0, ref, mlen;
+    uint32_t h, v;
+
+    if(size > MFLIMIT) {
+        while(ip < size - MFLIMIT) {
+            v = read32(src + ip);
+            h = hash32(v);
+            ref = table[h] - base;
+            table[h] = base + ip;
+
+            /* Entries from before this block wrap around to huge values */
+            if(ref >= ip || ip - ref > MAXOFFSET || read32(src + ref) != v) {
+                /* Skip faster through data that doesn't compress */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+
+            mlen = MINMATCH;
+
+            while(ip + mlen < size - LASTLITERALS &&
+                    src[ip + mlen] == src[ref + mlen])
+                mlen++;
+
+            op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref,
+                              mlen);
+
+            if(!op)
+                return 0;
+
+            ip += mlen;
+            anchor = ip;
+
+            /* Give the next search a better chance of finding something */
+            if(ip < size - MFLIMIT)
+                table[hash32(read32(src + ip - 2))] = base + ip - 2;
+        }
+    }
+
+    op = put_sequence(op, oend, src + anchor, size - anchor, 0, 0);
+
+    return op ? (size_t)(op - dst) : 0;
+}
+
+int kos_lz_compress(const void *src, size_t size, void *dst, size_t dstmax) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint32_t *table;
+    size_t rv;
+
+    if(!(table = (uint32_t *)calloc(1, HASH_SIZE)))
+        return -1;
+
+    /* A base of 1 keeps positions away from the empty entries, which are 0 */
+    rv = compress_block(table, 1, s, size, (uint8_t *)dst, dstmax);
+    free(table);
+
+    return rv;
+}
+
+/* Read the extra bytes of a length. Returns 0 if the data ends first. */
+static inline int get_length(const uint8_t **ip, const uint8_t *iend,
+                             size_t *len) {
+    unsigned int b;
+
+    do {
+        if(*ip >= iend)
+            return 0;
+
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+
+    return 1;
+}
+
+int kos_lz_decompress(const void *src, size_t size, void *dst, size_t dstmax) {
+    const uint8_t *ip = (const uint8_t *)src, *iend = ip + size, *match;
+    uint8_t *op = (uint8_t *)dst, *oend = op + dstmax;
+    unsigned int token;
+    size_t len, off;
+
+    while(ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+
+        if(len == 15 && !get_length(&ip, iend, &len))
+            return -1;
+
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+
+        /* When decompressing in place, the literals can overlap the output */
+        memmove(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence has no match */
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if(!off || off > (size_t)(op - (uint8_t *)dst))
+            return -1;
+
+        len = token & 15;
+
+        if(len == 15 && !get_length(&ip, iend, &len))
+            return -1;
+
+        len += MINMATCH;
+
+        if(len > (size_t)(oend - op))
+            return -1;
+
+        match = op - off;
+
+        /* An overlapping match repeats the last off bytes. Each copy of the
+           pattern doubles how much can be copied from match next time. */
+        while(len > off) {
+            memcpy(op, match, off);
+            op += off;
+            len -= off;
+            off <<= 1;
+        }
+
+        memcpy(op, match, len);
+        op += len;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/* Compression streams. The work memory holds the hash table, then the block
+   being filled, then room for a compressed block and its header. */
+
+static int enc_block(kos_lz_stream_t *s, const uint8_t *src, size_t size) {
+    uint32_t *table = (uint32_t *)s->work;
+    uint8_t *out = s->work + HASH_SIZE + s->block_size;
+    size_t len;
+
+    /* Start over before the positions wrap around */
+    if(s->pos > 0xffffffffU - KOS_LZ_BLOCK_MAX) {
+        memset(table, 0, HASH_SIZE);
+        s->pos = 1;
+    }
+
+    /* Blocks that don't get any smaller are stored as they are */
+    len = compress_block(table, s->pos, src, size, out + BLOCK_HDR, size - 1);
+    s->pos += size;
+
+    if(len) {
+        put_le32(out, len);
+    }
+    else {
+        put_le32(out, size | BLOCK_RAW);
+        memcpy(out + BLOCK_HDR, src, size);
+        len = size;
+    }
+
+    if(s->write(s->data, out, BLOCK_HDR + len) < 0) {
+        s->state = ST_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+int kos_lz_enc_start(kos_lz_stream_t *s, size_t block_size, void *work,
+                     kos_lz_write_t write, void *data) {
+    uint8_t hdr[STREAM_HDR] = STREAM_MAGIC;
+    int shift;
+
+    if(block_size < KOS_LZ_BLOCK_MIN || block_size > KOS_LZ_BLOCK_MAX ||
+            (block_size & (block_size - 1)))
+        return -1;
+
+    for(shift = 0; (1U << shift) < block_size; shift++)
+        ;
+
+    s->write = write;
+    s->data = data;
+    s->work = (uint8_t *)work;
+    s->work_size = KOS_LZ_ENC_WORK_SIZE(block_size);
+    s->block_size = block_size;
+    s->fill = 0;
+    s->need = 0;
+    s->pos = 1;
+    s->state = ST_BLOCK;
+
+    memset(s->work, 0, HASH_SIZE);
+
+    hdr[4] = shift;
+
+    if(write(data, hdr, STREAM_HDR) < 0) {
+        s->state = ST_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+int kos_lz_enc_write(kos_lz_stream_t *s, const void *buf, size_t size) {
+    const uint8_t *p = (const uint8_t *)buf;
+    uint8_t *window = s->work + HASH_SIZE;
+    size_t n;
+
+    if(s->state != ST_BLOCK)
+        return -1;
+
+    while(size) {
+        /* Whole blocks can be compressed straight from the caller's buffer */
+        if(!s->fill && size >= s->block_size) {
+            if(enc_block(s, p, s->block_size) < 0)
+                return -1;
+
+            p += s->block_size;
+            size -= s->block_size;
+            continue;
+        }
+
+        n = s->block_size - s->fill;
+
+        if(n > size)
+            n = size;
+
+        memcpy(window + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        size -= n;
+
+        if(s->fill == s->block_size) {
+            s->fill = 0;
+
+            if(enc_block(s, window, s->block_size) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int kos_lz_enc_finish(kos_lz_stream_t *s) {
+    uint8_t end[BLOCK_HDR] = { 0 };
+
+    if(s->state != ST_BLOCK)
+        return -1;
+
+    if(s->fill && enc_block(s, s->work + HASH_SIZE, s->fill) < 0)
+        return -1;
+
+    s->fill = 0;
+    s->state = ST_END;
+
+    if(s->write(s->data, end, BLOCK_HDR) < 0) {
+        s->state = ST_ERROR;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decompression streams. The work memory holds a block's compressed data
+   (or the header being read), then its decompressed data. */
+
+int kos_lz_dec_start(kos_lz_stream_t *s, void *work, size_t work_size,
+                     kos_lz_write_t write, void *data) {
+    if(work_size < KOS_LZ_DEC_WORK_SIZE(KOS_LZ_BLOCK_MIN))
+        return -1;
+
+    s->write = write;
+    s->data = data;
+    s->work = (uint8_t *)work;
+    s->work_size = work_size;
+    s->block_size = 0;
+    s->fill = 0;
+    s->need = STREAM_HDR;
+    s->pos = 0;
+    s->state = ST_HEADER;
+
+    return 0;
+}
+
+/* Handle a complete header or block. */
+static int dec_step(kos_lz_stream_t *s, const uint8_t *p) {
+    uint32_t v;
+    int len;
+
+    switch(s->state) {
+        case ST_HEADER:
+            if(memcmp(p, STREAM_MAGIC, 4) || p[4] < 9 || p[4] > 16)
+                return -1;
+
+            s->block_size = 1 << p[4];
+
+            if(s->work_size < KOS_LZ_DEC_WORK_SIZE(s->block_size))
+                return -1;
+
+            s->state = ST_BLOCK_HDR;
+            s->need = BLOCK_HDR;
+            break;
+
+        case ST_BLOCK_HDR:
+            v = get_le32(p);
+
+            if(!v) {
+                s->state = ST_END;
+                break;
+            }
+
+            s->state = (v & BLOCK_RAW) ? ST_BLOCK_RAW : ST_BLOCK;
+            s->need = v & ~BLOCK_RAW;
+
+            if(!s->need || s->need > s->block_size)
+                return -1;
+
+            break;
+
+        case ST_BLOCK:
+            len = kos_lz_decompress(p, s->need, s->work + s->block_size,
+                                    s->block_size);
+
+            if(len < 0 || s->write(s->data, s->work + s->block_size, len) < 0)
+                return -1;
+
+            s->state = ST_BLOCK_HDR;
+            s->need = BLOCK_HDR;
+            break;
+
+        case ST_BLOCK_RAW:
+            if(s->write(s->data, p, s->need) < 0)
+                return -1;
+
+            s->state = ST_BLOCK_HDR;
+            s->need = BLOCK_HDR;
+            break;
+    }
+
+    return 0;
+}
+
+int kos_lz_dec_write(kos_lz_stream_t *s, const void *buf, size_t size) {
+    const uint8_t *p = (const uint8_t *)buf;
+    size_t n;
+
+    while(size && s->state != ST_END) {
+        if(s->state == ST_ERROR)
+            return -1;
+
+        /* Use the caller's buffer directly if all of it is there */
+        if(!s->fill && size >= s->need) {
+            n = s->need;
+
+            if(dec_step(s, p) < 0) {
+                s->state = ST_ERROR;
+                return -1;
+            }
+
+            p += n;
+            size -= n;
+            continue;
+        }
+
+        n = s->need - s->fill;
+
+        if(n > size)
+            n = size;
+
+        memcpy(s->work + s->fill, p, n);
+        s->fill += n;
+        p += n;
+        size -= n;
+
+        if(s->fill == s->need) {
+            s->fill = 0;
+
+            if(dec_step(s, s->work) < 0) {
+                s->state = ST_ERROR;
+                return -1;
+            }
+        }
+    }
+
+    return s->state == ST_ERROR ? -1 : 0;
+}
+
+int kos_lz_dec_finish(kos_lz_stream_t *s) {
+    return s->state == ST_END ? 0 : -1;
+}
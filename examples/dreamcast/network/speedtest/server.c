@@ -14,6 +14,11 @@
 #define BACKLOG         1
 #define HTTP_PORT       80
 
+/* Socket buffer sizes. Anything over 64KiB relies on TCP window scaling, which
+   is negotiated in the <SYN,ACK>, so these need to be set on the listening
+   socket rather than on each accepted connection. */
+#define SOCK_BUF_SIZE   (256 * 1024)
+
 void *server_thread(void *p) {
     (void) p;
     int server_socket;
@@ -35,6 +40,10 @@ void *server_thread(void *p) {
         goto server_cleanup;
     }
 
+    uint32_t new_buf_sz = SOCK_BUF_SIZE;
+    setsockopt(server_socket, SOL_SOCKET, SO_SNDBUF, &new_buf_sz, sizeof(new_buf_sz));
+    setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, &new_buf_sz, sizeof(new_buf_sz));
+
     if(listen(server_socket, BACKLOG) < 0) {
         printf("server_thread: listen failed\n");
         goto server_cleanup;
@@ -56,10 +65,6 @@ void *server_thread(void *p) {
             goto server_cleanup;
         }
 
-        uint32_t new_buf_sz = 65535;
-        setsockopt(hr->socket, SOL_SOCKET, SO_SNDBUF, &new_buf_sz, sizeof(new_buf_sz));
-        setsockopt(hr->socket, SOL_SOCKET, SO_RCVBUF, &new_buf_sz, sizeof(new_buf_sz));
-
         /* Create thread for new client */
         thd_create(DETACHED_THREAD, handle_request, hr);
     }
@@ -0,0 +1,156 @@
+/* KallistiOS ##version##
+
+   pvrmark_dlist.c
+
+   This example measures how much CPU time it takes each frame to submit the
+   same static geometry, first by copying every vertex into the vertex buffer
+   with pvr_list_prim() as usual, then by replaying a recorded display list,
+   and finally by replaying it through the current matrix. Press Start to
+   skip to the next test.
+
+   The vertices are generated only once, so the first test doesn't include the
+   time it would take to build them each frame, which is also saved by using a
+   display list.
+*/
+
+#include <kos.h>
+#include <stdlib.h>
+
+#define POLYS       4000
+#define FRAMES      300
+#define VERTBUF_SIZE (1024 * 1024)
+
+pvr_init_params_t pvr_params = {
+    { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0, PVR_BINSIZE_0 },
+    1024 * 1024, 1, 0, 0, 3, 0
+};
+
+static uint8_t __attribute__((aligned(32))) op_buf[VERTBUF_SIZE];
+static pvr_vertex_t verts[POLYS * 3];
+static pvr_poly_hdr_t hdr;
+static pvr_dlist_t dl;
+
+enum { TEST_PRIM, TEST_DLIST, TEST_DLIST_MAT, TEST_COUNT };
+
+static const char *names[TEST_COUNT] = {
+    "pvr_list_prim()", "pvr_dlist_submit()", "pvr_dlist_submit_mat()"
+};
+
+static int check_start(void) {
+    maple_device_t *cont;
+    cont_state_t *state;
+
+    cont = maple_enum_type(0, MAPLE_FUNC_CONTROLLER);
+
+    if(!cont || !(state = (cont_state_t *)maple_dev_status(cont)))
+        return 0;
+
+    return state->buttons & CONT_START;
+}
+
+static void setup(void) {
+    pvr_poly_cxt_t cxt;
+    int i, x, y, size, col;
+
+    pvr_init(&pvr_params);
+    pvr_set_bg_color(0, 0, 0);
+    pvr_set_vertbuf(PVR_LIST_OP_POLY, op_buf, VERTBUF_SIZE);
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+    cxt.gen.shading = PVR_SHADE_FLAT;
+    pvr_poly_compile(&hdr, &cxt);
+
+    for(i = 0; i < POLYS; i++) {
+        x = rand() % 640;
+        y = rand() % 480;
+        size = rand() % 32 + 1;
+        col = rand() & 0xff;
+
+        verts[i * 3].flags = PVR_CMD_VERTEX;
+        verts[i * 3].x = x - size;
+        verts[i * 3].y = y + size;
+        verts[i * 3].z = 1.0f;
+        verts[i * 3].argb = col | (col << 8) | (col << 16) | 0xff000000;
+        verts[i * 3 + 1] = verts[i * 3];
+        verts[i * 3 + 1].y = y - size;
+        verts[i * 3 + 2] = verts[i * 3];
+        verts[i * 3 + 2].flags = PVR_CMD_VERTEX_EOL;
+        verts[i * 3 + 2].x = x + size;
+    }
+
+    /* Record the whole thing once */
+    pvr_dlist_init(&dl, sizeof(hdr) + sizeof(verts));
+    pvr_dlist_add(&dl, &hdr, sizeof(hdr));
+    pvr_dlist_add(&dl, verts, sizeof(verts));
+}
+
+/* Draw one frame, returning how long it took to submit the geometry */
+static uint64_t do_frame(int test) {
+    uint64_t start, end;
+    int i;
+
+    pvr_wait_ready();
+
+    start = timer_ns_gettime64();
+    pvr_scene_begin();
+    pvr_list_begin(PVR_LIST_OP_POLY);
+
+    switch(test) {
+        case TEST_PRIM:
+            pvr_prim(&hdr, sizeof(hdr));
+
+            for(i = 0; i < POLYS * 3; i++)
+                pvr_prim(&verts[i], sizeof(pvr_vertex_t));
+
+            break;
+
+        case TEST_DLIST:
+            pvr_dlist_submit(&dl, PVR_LIST_OP_POLY);
+            break;
+
+        case TEST_DLIST_MAT:
+            mat_identity();
+            pvr_dlist_submit_mat(&dl, PVR_LIST_OP_POLY);
+            break;
+    }
+
+    pvr_list_finish();
+    pvr_scene_finish();
+    end = timer_ns_gettime64();
+
+    return end - start;
+}
+
+int main(int argc, char **argv) {
+    uint64_t total, min, max, t;
+    int test, i;
+
+    setup();
+
+    printf("Submitting %d polys per frame:\n", POLYS);
+
+    for(test = 0; test < TEST_COUNT; test++) {
+        total = max = 0;
+        min = ~0ULL;
+
+        for(i = 0; i < FRAMES && !check_start(); i++) {
+            t = do_frame(test);
+            total += t;
+
+            if(t < min) min = t;
+            if(t > max) max = t;
+        }
+
+        while(check_start())
+            do_frame(test);
+
+        if(i)
+            printf("  %-24s min %6u  avg %6u  max %6u us per frame\n",
+                   names[test], (unsigned)(min / 1000),
+                   (unsigned)(total / i / 1000), (unsigned)(max / 1000));
+    }
+
+    pvr_dlist_free(&dl);
+
+    return 0;
+}
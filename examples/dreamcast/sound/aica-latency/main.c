@@ -0,0 +1,157 @@
+/* KallistiOS ##version##
+
+   main.c
+
+   This example measures how long it takes from submitting a command to the
+   AICA until the channel actually starts playing, for single commands, for
+   batches of commands, and for commands scheduled at a given sample.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <arch/timer.h>
+#include <dc/spu.h>
+#include <dc/sound/sound.h>
+#include <dc/sound/aica_comm.h>
+
+#define RUNS        64
+#define BATCH       8
+#define SMP_LEN     4096
+
+static uint32_t sample;
+static int16_t wave[SMP_LEN];
+
+/* Fill in a packet to start channel chn. */
+static void make_start(uint32_t *pkt, int chn, uint32_t flags) {
+    aica_cmd_t *cmd = (aica_cmd_t *)pkt;
+    aica_channel_t *chan = (aica_channel_t *)cmd->cmd_data;
+
+    memset(pkt, 0, AICA_CMDSTR_CHANNEL_SIZE * 4);
+    cmd->cmd = AICA_CMD_CHAN;
+    cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
+    cmd->cmd_id = chn;
+    chan->cmd = AICA_CH_CMD_START | flags;
+    chan->base = sample;
+    chan->type = AICA_SM_16BIT;
+    chan->length = SMP_LEN;
+    chan->loop = 1;
+    chan->loopend = SMP_LEN - 1;
+    chan->freq = 44100;
+    chan->vol = 32;
+    chan->pan = 128;
+}
+
+static void stop_all(int cnt) {
+    AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
+    int i;
+
+    memset(tmp, 0, sizeof(tmp));
+    cmd->cmd = AICA_CMD_CHAN;
+    cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
+    chan->cmd = AICA_CH_CMD_STOP;
+
+    for(i = 0; i < cnt; i++) {
+        cmd->cmd_id = i;
+        snd_sh4_to_aica(tmp, cmd->size);
+    }
+
+    while(snd_is_playing(0))
+        ;
+
+    timer_spin_sleep(5);
+}
+
+static void report(const char *what, uint64_t *us) {
+    uint64_t min = ~0ULL, max = 0, total = 0;
+    int i;
+
+    for(i = 0; i < RUNS; i++) {
+        if(us[i] < min) min = us[i];
+        if(us[i] > max) max = us[i];
+        total += us[i];
+    }
+
+    printf("%-32s min %5u  avg %5u  max %5u us\n", what, (unsigned)min,
+           (unsigned)(total / RUNS), (unsigned)max);
+}
+
+int main(int argc, char **argv) {
+    uint32_t batch[AICA_CMDSTR_CHANNEL_SIZE * (BATCH + 1)];
+    uint64_t single[RUNS], submit[RUNS], batched[RUNS], sched[RUNS];
+    uint64_t start;
+    uint32_t target;
+    int32_t late;
+    int i, j;
+
+    snd_init();
+
+    /* A quiet square wave to play. */
+    sample = snd_mem_malloc(SMP_LEN * 2);
+
+    for(i = 0; i < SMP_LEN; i++)
+        wave[i] = (i & 64) ? 0x0400 : -0x0400;
+
+    spu_memload(sample, wave, sizeof(wave));
+
+    /* One command, sent on its own. */
+    for(i = 0; i < RUNS; i++) {
+        make_start(batch, 0, 0);
+        start = timer_us_gettime64();
+        snd_sh4_to_aica(batch, AICA_CMDSTR_CHANNEL_SIZE);
+
+        while(!snd_is_playing(0))
+            ;
+
+        single[i] = timer_us_gettime64() - start;
+        stop_all(1);
+    }
+
+    /* A batch of channels, keyed on together with a sync start. */
+    for(i = 0; i < RUNS; i++) {
+        for(j = 0; j < BATCH; j++)
+            make_start(batch + j * AICA_CMDSTR_CHANNEL_SIZE, j,
+                       AICA_CH_START_DELAY);
+
+        make_start(batch + BATCH * AICA_CMDSTR_CHANNEL_SIZE,
+                   (1 << BATCH) - 1, AICA_CH_START_SYNC);
+
+        start = timer_us_gettime64();
+        snd_sh4_to_aica_batch(batch, AICA_CMDSTR_CHANNEL_SIZE * (BATCH + 1));
+        submit[i] = timer_us_gettime64() - start;
+
+        /* The sync start keys on every channel with a single register
+           write, so they all start on the same sample. */
+        while(!snd_is_playing(BATCH - 1))
+            ;
+
+        batched[i] = timer_us_gettime64() - start;
+        stop_all(BATCH);
+    }
+
+    /* One command scheduled 10ms (441 samples) ahead. */
+    for(i = 0; i < RUNS; i++) {
+        make_start(batch, 0, 0);
+        target = snd_get_sample_clock() + 441;
+        snd_cmd_set_sample_time(batch, target);
+        snd_sh4_to_aica(batch, AICA_CMDSTR_CHANNEL_SIZE);
+
+        while(!snd_is_playing(0))
+            ;
+
+        late = (int32_t)(snd_get_sample_clock() - target);
+        sched[i] = late > 0 ? (uint64_t)late * 1000000 / 44100 : 0;
+        stop_all(1);
+    }
+
+    printf("AICA command latency over %d runs:\n", RUNS);
+    report("single command to key-on", single);
+    report("batch of 9 commands, submit", submit);
+    report("batch of 9 commands to key-on", batched);
+    report("scheduled, lateness", sched);
+
+    snd_mem_free(sample);
+    snd_shutdown();
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* KallistiOS ##version##
+
+   main.c
+
+   This example measures how long it takes from a button press until the
+   frame showing it has been scanned out, with the controller polled once per
+   frame as usual, and then with high-rate polling between frames. Press A a
+   number of times for each; press Start to exit.
+
+   We can't know exactly when the button went down, only that it was some
+   time between the poll that saw it and the one before, so the shortest
+   latency is counted from the later and the longest from the earlier.
+*/
+
+#include <stdio.h>
+
+#include <arch/timer.h>
+#include <dc/video.h>
+#include <dc/maple.h>
+#include <dc/maple/controller.h>
+
+#define PRESSES     16
+#define FAST_PERIOD 2
+
+typedef struct {
+    uint64_t min, max, total;
+    int cnt;
+} lat_t;
+
+static void fill_box(uint16_t color) {
+    int x, y;
+
+    for(y = 160; y < 320; y++)
+        for(x = 240; x < 400; x++)
+            vram_s[y * 640 + x] = color;
+}
+
+static void report(const char *what, const lat_t *l) {
+    if(!l->cnt)
+        return;
+
+    /* The average assumes presses land half way between polls */
+    printf("%-24s min %5u  avg %5u  max %5u us\n", what,
+           (unsigned)(l->min / 1000),
+           (unsigned)(l->total / l->cnt / 2000),
+           (unsigned)(l->max / 1000));
+}
+
+/* Wait for PRESSES presses of A, timing each one until it's on screen */
+static int measure(lat_t *l) {
+    cont_event_t evs[16];
+    uint64_t seen = 0, since = 0, now;
+    uint32_t prev = 0;
+    uint16_t color = 0xf800;
+    size_t i, n;
+
+    l->min = ~0ULL;
+    l->max = l->total = 0;
+    l->cnt = 0;
+
+    while(l->cnt < PRESSES) {
+        vid_waitvbl();
+
+        /* The box drawn after the last vblank has now been scanned out */
+        if(seen) {
+            now = timer_ns_gettime64();
+
+            if(now - seen < l->min) l->min = now - seen;
+            if(now - since > l->max) l->max = now - since;
+            l->total += (now - seen) + (now - since);
+            l->cnt++;
+            seen = 0;
+        }
+
+        n = cont_events_drain(0, evs, 16);
+
+        for(i = 0; i < n; i++) {
+            if((evs[i].state.buttons & CONT_START))
+                return -1;
+
+            /* Only count new presses of A */
+            if((evs[i].state.buttons & ~prev & CONT_A) && !seen) {
+                seen = evs[i].time;
+                since = evs[i].since;
+                color ^= 0xffe0;
+                fill_box(color);
+            }
+
+            prev = evs[i].state.buttons;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    cont_poll_stats_t stats;
+    lat_t vbl, fast;
+
+    vid_set_mode(DM_640x480, PM_RGB565);
+    vid_clear(0, 0, 0);
+
+    printf("Press A %d times, polling once per frame...\n", PRESSES);
+    cont_fast_poll_start(0);
+
+    if(measure(&vbl) < 0)
+        goto out;
+
+    printf("Press A %d more times, polling every %d ms...\n", PRESSES,
+           FAST_PERIOD);
+    cont_fast_poll_start(FAST_PERIOD);
+
+    if(measure(&fast) < 0)
+        goto out;
+
+    cont_get_poll_stats(&stats);
+
+    printf("Input to visibility latency over %d presses:\n", PRESSES);
+    report("polled once per frame", &vbl);
+    report("polled every 2 ms", &fast);
+    printf("%u extra polls (%u skipped), %u events (%u dropped)\n",
+           (unsigned)stats.polls, (unsigned)stats.skipped,
+           (unsigned)stats.events, (unsigned)stats.dropped);
+
+out:
+    cont_fast_poll_stop();
+
+    return 0;
+}
@@ -39,7 +39,16 @@
     filesystem image. A rule to create the image is provided in the rules provided in Makefile.rules,
     the created object file must be linked with your binary file by adding romdisk.o to your 
     list of objects.
-    
+
+    To save memory, the files in an image can be compressed by passing -c to
+    genromfs (for example with "KOS_GENROMFS_FLAGS" in your Makefile). Each
+    file is split into blocks that are compressed separately, and reading from
+    it only decompresses the blocks the read touches; the last few are kept in
+    a small cache. mmap() on a compressed file decompresses all of it into a
+    buffer that is freed when the file is closed, so files meant to be mapped
+    are better left uncompressed (genromfs doesn't compress files aligned with
+    -A).
+
     \see INIT_FS_ROMDISK
     \see KOS_INIT_FLAGS()
 
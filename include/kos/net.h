@@ -846,6 +846,34 @@ void net_tcp_shutdown(void);
 */
 uint32_t __pure net_crc32le(const uint8_t *data, int size);
 
+/** \brief  Initial value for an incremental little-endian CRC-32. */
+#define NET_CRC32LE_INIT    0xFFFFFFFF
+
+/** \brief  Continue a "little-endian" CRC-32 over another block of data.
+
+    This allows a CRC-32 to be calculated over data that is not all available
+    at once. Start with NET_CRC32LE_INIT, call this function for each block in
+    order, and pass the result to net_crc32le_final() to get the same value
+    net_crc32le() would return over the concatenation of all of the blocks.
+
+    \param  crc             The running CRC value.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The updated running CRC value.
+*/
+uint32_t __pure net_crc32le_update(uint32_t crc, const uint8_t *data,
+                                   int size);
+
+/** \brief  Finish an incremental "little-endian" CRC-32.
+
+    \param  crc             The running CRC value.
+    \return                 The final CRC-32.
+*/
+static inline uint32_t net_crc32le_final(uint32_t crc) {
+    return ~crc;
+}
+
 /** \brief  Calculate a "big-endian" CRC-32 over a block of data.
 
     \param  data            The data to calculate over.
@@ -855,10 +883,28 @@ uint32_t __pure net_crc32le(const uint8_t *data, int size);
 */
 uint32_t __pure net_crc32be(const uint8_t *data, int size);
 
+/** \brief  Initial value for an incremental big-endian CRC-32. */
+#define NET_CRC32BE_INIT    0xFFFFFFFF
+
+/** \brief  Continue a "big-endian" CRC-32 over another block of data.
+
+    Start with NET_CRC32BE_INIT and call this function for each block in
+    order. No final step is required, the result is the same value that
+    net_crc32be() would return over the concatenation of all of the blocks.
+
+    \param  crc             The running CRC value.
+    \param  data            The data to calculate over.
+    \param  size            The size of the data, in bytes.
+
+    \return                 The updated CRC value.
+*/
+uint32_t __pure net_crc32be_update(uint32_t crc, const uint8_t *data,
+                                   int size);
+
 /** \brief  Calculate a CRC16-CCITT over a block of data.
 
-    \note                   Based on code found online at
-                            http://www.ccsinfo.com/forum/viewtopic.php?t=24977
+    This function is already incremental: passing the return value of a
+    previous call as the start value continues the calculation.
 
     \param  data            The data to calculate over.
     \param  size            The size of the data, in bytes.
@@ -22,6 +22,7 @@
 #define __NETINET_TCP_H
 
 #include <kos/cdefs.h>
+#include <stdint.h>
 
 __BEGIN_DECLS
 
@@ -46,9 +47,48 @@ __BEGIN_DECLS
 */
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
+#define TCP_INFO                11 /**< \brief Connection info (read-only). */
 
 /** @} */
 
+/** \defgroup tcp_info_opts             TCP_INFO option flags
+    \brief                              Values for tcpi_options in tcp_info
+    \ingroup                            networking_tcp
+
+    @{
+*/
+#define TCPI_OPT_TIMESTAMPS     1 /**< \brief RFC 7323 timestamps in use. */
+#define TCPI_OPT_SACK           2 /**< \brief RFC 2018 SACK in use. */
+#define TCPI_OPT_WSCALE         4 /**< \brief RFC 7323 window scaling in use. */
+/** @} */
+
+/** \brief  Information about a TCP connection.
+    \ingroup networking_tcp
+
+    This structure is filled in by getsockopt() with the TCP_INFO option at the
+    IPPROTO_TCP level. The field names and units follow what other systems use,
+    but only a subset of the fields are provided. Everything will be zero if
+    the socket is not connected (or connecting).
+
+    Note that KallistiOS never holds back outgoing data to coalesce it, so the
+    TCP_NODELAY option only controls whether ACKs may be delayed.
+
+    \headerfile netinet/tcp.h
+*/
+struct tcp_info {
+    uint8_t tcpi_options;       /**< \brief TCPI_OPT_* flags in use. */
+    uint8_t tcpi_snd_wscale;    /**< \brief Window scale the peer uses. */
+    uint8_t tcpi_rcv_wscale;    /**< \brief Window scale we use. */
+    uint8_t tcpi_backoff;       /**< \brief Times the RTO has backed off. */
+    uint32_t tcpi_rto;          /**< \brief Retransmit timeout (usec). */
+    uint32_t tcpi_snd_mss;      /**< \brief Max segment size to send. */
+    uint32_t tcpi_rtt;          /**< \brief Smoothed RTT (usec). */
+    uint32_t tcpi_rttvar;       /**< \brief RTT variation (usec). */
+    uint32_t tcpi_snd_ssthresh; /**< \brief Slow start threshold (bytes). */
+    uint32_t tcpi_snd_cwnd;     /**< \brief Congestion window (bytes). */
+    uint32_t tcpi_total_retrans;/**< \brief Segments retransmitted. */
+};
+
 __END_DECLS
 
 #endif /* !__NETINET_TCP_H */
@@ -27,6 +27,14 @@ back data (or have written it). There are no handles involved or anything
 else like that. The new fs_vmu sits on top of this and provides a (mostly)
 nice VFS interface similar to the old fs_vmu.
 
+The one exception is that the root block, directory and FAT of each VMU are
+kept around between calls, so that listing a directory or reading a file
+doesn't cost a dozen or more block reads every time. The cache is thrown
+away whenever the VMU is plugged in or pulled out, or when any of the
+low-level write functions are used, and the higher level functions always
+work on copies of it, so a failed write never leaves the cache out of step
+with the card.
+
 This module tends to do more work than it really needs to for some
 functions (like reading a named file) but it does it that way to have very
 clear, concise code that can be audited for bugs more easily. It's not
@@ -48,6 +56,30 @@ Function comments located in vmufs.h.
    be much of an issue :) */
 static mutex_t mutex;
 
+/* How many file blocks to hand to the maple driver at once */
+#define VMUFS_VEC_BLOCKS    16
+
+/* Cached root block, directory and FAT for each possible VMU. Everything in
+   here is protected by the mutex, except for gen, which is bumped whenever
+   the cache is invalidated (possibly from the maple interrupt, when a VMU is
+   pulled out). The cache is only good if it was filled in under the current
+   generation. */
+typedef struct {
+    int             loaded;
+    uint32          loaded_gen;
+    volatile uint32 gen;
+    vmu_root_t      root;
+    vmu_dir_t       *dir;
+    int             dirsize;
+    uint16          *fat;
+    int             fatsize;
+} vmufs_cache_t;
+
+static vmufs_cache_t cache[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
+/* Block I/O statistics, also protected by the mutex */
+static vmufs_stats_t stats;
+
 /* Convert a decimal number to BCD; max of two digits */
 static uint8 __pure dec_to_bcd(int dec) {
     uint8 rv = 0;
@@ -85,18 +117,22 @@ int vmufs_root_read(maple_device_t * dev, vmu_root_t * root_buf) {
         return -1;
     }
 
+    stats.blocks_read++;
     return 0;
 }
 
 int vmufs_root_write(maple_device_t * dev, vmu_root_t * root_buf) {
+    vmufs_cache_invalidate(dev);
+
     /* XXX: Assume root is at 255.. is there some way to figure this out dynamically? */
     if(vmu_block_write(dev, 255, (uint8 *)root_buf) != 0) {
         dbglog(DBG_ERROR, "vmufs_root_write: can't write block %d on device %c%c\n",
                255, dev->port + 'A', dev->unit + '0');
         return -1;
     }
-    else
-        return 0;
+
+    stats.blocks_written++;
+    return 0;
 }
 
 int vmufs_dir_blocks(vmu_root_t * root_buf) {
@@ -145,7 +181,14 @@ static int vmufs_dir_ops(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * di
                        (int)dir_block, dev->port + 'A', dev->unit + '0');
                 return -1;
             }
+
+            if(!write)
+                stats.blocks_read++;
+            else
+                stats.blocks_written++;
         }
+        else
+            stats.writes_saved++;
 
         dir_block--;
         dir_size--;
@@ -160,6 +203,7 @@ int vmufs_dir_read(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf)
 }
 
 int vmufs_dir_write(maple_device_t * dev, vmu_root_t * root, vmu_dir_t * dir_buf) {
+    vmufs_cache_invalidate(dev);
     return vmufs_dir_ops(dev, root, dir_buf, 1);
 }
 
@@ -193,6 +237,11 @@ static int vmufs_fat_ops(maple_device_t * dev, vmu_root_t * root, uint16 * fat_b
         return -2;
     }
 
+    if(!write)
+        stats.blocks_read++;
+    else
+        stats.blocks_written++;
+
     return 0;
 }
 
@@ -201,6 +250,7 @@ int vmufs_fat_read(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
 }
 
 int vmufs_fat_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat_buf) {
+    vmufs_cache_invalidate(dev);
     return vmufs_fat_ops(dev, root, fat_buf, 1);
 }
 
@@ -249,7 +299,8 @@ int vmufs_dir_add(vmu_root_t * root, vmu_dir_t * dir, vmu_dir_t * newdirent) {
 }
 
 int vmufs_file_read(maple_device_t * dev, uint16 * fat, vmu_dir_t * dirent, void * outbuf) {
-    int curblk, blkleft, rv;
+    int curblk, blkleft, n, rv;
+    uint16  blks[VMUFS_VEC_BLOCKS];
     uint8   * out;
 
     out = (uint8 *)outbuf;
@@ -262,28 +313,34 @@ int vmufs_file_read(maple_device_t * dev, uint16 * fat, vmu_dir_t * dirent, void
 
     /* While we've got stuff remaining... */
     while(blkleft > 0) {
-        /* Make sure the FAT matches up with the directory */
-        if(curblk == 0xfffc || curblk == 0xfffa) {
-            char fn[13] = {0};
-            memcpy(fn, dirent->filename, 12);
-            dbglog(DBG_ERROR, "vmufs_file_read: file '%s' ends prematurely in fat on device %c%c\n",
-                   fn, dev->port + 'A', dev->unit + '0');
-            return -1;
+        /* Follow the FAT as far as we can read in one go */
+        for(n = 0; n < VMUFS_VEC_BLOCKS && blkleft > 0; n++) {
+            /* Make sure the FAT matches up with the directory */
+            if(curblk == 0xfffc || curblk == 0xfffa) {
+                char fn[13] = {0};
+                memcpy(fn, dirent->filename, 12);
+                dbglog(DBG_ERROR, "vmufs_file_read: file '%s' ends prematurely in fat on device %c%c\n",
+                       fn, dev->port + 'A', dev->unit + '0');
+                return -1;
+            }
+
+            /* Scoot our counters */
+            blks[n] = curblk;
+            curblk = fat[curblk];
+            blkleft--;
         }
 
-        /* Read the block */
-        rv = vmu_block_read(dev, curblk, (uint8 *)out);
+        /* Read the blocks */
+        rv = vmu_block_read_vec(dev, blks, n, out);
 
         if(rv != 0) {
-            dbglog(DBG_ERROR, "vmufs_file_read: can't read block %d on device %c%c (error %d)\n",
-                   curblk, dev->port + 'A', dev->unit + '0', rv);
+            dbglog(DBG_ERROR, "vmufs_file_read: can't read blocks %d-%d on device %c%c (error %d)\n",
+                   blks[0], blks[n - 1], dev->port + 'A', dev->unit + '0', rv);
             return -2;
         }
 
-        /* Scoot our counters */
-        curblk = fat[curblk];
-        blkleft--;
-        out += 512;
+        stats.blocks_read += n;
+        out += 512 * n;
     }
 
     /* Make sure the FAT matches up with the directory */
@@ -335,8 +392,9 @@ static int vmufs_find_block(vmu_root_t * root, uint16 * fat, vmu_dir_t * dirent)
 
 int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
                      vmu_dir_t * dir, vmu_dir_t * newdirent, void * filebuf, int size) {
-    int curblk, blkleft, rv;
+    int curblk, blkleft, n, rv;
     int vmuspaceleft;
+    uint16  blks[VMUFS_VEC_BLOCKS];
     uint8   * out;
 
     /* Files must be at least one block long */
@@ -377,39 +435,44 @@ int vmufs_file_write(maple_device_t * dev, vmu_root_t * root, uint16 * fat,
 
     /* While we've got stuff remaining... */
     while(blkleft > 0) {
-        /* Write the block */
-        rv = vmu_block_write(dev, curblk, (uint8 *)out);
+        /* Claim as many blocks as we'll write in one go */
+        for(n = 0; n < VMUFS_VEC_BLOCKS && blkleft > 0; n++) {
+            blks[n] = curblk;
+            blkleft--;
+
+            /* If we have blocks left, find another free block. Otherwise,
+               write out a terminator. */
+            if(blkleft) {
+                // Set the pointer to the terminator just in case:
+                // a) vmufs_find_block() fails to find a block, AND
+                // b) the calling code for some reason writes the FAT back out anyway.
+                // This may render the save game unusable but at least we won't link
+                // into some other file (or worse, a game!)
+                fat[curblk] = 0xfffa;
+                rv = vmufs_find_block(root, fat, newdirent);
+
+                if(rv < 0)
+                    return rv;
+
+                fat[curblk] = rv;
+                curblk = rv;
+            }
+            else {
+                fat[curblk] = 0xfffa;
+            }
+        }
+
+        /* Write the blocks */
+        rv = vmu_block_write_vec(dev, blks, n, out);
 
         if(rv != 0) {
-            dbglog(DBG_ERROR, "vmufs_file_write: can't write block %d on device %c%c (error %d)\n",
-                   curblk, dev->port + 'A', dev->unit + '0', rv);
+            dbglog(DBG_ERROR, "vmufs_file_write: can't write blocks %d-%d on device %c%c (error %d)\n",
+                   blks[0], blks[n - 1], dev->port + 'A', dev->unit + '0', rv);
             return -5;
         }
 
-        /* Scoot our counters */
-        blkleft--;
-        out += 512;
-
-        /* If we have blocks left, find another free block. Otherwise,
-           write out a terminator. */
-        if(blkleft) {
-            // Set the pointer to the terminator just in case:
-            // a) vmufs_find_block() fails to find a block, AND
-            // b) the calling code for some reason writes the FAT back out anyway.
-            // This may render the save game unusable but at least we won't link
-            // into some other file (or worse, a game!)
-            fat[curblk] = 0xfffa;
-            rv = vmufs_find_block(root, fat, newdirent);
-
-            if(rv < 0)
-                return rv;
-
-            fat[curblk] = rv;
-            curblk = rv;
-        }
-        else {
-            fat[curblk] = 0xfffa;
-        }
+        stats.blocks_written += n;
+        out += 512 * n;
     }
 
     /* Add the entry to the directory */
@@ -496,11 +559,81 @@ int vmufs_mutex_unlock(void) {
     return mutex_unlock(&mutex);
 }
 
+void vmufs_cache_invalidate(maple_device_t * dev) {
+    /* This may be called from an interrupt, so all we can do here is
+       move on to the next generation. */
+    cache[dev->port][dev->unit].gen++;
+}
+
+void vmufs_get_stats(vmufs_stats_t * st) {
+    vmufs_mutex_lock();
+    *st = stats;
+    vmufs_mutex_unlock();
+}
+
+void vmufs_reset_stats(void) {
+    vmufs_mutex_lock();
+    memset(&stats, 0, sizeof(stats));
+    vmufs_mutex_unlock();
+}
+
 /* ****************** Higher level functions ******************** */
 
-/* Internal function gets everything setup for you */
+/* Is the cache for this VMU still good? Assumes the mutex is held. */
+static int vmufs_cache_valid(vmufs_cache_t * c) {
+    return c->loaded && c->loaded_gen == c->gen;
+}
+
+/* Make sure a buffer in the cache is the right size */
+static int vmufs_cache_alloc(maple_device_t * dev, void ** buf, int * cursize, int size) {
+    if(*buf && *cursize == size)
+        return 0;
+
+    free(*buf);
+    *buf = malloc(size);
+    *cursize = *buf ? size : 0;
+
+    if(!*buf) {
+        dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for cache on device %c%c\n",
+               size, dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read the root block, dir and FAT of a VMU into its cache, if they're not
+   there already. Assumes the mutex is held. */
+static int vmufs_cache_fill(maple_device_t * dev, vmufs_cache_t * c) {
+    uint32 gen;
+
+    /* Take note of the generation before we start, so that a VMU swapped out
+       from under us while we're reading is caught next time. */
+    gen = c->gen;
+    c->loaded = 0;
+
+    if(vmufs_root_read(dev, &c->root) < 0)
+        return -1;
+
+    if(vmufs_cache_alloc(dev, (void **)&c->dir, &c->dirsize, vmufs_dir_blocks(&c->root)) < 0 ||
+            vmufs_cache_alloc(dev, (void **)&c->fat, &c->fatsize, vmufs_fat_blocks(&c->root)) < 0)
+        return -1;
+
+    if(vmufs_dir_ops(dev, &c->root, c->dir, 0) < 0 ||
+            vmufs_fat_ops(dev, &c->root, c->fat, 0) < 0)
+        return -1;
+
+    c->loaded_gen = gen;
+    c->loaded = 1;
+    return 0;
+}
+
+/* Internal function gets everything setup for you. You get your own copies
+   of the dir and FAT to work on. */
 static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir, int * dirsize,
                        uint16 ** fat, int * fatsize) {
+    vmufs_cache_t * c;
+
     /* Check to make sure this is a valid device right now */
     if(!dev || !(dev->info.functions & MAPLE_FUNC_MEMCARD)) {
         if(!dev)
@@ -514,13 +647,25 @@ static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir
 
     vmufs_mutex_lock();
 
-    /* Read its root block */
-    if(!root || vmufs_root_read(dev, root) < 0)
+    if(!root)
         goto dead;
 
+    /* A device that's gone away might still have a good looking cache */
+    c = &cache[dev->port][dev->unit];
+
+    if(!dev->valid)
+        c->loaded = 0;
+
+    if(vmufs_cache_valid(c))
+        stats.reads_saved += 1 + (dir ? c->root.dir_size : 0) + (fat ? c->root.fat_size : 0);
+    else if(vmufs_cache_fill(dev, c) < 0)
+        goto dead;
+
+    memcpy(root, &c->root, sizeof(vmu_root_t));
+
     if(dir) {
         /* Alloc enough space for the whole dir */
-        *dirsize = vmufs_dir_blocks(root);
+        *dirsize = c->dirsize;
         *dir = (vmu_dir_t *)malloc(*dirsize);
 
         if(!*dir) {
@@ -529,37 +674,25 @@ static int vmufs_setup(maple_device_t * dev, vmu_root_t * root, vmu_dir_t ** dir
             goto dead;
         }
 
-        /* Ensure that the dir is 0'd to avoid possible uninitialized reads */
-        memset(*dir, 0, sizeof(*dirsize));
-
-        /* Read it */
-        if(vmufs_dir_read(dev, root, *dir) < 0) {
-            free(*dir);
-            *dir = NULL;
-            goto dead;
-        }
+        memcpy(*dir, c->dir, *dirsize);
     }
 
     if(fat) {
         /* Alloc enough space for the fat */
-        *fatsize = vmufs_fat_blocks(root);
+        *fatsize = c->fatsize;
         *fat = (uint16 *)malloc(*fatsize);
 
         if(!*fat) {
             dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
                    *fatsize, dev->port + 'A', dev->unit + '0');
-            if(dir)
+            if(dir) {
                 free(*dir);
+                *dir = NULL;
+            }
             goto dead;
         }
 
-        /* Read it */
-        if(vmufs_fat_read(dev, root, *fat) < 0) {
-            free(*fat);
-            if(dir)
-                free(*dir);
-            goto dead;
-        }
+        memcpy(*fat, c->fat, *fatsize);
     }
 
     /* Ok, everything's cool */
@@ -570,6 +703,35 @@ dead:
     return -1;
 }
 
+/* Write back the FAT, unless it's the same as what's on the card already.
+   Assumes the mutex is held. */
+static int vmufs_fat_sync(maple_device_t * dev, vmu_root_t * root, uint16 * fat) {
+    vmufs_cache_t * c = &cache[dev->port][dev->unit];
+
+    if(vmufs_cache_valid(c) && !memcmp(c->fat, fat, c->fatsize)) {
+        stats.writes_saved += root->fat_size;
+        return 0;
+    }
+
+    return vmufs_fat_ops(dev, root, fat, 1);
+}
+
+/* Update the cache to match what was just written out, or throw it away if
+   the write didn't go through. Assumes the mutex is held. */
+static void vmufs_cache_update(maple_device_t * dev, vmu_dir_t * dir, uint16 * fat, int ok) {
+    vmufs_cache_t * c = &cache[dev->port][dev->unit];
+
+    if(!ok) {
+        c->loaded = 0;
+        return;
+    }
+
+    if(vmufs_cache_valid(c)) {
+        memcpy(c->dir, dir, c->dirsize);
+        memcpy(c->fat, fat, c->fatsize);
+    }
+}
+
 /* Internal function to tear everything down for you */
 static void vmufs_teardown(vmu_dir_t * dir, uint16 * fat) {
     if(dir)
@@ -779,8 +941,10 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
         goto ex;
     }
 
-    /* Ok, everything's looking good so far.. update the FAT */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    /* Ok, everything's looking good so far.. update the FAT. Only the dir
+       blocks holding changed entries are written after that. */
+    if(vmufs_fat_sync(dev, &root, fat) < 0) {
+        vmufs_cache_update(dev, dir, fat, 0);
         rv = -5;
         goto ex;
     }
@@ -788,14 +952,17 @@ int vmufs_write(maple_device_t * dev, const char * fn, void * inbuf, int insize,
     /* This is the critical point. If the dir doesn't save correctly, then
        we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_dir_ops(dev, &root, dir, 1) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_write: warning, card may be corrupted or leaking blocks!\n");
+        vmufs_cache_update(dev, dir, fat, 0);
         rv = -6;
         goto ex;
     }
 
     /* Looks like everything was good */
+    vmufs_cache_update(dev, dir, fat, 1);
+
 ex:
     vmufs_teardown(dir, fat);
     return rv;
@@ -817,7 +984,8 @@ int vmufs_delete(maple_device_t * dev, const char * fn) {
     if(rv < 0) goto ex;
 
     /* If we succeeded, write back the dir and fat */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_dir_ops(dev, &root, dir, 1) < 0) {
+        vmufs_cache_update(dev, dir, fat, 0);
         rv = -2;
         goto ex;
     }
@@ -825,14 +993,17 @@ int vmufs_delete(maple_device_t * dev, const char * fn) {
     /* This is the critical point. If the fat doesn't save correctly, then
        we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    if(vmufs_fat_sync(dev, &root, fat) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_delete: warning, card may be corrupted or leaking blocks!\n");
+        vmufs_cache_update(dev, dir, fat, 0);
         rv = -2;
         goto ex;
     }
 
     /* Looks like everything was good */
+    vmufs_cache_update(dev, dir, fat, 1);
+
 ex:
     vmufs_teardown(dir, fat);
     return rv;
@@ -862,6 +1033,16 @@ int vmufs_init(void) {
 }
 
 int vmufs_shutdown(void) {
+    int i, j;
+
+    for(i = 0; i < MAPLE_PORT_COUNT; i++) {
+        for(j = 0; j < MAPLE_UNIT_COUNT; j++) {
+            free(cache[i][j].dir);
+            free(cache[i][j].fat);
+            memset(&cache[i][j], 0, sizeof(vmufs_cache_t));
+        }
+    }
+
     mutex_destroy(&mutex);
     return 0;
 }
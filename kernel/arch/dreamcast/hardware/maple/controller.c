@@ -7,9 +7,13 @@
  */
 
 #include <arch/arch.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
 #include <dc/maple.h>
 #include <dc/maple/controller.h>
+#include <kos/dbglog.h>
 #include <kos/mutex.h>
+#include <kos/thread.h>
 #include <kos/worker_thread.h>
 #include <assert.h>
 #include <string.h>
@@ -23,6 +27,13 @@
 #define CONT_BTN_CALLBACK_THD_STACK_SIZE (8 * 1024)
 #endif
 
+#ifndef CONT_FAST_POLL_THD_PRIO
+#define CONT_FAST_POLL_THD_PRIO (PRIO_DEFAULT - 2)
+#endif
+
+_Static_assert((CONT_EVENT_RING_SIZE & (CONT_EVENT_RING_SIZE - 1)) == 0,
+               "CONT_EVENT_RING_SIZE must be a power of two");
+
 /* Raw controller condition structure */
 typedef struct cont_cond {
     uint16_t buttons;  /* buttons bitfield */
@@ -50,6 +61,24 @@ static TAILQ_HEAD(cont_btn_callback_list, cont_callback_params) btn_cbs;
 
 static mutex_t btn_cbs_mtx = MUTEX_INITIALIZER;
 
+/* Event ring for each port. Events are only added from the maple interrupt
+   and taken out by cont_events_drain(), so each side only ever writes its
+   own index. */
+static cont_event_t events[MAPLE_PORT_COUNT][CONT_EVENT_RING_SIZE];
+static volatile uint32_t events_head[MAPLE_PORT_COUNT];
+static volatile uint32_t events_tail[MAPLE_PORT_COUNT];
+static uint64_t last_poll[MAPLE_PORT_COUNT];
+static volatile int events_enabled;
+
+/* High-rate polling thread and the frames it uses, one per port */
+static kthread_t *fast_thd;
+static volatile int fast_thd_run;
+static volatile unsigned int fast_period;
+static maple_frame_t *fast_frames;
+static cont_poll_stats_t poll_stats;
+
+static maple_driver_t controller_drv;
+
 /* Check whether the controller has EXACTLY the given capabilities. */
 int __pure cont_is_type(const maple_device_t *cont, uint32_t type) {
     return cont ? cont->info.function_data[CONT_FUNCTION_DATA_INDEX] == type :
@@ -141,6 +170,49 @@ int cont_btn_callback(uint8_t addr, uint32_t btns, cont_btn_callback_t cb) {
     return 0;
 }
 
+/* Record a change in state; called from the maple interrupt */
+static void cont_event_push(int port, uint64_t now, const cont_state_t *state) {
+    uint32_t head = events_head[port];
+    cont_event_t *ev;
+
+    if(head - events_tail[port] >= CONT_EVENT_RING_SIZE) {
+        poll_stats.dropped++;
+        return;
+    }
+
+    ev = &events[port][head & (CONT_EVENT_RING_SIZE - 1)];
+    ev->time = now;
+    ev->since = last_poll[port] ? last_poll[port] : now;
+    ev->state = *state;
+
+    /* Make sure the event is all there before it's made visible */
+    __asm__ __volatile__("" : : : "memory");
+    events_head[port] = head + 1;
+    poll_stats.events++;
+}
+
+size_t cont_events_drain(unsigned int port, cont_event_t *out, size_t max) {
+    uint32_t head, tail;
+    size_t cnt = 0;
+
+    if(port >= MAPLE_PORT_COUNT)
+        return 0;
+
+    head = events_head[port];
+    tail = events_tail[port];
+
+    while(tail != head && cnt < max) {
+        out[cnt++] = events[port][tail & (CONT_EVENT_RING_SIZE - 1)];
+        tail++;
+    }
+
+    /* Don't give the slots back until we're done copying them */
+    __asm__ __volatile__("" : : : "memory");
+    events_tail[port] = tail;
+
+    return cnt;
+}
+
 /* Response callback for the GETCOND Maple command. */
 static void cont_reply(maple_state_t *st, maple_frame_t *frm) {
     (void)st;
@@ -148,8 +220,9 @@ static void cont_reply(maple_state_t *st, maple_frame_t *frm) {
     maple_response_t *resp;
     uint32_t         *respbuf;
     cont_cond_t      *raw;
-    cont_state_t     *cooked;
+    cont_state_t     *cooked, cur;
     cont_callback_params_t *c;
+    uint64_t         now;
 
     /* Unlock the frame now (it's ok, we're in an IRQ) */
     maple_frame_unlock(frm);
@@ -174,13 +247,24 @@ static void cont_reply(maple_state_t *st, maple_frame_t *frm) {
 
     /* Fill the "nice" struct from the raw data */
     cooked = (cont_state_t *)(frm->dev->status);
-    cooked->buttons = (~raw->buttons) & 0xffff;
-    cooked->ltrig = raw->ltrig;
-    cooked->rtrig = raw->rtrig;
-    cooked->joyx = ((int)raw->joyx) - 128;
-    cooked->joyy = ((int)raw->joyy) - 128;
-    cooked->joy2x = ((int)raw->joy2x) - 128;
-    cooked->joy2y = ((int)raw->joy2y) - 128;
+    cur.buttons = (~raw->buttons) & 0xffff;
+    cur.ltrig = raw->ltrig;
+    cur.rtrig = raw->rtrig;
+    cur.joyx = ((int)raw->joyx) - 128;
+    cur.joyy = ((int)raw->joyy) - 128;
+    cur.joy2x = ((int)raw->joy2x) - 128;
+    cur.joy2y = ((int)raw->joy2y) - 128;
+
+    if(events_enabled && frm->dev->unit == 0) {
+        now = timer_ns_gettime64();
+
+        if(!frm->dev->status_valid || memcmp(cooked, &cur, sizeof(cur)))
+            cont_event_push(frm->dev->port, now, &cur);
+
+        last_poll[frm->dev->port] = now;
+    }
+
+    *cooked = cur;
     frm->dev->status_valid = 1;
 
     /* If someone is in the middle of modifying the list, don't process callbacks */
@@ -227,6 +311,171 @@ static void cont_periodic(maple_driver_t *drv) {
     maple_driver_foreach(drv, cont_poll);
 }
 
+/* Run an extra maple cycle to poll the controllers between vblanks. This
+   uses its own frames, so the regular poll and hotplug detection on the
+   controllers' frames aren't held up. */
+static void cont_fast_poll(void) {
+    maple_device_t *dev;
+    maple_frame_t *frm;
+    uint32_t *send_buf;
+    int p, queued = 0;
+    irq_mask_t old;
+
+    old = irq_disable();
+
+    /* Don't get in the way of a cycle that's already running, or of the
+       light gun, which has to be read in the vblank cycle. */
+    if(maple_state.dma_in_progress || maple_state.gun_port > -1) {
+        poll_stats.skipped++;
+        irq_restore(old);
+        return;
+    }
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        dev = maple_enum_dev(p, 0);
+        frm = &fast_frames[p];
+
+        if(!dev || dev->drv != &controller_drv || maple_frame_lock(frm) < 0)
+            continue;
+
+        maple_frame_init(frm);
+        send_buf = (uint32_t *)frm->recv_buf;
+        send_buf[0] = MAPLE_FUNC_CONTROLLER;
+        frm->cmd = MAPLE_COMMAND_GETCOND;
+        frm->dst_port = p;
+        frm->dst_unit = 0;
+        frm->length = 1;
+        frm->callback = cont_reply;
+        frm->send_buf = send_buf;
+        maple_queue_frame(frm);
+        queued++;
+    }
+
+    if(queued) {
+        maple_queue_flush();
+        poll_stats.polls++;
+    }
+
+    irq_restore(old);
+}
+
+static void *cont_fast_thd_func(void *arg) {
+    (void)arg;
+
+    while(fast_thd_run) {
+        cont_fast_poll();
+        thd_sleep(fast_period);
+    }
+
+    return NULL;
+}
+
+/* Wait for any extra polls still on the bus, so their frames can go */
+static void cont_fast_frames_free(void) {
+    maple_frame_t *frm;
+    irq_mask_t old;
+    int p, tries, state, live = 0;
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        frm = &fast_frames[p];
+
+        for(tries = 0; tries < 100; tries++) {
+            old = irq_disable();
+
+            /* Not sent yet (or sent again after a busy reply), so nothing
+               will look at it once it's off the queue */
+            if(frm->state == MAPLE_FRAME_UNSENT) {
+                maple_queue_remove(frm);
+                frm->state = MAPLE_FRAME_VACANT;
+            }
+
+            state = frm->state;
+            irq_restore(old);
+
+            if(state == MAPLE_FRAME_VACANT)
+                break;
+
+            /* On the bus, so the DMA will still write the reply into it and
+               cont_reply() will hand it back */
+            thd_sleep(1);
+        }
+
+        if(state != MAPLE_FRAME_VACANT)
+            live = 1;
+    }
+
+    /* A frame that never came back may still be written to by the DMA, so
+       it's safer to leak them than to free them */
+    if(live)
+        dbglog(DBG_WARNING, "cont_fast_poll_stop: frames still on the bus, "
+               "leaking them\n");
+    else
+        free(fast_frames);
+
+    fast_frames = NULL;
+}
+
+static void cont_fast_poll_stop_thd(void) {
+    if(!fast_thd)
+        return;
+
+    fast_thd_run = 0;
+    thd_join(fast_thd, NULL);
+    fast_thd = NULL;
+
+    cont_fast_frames_free();
+}
+
+int cont_fast_poll_start(unsigned int period) {
+    const kthread_attr_t attr = {
+        .prio = CONT_FAST_POLL_THD_PRIO,
+        .label = "cont_fast_poll"
+    };
+
+    fast_period = period;
+    events_enabled = 1;
+
+    /* Only changes seen by the regular poll are wanted */
+    if(!period) {
+        cont_fast_poll_stop_thd();
+        return 0;
+    }
+
+    if(fast_thd)
+        return 0;
+
+    /* All of the frames start out vacant */
+    fast_frames = (maple_frame_t *)calloc(MAPLE_PORT_COUNT, sizeof(maple_frame_t));
+
+    if(!fast_frames) {
+        dbglog(DBG_ERROR, "cont_fast_poll_start: can't allocate frames\n");
+        return -1;
+    }
+
+    fast_thd_run = 1;
+
+    if(!(fast_thd = thd_create_ex(&attr, cont_fast_thd_func, NULL))) {
+        dbglog(DBG_ERROR, "cont_fast_poll_start: can't create thread\n");
+        fast_thd_run = 0;
+        free(fast_frames);
+        fast_frames = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cont_fast_poll_stop(void) {
+    events_enabled = 0;
+    cont_fast_poll_stop_thd();
+}
+
+void cont_get_poll_stats(cont_poll_stats_t *stats) {
+    irq_mask_t old = irq_disable();
+    *stats = poll_stats;
+    irq_restore(old);
+}
+
 /* Device Driver Struct */
 static maple_driver_t controller_drv = {
     .functions = MAPLE_FUNC_CONTROLLER,
@@ -244,6 +493,8 @@ void cont_init(void) {
 }
 
 void cont_shutdown(void) {
+    cont_fast_poll_stop();
+
     /* Empty the callback list */
     cont_btn_callback_del(NULL);
     maple_driver_unreg(&controller_drv);
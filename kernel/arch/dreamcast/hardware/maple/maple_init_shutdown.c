@@ -75,6 +75,7 @@ static void maple_hw_init(void) {
     }
 
     maple_state.dma_in_progress = 0;
+    maple_state.flush_pending = 0;
     dbglog(DBG_INFO, "  DMA Buffer at %08lx\n", (uint32)maple_state.dma_buffer);
 
     /* Initialize other misc stuff */
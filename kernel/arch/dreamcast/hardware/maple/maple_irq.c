@@ -229,9 +229,12 @@ void maple_vbl_irq_hnd(uint32 code, void *data) {
             drv->periodic(drv);
     }
 
-    /* Send any queued data */
+    /* Send any queued data. If there's a DMA running (some drivers can
+       start one between vblanks), send it as soon as that finishes. */
     if(!state->dma_in_progress)
         maple_queue_flush();
+    else
+        state->flush_pending = 1;
 
     /* dbgio_write_str("finish vbl_irq_hnd\n"); */
 }
@@ -300,5 +303,11 @@ void maple_dma_irq_hnd(uint32 code, void *data) {
         state->gun_port = -1;
     }
 
+    /* Send whatever the last vblank couldn't */
+    if(state->flush_pending) {
+        state->flush_pending = 0;
+        maple_queue_flush();
+    }
+
     /* dbgio_write_str("finish dma_irq_hnd\n"); */
 }
@@ -14,10 +14,12 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <kos/thread.h>
 #include <kos/genwait.h>
+#include <kos/mutex.h>
 #include <kos/platform.h>
 #include <kos/dbglog.h>
 #include <dc/maple.h>
@@ -26,9 +28,25 @@
 #include <dc/biosfont.h>
 #include <dc/vmufs.h>
 #include <arch/timer.h>
+#include <arch/irq.h>
 
 #define VMU_BLOCK_WRITE_RETRY_TIME  100     /* time to sleep until retrying a failed write */
 
+/* Number of frames each VMU gets for the vectored block functions. This is
+   enough for the four write phases and the sync of two blocks. */
+#define VMU_FRAME_POOL  10
+
+/* Frames for the vectored block functions, allocated for each VMU the first
+   time they're needed. */
+typedef struct vmu_frame_pool {
+    mutex_t         lock;
+    volatile int    pending;
+    maple_frame_t   frames[VMU_FRAME_POOL];
+} vmu_frame_pool_t;
+
+static vmu_frame_pool_t *vmu_pools[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+static mutex_t vmu_pools_lock = MUTEX_INITIALIZER;
+
 /* This is the value that official VMUs report for function_data[0]. Have not 
    found any official ones that report a different value nor any third party
    that report it.
@@ -92,9 +110,17 @@ static void vmu_datetime_from_tm(vmu_datetime_t *dt, const struct tm *bt) {
 static int vmu_attach(maple_driver_t *drv, maple_device_t *dev) {
     (void)drv;
     dev->status_valid = 1;
+
+    /* This might not be the same card as was here before */
+    vmufs_cache_invalidate(dev);
     return 0;
 }
 
+static void vmu_detach(maple_driver_t *drv, maple_device_t *dev) {
+    (void)drv;
+    vmufs_cache_invalidate(dev);
+}
+
 static void vmu_poll_reply(maple_state_t *st, maple_frame_t *frm) {
     (void)st;
 
@@ -184,7 +210,7 @@ static maple_driver_t vmu_drv = {
     .periodic = NULL,
     .status_size = sizeof(vmu_state_t),
     .attach = vmu_attach,
-    .detach = NULL
+    .detach = vmu_detach
 };
 
 /* Add the VMU to the driver chain */
@@ -193,7 +219,19 @@ void vmu_init(void) {
 }
 
 void vmu_shutdown(void) {
+    int p, u;
+
     maple_driver_unreg(&vmu_drv);
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        for(u = 0; u < MAPLE_UNIT_COUNT; u++) {
+            if(vmu_pools[p][u]) {
+                mutex_destroy(&vmu_pools[p][u]->lock);
+                free(vmu_pools[p][u]);
+                vmu_pools[p][u] = NULL;
+            }
+        }
+    }
 }
 
 /* Dynamically add the periodic polling callback to the driver when button input is enabled. */
@@ -645,6 +683,254 @@ int vmu_block_write(maple_device_t *dev, uint16_t blocknum, const uint8_t *buffe
     return rv;
 }
 
+/* Get the frame pool for a VMU, making one if it doesn't have one yet */
+static vmu_frame_pool_t *vmu_pool_get(maple_device_t *dev) {
+    vmu_frame_pool_t *pool;
+
+    mutex_lock(&vmu_pools_lock);
+
+    pool = vmu_pools[dev->port][dev->unit];
+
+    if(!pool) {
+        /* All of the frames start out vacant */
+        pool = (vmu_frame_pool_t *)calloc(1, sizeof(vmu_frame_pool_t));
+
+        if(pool) {
+            mutex_init(&pool->lock, MUTEX_TYPE_NORMAL);
+            vmu_pools[dev->port][dev->unit] = pool;
+        }
+        else {
+            dbglog(DBG_ERROR, "vmu: can't allocate frames for unit %c%c\n",
+                   dev->port + 'A', dev->unit + '0');
+        }
+    }
+
+    mutex_unlock(&vmu_pools_lock);
+
+    return pool;
+}
+
+/* Called for each pooled frame as its response comes in. The frame is left
+   alone until the waiting thread has looked at the response. */
+static void vmu_vec_callback(maple_state_t *st, maple_frame_t *frm) {
+    vmu_frame_pool_t *pool = vmu_pools[frm->dst_port][frm->dst_unit];
+
+    (void)st;
+
+    if(--pool->pending == 0)
+        genwait_wake_all(pool);
+}
+
+/* Fill in and queue up one block command using a pooled frame. The data, if
+   any, is one write phase (128 bytes). */
+static void vmu_vec_queue(maple_device_t *dev, maple_frame_t *frm, int cmd,
+                          uint32_t blkid, const uint8_t *data) {
+    uint32_t *send_buf;
+
+    /* These frames are only ours, so this can't fail */
+    maple_frame_lock(frm);
+
+    maple_frame_init(frm);
+    send_buf = (uint32_t *)frm->recv_buf;
+    send_buf[0] = MAPLE_FUNC_MEMCARD;
+    send_buf[1] = blkid;
+    frm->length = 2;
+
+    if(data) {
+        memcpy(send_buf + 2, data, 128);
+        frm->length += 128 / 4;
+    }
+
+    frm->cmd = cmd;
+    frm->dst_port = dev->port;
+    frm->dst_unit = dev->unit;
+    frm->callback = vmu_vec_callback;
+    frm->send_buf = send_buf;
+    maple_queue_frame(frm);
+}
+
+/* Wait for the first cnt frames in the pool to come back. Any that don't
+   are pulled off the queue and freed up again. */
+static int vmu_vec_wait(maple_device_t *dev, vmu_frame_pool_t *pool, int cnt,
+                        const char *mesg) {
+    maple_frame_t *frm;
+    int i, rv = MAPLE_EOK;
+    uint32 save;
+
+    save = irq_disable();
+
+    while(pool->pending > 0) {
+        if(genwait_wait(pool, mesg, 100, NULL) < 0 && pool->pending > 0) {
+            /* They're probably never coming back */
+            dbglog(DBG_ERROR, "%s: timeout to unit %c%c\n", mesg,
+                   dev->port + 'A', dev->unit + '0');
+            rv = MAPLE_ETIMEOUT;
+            break;
+        }
+    }
+
+    for(i = 0; i < cnt && rv != MAPLE_EOK; i++) {
+        frm = &pool->frames[i];
+
+        if(frm->state != MAPLE_FRAME_RESPONDED) {
+            maple_queue_remove(frm);
+            frm->state = MAPLE_FRAME_VACANT;
+        }
+    }
+
+    pool->pending = 0;
+    irq_restore(save);
+
+    return rv;
+}
+
+static inline uint32_t vmu_blkid(uint16_t blocknum, int phase) {
+    /* This is (block << 24) | (phase << 8) | (partition (0 for all vmu)) */
+    return ((blocknum & 0xff) << 24) | ((blocknum >> 8) << 16) | (phase << 8);
+}
+
+int vmu_block_read_vec(maple_device_t *dev, const uint16_t *blocks,
+                       size_t cnt, uint8_t *buffer) {
+    vmu_frame_pool_t *pool;
+    maple_frame_t    *frm;
+    maple_response_t *resp;
+    uint32_t         *recv_buf;
+    size_t           done;
+    int              i, n, rv = MAPLE_EOK, wrv;
+
+    assert(dev != NULL);
+
+    if(!(pool = vmu_pool_get(dev)))
+        return MAPLE_EFAIL;
+
+    mutex_lock(&pool->lock);
+
+    for(done = 0; done < cnt && rv == MAPLE_EOK; done += n) {
+        n = cnt - done < VMU_FRAME_POOL ? cnt - done : VMU_FRAME_POOL;
+
+        /* Send off a request for each block, all in the same DMA cycle */
+        pool->pending = n;
+
+        for(i = 0; i < n; i++)
+            vmu_vec_queue(dev, &pool->frames[i], MAPLE_COMMAND_BREAD,
+                          vmu_blkid(blocks[done + i], 0), NULL);
+
+        rv = vmu_vec_wait(dev, pool, n, "vmu_block_read_vec");
+
+        /* Copy out whatever came back */
+        for(i = 0; i < n; i++) {
+            frm = &pool->frames[i];
+
+            if(frm->state != MAPLE_FRAME_RESPONDED)
+                continue;
+
+            resp = (maple_response_t *)frm->recv_buf;
+            recv_buf = (uint32_t *)resp->data;
+
+            if(resp->response != MAPLE_RESPONSE_DATATRF
+                    || recv_buf[0] != MAPLE_FUNC_MEMCARD
+                    || recv_buf[1] != vmu_blkid(blocks[done + i], 0)) {
+                dbglog(DBG_ERROR, "vmu_block_read_vec failed on block %d: %s(%d)\n",
+                       (int)blocks[done + i], maple_perror(resp->response),
+                       resp->response);
+                wrv = MAPLE_EFAIL;
+            }
+            else {
+                memcpy(buffer + (done + i) * 512, recv_buf + 2,
+                       (resp->data_len - 2) * 4);
+                wrv = MAPLE_EOK;
+            }
+
+            if(rv == MAPLE_EOK)
+                rv = wrv;
+
+            maple_frame_unlock(frm);
+        }
+    }
+
+    mutex_unlock(&pool->lock);
+
+    return rv;
+}
+
+int vmu_block_write_vec(maple_device_t *dev, const uint16_t *blocks,
+                        size_t cnt, const uint8_t *buffer) {
+    vmu_frame_pool_t *pool;
+    maple_frame_t    *frm;
+    maple_response_t *resp;
+    size_t           done;
+    int              good[VMU_FRAME_POOL / 5];
+    int              i, j, n, rv = MAPLE_EOK, wrv;
+
+    assert(dev != NULL);
+
+    if(!(pool = vmu_pool_get(dev)))
+        return MAPLE_EFAIL;
+
+    mutex_lock(&pool->lock);
+
+    /* Send the four phases of each block followed by its sync, just like
+       vmu_block_write() does, but for as many blocks as fit in the pool in
+       each DMA cycle. Frames go out in the order they're queued, so the VMU
+       never sees a block's phases before the sync of the one before it. */
+    for(done = 0; done < cnt; done += n) {
+        n = cnt - done < VMU_FRAME_POOL / 5 ? cnt - done : VMU_FRAME_POOL / 5;
+        pool->pending = n * 5;
+
+        for(i = 0; i < n; i++) {
+            for(j = 0; j < 4; j++)
+                vmu_vec_queue(dev, &pool->frames[i * 5 + j],
+                              MAPLE_COMMAND_BWRITE,
+                              vmu_blkid(blocks[done + i], j),
+                              buffer + (done + i) * 512 + j * 128);
+
+            vmu_vec_queue(dev, &pool->frames[i * 5 + 4], MAPLE_COMMAND_BSYNC,
+                          vmu_blkid(blocks[done + i], 4), NULL);
+        }
+
+        vmu_vec_wait(dev, pool, n * 5, "vmu_block_write_vec");
+
+        /* A block is only written if all five commands were accepted */
+        for(i = 0; i < n; i++) {
+            good[i] = 1;
+
+            for(j = 0; j < 5; j++) {
+                frm = &pool->frames[i * 5 + j];
+
+                if(frm->state != MAPLE_FRAME_RESPONDED) {
+                    good[i] = 0;
+                    continue;
+                }
+
+                resp = (maple_response_t *)frm->recv_buf;
+
+                if(resp->response != MAPLE_RESPONSE_OK)
+                    good[i] = 0;
+
+                maple_frame_unlock(frm);
+            }
+        }
+
+        /* Anything that failed gets another go the slow way, with retries */
+        for(i = 0; i < n; i++) {
+            if(good[i])
+                continue;
+
+            dbglog(DBG_WARNING, "vmu_block_write_vec: retrying block %d on unit %c%c\n",
+                   (int)blocks[done + i], dev->port + 'A', dev->unit + '0');
+            wrv = vmu_block_write(dev, blocks[done + i],
+                                  buffer + (done + i) * 512);
+
+            if(rv == MAPLE_EOK)
+                rv = wrv;
+        }
+    }
+
+    mutex_unlock(&pool->lock);
+
+    return rv;
+}
+
 int vmu_set_datetime(maple_device_t *dev, time_t unix) {
     uint32_t *send_buf;
     struct tm *btime;
@@ -0,0 +1,185 @@
+/* KallistiOS ##version##
+
+   pvr_dlist.c
+
+   Recorded display lists, see dc/pvr/pvr_dlist.h.
+*/
+
+#include <assert.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+#include <dc/pvr.h>
+#include <dc/sq.h>
+#include <dc/matrix.h>
+#include <kos/dbglog.h>
+#include "pvr_internal.h"
+
+/* Both PVR_CMD_VERTEX and PVR_CMD_VERTEX_EOL have these bits set */
+#define IS_VERTEX(cmd)  (((cmd) & PVR_CMD_VERTEX) == PVR_CMD_VERTEX)
+
+int pvr_dlist_init(pvr_dlist_t *dl, size_t max) {
+    max = (max + 31) & ~31;
+
+    dl->data = NULL;
+    dl->size = 0;
+    dl->max = 0;
+
+    if(max) {
+        if(!(dl->data = memalign(32, max))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        dl->max = max;
+    }
+
+    return 0;
+}
+
+void pvr_dlist_free(pvr_dlist_t *dl) {
+    /* It may still be on its way to the TA */
+    pvr_list_flush_wait();
+
+    free(dl->data);
+    dl->data = NULL;
+    dl->size = dl->max = 0;
+}
+
+void pvr_dlist_clear(pvr_dlist_t *dl) {
+    pvr_list_flush_wait();
+    dl->size = 0;
+}
+
+int pvr_dlist_add(pvr_dlist_t *dl, const void *data, size_t size) {
+    uint8_t *buf;
+    size_t max;
+
+    assert(!(size & 31));
+
+    pvr_list_flush_wait();
+
+    if(dl->size + size > dl->max) {
+        max = dl->max ? dl->max * 2 : 1024;
+
+        while(max < dl->size + size)
+            max *= 2;
+
+        if(!(buf = memalign(32, max))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if(dl->size)
+            memcpy(buf, dl->data, dl->size);
+
+        free(dl->data);
+        dl->data = buf;
+        dl->max = max;
+    }
+
+    memcpy(dl->data + dl->size, data, size);
+    dl->size += size;
+
+    return 0;
+}
+
+/* Does the list have a vertex buffer, or is it submitted directly? */
+static inline bool dlist_uses_dma(pvr_list_t list) {
+    return pvr_state.dma_mode &&
+           pvr_state.dma_buffers[pvr_state.ram_target].base[list];
+}
+
+/* Direct submission only works for the list that is open. */
+static int dlist_check_open(pvr_list_t list) {
+    if(pvr_state.list_reg_open != (int)list) {
+        dbglog(DBG_WARNING, "pvr_dlist_submit: list isn't open\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int pvr_dlist_submit(const pvr_dlist_t *dl, pvr_list_t list) {
+    assert(list < PVR_OPB_COUNT);
+
+    if(!dl->size)
+        return 0;
+
+    if(dlist_uses_dma(list))
+        return pvr_list_flush_ext(list, dl->data, dl->size);
+
+    if(dlist_check_open(list) < 0)
+        return -1;
+
+    sq_fast_cpy(SQ_MASK_DEST(PVR_TA_INPUT), dl->data, dl->size >> 5);
+
+    return 0;
+}
+
+/* Transform cnt vertices into the list's vertex buffer, in as few pieces as
+   the buffer allows. */
+static int dlist_transform_vertbuf(pvr_list_t list, const uint32_t *src,
+                                   size_t cnt) {
+    size_t max, n;
+    void *dst;
+
+    max = pvr_state.dma_buffers[pvr_state.ram_target].size[list] / 32;
+
+    while(cnt) {
+        n = cnt < max ? cnt : max;
+
+        if(!(dst = pvr_vertbuf_reserve(list, n * 32)))
+            return -1;
+
+        sq_lock(dst);
+        mat_transform_sq((void *)src, SQ_MASK_DEST(dst), n);
+        sq_unlock();
+
+        src += n * 8;
+        cnt -= n;
+    }
+
+    return 0;
+}
+
+int pvr_dlist_submit_mat(const pvr_dlist_t *dl, pvr_list_t list) {
+    const uint32_t *p = (const uint32_t *)dl->data;
+    const uint32_t *end = (const uint32_t *)(dl->data + dl->size);
+    const uint32_t *run;
+    bool dma;
+
+    assert(list < PVR_OPB_COUNT);
+
+    dma = dlist_uses_dma(list);
+
+    if(!dma && dlist_check_open(list) < 0)
+        return -1;
+
+    while(p < end) {
+        /* Copy the headers up to the next vertex as they are */
+        for(run = p; p < end && !IS_VERTEX(*p); p += 8)
+            ;
+
+        if(p > run) {
+            if(!dma)
+                sq_fast_cpy(SQ_MASK_DEST(PVR_TA_INPUT), run, (p - run) / 8);
+            else if(pvr_list_prim(list, run, (p - run) * 4) < 0)
+                return -1;
+        }
+
+        /* And transform the vertices after them */
+        for(run = p; p < end && IS_VERTEX(*p); p += 8)
+            ;
+
+        if(p > run) {
+            if(!dma)
+                mat_transform_sq((void *)run, SQ_MASK_DEST(PVR_TA_INPUT),
+                                 (p - run) / 8);
+            else if(dlist_transform_vertbuf(list, run, (p - run) / 8) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
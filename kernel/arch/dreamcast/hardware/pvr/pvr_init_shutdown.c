@@ -125,6 +125,8 @@ int pvr_init(const pvr_init_params_t *params) {
     pvr_state.rnd_last_len = -1;
     pvr_state.vtx_buf_used = 0;
     pvr_state.vtx_buf_used_max = 0;
+    memset(pvr_state.vtx_dma_used_max, 0, sizeof(pvr_state.vtx_dma_used_max));
+    pvr_state.vtx_dma_flushes = 0;
     pvr_state.dr_used = 0;
 
     /* If we're on a VGA box, disable vertical smoothing */
@@ -199,6 +201,7 @@ int pvr_init(const pvr_init_params_t *params) {
     /* Initialize PVR DMA */
     mutex_init((mutex_t *)&pvr_state.dma_lock, MUTEX_TYPE_NORMAL);
     pvr_dma_init();
+    pvr_upload_init();
 
     /* Set us as valid and return success */
     pvr_state.valid = 1;
@@ -223,6 +226,9 @@ int pvr_shutdown(void) {
     /* Set us invalid */
     pvr_state.valid = 0;
 
+    /* Drop any queued uploads, once the one being sent is done */
+    pvr_upload_shutdown();
+
     /* Stop anything that might be going on */
     PVR_SET(PVR_RESET, PVR_RESET_ALL);
     PVR_SET(PVR_RESET, PVR_RESET_NONE);
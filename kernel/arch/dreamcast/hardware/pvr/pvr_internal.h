@@ -134,6 +134,8 @@ typedef struct {
     uint8   * base[PVR_OPB_COUNT];  // DMA buffers, if assigned
     uint32  ptr[PVR_OPB_COUNT];     // DMA buffer write pointer, if used
     uint32  size[PVR_OPB_COUNT];    // DMA buffer sizes, or zero if none
+    uint32  start[PVR_OPB_COUNT];   // Start of the data not yet sent to the TA
+    int open;                       // List partly sent by pvr_list_flush(), or -1
     int ready;                      // >0 if these buffers are ready to be DMAed
 } pvr_dma_buffers_t;
 
@@ -169,10 +171,13 @@ typedef struct {
     uint32  lists_dmaed;                // (1 << idx) for each list which has been DMA'd (DMA mode only)
 
     mutex_t dma_lock;                   // Locked if a DMA is in progress (vertex or texture)
+    int     dma_waiting;                // Threads waiting for dma_lock (queued uploads give way)
     int     ta_checked_ready;           // >0 if the TA has been checked to be ready for the new scene
     int     ta_busy;                    // >0 if a scene is ongoing and the TA hasn't signaled completion
     int     render_busy;                // >0 if a render is in progress
     int     render_completed;           // >1 if a render has recently finished
+    int     flush_busy;                 // >0 if pvr_list_flush() is DMAing part of a list
+    uint32  flush_base, flush_end;      // Where in its buffer that part lies
 
     // Memory pointers / buffers
     pvr_dma_buffers_t   dma_buffers[2];     // DMA buffers (if any)
@@ -204,6 +209,8 @@ typedef struct {
     size_t   frame_count;                // Total number of viewed frames
     size_t   vtx_buf_used;               // Vertex buffer used size for the last frame
     size_t   vtx_buf_used_max;           // Maximum used vertex buffer size
+    size_t   vtx_dma_used_max[PVR_OPB_COUNT]; // Maximum used DMA buffer size for each list
+    size_t   vtx_dma_flushes;            // Number of times part of a list was flushed
 
     // Handle for the vblank interrupt
     int     vbl_handle;
@@ -310,4 +317,34 @@ void pvr_vblank_handler(uint32 code, void *data);
 
 void pvr_start_dma(void);
 
+
+/**** pvr_upload.c ****************************************************/
+
+/* Take dma_lock from a thread, once the upload queue has finished the piece
+   it is sending, and keep the queue stopped until then */
+void pvr_dma_lock(void);
+
+/* Start a new frame's upload budget (vblank IRQ) */
+void pvr_upload_frame(void);
+
+/* Send queued uploads if the DMA channel is free (IRQs only) */
+void pvr_upload_kick(void);
+
+void pvr_upload_get_stats(pvr_stats_t *stat);
+void pvr_upload_init(void);
+void pvr_upload_shutdown(void);
+
+
+/**** pvr_scene.c *****************************************************/
+
+/* Claim size bytes at the end of a list's vertex buffer (DMA mode only),
+   flushing and starting the buffer over if it's full */
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size);
+
+/* Flush a list, then DMA data from elsewhere in RAM to the TA as part of it */
+int pvr_list_flush_ext(pvr_list_t list, const void *data, size_t size);
+
+/* Wait for the data of the last pvr_list_flush() to be sent */
+void pvr_list_flush_wait(void);
+
 #endif
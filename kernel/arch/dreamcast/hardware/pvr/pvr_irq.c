@@ -34,6 +34,20 @@ static void dma_next_list(void *thread) {
     // Get the buffers for this frame.
     b = pvr_state.dma_buffers + (pvr_state.ram_target ^ 1);
 
+    // If part of a list was flushed already, the TA is still waiting for
+    // the rest of it, so that has to go first. There's none left if
+    // pvr_scene_finish() had to end it itself.
+    if(b->open != -1 && !(pvr_state.lists_dmaed & BIT(b->open))) {
+        i = b->open;
+        pvr_state.lists_dmaed |= BIT(i);
+
+        if(b->ptr[i] != b->start[i]) {
+            pvr_dma_load_ta(b->base[i] + b->start[i], b->ptr[i] - b->start[i],
+                            0, dma_next_list, thread);
+            return;
+        }
+    }
+
     for(i = 0; i < PVR_OPB_COUNT; i++) {
         if((pvr_state.lists_enabled & BIT(i))
                 && !(pvr_state.lists_dmaed & BIT(i))) {
@@ -67,12 +81,16 @@ static void dma_next_list(void *thread) {
 
     // Buffers are now empty again
     pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready = 0;
+
+    // Let queued uploads have the channel until the next frame's vertices
+    if(irq_inside_int())
+        pvr_upload_kick();
 }
 
 void pvr_start_dma(void) {
     pvr_sync_stats(PVR_SYNC_REGSTART);
 
-    mutex_lock((mutex_t *)&pvr_state.dma_lock);
+    pvr_dma_lock();
 
     // Begin DMAing the first list.
     dma_next_list(thd_get_current());
@@ -119,6 +137,9 @@ void pvr_vblank_handler(uint32 code, void *data) {
 
     pvr_sync_stats(PVR_SYNC_VBLANK);
 
+    // Start a new budget for queued uploads, and send some
+    pvr_upload_frame();
+
     // If the render-done interrupt has fired then we are ready to flip to the
     // new frame buffer.
     if(pvr_state.render_completed) {
@@ -171,6 +192,7 @@ void pvr_int_handler(uint32 code, void *data) {
             pvr_sync_stats(PVR_SYNC_RNDDONE);
 
             genwait_wake_all((void *)&pvr_state.render_busy);
+            pvr_upload_kick();
             break;
     }
 
@@ -72,8 +72,12 @@ int pvr_get_stats(pvr_stats_t *stat) {
 
     stat->vtx_buffer_used = pvr_state.vtx_buf_used;
     stat->vtx_buffer_used_max = pvr_state.vtx_buf_used_max;
+    memcpy(stat->vtx_dma_used_max, pvr_state.vtx_dma_used_max,
+           sizeof(stat->vtx_dma_used_max));
+    stat->vtx_dma_flushes = pvr_state.vtx_dma_flushes;
     stat->buf_last_time = pvr_state.buf_last_len;
     stat->frame_count = pvr_state.frame_count;
+    pvr_upload_get_stats(stat);
 
     return 0;
 }
@@ -58,15 +58,33 @@ void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len) {
     pvr_state.dma_buffers[0].base[list] = (uint8 *)buffer;
     pvr_state.dma_buffers[0].ptr[list] = 0;
     pvr_state.dma_buffers[0].size[list] = len / 2;
+    pvr_state.dma_buffers[0].start[list] = 0;
+    pvr_state.dma_buffers[0].open = -1;
     pvr_state.dma_buffers[0].ready = 0;
     pvr_state.dma_buffers[1].base[list] = ((uint8 *)buffer) + len / 2;
     pvr_state.dma_buffers[1].ptr[list] = 0;
     pvr_state.dma_buffers[1].size[list] = len / 2;
+    pvr_state.dma_buffers[1].start[list] = 0;
+    pvr_state.dma_buffers[1].open = -1;
     pvr_state.dma_buffers[1].ready = 0;
 
     return oldbuf;
 }
 
+/* Called from the DMA interrupt once a flushed part of a list is sent. */
+static void pvr_list_flush_done(void *thread) {
+    pvr_state.flush_busy = 0;
+    mutex_unlock_as_thread((mutex_t *)&pvr_state.dma_lock, thread);
+}
+
+/* Wait for a flushed part of a list to be sent, if there is one. */
+void pvr_list_flush_wait(void) {
+    if(pvr_state.flush_busy) {
+        pvr_dma_lock();
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+}
+
 void *pvr_vertbuf_tail(pvr_list_t list) {
     uint8 *bufbase;
 
@@ -74,6 +92,11 @@ void *pvr_vertbuf_tail(pvr_list_t list) {
     assert(list < PVR_OPB_COUNT);
     assert(pvr_state.dma_mode);
 
+    // The caller may write anywhere past the tail, so make sure none of it
+    // is still being flushed.
+    if(pvr_state.dma_buffers[pvr_state.ram_target].open == (int)list)
+        pvr_list_flush_wait();
+
     // Get the buffer base.
     bufbase = pvr_state.dma_buffers[pvr_state.ram_target].base[list];
     assert(bufbase);
@@ -133,8 +156,11 @@ void pvr_scene_begin(void) {
     if(pvr_state.dma_mode) {
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+            pvr_state.dma_buffers[pvr_state.ram_target].start[i] = 0;
         }
 
+        pvr_state.dma_buffers[pvr_state.ram_target].open = -1;
+
         pvr_sync_stats(PVR_SYNC_BUFSTART);
         // DBG(("pvr_scene_begin(dma -> %d)\n", pvr_state.ram_target));
     }
@@ -195,6 +221,14 @@ int pvr_list_begin(pvr_list_t list) {
     pvr_list_dma = pvr_list_uses_dma(list);
 
     if(!pvr_list_dma) {
+        /* A flushed list has to be finished before the TA takes another */
+        if(pvr_state.dma_mode &&
+           pvr_state.dma_buffers[pvr_state.ram_target].open != -1) {
+            dbglog(DBG_WARNING, "pvr_list_begin: attempt to submit directly "
+                                "while a flushed list is open\n");
+            return -1;
+        }
+
         pvr_start_ta_rendering();
         sq_lock((void *)PVR_TA_INPUT);
     }
@@ -270,24 +304,59 @@ int pvr_prim(const void *data, size_t size) {
     return 0;
 }
 
-int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
+/* Keep track of the most of each vertex buffer used, to help size them. */
+static inline void pvr_vertbuf_peak(volatile pvr_dma_buffers_t *b,
+                                    pvr_list_t list) {
+    if(b->ptr[list] > pvr_state.vtx_dma_used_max[list])
+        pvr_state.vtx_dma_used_max[list] = b->ptr[list];
+}
+
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size) {
     volatile pvr_dma_buffers_t * b;
+    uint8 *p;
 
     b = pvr_state.dma_buffers + pvr_state.ram_target;
 
+    /* If the vertex buffer is full, send what it holds to the TA and start
+       over at the beginning. */
+    if(b->ptr[list] + size > b->size[list]) {
+        assert(size <= b->size[list]);
+
+        pvr_vertbuf_peak(b, list);
+
+        if(pvr_list_flush(list) < 0)
+            return NULL;
+
+        b->ptr[list] = b->start[list] = 0;
+    }
+
+    /* Don't overwrite the part of the buffer still being flushed. */
+    if(pvr_state.flush_busy && b->open == (int)list &&
+       b->ptr[list] < pvr_state.flush_end &&
+       b->ptr[list] + size > pvr_state.flush_base)
+        pvr_list_flush_wait();
+
+    p = b->base[list] + b->ptr[list];
+    b->ptr[list] += size;
+
+    return p;
+}
+
+int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
+    void *dst;
+
     /* Ensure we associated a DMA vertex buffer with this list type. */
-    assert(b->base[list]);
+    assert(pvr_state.dma_buffers[pvr_state.ram_target].base[list]);
 
     /* Ensure data size is multiple of 32-bytes. */
     assert(!(size & 31));
     /* Ensure at least 4-byte alignment. */
     assert(!((uintptr_t)data & 0x3));
 
-    /* Ensure we won't overflow the vertex buffer. */
-    assert(b->ptr[list] + size <= b->size[list]);
+    if(!(dst = pvr_vertbuf_reserve(list, size)))
+        return -1;
 
-    memcpy(b->base[list] + b->ptr[list], data, size);
-    b->ptr[list] += size;
+    memcpy(dst, data, size);
 
     return 0;
 }
@@ -302,10 +371,75 @@ void pvr_dr_finish(void) {
 }
 
 int pvr_list_flush(pvr_list_t list) {
-    (void)list;
+    volatile pvr_dma_buffers_t * b;
+    uint32 start;
+
+    assert(list < PVR_OPB_COUNT);
+    assert(pvr_state.dma_mode);
 
-    assert_msg(0, "not implemented yet");
-    return -1;
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+    assert(b->base[list]);
+
+    /* The TA takes each list in one piece, so once part of a list has been
+       sent, nothing else can go to it until the end of the scene. */
+    if((b->open != -1 && b->open != (int)list) ||
+       (pvr_state.list_reg_open != -1 && !pvr_list_dma)) {
+        dbglog(DBG_WARNING, "pvr_list_flush: another list is open on the TA\n");
+        return -1;
+    }
+
+    start = b->start[list];
+
+    if(b->ptr[list] == start)
+        return 0;
+
+    pvr_start_ta_rendering();
+
+    /* This also waits for the last part of the list we flushed. */
+    pvr_dma_lock();
+
+    b->open = list;
+    b->start[list] = b->ptr[list];
+    pvr_state.flush_base = start;
+    pvr_state.flush_end = b->ptr[list];
+    pvr_state.flush_busy = 1;
+    pvr_state.vtx_dma_flushes++;
+
+    if(pvr_dma_load_ta(b->base[list] + start, b->ptr[list] - start, false,
+                       pvr_list_flush_done, thd_get_current()) < 0) {
+        pvr_state.flush_busy = 0;
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+int pvr_list_flush_ext(pvr_list_t list, const void *data, size_t size) {
+    volatile pvr_dma_buffers_t * b;
+
+    /* Whatever was buffered for the list has to go first. */
+    if(pvr_list_flush(list) < 0)
+        return -1;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    pvr_start_ta_rendering();
+    pvr_dma_lock();
+
+    /* None of the list's own buffer is in use by this DMA. */
+    b->open = list;
+    pvr_state.flush_base = pvr_state.flush_end = 0;
+    pvr_state.flush_busy = 1;
+
+    if(pvr_dma_load_ta(data, size, false, pvr_list_flush_done,
+                       thd_get_current()) < 0) {
+        pvr_state.flush_busy = 0;
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+        return -1;
+    }
+
+    return 0;
 }
 
 /* Call this after you have finished submitting all data for a frame; once
@@ -313,7 +447,7 @@ int pvr_list_flush(pvr_list_t list) {
    pvr_scene_begin() functions is called again. An error (-1) is returned if
    you have not started a scene already. */
 int pvr_scene_finish(void) {
-    int i, o;
+    int i, o, ended = -1;
     volatile pvr_dma_buffers_t * b;
 
     /* Release Store Queues if they are used */
@@ -328,14 +462,45 @@ int pvr_scene_finish(void) {
         // add a zero-marker to the end of each list.
         b = pvr_state.dma_buffers + pvr_state.ram_target;
 
+        // The end of a flushed list may go where the last part of it is
+        // still being sent.
+        if(b->open != -1) {
+            pvr_list_flush_wait();
+
+            // The TA won't take a blank list submitted directly until the
+            // flushed one has ended, so if one is needed, end that now
+            // instead of with the rest of the lists.
+            for(i = 0; i < PVR_OPB_COUNT; i++) {
+                if((pvr_state.lists_enabled & BIT(i)) && !b->base[i] &&
+                   !(pvr_state.lists_closed & BIT(i)))
+                    break;
+            }
+
+            if(i < PVR_OPB_COUNT) {
+                ended = b->open;
+                memset(b->base[ended] + b->ptr[ended], 0, 32);
+                b->ptr[ended] += 32;
+                assert(b->ptr[ended] <= b->size[ended]);
+                pvr_vertbuf_peak(b, ended);
+
+                if(pvr_list_flush(ended) < 0)
+                    ended = -1;
+                else
+                    pvr_list_flush_wait();
+            }
+        }
+
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             /* We never enabled the list globally with pvr_init() - skip it */
             if(!(pvr_state.lists_enabled & BIT(i)))
                 continue;
 
+            /* The flushed list was ended above, and all of it is sent */
+            if(i == ended)
+                continue;
+
             /* If any lists weren't used in this scene, submit blank ones now */
-            if(!(pvr_state.lists_closed & BIT(i))) {
-                pvr_list_begin(i);
+            if(!(pvr_state.lists_closed & BIT(i)) && !pvr_list_begin(i)) {
                 pvr_blank_polyhdr(i);
                 pvr_list_finish();
             }
@@ -346,8 +511,9 @@ int pvr_scene_finish(void) {
             if(!b->base[i])
                 continue;
 
-            // Make sure there's at least one primitive in each.
-            if(b->ptr[i] == 0) {
+            // Make sure there's at least one primitive in each, unless some
+            // were already flushed.
+            if(b->ptr[i] == 0 && b->open != i) {
                 pvr_blank_polyhdr_buf(i, (pvr_poly_hdr_t*)(b->base[i]));
                 b->ptr[i] += 32;
             }
@@ -358,6 +524,8 @@ int pvr_scene_finish(void) {
 
             // Verify that there is no overrun.
             assert(b->ptr[i] <= b->size[i]);
+
+            pvr_vertbuf_peak(b, i);
         }
 
         pvr_start_ta_rendering();
@@ -7,12 +7,16 @@
  */
 
 #include <assert.h>
+#include <malloc.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
+#include <arch/timer.h>
 #include <kos/dbglog.h>
 #include <kos/regfield.h>
 #include <string.h>
 #include "pvr_internal.h"
+#include "pvr_txr_enc.h"
+#include "pvr_txr_twiddle.h"
 
 /*
 
@@ -48,33 +52,127 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count) {
     pvr_sq_load((uint32_t *)dst, (const uint32_t *)src, count, PVR_DMA_VRAM64);
 }
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+/* Twiddled textures of at least this many bytes are made in one buffer and
+   sent by DMA. Smaller ones are made a chunk at a time, and each chunk is sent
+   through the store queues while it is still in the cache. */
+#define TWIDDLE_DMA_SIZE    (64 * 1024)
+#define TWIDDLE_CHUNK       1024
 
 #define MIN(a, b) ( (a)<(b)? (a):(b) )
 
+/* Texel format for the encoders, from the load flags */
+static int txr_enc_fmt(uint32_t flags) {
+    switch(flags & PVR_TXRLOAD_PXL_MASK) {
+        case PVR_TXRLOAD_ARGB1555:
+            return PVR_ENC_ARGB1555;
+        case PVR_TXRLOAD_ARGB4444:
+            return PVR_ENC_ARGB4444;
+        default:
+            return PVR_ENC_RGB565;
+    }
+}
+
+/* VQ compress a 16bpp texture into a buffer, then copy that to VRAM */
+static void txr_load_vq(const uint16_t *src, pvr_ptr_t dst, uint32_t w,
+                        uint32_t h, uint32_t flags) {
+    size_t size = PVR_TXRLOAD_VQ_SIZE(w, h), i;
+    uint64_t start = timer_us_gettime64();
+    uint16_t *buf;
+    int stride = w;
+
+    assert_msg(w >= 8 && h >= 8, "VQ textures have to be at least 8x8");
+
+    if(flags & PVR_TXRLOAD_INVERT_Y) {
+        src += (h - 1) * w;
+        stride = -stride;
+    }
+
+    buf = memalign(32, size);
+
+    if(!buf || pvr_enc_vq(src, stride, w, h, txr_enc_fmt(flags),
+                          (uint8_t *)buf)) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: out of memory for VQ compression\n");
+        free(buf);
+        return;
+    }
+
+    /* The store queues move 32 bytes at a time; only 8x8 leaves any over */
+    pvr_txr_load(buf, dst, size & ~31);
+
+    for(i = size & ~31; i < size; i += 2)
+        ((uint16_t *)dst)[i / 2] = buf[i / 2];
+
+    free(buf);
+
+    dbglog(DBG_DEBUG, "pvr_txr_load_ex: VQ compressed %lux%lu texture in "
+           "%lu us, %zu bytes of VRAM instead of %lu\n", w, h,
+           (uint32_t)(timer_us_gettime64() - start), size, w * h * 2);
+}
+
+/* Copy twiddled lines to VRAM. Texture addresses only have to be 8-byte
+   aligned, and the store queues need 32. */
+static void txr_copy_lines(const uint8_t *buf, pvr_ptr_t dst, size_t size) {
+    size_t i;
+
+    if(!((uintptr_t)dst & 31)) {
+        pvr_txr_load(buf, dst, size);
+        return;
+    }
+
+    for(i = 0; i < size; i += 4)
+        ((uint32_t *)dst)[i / 4] = ((const uint32_t *)buf)[i / 4];
+}
+
+/* Twiddle the whole texture into a buffer and DMA it to VRAM. Returns -1 if
+   the buffer couldn't be allocated. */
+static int txr_load_twiddled_dma(const uint8_t *src, int stride, pvr_ptr_t dst,
+                                 uint32_t w, uint32_t h, int bpp) {
+    size_t size = w * h * bpp / 8;
+    uint8_t *buf = memalign(32, size);
+    int rv = -1;
+
+    if(!buf)
+        return -1;
+
+    pvr_twiddle(buf, src, stride, w, h, bpp, 0, size / PVR_TWIDDLE_LINE);
+
+    /* The lock waits out any vertex DMA still going */
+    if(!((uintptr_t)dst & 31)) {
+        pvr_dma_lock();
+        rv = pvr_txr_load_dma(buf, dst, size, true, NULL, 0);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+
+    if(rv)
+        txr_copy_lines(buf, dst, size);
+
+    free(buf);
+    return 0;
+}
+
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
    in the process.
 
-   This is a modified version of Vincent Penne's general twiddling
-   function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
-   The rectangle does not need to be a square (not tested with h>w, but
-   this is just a matter of a rotation by PI/2 and UV swapping).
+   The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted), and doesn't
+   need to be square. The twiddling itself is in pvr_txr_twiddle.c.
 
    - w and h must be a power of 2
    - flags must be a logical OR of the various texture loading
      flags available:
        PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
-       PVR_TXRLOAD_VQ (not supported yet)
-       PVR_TXRLOAD_INVERT
+       PVR_TXRLOAD_VQ_LOAD (16bpp only)
+       PVR_TXRLOAD_INVERT_Y
+       PVR_TXRLOAD_DMA
 
 */
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
                      uint32_t flags) {
-    uint32_t x, y, yout, min, mask, bpp, invert;
+    uint8_t buf[TWIDDLE_CHUNK] __attribute__((aligned(32)));
+    const uint8_t *pixels = src;
+    uint32_t bpp, lines, l, n;
+    size_t size;
+    int stride;
 
     /* Make sure we're attempting something we can do */
     switch(flags & PVR_TXRLOAD_FMT_MASK) {
@@ -92,76 +190,82 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
             bpp = 8;
     }
 
-    assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
-    invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
-
-    min = MIN(w, h);
-    mask = min - 1;
-
-    switch(bpp) {
-        case 4: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x += 2) {
-                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
-                         (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
-                }
-            }
-        }
-        break;
-        case 8: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
-                         (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
-                }
-            }
-        }
-        break;
-        case 16: {
-            uint16_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint16_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y++) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT(x & mask, yout & mask) +
-                         (x / min + yout / min)*min * min] = pixels[y * w + x];
-                }
-            }
-        }
-        break;
+    if(flags & PVR_TXRLOAD_VQ_LOAD) {
+        assert_msg(bpp == 16, "VQ compression needs 16bpp texels, use "
+                   "pvr_txr_load_pal() for palettes");
+        txr_load_vq(src, dst, w, h, flags);
+        return;
+    }
+
+    assert_msg(w >= 8 && h >= 8, "Twiddled textures have to be at least 8x8");
+
+    stride = w * bpp / 8;
+    size = h * stride;
+
+    if(flags & PVR_TXRLOAD_INVERT_Y) {
+        pixels += size - stride;
+        stride = -stride;
+    }
+
+    if(((flags & PVR_TXRLOAD_DMA) || size >= TWIDDLE_DMA_SIZE) &&
+       !txr_load_twiddled_dma(pixels, stride, dst, w, h, bpp))
+        return;
+
+    lines = size / PVR_TWIDDLE_LINE;
+
+    for(l = 0; l < lines; l += n) {
+        n = MIN(TWIDDLE_CHUNK / PVR_TWIDDLE_LINE, lines - l);
+        pvr_twiddle(buf, pixels, stride, w, h, bpp, l, n);
+        txr_copy_lines(buf, (uint8_t *)dst + l * PVR_TWIDDLE_LINE,
+                       n * PVR_TWIDDLE_LINE);
     }
 }
 
+/* Load a 16bpp texture as a paletted one, choosing the palette on the fly */
+int pvr_txr_load_pal(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
+                     uint32_t flags, uint32_t pal_entry) {
+    uint64_t start = timer_us_gettime64();
+    uint16_t pal[256];
+    uint8_t *idx;
+    int colors, i;
+
+    switch(flags & PVR_TXRLOAD_FMT_MASK) {
+        case PVR_TXRLOAD_4BPP:
+            colors = 16;
+            break;
+        case PVR_TXRLOAD_8BPP:
+            colors = 256;
+            break;
+        default:
+            assert_msg(0, "Palettes have to be 4bpp or 8bpp");
+            return -1;
+    }
+
+    assert_msg(pal_entry + colors <= 1024, "Palette doesn't fit");
+
+    idx = malloc(colors == 16 ? w * h / 2 : w * h);
+
+    if(!idx || pvr_enc_pal(src, w, w, h, txr_enc_fmt(flags), colors, idx,
+                           pal)) {
+        dbglog(DBG_ERROR, "pvr_txr_load_pal: out of memory\n");
+        free(idx);
+        return -1;
+    }
+
+    pvr_txr_load_ex(idx, dst, w, h, flags & (PVR_TXRLOAD_FMT_MASK |
+                                              PVR_TXRLOAD_INVERT_Y));
+    free(idx);
+
+    for(i = 0; i < colors; i++)
+        pvr_set_pal_entry(pal_entry + i, pal[i]);
+
+    dbglog(DBG_DEBUG, "pvr_txr_load_pal: reduced %lux%lu texture to %d colors "
+           "in %lu us, %lu bytes of VRAM instead of %lu\n", w, h, colors,
+           (uint32_t)(timer_us_gettime64() - start),
+           colors == 16 ? w * h / 2 : w * h, w * h * 2);
+    return 0;
+}
+
 /* Load a KOS Platform Independent Image (subject to restraint checking) */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
     uint32_t fmt, w, h;
@@ -199,6 +303,16 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
     /* Make sure the format part of the flags is clean */
     flags = (flags & ~PVR_TXRLOAD_FMT_MASK) | fmt;
 
+    /* Tell the VQ encoder what the texels are */
+    if(fmt == PVR_TXRLOAD_16BPP) {
+        flags &= ~PVR_TXRLOAD_PXL_MASK;
+
+        if((KOS_IMG_FMT_I(img->fmt) & KOS_IMG_FMT_MASK) == KOS_IMG_FMT_ARGB4444)
+            flags |= PVR_TXRLOAD_ARGB4444;
+        else if((KOS_IMG_FMT_I(img->fmt) & KOS_IMG_FMT_MASK) == KOS_IMG_FMT_ARGB1555)
+            flags |= PVR_TXRLOAD_ARGB1555;
+    }
+
     /* Call down */
     if((flags & PVR_TXRLOAD_FMT_VQ) || (flags & PVR_TXRLOAD_FMT_TWIDDLED) ||
             (KOS_IMG_FMT_D(img->fmt) & PVR_TXRLOAD_FMT_VQ) ||
@@ -209,7 +323,7 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
             /* We only enable DMA here for now since it sort of changes things
                to have to allocate an intermediary buffer. */
             if(flags & PVR_TXRLOAD_DMA) {
-                mutex_lock((mutex_t *)&pvr_state.dma_lock);
+                pvr_dma_lock();
                 pvr_txr_load_dma(img->data, dst, img->byte_count,
                                  (flags & PVR_TXRLOAD_NONBLOCK) ? 1 : 0, NULL, 0);
                 mutex_unlock((mutex_t *)&pvr_state.dma_lock);
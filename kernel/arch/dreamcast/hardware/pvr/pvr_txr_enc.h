@@ -0,0 +1,38 @@
+/* KallistiOS ##version##
+
+   pvr_txr_enc.h
+
+   Texture compression for pvr_txr_load_ex() and pvr_txr_load_pal(). These
+   don't depend on anything else in KOS, so they can be built and tested on
+   the host as well.
+*/
+
+#ifndef __PVR_TXR_ENC_H
+#define __PVR_TXR_ENC_H
+
+#include <stdint.h>
+
+/* Formats of the 16-bit texels that are compressed. */
+#define PVR_ENC_RGB565      0
+#define PVR_ENC_ARGB1555    1
+#define PVR_ENC_ARGB4444    2
+
+/* Size of a w x h VQ texture with a full 256 entry codebook. */
+#define PVR_ENC_VQ_SIZE(w, h)   (2048 + (w) * (h) / 4)
+
+/* Compress w x h texels into a VQ texture, ready to be copied to VRAM: the
+   codebook, then the twiddled indices. Rows in src are stride texels apart,
+   which may be negative to flip the texture. w and h must be powers of two
+   from 8 to 1024. Returns 0, or -1 if memory couldn't be allocated. */
+int pvr_enc_vq(const uint16_t *src, int stride, uint32_t w, uint32_t h,
+               int fmt, uint8_t *out);
+
+/* Reduce w x h texels to a palette of colors (16 or 256) entries. The
+   indices are stored untwiddled, one byte per texel, or for 16 colors two
+   texels per byte with the left one in the low nibble. The palette is in the
+   same format as the texels. Returns 0, or -1 if memory couldn't be
+   allocated. */
+int pvr_enc_pal(const uint16_t *src, int stride, uint32_t w, uint32_t h,
+                int fmt, int colors, uint8_t *out, uint16_t *pal);
+
+#endif  /* __PVR_TXR_ENC_H */
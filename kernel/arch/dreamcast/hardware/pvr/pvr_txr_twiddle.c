@@ -0,0 +1,107 @@
+/* KallistiOS ##version##
+
+   pvr_txr_twiddle.c
+
+   Table driven twiddling. The output is made in order, in units of 4x4
+   texels, which are 8, 16 or 32 contiguous bytes of the twiddled texture.
+   Where each unit comes from is looked up in a table, so the inner loops are
+   just loads and stores: each unit reads from four source rows, and the next
+   few units read from the same cache lines. Writing whole lines in order is
+   what lets the result go to VRAM through the store queues or by DMA,
+   instead of one scattered 16-bit store per texel.
+*/
+
+#include "pvr_txr_twiddle.h"
+
+/* The even bits of a byte, packed into a nibble. These undo the interleaving
+   of the x and y bits in a twiddled index, y being in the lowest bit. */
+#define EVEN(i)     (((i) & 1) | (((i) >> 1) & 2) | (((i) >> 2) & 4) | \
+                     (((i) >> 3) & 8))
+#define EVEN4(i)    EVEN(i), EVEN((i) + 1), EVEN((i) + 2), EVEN((i) + 3)
+#define EVEN16(i)   EVEN4(i), EVEN4((i) + 4), EVEN4((i) + 8), EVEN4((i) + 12)
+#define EVEN64(i)   EVEN16(i), EVEN16((i) + 16), EVEN16((i) + 32), \
+                    EVEN16((i) + 48)
+
+static const uint8_t even_bits[256] = {
+    EVEN64(0), EVEN64(64), EVEN64(128), EVEN64(192)
+};
+
+/* Units are at most 1024 * 1024 / 16 apart, so 16 bits is enough */
+static inline uint32_t even16(uint32_t i) {
+    return even_bits[i & 0xff] | (even_bits[(i >> 8) & 0xff] << 4);
+}
+
+/* In each unit, the 2x2 quads are in the order (0, 0), (0, 2), (2, 0),
+   (2, 2), and the texels of a quad go down, then across. */
+static inline void unit16(uint16_t *out, const uint16_t *r0,
+                          const uint16_t *r1, const uint16_t *r2,
+                          const uint16_t *r3) {
+    out[0] = r0[0];     out[1] = r1[0];     out[2] = r0[1];     out[3] = r1[1];
+    out[4] = r2[0];     out[5] = r3[0];     out[6] = r2[1];     out[7] = r3[1];
+    out[8] = r0[2];     out[9] = r1[2];     out[10] = r0[3];    out[11] = r1[3];
+    out[12] = r2[2];    out[13] = r3[2];    out[14] = r2[3];    out[15] = r3[3];
+}
+
+static inline void unit8(uint8_t *out, const uint8_t *r0, const uint8_t *r1,
+                         const uint8_t *r2, const uint8_t *r3) {
+    out[0] = r0[0];     out[1] = r1[0];     out[2] = r0[1];     out[3] = r1[1];
+    out[4] = r2[0];     out[5] = r3[0];     out[6] = r2[1];     out[7] = r3[1];
+    out[8] = r0[2];     out[9] = r1[2];     out[10] = r0[3];    out[11] = r1[3];
+    out[12] = r2[2];    out[13] = r3[2];    out[14] = r2[3];    out[15] = r3[3];
+}
+
+/* A byte of the source holds a pair of texels across, and one of the output a
+   pair down */
+#define PAIR_LO(a, b)   (((a) & 0x0f) | ((b) << 4))
+#define PAIR_HI(a, b)   (((a) >> 4) | ((b) & 0xf0))
+
+static inline void unit4(uint8_t *out, const uint8_t *r0, const uint8_t *r1,
+                         const uint8_t *r2, const uint8_t *r3) {
+    out[0] = PAIR_LO(r0[0], r1[0]);     out[1] = PAIR_HI(r0[0], r1[0]);
+    out[2] = PAIR_LO(r2[0], r3[0]);     out[3] = PAIR_HI(r2[0], r3[0]);
+    out[4] = PAIR_LO(r0[1], r1[1]);     out[5] = PAIR_HI(r0[1], r1[1]);
+    out[6] = PAIR_LO(r2[1], r3[1]);     out[7] = PAIR_HI(r2[1], r3[1]);
+}
+
+void pvr_twiddle(uint8_t *out, const uint8_t *src, int stride, uint32_t w,
+                 uint32_t h, int bpp, uint32_t first, uint32_t count) {
+    uint32_t min = w < h ? w : h, unit_size = bpp * 2;
+    uint32_t u = first * (PVR_TWIDDLE_LINE / unit_size);
+    uint32_t end = (first + count) * (PVR_TWIDDLE_LINE / unit_size);
+    uint32_t mask = min * min / 16 - 1, x, y;
+    int shift = 0;
+    const uint8_t *r0, *r1, *r2, *r3;
+
+    /* Rectangular textures are a row or column of twiddled squares */
+    while((1u << shift) <= mask)
+        shift++;
+
+    for(; u < end; u++, out += unit_size) {
+        x = even16((u & mask) >> 1) * 4;
+        y = even16(u & mask) * 4;
+
+        if(w > h)
+            x += (u >> shift) * min;
+        else
+            y += (u >> shift) * min;
+
+        r0 = src + (int)y * stride + x * bpp / 8;
+        r1 = r0 + stride;
+        r2 = r1 + stride;
+        r3 = r2 + stride;
+
+        switch(bpp) {
+            case 16:
+                unit16((uint16_t *)out, (const uint16_t *)r0,
+                       (const uint16_t *)r1, (const uint16_t *)r2,
+                       (const uint16_t *)r3);
+                break;
+            case 8:
+                unit8(out, r0, r1, r2, r3);
+                break;
+            default:
+                unit4(out, r0, r1, r2, r3);
+                break;
+        }
+    }
+}
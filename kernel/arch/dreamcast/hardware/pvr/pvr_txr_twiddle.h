@@ -0,0 +1,28 @@
+/* KallistiOS ##version##
+
+   pvr_txr_twiddle.h
+
+   Twiddling for pvr_txr_load_ex(). Like the encoders in pvr_txr_enc.h, this
+   doesn't depend on anything else in KOS, so it can be built and tested on
+   the host as well.
+*/
+
+#ifndef __PVR_TXR_TWIDDLE_H
+#define __PVR_TXR_TWIDDLE_H
+
+#include <stdint.h>
+
+/* The twiddled texture is produced a line of this many bytes at a time, which
+   is what the store queues and the DMA move in one go. */
+#define PVR_TWIDDLE_LINE    32
+
+/* Twiddle part of a w x h texture of bpp (4, 8 or 16) bits per texel. The
+   twiddled texture is cut into PVR_TWIDDLE_LINE byte lines, and lines first
+   to first + count - 1 are written to out, so a big texture can be done a
+   piece at a time. Rows in src are stride bytes apart, which may be negative
+   to flip the texture. At 4bpp, the left texel of a pair is in the low
+   nibble. w and h must be powers of two from 8 to 1024. */
+void pvr_twiddle(uint8_t *out, const uint8_t *src, int stride, uint32_t w,
+                 uint32_t h, int bpp, uint32_t first, uint32_t count);
+
+#endif  /* __PVR_TXR_TWIDDLE_H */
@@ -0,0 +1,229 @@
+/* KallistiOS ##version##
+
+   pvr_upload.c
+
+   Queue of uploads to VRAM, sent by DMA a piece at a time from the PVR's
+   interrupts. Each vertical blank starts a new frame's budget, and the queue
+   is also looked at when a render or a vertex DMA finishes, which is when the
+   DMA channel is most likely to be free. Pieces are chained from the DMA
+   interrupt until the budget runs out, or until a thread wants the channel
+   for vertices, so uploads never hold up a frame by more than one piece.
+
+   The queue doesn't take dma_lock, since a mutex can't be held by an
+   interrupt once it returns. Instead, it only starts while the mutex is free,
+   and threads that take the mutex with pvr_dma_lock() first wait for the
+   queue to finish its piece.
+*/
+
+#include <errno.h>
+#include <dc/pvr.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
+#include <kos/genwait.h>
+
+#include "pvr_internal.h"
+
+/* The most sent by one DMA, which is the longest the vertex DMA can be kept
+   waiting by an upload */
+#define PIECE_MAX       (32 * 1024)
+
+typedef struct upload {
+    const uint8_t *src;
+    uintptr_t dst;
+    size_t count;                   /* Bytes still to send */
+    pvr_dma_callback_t callback;
+    void *cbdata;
+} upload_t;
+
+/* Uploads head to tail - 1 are waiting, in a ring */
+static upload_t queue[PVR_UPLOAD_QUEUE_MAX];
+static volatile unsigned int head, tail;
+static volatile size_t queued_bytes;
+
+/* Set while a piece is being sent */
+static volatile bool busy;
+static size_t piece;
+
+static size_t budget_bytes;
+static unsigned int budget_us;
+static size_t frame_bytes, last_bytes;
+static uint64_t frame_start;
+
+static void upload_done(void *data);
+
+/* Start the next piece, if the budget allows. Returns 0 if one was started. */
+static int upload_start(void) {
+    upload_t *u = queue + head % PVR_UPLOAD_QUEUE_MAX;
+    size_t n;
+
+    if(head == tail || pvr_state.dma_waiting)
+        return -1;
+
+    n = u->count;
+
+    if(budget_bytes) {
+        if(frame_bytes + 32 > budget_bytes)
+            return -1;
+
+        if(n > budget_bytes - frame_bytes)
+            n = (budget_bytes - frame_bytes) & ~31;
+    }
+
+    if(budget_us && frame_bytes &&
+       timer_us_gettime64() - frame_start >= budget_us)
+        return -1;
+
+    if(n > PIECE_MAX)
+        n = PIECE_MAX;
+
+    if(pvr_dma_transfer(u->src, u->dst, n, PVR_DMA_VRAM64, false,
+                        upload_done, NULL))
+        return -1;
+
+    if(!frame_bytes)
+        frame_start = timer_us_gettime64();
+
+    piece = n;
+    frame_bytes += n;
+    return 0;
+}
+
+/* Called from the DMA interrupt once a piece is sent */
+static void upload_done(void *data) {
+    upload_t *u = queue + head % PVR_UPLOAD_QUEUE_MAX;
+    pvr_dma_callback_t cb;
+    void *cbdata;
+
+    (void)data;
+
+    u->src += piece;
+    u->dst += piece;
+    u->count -= piece;
+    queued_bytes -= piece;
+
+    if(!u->count) {
+        cb = u->callback;
+        cbdata = u->cbdata;
+        head++;
+
+        if(cb)
+            cb(cbdata);
+
+        if(head == tail)
+            genwait_wake_all((void *)queue);
+    }
+
+    if(upload_start()) {
+        busy = false;
+        genwait_wake_all((void *)&pvr_state.dma_waiting);
+    }
+}
+
+void pvr_upload_kick(void) {
+    if(busy || head == tail || pvr_state.dma_waiting || !pvr_dma_ready() ||
+       mutex_is_locked((mutex_t *)&pvr_state.dma_lock))
+        return;
+
+    busy = true;
+
+    if(upload_start())
+        busy = false;
+}
+
+void pvr_dma_lock(void) {
+    irq_disable_scoped();
+
+    /* This also keeps the queue from starting another piece */
+    pvr_state.dma_waiting++;
+
+    while(busy)
+        genwait_wait((void *)&pvr_state.dma_waiting, "pvr_dma_lock", 0, NULL);
+
+    mutex_lock((mutex_t *)&pvr_state.dma_lock);
+    pvr_state.dma_waiting--;
+}
+
+void pvr_upload_frame(void) {
+    last_bytes = frame_bytes;
+    frame_bytes = 0;
+    pvr_upload_kick();
+}
+
+int pvr_upload_queue(const void *src, pvr_ptr_t dst, size_t count,
+                     pvr_dma_callback_t callback, void *cbdata) {
+    upload_t *u;
+
+    if(!count || (count & 31) || ((uintptr_t)src & 31) ||
+       ((uintptr_t)dst & 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    irq_disable_scoped();
+
+    if(tail - head == PVR_UPLOAD_QUEUE_MAX) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    u = queue + tail % PVR_UPLOAD_QUEUE_MAX;
+    u->src = src;
+    u->dst = (uintptr_t)dst;
+    u->count = count;
+    u->callback = callback;
+    u->cbdata = cbdata;
+
+    tail++;
+    queued_bytes += count;
+    return 0;
+}
+
+void pvr_upload_set_budget(size_t bytes, unsigned int us) {
+    irq_disable_scoped();
+
+    budget_bytes = bytes;
+    budget_us = us;
+}
+
+size_t pvr_upload_pending(void) {
+    return tail - head;
+}
+
+int pvr_upload_wait(void) {
+    irq_disable_scoped();
+
+    while(head != tail) {
+        if(genwait_wait((void *)queue, "pvr_upload_wait", 0, NULL) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+void pvr_upload_get_stats(pvr_stats_t *stat) {
+    stat->upload_pending = tail - head;
+    stat->upload_pending_bytes = queued_bytes;
+    stat->upload_bytes_last = last_bytes;
+}
+
+void pvr_upload_init(void) {
+    head = tail = 0;
+    queued_bytes = 0;
+    busy = false;
+    budget_bytes = PVR_UPLOAD_BUDGET_DEFAULT;
+    budget_us = 0;
+    frame_bytes = last_bytes = 0;
+}
+
+void pvr_upload_shutdown(void) {
+    /* Let a piece that is being sent finish first */
+    pvr_dma_lock();
+
+    /* Anything still waiting is dropped, without its callback */
+    irq_disable_scoped();
+    head = tail = 0;
+    queued_bytes = 0;
+    genwait_wake_all((void *)queue);
+
+    mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+}
@@ -0,0 +1,381 @@
+/* KallistiOS ##version##
+
+   enc_test.c
+
+   Checks the VQ and palette encoders in pvr_txr_enc.c by decoding what they
+   make. Textures with no more blocks or colors than fit in the codebook or
+   palette have to come back exactly, flipped or not, in each of the texel
+   formats pvr_txr_load_ex() takes. Other textures have to come back close.
+   Then times both encoders.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Only the flags are wanted from pvr_txr.h, not the rest of the PVR API */
+typedef void *pvr_ptr_t;
+
+#include <dc/pvr/pvr_txr.h>
+
+#include "pvr_txr_enc.h"
+
+#define MAX_SIZE    1024
+#define GUARD       0xa5
+
+/* Twiddled index of a VQ block, as the old loops in pvr_txr_load_ex() had it */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+static int failures;
+
+static void check(int ok, const char *what, int a, int b) {
+    if(!ok) {
+        printf("FAIL: %s (%d, %d)\n", what, a, b);
+        failures++;
+    }
+}
+
+static const struct {
+    uint32_t flags;
+    const char *name;
+} fmts[3] = {
+    { PVR_TXRLOAD_RGB565, "RGB565" },
+    { PVR_TXRLOAD_ARGB1555, "ARGB1555" },
+    { PVR_TXRLOAD_ARGB4444, "ARGB4444" }
+};
+
+/* The same mapping as pvr_texture.c */
+static int enc_fmt(uint32_t flags) {
+    switch(flags & PVR_TXRLOAD_PXL_MASK) {
+        case PVR_TXRLOAD_ARGB1555:
+            return PVR_ENC_ARGB1555;
+        case PVR_TXRLOAD_ARGB4444:
+            return PVR_ENC_ARGB4444;
+        default:
+            return PVR_ENC_RGB565;
+    }
+}
+
+/* Any 16-bit value is a valid texel in each of the formats */
+static uint16_t rand_texel(void) {
+    return (uint16_t)(rand() ^ ((unsigned)rand() << 8));
+}
+
+/* Components of a texel, scaled to 0..255 */
+static void expand(uint16_t px, int fmt, int *c) {
+    switch(fmt) {
+        case PVR_ENC_RGB565:
+            c[0] = (px >> 11) * 255 / 31;
+            c[1] = ((px >> 5) & 63) * 255 / 63;
+            c[2] = (px & 31) * 255 / 31;
+            c[3] = 255;
+            break;
+        case PVR_ENC_ARGB1555:
+            c[0] = (px >> 15) * 255;
+            c[1] = ((px >> 10) & 31) * 255 / 31;
+            c[2] = ((px >> 5) & 31) * 255 / 31;
+            c[3] = (px & 31) * 255 / 31;
+            break;
+        default:
+            c[0] = (px >> 12) * 17;
+            c[1] = ((px >> 8) & 15) * 17;
+            c[2] = ((px >> 4) & 15) * 17;
+            c[3] = (px & 15) * 17;
+            break;
+    }
+}
+
+/* Peak signal to noise ratio of a decoded texture, in dB */
+static double psnr(const uint16_t *a, const uint16_t *b, uint32_t n, int fmt) {
+    int ca[4], cb[4], k;
+    double se = 0;
+    uint32_t i;
+
+    for(i = 0; i < n; i++) {
+        expand(a[i], fmt, ca);
+        expand(b[i], fmt, cb);
+
+        for(k = 0; k < 4; k++)
+            se += (ca[k] - cb[k]) * (ca[k] - cb[k]);
+    }
+
+    return se ? 10 * log10(255.0 * 255 * n * 4 / se) : 99;
+}
+
+/* Turn a VQ texture back into texels */
+static void decode_vq(const uint8_t *vq, uint32_t w, uint32_t h,
+                      uint16_t *out) {
+    const uint16_t *codebook = (const uint16_t *)vq;
+    const uint8_t *idx = vq + 2048;
+    uint32_t bw = w / 2, bh = h / 2, min = bw < bh ? bw : bh, mask = min - 1;
+    uint32_t x, y;
+    const uint16_t *e;
+
+    for(y = 0; y < bh; y++) {
+        for(x = 0; x < bw; x++) {
+            e = codebook + idx[TWIDOUT(x & mask, y & mask) +
+                               (x / min + y / min) * min * min] * 4;
+            out[y * 2 * w + x * 2] = e[0];
+            out[(y * 2 + 1) * w + x * 2] = e[1];
+            out[y * 2 * w + x * 2 + 1] = e[2];
+            out[(y * 2 + 1) * w + x * 2 + 1] = e[3];
+        }
+    }
+}
+
+static void decode_pal(const uint8_t *idx, const uint16_t *pal, uint32_t n,
+                       int colors, uint16_t *out) {
+    uint32_t i;
+
+    for(i = 0; i < n; i++) {
+        if(colors == 16)
+            out[i] = pal[(idx[i >> 1] >> ((i & 1) << 2)) & 15];
+        else
+            out[i] = pal[idx[i]];
+    }
+}
+
+static void flip(const uint16_t *src, uint16_t *dst, uint32_t w, uint32_t h) {
+    uint32_t y;
+
+    for(y = 0; y < h; y++)
+        memcpy(dst + y * w, src + (h - 1 - y) * w, w * 2);
+}
+
+/* Fill a texture from at most blocks distinct 2x2 blocks */
+static void make_blocks(uint16_t *txr, uint32_t w, uint32_t h, int blocks) {
+    uint16_t set[256][4];
+    uint32_t x, y;
+    int i, k;
+
+    for(i = 0; i < blocks; i++)
+        for(k = 0; k < 4; k++)
+            set[i][k] = rand_texel();
+
+    for(y = 0; y < h; y += 2) {
+        for(x = 0; x < w; x += 2) {
+            i = rand() % blocks;
+            txr[y * w + x] = set[i][0];
+            txr[(y + 1) * w + x] = set[i][1];
+            txr[y * w + x + 1] = set[i][2];
+            txr[(y + 1) * w + x + 1] = set[i][3];
+        }
+    }
+}
+
+/* A smooth texture that has far too many colors for any codebook */
+static void make_gradient(uint16_t *txr, uint32_t w, uint32_t h, int fmt) {
+    uint32_t x, y, r, g, b, a;
+
+    for(y = 0; y < h; y++) {
+        for(x = 0; x < w; x++) {
+            r = x * 255 / (w - 1);
+            g = y * 255 / (h - 1);
+            b = (x + y) * 255 / (w + h - 2);
+            a = 255 - r / 2;
+
+            switch(fmt) {
+                case PVR_ENC_RGB565:
+                    txr[y * w + x] = ((r >> 3) << 11) | ((g >> 2) << 5) |
+                                     (b >> 3);
+                    break;
+                case PVR_ENC_ARGB1555:
+                    txr[y * w + x] = ((a >> 7) << 15) | ((r >> 3) << 10) |
+                                     ((g >> 3) << 5) | (b >> 3);
+                    break;
+                default:
+                    txr[y * w + x] = ((a >> 4) << 12) | ((r >> 4) << 8) |
+                                     ((g >> 4) << 4) | (b >> 4);
+                    break;
+            }
+        }
+    }
+}
+
+/* Every texel value has to survive being split into components and packed
+   back, or nothing could round-trip */
+static void test_texels(void) {
+    uint16_t txr[8 * 8], back[8 * 8], pal[256];
+    uint8_t idx[8 * 8];
+    uint32_t v, i;
+    int f, fmt;
+
+    for(f = 0; f < 3; f++) {
+        fmt = enc_fmt(fmts[f].flags);
+
+        for(v = 0; v < 65536; v += 64) {
+            for(i = 0; i < 64; i++)
+                txr[i] = v + i;
+
+            pvr_enc_pal(txr, 8, 8, 8, fmt, 256, idx, pal);
+            decode_pal(idx, pal, 64, 256, back);
+
+            for(i = 0; i < 64; i++)
+                check(back[i] == txr[i], fmts[f].name, v + i, back[i]);
+        }
+    }
+}
+
+static void test_vq(uint16_t *txr, uint16_t *flipped, uint16_t *back,
+                    uint8_t *vq) {
+    uint32_t w, h, size;
+    int f, fmt, inv;
+    size_t i;
+
+    for(f = 0; f < 3; f++) {
+        fmt = enc_fmt(fmts[f].flags);
+
+        for(w = 8; w <= MAX_SIZE; w *= 2) {
+            for(h = 8; h <= MAX_SIZE; h *= 2) {
+                size = PVR_TXRLOAD_VQ_SIZE(w, h);
+                check(size == PVR_ENC_VQ_SIZE(w, h), "VQ size", w, h);
+
+                make_blocks(txr, w, h, w * h / 4 < 256 ? w * h / 8 : 256);
+                flip(txr, flipped, w, h);
+
+                for(inv = 0; inv < 2; inv++) {
+                    memset(vq, GUARD, size + 64);
+
+                    if(inv)
+                        check(!pvr_enc_vq(flipped + (h - 1) * w, -(int)w, w,
+                                          h, fmt, vq), "VQ flipped", w, h);
+                    else
+                        check(!pvr_enc_vq(txr, w, w, h, fmt, vq), "VQ", w, h);
+
+                    for(i = size; i < size + 64; i++)
+                        check(vq[i] == GUARD, "VQ overrun", w, h);
+
+                    decode_vq(vq, w, h, back);
+
+                    if(memcmp(back, txr, w * h * 2)) {
+                        printf("FAIL: VQ %s %ux%u%s doesn't round-trip\n",
+                               fmts[f].name, w, h, inv ? " flipped" : "");
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void test_pal(uint16_t *txr, uint16_t *flipped, uint16_t *back,
+                     uint8_t *idx) {
+    static const int colors[2] = { 16, 256 };
+    uint16_t pal[256 + 8];
+    uint32_t w, h, n, i, size;
+    int f, fmt, c, inv;
+
+    for(f = 0; f < 3; f++) {
+        fmt = enc_fmt(fmts[f].flags);
+
+        for(c = 0; c < 2; c++) {
+            for(w = 8; w <= 256; w *= 2) {
+                for(h = 8; h <= 256; h *= 2) {
+                    n = w * h;
+                    size = colors[c] == 16 ? n / 2 : n;
+
+                    for(i = 0; i < 64; i++)
+                        pal[i] = rand_texel();
+
+                    for(i = 0; i < n; i++)
+                        txr[i] = pal[rand() % (colors[c] < 64 ? colors[c] : 64)];
+
+                    flip(txr, flipped, w, h);
+
+                    for(inv = 0; inv < 2; inv++) {
+                        memset(idx, GUARD, size + 64);
+                        memset(pal, GUARD, sizeof(pal));
+
+                        if(inv)
+                            check(!pvr_enc_pal(flipped + (h - 1) * w, -(int)w,
+                                               w, h, fmt, colors[c], idx, pal),
+                                  "palette flipped", w, h);
+                        else
+                            check(!pvr_enc_pal(txr, w, w, h, fmt, colors[c],
+                                               idx, pal), "palette", w, h);
+
+                        for(i = size; i < size + 64; i++)
+                            check(idx[i] == GUARD, "palette index overrun", w,
+                                  h);
+
+                        for(i = colors[c]; i < colors[c] + 8u; i++)
+                            check(pal[i] == ((GUARD << 8) | GUARD),
+                                  "palette overrun", w, h);
+
+                        decode_pal(idx, pal, n, colors[c], back);
+
+                        if(memcmp(back, txr, n * 2)) {
+                            printf("FAIL: %d color %s %ux%u%s doesn't "
+                                   "round-trip\n", colors[c], fmts[f].name, w,
+                                   h, inv ? " flipped" : "");
+                            failures++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* Textures with too many colors to keep have to come out close, and the
+   encoders get timed on them */
+static void test_lossy(uint16_t *txr, uint16_t *back, uint8_t *buf) {
+    uint16_t pal[256];
+    double q_vq, q_16, q_256, t_vq, t_pal;
+    clock_t start;
+    int f, fmt;
+
+    printf("256x256 gradient      VQ dB  ms   16 dB  256 dB  ms\n");
+
+    for(f = 0; f < 3; f++) {
+        fmt = enc_fmt(fmts[f].flags);
+        make_gradient(txr, 256, 256, fmt);
+
+        start = clock();
+        pvr_enc_vq(txr, 256, 256, 256, fmt, buf);
+        t_vq = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+        decode_vq(buf, 256, 256, back);
+        q_vq = psnr(txr, back, 256 * 256, fmt);
+
+        pvr_enc_pal(txr, 256, 256, 256, fmt, 16, buf, pal);
+        decode_pal(buf, pal, 256 * 256, 16, back);
+        q_16 = psnr(txr, back, 256 * 256, fmt);
+
+        start = clock();
+        pvr_enc_pal(txr, 256, 256, 256, fmt, 256, buf, pal);
+        t_pal = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+        decode_pal(buf, pal, 256 * 256, 256, back);
+        q_256 = psnr(txr, back, 256 * 256, fmt);
+
+        printf("%-20s %6.1f %4.1f %7.1f %7.1f %4.1f\n", fmts[f].name, q_vq,
+               t_vq, q_16, q_256, t_pal);
+
+        check(q_vq > 30, "VQ quality", f, (int)q_vq);
+        check(q_16 > 20, "16 color quality", f, (int)q_16);
+        check(q_256 > 30, "256 color quality", f, (int)q_256);
+    }
+}
+
+int main(void) {
+    uint16_t *txr = malloc(MAX_SIZE * MAX_SIZE * 2);
+    uint16_t *flipped = malloc(MAX_SIZE * MAX_SIZE * 2);
+    uint16_t *back = malloc(MAX_SIZE * MAX_SIZE * 2);
+    uint8_t *buf = malloc(PVR_TXRLOAD_VQ_SIZE(MAX_SIZE, MAX_SIZE) + 64);
+
+    test_texels();
+    test_vq(txr, flipped, back, buf);
+    test_pal(txr, flipped, back, buf);
+    test_lossy(txr, back, buf);
+
+    free(txr);
+    free(flipped);
+    free(back);
+    free(buf);
+    printf("%s\n", failures ? "FAILED" : "All tests passed");
+    return failures ? 1 : 0;
+}
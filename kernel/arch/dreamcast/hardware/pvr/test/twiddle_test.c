@@ -0,0 +1,160 @@
+/* KallistiOS ##version##
+
+   twiddle_test.c
+
+   Checks pvr_twiddle() against the scalar loops that pvr_txr_load_ex() used
+   before it, for every texture size at 4, 8 and 16bpp, flipped or not, and
+   made all at once or a few lines at a time. Then times both.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pvr_txr_twiddle.h"
+
+#define MAX_SIZE    (1024 * 1024 * 2)
+
+/* Linear/iterative twiddling algorithm from Marcus' tatest */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+/* The old loops, without their INVERT_Y handling. That paired each row with
+   the one below it in the output, which swapped the rows of every pair at
+   4bpp and 8bpp. Flipped textures are checked against these loops run on a
+   flipped copy instead. */
+static void scalar_twiddle(const void *src, void *dst, uint32_t w, uint32_t h,
+                           int bpp) {
+    uint32_t x, y, min = w < h ? w : h, mask = min - 1;
+    const uint8_t *p8 = src;
+    const uint16_t *p16 = src;
+    uint16_t *vtex = dst;
+
+    switch(bpp) {
+        case 4:
+            for(y = 0; y < h; y += 2) {
+                for(x = 0; x < w; x += 2) {
+                    vtex[TWIDOUT((x & mask) / 2, (y & mask) / 2) +
+                         (x / min + y / min)*min * min / 4] =
+                             (p8[(x + y * w) >> 1] & 15) | ((p8[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                             ((p8[(x + y * w) >> 1] >> 4) << 8) | ((p8[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                }
+            }
+            break;
+        case 8:
+            for(y = 0; y < h; y += 2) {
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT((y & mask) / 2, x & mask) +
+                         (x / min + y / min)*min * min / 2] =
+                             p8[y * w + x] | (p8[(y + 1) * w + x] << 8);
+                }
+            }
+            break;
+        case 16:
+            for(y = 0; y < h; y++) {
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT(x & mask, y & mask) +
+                         (x / min + y / min)*min * min] = p16[y * w + x];
+                }
+            }
+            break;
+    }
+}
+
+int main(void) {
+    static const int bpps[3] = { 4, 8, 16 };
+    uint8_t *src = malloc(MAX_SIZE), *flip = malloc(MAX_SIZE);
+    uint8_t *ref = malloc(MAX_SIZE), *out = malloc(MAX_SIZE);
+    uint32_t w, h, size, row, lines, l, n, y;
+    int b, bpp, inv, stride, failures = 0, cases = 0;
+    const uint8_t *start;
+    clock_t t;
+    double t_old, t_new;
+
+    for(size = 0; size < MAX_SIZE; size++)
+        src[size] = rand();
+
+    for(b = 0; b < 3; b++) {
+        for(w = 8; w <= 1024; w *= 2) {
+            for(h = 8; h <= 1024; h *= 2) {
+                bpp = bpps[b];
+                row = w * bpp / 8;
+                size = h * row;
+                lines = size / PVR_TWIDDLE_LINE;
+
+                for(inv = 0; inv < 2; inv++) {
+                    if(inv) {
+                        for(y = 0; y < h; y++)
+                            memcpy(flip + y * row, src + (h - 1 - y) * row, row);
+
+                        scalar_twiddle(flip, ref, w, h, bpp);
+                        start = src + size - row;
+                        stride = -row;
+                    }
+                    else {
+                        scalar_twiddle(src, ref, w, h, bpp);
+                        start = src;
+                        stride = row;
+                    }
+
+                    /* All at once */
+                    memset(out, 0x55, size);
+                    pvr_twiddle(out, start, stride, w, h, bpp, 0, lines);
+
+                    if(memcmp(out, ref, size)) {
+                        printf("FAIL: %ux%u %dbpp%s\n", w, h, bpp,
+                               inv ? " flipped" : "");
+                        failures++;
+                    }
+
+                    /* A few lines at a time, as pvr_txr_load_ex() does */
+                    memset(out, 0xaa, size);
+
+                    for(l = 0; l < lines; l += n) {
+                        n = lines - l < 7 ? lines - l : 7;
+                        pvr_twiddle(out + l * PVR_TWIDDLE_LINE, start, stride,
+                                    w, h, bpp, l, n);
+                    }
+
+                    if(memcmp(out, ref, size)) {
+                        printf("FAIL: %ux%u %dbpp%s, in pieces\n", w, h, bpp,
+                               inv ? " flipped" : "");
+                        failures++;
+                    }
+
+                    cases++;
+                }
+            }
+        }
+    }
+
+    printf("%d cases checked\n\n1024x1024 ms      scalar  pvr_twiddle\n",
+           cases);
+
+    for(b = 0; b < 3; b++) {
+        bpp = bpps[b];
+        t = clock();
+
+        for(n = 0; n < 10; n++)
+            scalar_twiddle(src, ref, 1024, 1024, bpp);
+
+        t_old = (double)(clock() - t) / CLOCKS_PER_SEC * 100;
+        t = clock();
+
+        for(n = 0; n < 10; n++)
+            pvr_twiddle(out, src, 1024 * bpp / 8, 1024, 1024, bpp, 0,
+                        1024 * 1024 * bpp / 8 / PVR_TWIDDLE_LINE);
+
+        t_new = (double)(clock() - t) / CLOCKS_PER_SEC * 100;
+        printf("%2dbpp           %8.2f  %8.2f\n", bpp, t_old, t_new);
+    }
+
+    free(src);
+    free(flip);
+    free(ref);
+    free(out);
+    printf("%s\n", failures ? "FAILED" : "All tests passed");
+    return failures ? 1 : 0;
+}
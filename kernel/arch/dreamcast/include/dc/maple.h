@@ -408,6 +408,9 @@ typedef struct maple_state_str {
     /** \brief  Is a DMA running now? */
     volatile int                dma_in_progress;
 
+    /** \brief  Did a vblank have to skip sending queued frames? */
+    volatile int                flush_pending;
+
     /** \brief  Next port that will be auto-detected */
     uint8                       detect_port_next;
 
@@ -28,6 +28,7 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <stddef.h>
 #include <kos/regfield.h>
 
 /** \defgroup controller Controller
@@ -218,6 +219,92 @@ typedef void (*cont_btn_callback_t)(uint8_t addr, uint32_t btns);
 */
 int cont_btn_callback(uint8_t addr, uint32_t btns, cont_btn_callback_t cb);
 
+/** \defgroup controller_events High-Rate Polling
+    \brief    Timestamped controller input events
+    \ingroup  controller
+
+    Normally, controllers are only polled once per frame, as part of the maple
+    bus cycle started at each vblank. For games where input latency and the
+    exact order of inputs matter, extra polls can be run in between vblanks
+    with cont_fast_poll_start(). Every change in a controller's state is then
+    recorded with a timestamp into a ring buffer for its port, which you can
+    read with cont_events_drain().
+
+    Only controllers plugged straight into a port (unit 0) are polled this
+    way and have their changes recorded.
+
+    @{
+*/
+
+/** \brief   Number of events each port's ring buffer holds. */
+#define CONT_EVENT_RING_SIZE    64
+
+/** \brief   Controller input event.
+
+    One of these is recorded each time a controller's state changes.
+*/
+typedef struct cont_event {
+    uint64_t        time;   /**< \brief When the change was seen, from
+                                        timer_ns_gettime64(). */
+    uint64_t        since;  /**< \brief When the controller was last polled
+                                        before that. The change happened
+                                        somewhere in between. */
+    cont_state_t    state;  /**< \brief The new state of the controller. */
+} cont_event_t;
+
+/** \brief   High-rate polling statistics.
+
+    \sa cont_get_poll_stats
+*/
+typedef struct cont_poll_stats {
+    uint32_t polls;     /**< \brief Extra maple cycles run between vblanks */
+    uint32_t skipped;   /**< \brief Extra cycles skipped as the bus was busy */
+    uint32_t events;    /**< \brief State changes recorded */
+    uint32_t dropped;   /**< \brief State changes lost to a full ring */
+} cont_poll_stats_t;
+
+/** \brief   Start high-rate controller polling.
+
+    This function starts recording controller events and, if period is not
+    zero, starts a thread that runs an extra maple bus cycle to poll the
+    controllers every period milliseconds. If it's already running, the
+    period is just changed.
+
+    \param  period          Time between extra polls in milliseconds, or 0 to
+                            only record the changes seen once per frame.
+    \retval 0               On success.
+    \retval -1              If the polling thread couldn't be created.
+*/
+int cont_fast_poll_start(unsigned int period);
+
+/** \brief   Stop high-rate controller polling.
+
+    This stops the extra polls and the recording of events. Events that were
+    already recorded can still be read with cont_events_drain().
+*/
+void cont_fast_poll_stop(void);
+
+/** \brief   Read recorded controller events.
+
+    This function takes the oldest events recorded for a port out of its ring
+    buffer, in the order they happened. The ring buffers are lock-free, but
+    each port must only be drained from one thread at a time.
+
+    \param  port            The maple port to read (0-3).
+    \param  events          Where to store the events.
+    \param  max             The most events to read.
+    \return                 The number of events read.
+*/
+size_t cont_events_drain(unsigned int port, cont_event_t *events, size_t max);
+
+/** \brief   Get the high-rate polling statistics.
+
+    \param  stats           Where to store the statistics.
+*/
+void cont_get_poll_stats(cont_poll_stats_t *stats);
+
+/** @} */
+
 /** \defgroup controller_query_caps Querying Capabilities
     \brief    API used to query for a controller's capabilities
     \ingroup  controller
@@ -34,6 +34,7 @@ __BEGIN_DECLS
 #include <kos/regfield.h>
 
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
 
 /** \defgroup vmu Visual Memory Unit
@@ -372,6 +373,51 @@ int vmu_block_read(maple_device_t *dev, uint16_t blocknum, uint8_t *buffer);
 */
 int vmu_block_write(maple_device_t *dev, uint16_t blocknum, const uint8_t *buffer);
 
+/** \brief   Read several blocks from a memory card.
+    \ingroup maple_memcard
+
+    This function works like vmu_block_read(), but rather than waiting for
+    each block in turn, it sends requests for as many blocks as it can in
+    each maple DMA cycle, which makes reading a lot of blocks much faster.
+
+    \param  dev             The device to read from.
+    \param  blocks          The block numbers to read.
+    \param  cnt             The number of blocks to read.
+    \param  buffer          The buffer to read into (512 bytes per block, in
+                            the same order as blocks).
+
+    \retval MAPLE_EOK       On success.
+    \retval MAPLE_ETIMEOUT  If the command timed out while blocking.
+    \retval MAPLE_EFAIL     On errors other than timeout.
+
+    \sa vmu_block_write_vec
+*/
+int vmu_block_read_vec(maple_device_t *dev, const uint16_t *blocks,
+                       size_t cnt, uint8_t *buffer);
+
+/** \brief   Write several blocks to a memory card.
+    \ingroup maple_memcard
+
+    This function works like vmu_block_write(), but sends the write phases and
+    the sync of two blocks in each maple DMA cycle, rather than one command at
+    a time.
+    Blocks that fail to write this way are retried with vmu_block_write().
+
+    \param  dev             The device to write to.
+    \param  blocks          The block numbers to write.
+    \param  cnt             The number of blocks to write.
+    \param  buffer          The buffer to write from (512 bytes per block, in
+                            the same order as blocks).
+
+    \retval MAPLE_EOK       On success.
+    \retval MAPLE_ETIMEOUT  If the command timed out while blocking.
+    \retval MAPLE_EFAIL     On errors other than timeout.
+
+    \sa vmu_block_read_vec
+*/
+int vmu_block_write_vec(maple_device_t *dev, const uint16_t *blocks,
+                        size_t cnt, const uint8_t *buffer);
+
 /** \defgroup maple_clock Clock Function
     \brief    API for features of the Clock Maple Function
     \ingroup  vmu
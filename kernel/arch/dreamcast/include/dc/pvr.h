@@ -1338,6 +1338,11 @@ void pvr_send_to_ta(void *data);
     Data will be queued in a vertex buffer, thus one must be available for the
     list specified (will be asserted by the code).
 
+    If the buffer is full, what it holds is sent to the TA with
+    pvr_list_flush(), and the list carries on from the start of the buffer.
+    This means that a list can hold more than one buffer's worth of data, but
+    the same restrictions apply as when calling pvr_list_flush() directly.
+
     \param  list            The list to submit to.
     \param  data            The primitive to submit.
     \param  size            The size of the primitive in bytes. This must be a
@@ -1351,13 +1356,27 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size);
 /** \brief   Flush the buffered data of the given list type to the TA.
     \ingroup pvr_list_mgmt
 
-    This function is currently not implemented, and calling it will result in an
-    assertion failure. It is intended to be used later in a "hybrid" mode where
-    both direct and DMA TA submission is possible.
+    This starts a DMA of the data queued in the list's vertex buffer so far,
+    without waiting for the scene to be finished, and primitives submitted
+    afterwards are added after it. This way, part of a scene can be processed
+    by the TA while the rest is still being built, and a list can be larger
+    than its vertex buffer.
+
+    The TA has to receive each list in one piece, so once part of a list has
+    been flushed, that list stays open on the TA until pvr_scene_finish(), and
+    no other list can be flushed or submitted directly until then. Other lists
+    with vertex buffers can still be built as usual, as they are only sent at
+    the end of the scene. Flushing also has to wait for the TA to be done with
+    the previous scene.
+
+    The peak use of each list's vertex buffer is kept in pvr_stats_t, to help
+    with picking buffer sizes.
 
     \param  list            The list to flush.
 
-    \retval -1              On error (it is not possible to succeed).
+    \retval 0               On success.
+    \retval -1              If another list is already open on the TA, or
+                            the DMA could not be started.
 */
 int pvr_list_flush(pvr_list_t list);
 
@@ -1611,6 +1630,7 @@ pvr_ptr_t pvr_get_front_buffer(void);
 #include "pvr/pvr_fog.h"
 #include "pvr/pvr_pal.h"
 #include "pvr/pvr_txr.h"
+#include "pvr/pvr_dlist.h"
 
 __END_DECLS
 
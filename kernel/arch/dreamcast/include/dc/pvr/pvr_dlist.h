@@ -0,0 +1,125 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_dlist.h
+*/
+
+/** \file       dc/pvr/pvr_dlist.h
+    \brief      Recorded display lists for the PVR
+    \ingroup    pvr_dlist
+*/
+
+#ifndef __DC_PVR_PVR_DLIST_H
+#define __DC_PVR_PVR_DLIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_dlist     Display Lists
+    \brief                  Recording geometry once and submitting it each frame
+    \ingroup                pvr_list_mgmt
+
+    Geometry that doesn't change from one frame to the next (a HUD, the
+    architecture of a level, a skybox) doesn't need to be built and copied into
+    a vertex buffer again every frame. Instead, the headers and vertices can be
+    recorded once into a display list, which is then submitted as a whole to
+    any list in later frames.
+
+    When the list being submitted to has a vertex buffer, the display list is
+    sent to the TA by DMA straight from where it was recorded, without being
+    copied first. Otherwise, it's copied to the TA with the store queues, in
+    which case the list must be the one currently open with pvr_list_begin().
+
+    @{
+*/
+
+/** \brief   A recorded display list.
+
+    The contents of this structure should be considered read-only; use the
+    functions below to fill it in.
+*/
+typedef struct pvr_dlist {
+    uint8_t *data;      /**< \brief The recorded data (32-byte aligned) */
+    size_t size;        /**< \brief How many bytes have been recorded */
+    size_t max;         /**< \brief How many bytes fit in data */
+} pvr_dlist_t;
+
+/** \brief   Set up an empty display list.
+
+    \param  dl              The display list to set up.
+    \param  max             How many bytes to allocate to start with. The
+                            buffer grows as needed, so this may be 0.
+
+    \retval 0               On success.
+    \retval -1              If the memory can't be allocated.
+*/
+int pvr_dlist_init(pvr_dlist_t *dl, size_t max);
+
+/** \brief   Free the memory used by a display list.
+
+    \param  dl              The display list to free.
+*/
+void pvr_dlist_free(pvr_dlist_t *dl);
+
+/** \brief   Remove everything recorded in a display list.
+
+    The memory is kept, so that the list can be recorded again.
+
+    \param  dl              The display list to clear.
+*/
+void pvr_dlist_clear(pvr_dlist_t *dl);
+
+/** \brief   Record data into a display list.
+
+    The data is exactly what would be passed to pvr_prim() or pvr_list_prim(),
+    i.e. compiled headers and vertices.
+
+    \param  dl              The display list to record into.
+    \param  data            The data to add.
+    \param  size            The size of the data in bytes. This must be a
+                            multiple of 32.
+
+    \retval 0               On success.
+    \retval -1              If the buffer couldn't be grown.
+*/
+int pvr_dlist_add(pvr_dlist_t *dl, const void *data, size_t size);
+
+/** \brief   Submit a display list to the given list type.
+
+    As with pvr_list_flush(), DMAing the display list leaves the list open on
+    the TA until pvr_scene_finish(). The display list must not be changed or
+    freed until the scene has been finished.
+
+    \param  dl              The display list to submit.
+    \param  list            The list to submit it to.
+
+    \retval 0               On success.
+    \retval -1              On error.
+*/
+int pvr_dlist_submit(const pvr_dlist_t *dl, pvr_list_t list);
+
+/** \brief   Submit a display list, transformed by the current matrix.
+
+    Each vertex is transformed with mat_transform_sq() on the way, and the
+    headers are copied as they are. Only 32-byte vertices (like pvr_vertex_t)
+    can be transformed, so this can't be used for sprites or modifier volumes.
+
+    When the list has a vertex buffer, the vertices are transformed into it,
+    so this costs about as much as building them would. The saving is in not
+    having to build or compile them again.
+
+    \param  dl              The display list to submit.
+    \param  list            The list to submit it to.
+
+    \retval 0               On success.
+    \retval -1              On error.
+*/
+int pvr_dlist_submit_mat(const pvr_dlist_t *dl, pvr_list_t list);
+
+/** @} */
+
+__END_DECLS
+
+#endif  /* __DC_PVR_PVR_DLIST_H */
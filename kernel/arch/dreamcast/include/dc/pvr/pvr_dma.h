@@ -186,6 +186,84 @@ void pvr_dma_init(void);
  */
 void pvr_dma_shutdown(void);
 
+/** \defgroup pvr_upload    Upload Queue
+    \brief                  Uploads to VRAM spread over several frames
+    \ingroup                pvr_dma
+
+    Loading a texture with pvr_txr_load() or pvr_txr_load_dma() happens right
+    away, and can hold up the vertex DMA of the frame being drawn. Uploads
+    added with pvr_upload_queue() are instead sent by DMA from the PVR's
+    interrupts: at each vertical blank, when a render finishes, and when the
+    vertex DMA of a frame finishes. Big uploads are sent in pieces, and only
+    up to a budget each frame, which is set with pvr_upload_set_budget().
+    Whenever a thread needs the DMA channel for vertices, the queue stops
+    after the piece it is sending, and picks up again once the vertices are
+    sent.
+
+    The queue and the bytes sent in the last frame are shown in pvr_stats_t.
+*/
+
+/** \brief   Most uploads that can be waiting in the queue.
+    \ingroup pvr_upload
+*/
+#define PVR_UPLOAD_QUEUE_MAX        64
+
+/** \brief   Bytes of uploads sent per frame, until pvr_upload_set_budget().
+    \ingroup pvr_upload
+*/
+#define PVR_UPLOAD_BUDGET_DEFAULT   (128 * 1024)
+
+/** \brief   Add an upload to VRAM to the queue.
+    \ingroup pvr_upload
+
+    The data isn't copied, so src has to stay as it is until the callback is
+    called. Uploads are sent in the order they were queued. The callback is
+    called in an interrupt context, like the ones of pvr_dma_transfer().
+
+    \param  src             Where to copy from. Must be 32-byte aligned.
+    \param  dst             Where to copy to. Must be 32-byte aligned.
+    \param  count           The number of bytes to copy. Must be a non-zero
+                            multiple of 32.
+    \param  callback        A function to call once it has all been sent, or
+                            NULL.
+    \param  cbdata          Data to pass to the callback function.
+    \retval 0               On success.
+    \retval -1              On failure. Sets errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - src, dst or count is not suitably aligned \n
+    \em     EAGAIN - the queue is full
+*/
+int pvr_upload_queue(const void *src, pvr_ptr_t dst, size_t count,
+                     pvr_dma_callback_t callback, void *cbdata);
+
+/** \brief   Set how much of the queue may be sent each frame.
+    \ingroup pvr_upload
+
+    No new piece is started once bytes have been sent since the last vertical
+    blank, or once us microseconds have passed since the first piece of the
+    frame started. Either limit can be 0 to turn it off.
+
+    \param  bytes           Bytes per frame, at least 32, or 0.
+    \param  us              Microseconds per frame, or 0.
+*/
+void pvr_upload_set_budget(size_t bytes, unsigned int us);
+
+/** \brief   Get the number of uploads that haven't been fully sent yet.
+    \ingroup pvr_upload
+
+    \return                 The number of uploads in the queue.
+*/
+size_t pvr_upload_pending(void);
+
+/** \brief   Block the caller until every queued upload has been sent.
+    \ingroup pvr_upload
+
+    \retval 0               On success.
+    \retval -1              If the wait was interrupted.
+*/
+int pvr_upload_wait(void);
+
 /** \brief   Copy a block of memory to VRAM
     \ingroup store_queues
 
@@ -164,6 +164,11 @@ typedef struct pvr_stats {
     size_t   vtx_buffer_used_max; /**< \brief Number of bytes used in the vertex buffer for the largest frame */
     float    frame_rate;          /**< \brief Current frame rate (per second) */
     uint32_t enabled_list_mask;   /**< \brief Which lists are enabled? */
+    size_t   vtx_dma_used_max[PVR_LIST_PT_POLY + 1]; /**< \brief Most bytes used in each list's DMA vertex buffer at once */
+    size_t   vtx_dma_flushes;     /**< \brief Number of times part of a list was sent to the TA before the end of the scene */
+    size_t   upload_pending;      /**< \brief Number of uploads waiting in the upload queue */
+    size_t   upload_pending_bytes; /**< \brief Bytes waiting in the upload queue */
+    size_t   upload_bytes_last;   /**< \brief Bytes sent from the upload queue during the last frame */
     /* ... more later as it's implemented ... */
 } pvr_stats_t;
 
@@ -109,7 +109,7 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_16BPP           0x03    /**< \brief 16BPP format */
 #define PVR_TXRLOAD_FMT_MASK        0x0f    /**< \brief Bits used for basic formats */
 
-#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (not supported yet, if ever) */
+#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (16bpp only) */
 #define PVR_TXRLOAD_INVERT_Y        0x20    /**< \brief Invert the Y axis while loading */
 #define PVR_TXRLOAD_FMT_VQ          0x40    /**< \brief Texture is already VQ encoded */
 #define PVR_TXRLOAD_FMT_TWIDDLED    0x80    /**< \brief Texture is already twiddled */
@@ -117,6 +117,14 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_DMA             0x8000  /**< \brief Use DMA to load the texture */
 #define PVR_TXRLOAD_NONBLOCK        0x4000  /**< \brief Use non-blocking loads (only for DMA) */
 #define PVR_TXRLOAD_SQ              0x2000  /**< \brief Use Store Queues to load */
+
+#define PVR_TXRLOAD_RGB565          0x0000  /**< \brief Texels to compress are RGB565 */
+#define PVR_TXRLOAD_ARGB1555        0x0100  /**< \brief Texels to compress are ARGB1555 */
+#define PVR_TXRLOAD_ARGB4444        0x0200  /**< \brief Texels to compress are ARGB4444 */
+#define PVR_TXRLOAD_PXL_MASK        0x0300  /**< \brief Bits used for the texel format */
+
+/** \brief  Size in VRAM of a w x h texture loaded with PVR_TXRLOAD_VQ_LOAD. */
+#define PVR_TXRLOAD_VQ_SIZE(w, h)   (2048 + (w) * (h) / 4)
 /** @} */
 
 /** \brief   Load texture data from an SH-4 buffer into PVR RAM, twiddling it in
@@ -126,8 +134,26 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
     This function loads a texture to the PVR's RAM with the specified set of
     flags. It will currently always twiddle the data, whether you ask it to or
     not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
+    Pretty much the only supported flags, other than the format ones, are
+    PVR_TXRLOAD_INVERT_Y, PVR_TXRLOAD_VQ_LOAD and PVR_TXRLOAD_DMA.
+
+    The texture is twiddled a 1KB chunk at a time, and each chunk is copied
+    to VRAM with the store queues. Textures of 64KB or more, or any size with
+    PVR_TXRLOAD_DMA, are twiddled into a temporary buffer instead and sent by
+    DMA, which waits for any vertex DMA in progress to finish. If the buffer
+    can't be allocated, the chunked copy is used.
+
+    With PVR_TXRLOAD_VQ_LOAD and PVR_TXRLOAD_16BPP, the texture is VQ
+    compressed while it is loaded, which takes PVR_TXRLOAD_VQ_SIZE(w, h) bytes
+    of VRAM instead of w * h * 2: 18KB instead of 128KB for 256x256. The
+    format of the texels is given with PVR_TXRLOAD_RGB565 (the default),
+    PVR_TXRLOAD_ARGB1555 or PVR_TXRLOAD_ARGB4444, and the polygon header needs
+    the same format with PVR_TXRFMT_VQ_ENABLE and PVR_TXRFMT_TWIDDLED. The
+    codebook is built in a single quick pass, so it won't look as good as a
+    texture compressed offline with pvrtex, but it only takes a few
+    milliseconds. A temporary buffer of about w * h * 5 bytes is allocated
+    while compressing. The time it took and the VRAM saved are logged at
+    DBG_DEBUG.
 
     This will be slower than using pvr_txr_load() in pretty much all cases, so
     unless you need to twiddle your texture, just use that instead.
@@ -143,6 +169,34 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                      uint32_t w, uint32_t h, uint32_t flags);
 
+/** \brief   Load a 16bpp texture into PVR RAM as a paletted texture.
+    \ingroup pvr_txr_mgmt
+
+    This function reduces a texture to 16 or 256 colors, loads the twiddled
+    indices to PVR RAM, and sets the palette entries from pal_entry on. The
+    palette is in the same format as the texels, so pvr_set_pal_format() has
+    to be set to match. The colors are chosen with the same quick method as
+    PVR_TXRLOAD_VQ_LOAD uses. The time it took and the VRAM saved are logged
+    at DBG_DEBUG.
+
+    \param  src             The 16bpp texels to load.
+    \param  dst             The location to copy to, which needs w * h / 2
+                            bytes for 16 colors, or w * h for 256.
+    \param  w               The width of the texture, in pixels.
+    \param  h               The height of the texture, in pixels.
+    \param  flags           PVR_TXRLOAD_4BPP or PVR_TXRLOAD_8BPP, the format of
+                            the texels (PVR_TXRLOAD_RGB565,
+                            PVR_TXRLOAD_ARGB1555 or PVR_TXRLOAD_ARGB4444), and
+                            optionally PVR_TXRLOAD_INVERT_Y.
+    \param  pal_entry       The first palette entry to set.
+    \retval 0               On success.
+    \retval -1              If memory couldn't be allocated.
+
+    \see    pvr_txrload_constants
+*/
+int pvr_txr_load_pal(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
+                     uint32_t flags, uint32_t pal_entry);
+
 /** \brief   Load a KOS Platform Independent Image (subject to constraint
              checking).
     \ingroup pvr_txr_mgmt
@@ -150,7 +204,8 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
     This function loads a KOS Platform Independent image to the PVR's RAM with
     the specified set of flags. This function, unlike pvr_txr_load_ex() supports
     everything in the flags available, other than what's explicitly marked as
-    not supported.
+    not supported. With PVR_TXRLOAD_VQ_LOAD, 16bpp images are VQ compressed
+    in their own format.
 
     \param  img             The image to load.
     \param  dst             The location to copy to.
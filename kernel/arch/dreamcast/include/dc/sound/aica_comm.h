@@ -60,6 +60,23 @@ typedef struct aica_cmd {
 /** \brief Maximum command size -- 256 dwords */
 #define AICA_CMD_MAX_SIZE   256
 
+/** \brief Samples per tick of the driver's clock
+
+    The driver's clock (which aica_cmd_t::timestamp is compared against) ticks
+    once every this many samples at 44100Hz.
+*/
+#define AICA_CLOCK_SAMPLES  10
+
+/** \brief Marker for a sample-accurate timestamp
+
+    If aica_cmd_t::misc[1] holds this value and the timestamp is non-zero, then
+    misc[0] holds the exact time to execute the command at, in samples on the
+    driver's clock. The timestamp itself should still be set to the matching
+    clock tick, so that older drivers run the command at close to the right
+    time.
+*/
+#define AICA_CMD_TS_SAMPLE  0x534d504c
+
 /** \brief AICA command payload data for AICA_CMD_CHAN
 
     This is the aica_cmd_t::cmd_data for AICA_CMD_CHAN.
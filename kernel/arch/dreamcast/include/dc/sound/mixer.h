@@ -0,0 +1,183 @@
+/* KallistiOS ##version##
+
+   dc/sound/mixer.h
+
+*/
+
+/** \file    dc/sound/mixer.h
+    \brief   Software mixing of sound sources into a stream.
+    \ingroup audio_mixer
+
+    This file contains declarations for the software mixer. The mixer combines
+    any number of sound sources into a single stereo 16-bit stream, so that you
+    aren't limited by SND_STREAM_MAX or the number of AICA channels. Each source
+    can be 16-bit PCM, 8-bit PCM or Yamaha ADPCM, mono or stereo, at any
+    frequency, and has its own volume and panning.
+
+    The mixer can either run its own stream (see snd_mix_init()) or mix its
+    sources on top of a stream you already have (see snd_mix_attach()), for
+    instance to put voice or ambient layers over the music. Either way, it runs
+    as a filter on the stream, so it does its work whenever the stream is
+    polled.
+*/
+
+#ifndef __DC_SOUND_MIXER_H
+#define __DC_SOUND_MIXER_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <dc/sound/stream.h>
+
+/** \defgroup audio_mixer   Mixer
+    \brief                  Software mixing of many sources into one stream
+    \ingroup                audio
+    @{
+*/
+
+/** \defgroup snd_mix_fmts  Source formats
+    \brief                  Sample formats a mixer source can use
+    @{
+*/
+#define SND_MIX_FMT_PCM16   0   /**< \brief 16-bit signed PCM */
+#define SND_MIX_FMT_PCM8    1   /**< \brief 8-bit signed PCM */
+#define SND_MIX_FMT_ADPCM   2   /**< \brief 4-bit Yamaha ADPCM */
+/** @} */
+
+/** \brief  Mixer source type.
+
+    This is an opaque type, returned by snd_mix_src_alloc().
+*/
+typedef struct snd_mix_src snd_mix_src_t;
+
+/** \brief  Mixer source data callback type.
+
+    The mixer calls this function whenever a source needs more data. Stereo
+    data must be interleaved in the same way as for streams.
+
+    This is called with the mixer locked, from whichever thread is polling the
+    stream. The callback may stop its own source, but must not free it.
+
+    \param  src             The source that needs data.
+    \param  user            The user data given to snd_mix_src_alloc().
+    \param  buf             Where to put the data.
+    \param  size            How many bytes are wanted.
+    \return                 The number of bytes stored in buf. Returning zero
+                            (or less) marks the end of the source, and it will
+                            be stopped.
+*/
+typedef int (*snd_mix_callback_t)(snd_mix_src_t *src, void *user, void *buf,
+                                  int size);
+
+/** \brief  Start the mixer on its own stream.
+
+    This function allocates a stereo stream, attaches the mixer to it and
+    starts it playing. You will need to poll the returned stream (or use
+    snd_stream_thread_start()) for anything to be heard.
+
+    \param  freq            The output frequency of the mixer.
+    \param  bufsize         The buffer size for the stream.
+    \return                 The stream handle, or SND_STREAM_INVALID on error.
+*/
+snd_stream_hnd_t snd_mix_init(uint32_t freq, int bufsize);
+
+/** \brief  Attach the mixer to an existing stream.
+
+    This function adds the mixer as a filter on a stream you already have, so
+    that all of the mixer's sources are mixed on top of the stream's data. The
+    stream must be started as 16-bit stereo; data from mono streams is passed
+    through untouched.
+
+    \param  hnd             The stream to attach to.
+    \retval 0               On success.
+    \retval -1              If the mixer is already running, or if the stream
+                            was started with a format other than 16-bit PCM.
+*/
+int snd_mix_attach(snd_stream_hnd_t hnd);
+
+/** \brief  Shut down the mixer.
+
+    This function detaches the mixer from its stream (destroying the stream if
+    it was created by snd_mix_init()) and frees all sources.
+*/
+void snd_mix_shutdown(void);
+
+/** \brief  Allocate a mixer source.
+
+    The new source starts out stopped, at full volume and panned to the center.
+
+    \param  fmt             The sample format (see \ref snd_mix_fmts).
+    \param  freq            The frequency of the source's data.
+    \param  stereo          Non-zero if the data is stereo.
+    \param  cb              The callback to get data from.
+    \param  user            User data passed to the callback.
+    \return                 The new source, or NULL on failure.
+*/
+snd_mix_src_t *snd_mix_src_alloc(int fmt, uint32_t freq, int stereo,
+                                 snd_mix_callback_t cb, void *user);
+
+/** \brief  Free a mixer source.
+
+    This may be called from the source's own callback (or any other source's),
+    in which case the source is stopped straight away and freed once the mixer
+    is done with it.
+
+    \param  src             The source to free.
+*/
+void snd_mix_src_free(snd_mix_src_t *src);
+
+/** \brief  Start (or restart) playing a mixer source.
+
+    \param  src             The source to start.
+*/
+void snd_mix_src_start(snd_mix_src_t *src);
+
+/** \brief  Stop playing a mixer source.
+
+    \param  src             The source to stop.
+*/
+void snd_mix_src_stop(snd_mix_src_t *src);
+
+/** \brief  Check if a mixer source is playing.
+
+    A source stops on its own once its callback runs out of data.
+
+    \param  src             The source to check.
+    \return                 Non-zero if the source is playing.
+*/
+int snd_mix_src_playing(snd_mix_src_t *src);
+
+/** \brief  Set the volume of a mixer source.
+
+    \param  src             The source to change.
+    \param  vol             The volume, from 0 to 255.
+*/
+void snd_mix_src_volume(snd_mix_src_t *src, int vol);
+
+/** \brief  Set the panning of a mixer source.
+
+    For stereo sources, this works as a balance control.
+
+    \param  src             The source to change.
+    \param  pan             The panning, from 0 (left) to 255 (right).
+*/
+void snd_mix_src_pan(snd_mix_src_t *src, int pan);
+
+/** \brief  Set the playback frequency of a mixer source.
+
+    The source is resampled to the mixer's frequency with linear interpolation.
+    The frequency can be changed at any time for pitch effects, up to eight
+    times the mixer's frequency.
+
+    \param  src             The source to change.
+    \param  freq            The new frequency.
+*/
+void snd_mix_src_freq(snd_mix_src_t *src, uint32_t freq);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __DC_SOUND_MIXER_H */
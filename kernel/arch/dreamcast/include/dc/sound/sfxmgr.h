@@ -71,14 +71,36 @@ typedef struct sfx_play_data {
     unsigned int loopstart;  /**< \brief Loop start index (in samples). */
     unsigned int loopend;    /**< \brief Loop end index (in samples). If loopend == 0,
                             the loop end will default to sfx size in samples. */
+    int prio;       /**< \brief Priority of the sound effect. When all channels
+                            are busy, a sound with a lower (or the same) priority
+                            will be cut off to make room. Higher is more
+                            important, and 0 is the default. */
 } sfx_play_data_t;
 
+/** \brief  Sound effect voice statistics.
+
+    These are kept by the automatic channel allocation in snd_sfx_play() and
+    snd_sfx_play_ex(), to give an idea of how many channels a program really
+    needs. They can be read with snd_sfx_get_voice_stats().
+*/
+typedef struct sfx_voice_stats {
+    uint32_t plays;     /**< \brief Sounds given a channel automatically */
+    uint32_t reclaimed; /**< \brief Channels reused after their sound ended */
+    uint32_t stolen;    /**< \brief Sounds cut off to make room */
+    uint32_t failed;    /**< \brief Sounds not played for lack of a channel */
+    uint32_t active;    /**< \brief Channels currently playing sound effects */
+    uint32_t peak;      /**< \brief Most channels playing at once */
+} sfx_voice_stats_t;
+
 /** \brief  Load a sound effect.
 
     This function loads a sound effect from a WAV file and returns a handle to
     it. The sound effect can be either stereo or mono, and must either be 8-bit
     or 16-bit uncompressed PCM samples, or 4-bit Yamaha ADPCM.
 
+    The data is read and sent to sound RAM a few kilobytes at a time, so that
+    loading a large effect doesn't need a large amount of main RAM.
+
     \warning The sound effect you are loading must be at most 65534 samples
     in length.
 
@@ -88,6 +110,23 @@ typedef struct sfx_play_data {
 */
 sfxhnd_t snd_sfx_load(const char *fn);
 
+/** \brief  Load a bank of sound effects.
+
+    This function loads a number of sound effects from a single file, in one
+    pass. The file is simply a set of WAV files stuck together one after
+    another (for instance, with cat), and the effects are returned in the same
+    order. Each one has the same restrictions as with snd_sfx_load().
+
+    If any of the effects can't be loaded, all of the ones that were loaded
+    from the bank are unloaded again.
+
+    \param  fn              The file to load.
+    \param  hnds            Where to store the handles of the effects.
+    \param  max             The most effects to load (the size of hnds).
+    \return                 The number of effects loaded, or -1 on error.
+*/
+int snd_sfx_load_bank(const char *fn, sfxhnd_t *hnds, int max);
+
 /** \brief  Load a sound effect without wav header.
 
     This function loads a sound effect from a RAW file and returns a handle to
@@ -221,10 +260,15 @@ int snd_sfx_play_chn(int chn, sfxhnd_t idx, int vol, int pan);
     function, you can additionally specify extra parameters such as frequency
     and looping (see sfx_play_data_t structure).
 
+    If data->chn is -1, a channel is picked automatically. Channels whose sound
+    has finished are reused first. If there are none, the channel playing the
+    lowest priority sound is taken over (the oldest one, if there's a tie), as
+    long as its priority isn't higher than data->prio.
+
     \param  data            The data structure containing the information needed
                             to play the sound effect.
 
-    \return                 chn
+    \return                 chn, or -1 if no channel could be found.
 */
 int snd_sfx_play_ex(sfx_play_data_t *data);
 
@@ -247,6 +291,18 @@ void snd_sfx_stop(int chn);
 */
 void snd_sfx_stop_all(void);
 
+/** \brief  Get the sound effect voice statistics.
+
+    \param  stats           Where to store the statistics.
+*/
+void snd_sfx_get_voice_stats(sfx_voice_stats_t *stats);
+
+/** \brief  Reset the sound effect voice statistics.
+
+    This clears all of the counters, except for the number of active channels.
+*/
+void snd_sfx_reset_voice_stats(void);
+
 /** \brief  Allocate a sound channel for use outside the sound effect system.
 
     This function finds and allocates a channel for use for things other than
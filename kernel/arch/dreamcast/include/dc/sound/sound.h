@@ -112,12 +112,59 @@ void snd_shutdown(void);
     This function is to put in a low-level request using the built-in streaming
     sound driver.
 
+    If the AICA hasn't made room for the packet yet, nothing is written and
+    the packet is dropped. That only happens if the driver has stopped
+    processing the queue or has fallen far behind, so retrying straight away
+    won't usually help.
+
     \param  packet          The packet of data to copy.
     \param  size            The size of the packet, in 32-bit increments.
-    \retval 0               On success (no error conditions defined).
+    \retval 0               On success.
+    \retval -1              If there isn't room in the queue.
 */
 int snd_sh4_to_aica(void *packet, uint32 size);
 
+/** \brief  Copy a batch of request packets to the AICA queue.
+
+    This function works like snd_sh4_to_aica(), but takes any number of packets
+    laid out one after another. They are all made visible to the AICA at once,
+    so the driver processes them together, without needing to stop and restart
+    queue processing around them.
+
+    \param  packets         The packets of data to copy.
+    \param  size            The total size of the packets, in 32-bit
+                            increments.
+    \retval 0               On success.
+    \retval -1              If there isn't room in the queue.
+*/
+int snd_sh4_to_aica_batch(void *packets, uint32_t size);
+
+/** \brief  Get the AICA driver's clock, in samples.
+
+    This returns the current time on the driver's clock, in samples at 44100Hz,
+    for use with snd_cmd_set_sample_time(). The clock is reset to zero with the
+    AICA_CMD_SYNC_CLOCK command.
+
+    \return                 The current time in samples.
+*/
+uint32_t snd_get_sample_clock(void);
+
+/** \brief  Schedule a request packet for a given sample.
+
+    This function sets up a packet so that the driver executes it when its clock
+    (see snd_get_sample_clock()) reaches the given sample. Give a batch of
+    packets all the same time to have them take effect together, and use a
+    channel start with AICA_CH_START_SYNC to key on several channels on exactly
+    the same sample.
+
+    Packets are still processed in order, so a scheduled packet holds up any
+    packets queued after it until its time comes.
+
+    \param  packet          The packet to schedule.
+    \param  sample          When to execute it, in samples.
+*/
+void snd_cmd_set_sample_time(void *packet, uint32_t sample);
+
 /** \brief  Begin processing AICA queue requests.
 
     This function begins processing of any queued requests in the AICA queue.
@@ -29,6 +29,7 @@
 __BEGIN_DECLS
 
 #include <arch/types.h>
+#include <kos/thread.h>
 
 /** \defgroup audio_streaming   Streaming
     \brief                      Streaming audio playback and management
@@ -52,6 +53,31 @@ __BEGIN_DECLS
             and for backward compatibility. */
 #define SND_STREAM_BUFFER_MAX       (64 << 10)
 
+/** \brief  Number of buckets in the fill time histogram of a stream. */
+#define SND_STREAM_FILL_HIST_SIZE   8
+
+/** \brief  Upper bound of the first fill time histogram bucket, in
+            microseconds. Each following bucket covers twice the time of the
+            one before it, and the last one takes everything else. */
+#define SND_STREAM_FILL_HIST_BASE   250
+
+/** \brief  Stream statistics.
+
+    Counters kept for each stream, which can be read with
+    snd_stream_get_stats(). A fill covers everything done to load more data
+    into the stream's buffer, including the time spent in the callback.
+
+    \headerfile dc/sound/stream.h
+*/
+typedef struct snd_stream_stats {
+    uint32_t fills;         /**< \brief Number of times the buffer was filled */
+    uint32_t underruns;     /**< \brief Number of times the buffer ran dry,
+                                 or the callback had no data to give */
+    uint32_t max_fill_us;   /**< \brief Longest fill, in microseconds */
+    /** \brief Histogram of fill times (see SND_STREAM_FILL_HIST_BASE) */
+    uint32_t fill_hist[SND_STREAM_FILL_HIST_SIZE];
+} snd_stream_stats_t;
+
 /** \brief  Stream handle type.
 
     Each stream will be assigned a handle, which will be of this type. Further
@@ -337,16 +363,83 @@ void snd_stream_stop(snd_stream_hnd_t hnd);
 
     This function polls the specified stream to load more data if necessary. If
     using the streaming support, you must call this function periodically (most
-    likely in a thread), or you won't get any sound output.
+    likely in a thread), or you won't get any sound output. If the servicing
+    thread has been started with snd_stream_thread_start(), this doesn't poll
+    the stream itself, but still returns -3 if the callback came up empty for
+    the thread since the last call.
 
     \param  hnd             The stream to poll.
-    \retval -3              If NULL was returned from the callback.
+    \retval -3              If NULL was returned from the callback, or it had
+                            no data. This is also counted as an underrun.
     \retval -1              If no callback is set, or if the state has been
                             corrupted.
     \retval 0               On success.
 */
 int snd_stream_poll(snd_stream_hnd_t hnd);
 
+/** \brief  Start the stream servicing thread.
+
+    This function starts a thread that takes care of polling every playing
+    stream, so that you don't have to call snd_stream_poll() yourself. It wakes
+    up often enough to look at each stream at least twice in the time it takes
+    to play out its low watermark (see snd_stream_set_low_watermark()).
+
+    Note that your stream callbacks will be called from this thread, so they
+    must be safe to call from a thread other than the one that started the
+    stream.
+
+    \param  prio            The priority of the thread. This should usually be
+                            higher (a lower number) than PRIO_DEFAULT, so that
+                            the thread can interrupt a long load.
+    \retval 0               On success (or if the thread was already running).
+    \retval -1              If the thread couldn't be created.
+*/
+int snd_stream_thread_start(prio_t prio);
+
+/** \brief  Stop the stream servicing thread.
+
+    This function stops the thread started by snd_stream_thread_start() and
+    waits for it to exit. After this, you must call snd_stream_poll() yourself
+    again.
+*/
+void snd_stream_thread_stop(void);
+
+/** \brief  Set the low watermark of a stream.
+
+    The stream is refilled once the amount of data left to play in its buffer
+    drops to this level. A higher watermark makes an underrun less likely at the
+    cost of more frequent (and smaller) refills. The default is half of the
+    buffer.
+
+    \param  hnd             The stream to set the watermark on.
+    \param  bytes           Bytes per channel, or 0 for the default.
+    \retval 0               On success.
+    \retval -1              If the watermark is not smaller than the buffer.
+*/
+int snd_stream_set_low_watermark(snd_stream_hnd_t hnd, size_t bytes);
+
+/** \brief  Get the sample size of a stream.
+
+    \param  hnd             The stream to look at.
+    \return                 16, 8 or 4 bits per sample, for the format the
+                            stream was last started with, or 0 if it hasn't
+                            been started yet.
+*/
+int snd_stream_get_bitsize(snd_stream_hnd_t hnd);
+
+/** \brief  Get the statistics of a stream.
+
+    \param  hnd             The stream to get statistics for.
+    \param  stats           Where to store the statistics.
+*/
+void snd_stream_get_stats(snd_stream_hnd_t hnd, snd_stream_stats_t *stats);
+
+/** \brief  Reset the statistics of a stream.
+
+    \param  hnd             The stream to reset statistics for.
+*/
+void snd_stream_reset_stats(snd_stream_hnd_t hnd);
+
 /** \brief  Set the volume on the stream.
 
     This function sets the volume of the specified stream.
@@ -96,6 +96,23 @@ typedef struct {
    default.
  */
 
+/** \brief  VMU FS block I/O statistics.
+
+    The root block, directory and FAT of each VMU are cached, so most calls to
+    the higher level functions don't need to read them from the VMU again.
+    These counters show how many blocks were actually read from and written
+    to VMUs, and how many reads and writes were avoided. They can be read
+    with vmufs_get_stats().
+
+    \headerfile dc/vmufs.h
+*/
+typedef struct {
+    uint32          blocks_read;    /**< \brief Blocks read from VMUs */
+    uint32          blocks_written; /**< \brief Blocks written to VMUs */
+    uint32          reads_saved;    /**< \brief Reads served from the cache */
+    uint32          writes_saved;   /**< \brief Unchanged blocks not written */
+} vmufs_stats_t;
+
 
 /* ****************** Low level functions ******************** */
 
@@ -298,6 +315,27 @@ int vmufs_mutex_lock(void);
 */
 int vmufs_mutex_unlock(void);
 
+/** \brief  Throw away the cached root block, directory and FAT of a VMU.
+
+    This is done automatically whenever a VMU is plugged in or pulled out,
+    and when any of the low-level write functions above are used. You only
+    need to call it yourself if you change a VMU's filesystem in some other
+    way, such as with vmu_block_write(). This is safe to call from an
+    interrupt.
+
+    \param  dev             The VMU whose cache should be dropped.
+*/
+void vmufs_cache_invalidate(maple_device_t * dev);
+
+/** \brief  Get the VMU FS block I/O statistics.
+
+    \param  stats           Where to store the statistics.
+*/
+void vmufs_get_stats(vmufs_stats_t * stats);
+
+/** \brief  Reset the VMU FS block I/O statistics. */
+void vmufs_reset_stats(void);
+
 
 /* ****************** Higher level functions ******************** */
 
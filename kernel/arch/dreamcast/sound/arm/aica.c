@@ -165,17 +165,24 @@ void aica_play(int ch, int delay) {
     }
 }
 
-/* Start sound on all channels specified by chmap bitmap */
+/* Start sound on all channels specified by chmap bitmap. The key-on bit is
+   set on each of them first, and then a single KYONEX write starts them all
+   on the same sample. */
 void aica_sync_play(uint32 chmap) {
-    int i = 0;
+    int i = 0, last = -1;
 
     while(chmap) {
-        if(chmap & 0x1)
-            CHNREG32(i, 0) = CHNREG32(i, 0) | 0xc000;
+        if(chmap & 0x1) {
+            CHNREG32(i, 0) = (CHNREG32(i, 0) & ~0x8000) | 0x4000;
+            last = i;
+        }
 
         i++;
         chmap >>= 1;
     }
+
+    if(last >= 0)
+        CHNREG32(last, 0) = CHNREG32(last, 0) | 0xc000;
 }
 
 /* Stop the sound on a given channel */
@@ -17,6 +17,28 @@
 
 #define timer (*((volatile uint32 *)AICA_MEM_CLOCK))
 
+/* The timer that drives our clock counts once per sample, from 256 minus
+   AICA_CLOCK_SAMPLES up to its overflow (see the FIQ handler in crt0.s). */
+#define TIMER_A     (*((volatile uint32 *)0x00802890))
+#define TIMER_BASE  (256 - AICA_CLOCK_SAMPLES)
+
+/* Get the current time in samples, on the same clock as the timer. */
+uint32 sample_clock(void) {
+    uint32 ticks, cnt;
+
+    do {
+        ticks = timer;
+        cnt = TIMER_A & 0xff;
+    } while(ticks != timer);
+
+    /* If the counter has wrapped but the FIQ hasn't reloaded it yet, the tick
+       hasn't been counted yet either. */
+    if(cnt < TIMER_BASE)
+        return (ticks + 1) * AICA_CLOCK_SAMPLES + cnt;
+
+    return ticks * AICA_CLOCK_SAMPLES + cnt - TIMER_BASE;
+}
+
 void timer_wait(uint32 jiffies) {
     uint32 fin = timer + jiffies;
 
@@ -155,12 +177,28 @@ uint32 process_one(uint32 tail) {
     return size;
 }
 
+/* If a command is due within this many samples, we wait for it rather than
+   going around the main loop again, so that it runs on the exact sample. This
+   needs to be longer than a trip around the main loop. */
+#define SPIN_SAMPLES    256
+
+/* Read a field of the packet at tail, which may have wrapped around. */
+uint32 q_cmd_read(uint32 tail, uint32 offset) {
+    uint32 loc = tail + offset;
+
+    if(loc >= q_cmd->size)
+        loc -= q_cmd->size;
+
+    return *((volatile uint32 *)(q_cmd->data + loc));
+}
+
 /* Look for an available request in the command queue; if one is there
    then process it and move the tail pointer. */
 void process_cmd_queue(void) {
-    uint32      head, tail, tsloc, ts;
+    uint32      head, tail, ts;
 
-    /* Grab these values up front in case SH-4 changes head */
+    /* Grab these values up front in case SH-4 changes head. Everything the
+       SH-4 submits with a single head update gets processed in one go. */
     head = q_cmd->head;
     tail = q_cmd->tail;
 
@@ -168,15 +206,21 @@ void process_cmd_queue(void) {
     while(head != tail) {
         /* Look at the next packet. If our clock isn't there yet, then
            we won't process anything yet either. */
-        tsloc = tail + offsetof(aica_cmd_t, timestamp);
+        ts = q_cmd_read(tail, offsetof(aica_cmd_t, timestamp));
 
-        if(tsloc >= q_cmd->size)
-            tsloc -= q_cmd->size;
+        if(ts > 0 && q_cmd_read(tail, offsetof(aica_cmd_t, misc[1])) ==
+           AICA_CMD_TS_SAMPLE) {
+            ts = q_cmd_read(tail, offsetof(aica_cmd_t, misc[0]));
 
-        ts = *((volatile uint32*)(q_cmd->data + tsloc));
+            if((int)(ts - sample_clock()) > SPIN_SAMPLES)
+                return;
 
-        if(ts > 0 && ts >= timer)
+            while((int)(ts - sample_clock()) > 0)
+                ;
+        }
+        else if(ts > 0 && ts >= timer) {
             return;
+        }
 
         /* Process it */
         ts = process_one(tail);
@@ -71,11 +71,11 @@ void snd_shutdown(void) {
     }
 }
 
-/* Submit a request to the SH4->AICA queue; size is in uint32's */
-int snd_sh4_to_aica(void *packet, uint32_t size) {
-    uint32_t qa, bot, start, top, *pkt32, cnt;
+/* Copy size dwords of packets into the SH4->AICA queue, and then make them
+   all visible to the AICA at once with a single update of the head. */
+static int queue_write(void *packet, uint32_t size) {
+    uint32_t qa, bot, start, top, tail, avail, *pkt32, cnt;
     g2_ctx_t ctx;
-    assert_msg(size < AICA_CMD_MAX_SIZE, "SH4->AICA packets may not be >256 uint32's long");
 
     ctx = g2_lock();
 
@@ -86,9 +86,18 @@ int snd_sh4_to_aica(void *packet, uint32_t size) {
     bot = SPU_RAM_UNCACHED_BASE + g2_read_32_raw(qa + offsetof(aica_queue_t, data));
     top = bot + g2_read_32_raw(qa + offsetof(aica_queue_t, size));
     start = bot + g2_read_32_raw(qa + offsetof(aica_queue_t, head));
+    tail = bot + g2_read_32_raw(qa + offsetof(aica_queue_t, tail));
     pkt32 = (uint32_t *)packet;
     cnt = 0;
 
+    /* Don't run over the commands the AICA hasn't gotten to yet. */
+    avail = (tail > start ? tail - start : top - bot - (start - tail)) - 4;
+
+    if(size * 4 > avail) {
+        g2_unlock(ctx);
+        return -1;
+    }
+
     while(size-- > 0) {
         /* Fifo wait if necessary */
         if((cnt++ & 7) == 0)
@@ -117,6 +126,42 @@ int snd_sh4_to_aica(void *packet, uint32_t size) {
     return 0;
 }
 
+/* Submit a request to the SH4->AICA queue; size is in uint32's */
+int snd_sh4_to_aica(void *packet, uint32_t size) {
+    assert_msg(size < AICA_CMD_MAX_SIZE, "SH4->AICA packets may not be >256 uint32's long");
+
+    return queue_write(packet, size);
+}
+
+/* Submit a number of requests to the SH4->AICA queue at once */
+int snd_sh4_to_aica_batch(void *packets, uint32_t size) {
+    return queue_write(packets, size);
+}
+
+/* Read the AICA driver's clock, to the sample. This works just like the
+   sample_clock() function in the driver. */
+uint32_t snd_get_sample_clock(void) {
+    uint32_t ticks, cnt, base = 256 - AICA_CLOCK_SAMPLES;
+
+    do {
+        ticks = g2_read_32(SPU_RAM_UNCACHED_BASE + AICA_MEM_CLOCK);
+        cnt = g2_read_32(MEM_AREA_P2_BASE + 0x00702890) & 0xff;
+    } while(ticks != g2_read_32(SPU_RAM_UNCACHED_BASE + AICA_MEM_CLOCK));
+
+    if(cnt < base)
+        return (ticks + 1) * AICA_CLOCK_SAMPLES + cnt;
+
+    return ticks * AICA_CLOCK_SAMPLES + cnt - base;
+}
+
+void snd_cmd_set_sample_time(void *packet, uint32_t sample) {
+    aica_cmd_t *cmd = (aica_cmd_t *)packet;
+
+    cmd->timestamp = sample / AICA_CLOCK_SAMPLES;
+    cmd->misc[0] = sample;
+    cmd->misc[1] = AICA_CMD_TS_SAMPLE;
+}
+
 /* Start processing requests in the queue */
 void snd_sh4_to_aica_start(void) {
     g2_write_32(SPU_RAM_UNCACHED_BASE + AICA_MEM_CMD_QUEUE + offsetof(aica_queue_t, process_ok), 1);
@@ -0,0 +1,55 @@
+/* KallistiOS ##version##
+
+   snd_mix.h
+
+   Sample-level kernels for the software mixer. These don't depend on anything
+   else in KOS, so they can be built and tested on the host as well.
+*/
+
+#ifndef __SND_MIX_H
+#define __SND_MIX_H
+
+#include <stdint.h>
+
+/* Resampling positions and steps are 16.16 fixed point, in source frames. */
+#define SND_MIX_FRAC_BITS   16
+#define SND_MIX_ONE         (1 << SND_MIX_FRAC_BITS)
+
+/* Gains are 8.8 fixed point, so the accumulator holds samples scaled by 256. */
+#define SND_MIX_GAIN_BITS   8
+
+/* Decoder state for one channel of Yamaha ADPCM. */
+typedef struct snd_mix_adpcm {
+    int16_t history;
+    int16_t step_size;
+} snd_mix_adpcm_t;
+
+/* Reset an ADPCM decoder to its initial state. */
+void snd_mix_adpcm_reset(snd_mix_adpcm_t *st);
+
+/* Decode frames of ADPCM. Mono data has two samples per byte, low nibble
+   first. Stereo data has one frame per byte, with the left channel in the high
+   nibble (the same layout that snd_adpcm_split() expects). The output is
+   interleaved 16-bit PCM. */
+void snd_mix_adpcm_decode(int16_t *out, const uint8_t *in, int frames,
+                          int channels, snd_mix_adpcm_t *st);
+
+/* Convert signed 8-bit PCM to 16-bit. */
+void snd_mix_s8_to_s16(int16_t *out, const int8_t *in, int samples);
+
+/* Load 16-bit samples into the accumulator, at unity gain. */
+void snd_mix_load(int32_t *acc, const int16_t *in, int samples);
+
+/* Mix frames of 16-bit PCM (mono or interleaved stereo) into a stereo
+   accumulator, resampling with linear interpolation. Reads start at *pos in
+   src and advance by step for each output frame, and *pos is updated on the
+   way out. The caller has to make sure that src has a frame past the last one
+   the position reaches, for the interpolation. */
+void snd_mix_s16(int32_t *acc, const int16_t *src, int channels,
+                 uint32_t *pos, uint32_t step, int frames,
+                 int lgain, int rgain);
+
+/* Scale the accumulator back down and saturate it into 16-bit samples. */
+void snd_mix_store(int16_t *out, const int32_t *acc, int samples);
+
+#endif /* __SND_MIX_H */
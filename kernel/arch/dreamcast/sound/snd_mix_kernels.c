@@ -0,0 +1,200 @@
+/* KallistiOS ##version##
+
+   snd_mix_kernels.c
+
+   Inner loops for the software mixer. Everything in here is plain C with no
+   dependencies on the rest of KOS, so that it can be built on the host for
+   testing and benchmarking. The loops are written with the SH4 in mind: the
+   common unity-rate case is unrolled and prefetches a cache line ahead, and
+   nothing in any of the loops needs a division.
+*/
+
+#include <stdint.h>
+
+#include "snd_mix.h"
+
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+
+/* Prefetch the cache line after the one we're working on. On the SH4, GCC turns
+   this into a pref instruction. */
+#define PREFETCH(p)     __builtin_prefetch((const char *)(p) + 32)
+
+void snd_mix_adpcm_reset(snd_mix_adpcm_t *st) {
+    st->history = 0;
+    st->step_size = 127;
+}
+
+/* Decode one ADPCM nibble. This is the same algorithm as wav2adpcm uses. */
+static inline int16_t adpcm_step(uint8_t step, snd_mix_adpcm_t *st) {
+    static const int step_table[8] = {
+        230, 230, 230, 230, 307, 409, 512, 614
+    };
+
+    int delta = step & 7;
+    int diff = ((1 + (delta << 1)) * st->step_size) >> 3;
+    int newval = st->history * 254 / 256;
+    int nstep = (step_table[delta] * st->step_size) >> 8;
+
+    diff = CLAMP(diff, 0, 32767);
+
+    if(step & 8)
+        newval -= diff;
+    else
+        newval += diff;
+
+    st->step_size = CLAMP(nstep, 127, 24576);
+    st->history = newval = CLAMP(newval, -32768, 32767);
+    return newval;
+}
+
+void snd_mix_adpcm_decode(int16_t *out, const uint8_t *in, int frames,
+                          int channels, snd_mix_adpcm_t *st) {
+    uint8_t b;
+
+    if(channels == 2) {
+        while(frames-- > 0) {
+            b = *in++;
+            out[0] = adpcm_step(b >> 4, st);
+            out[1] = adpcm_step(b & 15, st + 1);
+            out += 2;
+        }
+    }
+    else {
+        for(; frames >= 2; frames -= 2) {
+            b = *in++;
+            *out++ = adpcm_step(b & 15, st);
+            *out++ = adpcm_step(b >> 4, st);
+        }
+
+        if(frames)
+            *out = adpcm_step(*in & 15, st);
+    }
+}
+
+void snd_mix_s8_to_s16(int16_t *out, const int8_t *in, int samples) {
+    for(; samples >= 4; samples -= 4) {
+        out[0] = in[0] << 8;
+        out[1] = in[1] << 8;
+        out[2] = in[2] << 8;
+        out[3] = in[3] << 8;
+        out += 4;
+        in += 4;
+    }
+
+    while(samples-- > 0)
+        *out++ = *in++ << 8;
+}
+
+void snd_mix_load(int32_t *acc, const int16_t *in, int samples) {
+    for(; samples >= 4; samples -= 4) {
+        PREFETCH(in);
+        acc[0] = in[0] << SND_MIX_GAIN_BITS;
+        acc[1] = in[1] << SND_MIX_GAIN_BITS;
+        acc[2] = in[2] << SND_MIX_GAIN_BITS;
+        acc[3] = in[3] << SND_MIX_GAIN_BITS;
+        acc += 4;
+        in += 4;
+    }
+
+    while(samples-- > 0)
+        *acc++ = *in++ << SND_MIX_GAIN_BITS;
+}
+
+/* Unity-rate mixing of mono data: no interpolation needed. */
+static void mix_mono_unity(int32_t *acc, const int16_t *src, int frames,
+                           int lgain, int rgain) {
+    int32_t s0, s1;
+
+    for(; frames >= 2; frames -= 2) {
+        PREFETCH(src);
+        s0 = src[0];
+        s1 = src[1];
+        acc[0] += s0 * lgain;
+        acc[1] += s0 * rgain;
+        acc[2] += s1 * lgain;
+        acc[3] += s1 * rgain;
+        acc += 4;
+        src += 2;
+    }
+
+    if(frames) {
+        acc[0] += src[0] * lgain;
+        acc[1] += src[0] * rgain;
+    }
+}
+
+/* Unity-rate mixing of stereo data. */
+static void mix_stereo_unity(int32_t *acc, const int16_t *src, int frames,
+                             int lgain, int rgain) {
+    for(; frames >= 2; frames -= 2) {
+        PREFETCH(src);
+        acc[0] += src[0] * lgain;
+        acc[1] += src[1] * rgain;
+        acc[2] += src[2] * lgain;
+        acc[3] += src[3] * rgain;
+        acc += 4;
+        src += 4;
+    }
+
+    if(frames) {
+        acc[0] += src[0] * lgain;
+        acc[1] += src[1] * rgain;
+    }
+}
+
+void snd_mix_s16(int32_t *acc, const int16_t *src, int channels,
+                 uint32_t *pos, uint32_t step, int frames,
+                 int lgain, int rgain) {
+    uint32_t p = *pos;
+    const int16_t *s;
+    int32_t frac, a, b;
+
+    *pos = p + step * frames;
+
+    /* When we're not resampling and sit right on a sample, just add. */
+    if(step == SND_MIX_ONE && !(p & (SND_MIX_ONE - 1))) {
+        src += (p >> SND_MIX_FRAC_BITS) * channels;
+
+        if(channels == 2)
+            mix_stereo_unity(acc, src, frames, lgain, rgain);
+        else
+            mix_mono_unity(acc, src, frames, lgain, rgain);
+
+        return;
+    }
+
+    /* Otherwise, interpolate between the two nearest frames. The fraction is
+       cut down to 15 bits so that the product can't overflow. */
+    if(channels == 2) {
+        while(frames-- > 0) {
+            s = src + (p >> SND_MIX_FRAC_BITS) * 2;
+            frac = (p & (SND_MIX_ONE - 1)) >> 1;
+            a = s[0] + (((s[2] - s[0]) * frac) >> 15);
+            b = s[1] + (((s[3] - s[1]) * frac) >> 15);
+            acc[0] += a * lgain;
+            acc[1] += b * rgain;
+            acc += 2;
+            p += step;
+        }
+    }
+    else {
+        while(frames-- > 0) {
+            s = src + (p >> SND_MIX_FRAC_BITS);
+            frac = (p & (SND_MIX_ONE - 1)) >> 1;
+            a = s[0] + (((s[1] - s[0]) * frac) >> 15);
+            acc[0] += a * lgain;
+            acc[1] += a * rgain;
+            acc += 2;
+            p += step;
+        }
+    }
+}
+
+void snd_mix_store(int16_t *out, const int32_t *acc, int samples) {
+    int32_t v;
+
+    while(samples-- > 0) {
+        v = *acc++ >> SND_MIX_GAIN_BITS;
+        *out++ = CLAMP(v, -32768, 32767);
+    }
+}
@@ -0,0 +1,506 @@
+/* KallistiOS ##version##
+
+   snd_mixer.c
+
+   Software mixer. This mixes any number of sources into a single stereo
+   stream, working as a filter on that stream.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include <kos/dbglog.h>
+#include <kos/mutex.h>
+#include <dc/sound/stream.h>
+#include <dc/sound/mixer.h>
+
+#include "snd_mix.h"
+
+/*
+
+Each source keeps a small buffer of decoded 16-bit frames. The mixer walks
+through that buffer at the source's rate, and asks the source's callback for
+more whenever it gets to the end. The last frame of the old buffer is carried
+over to the start of the new one, so the interpolation doesn't skip a beat.
+
+Mixing is done a chunk at a time into a 32-bit accumulator that is small
+enough to stay in the cache, and then saturated down into the output buffer
+that goes to the stream.
+
+*/
+
+/* Number of frames of decoded data buffered for each source. */
+#define SRC_FRAMES      1024
+
+/* Number of frames mixed at once. */
+#define MIX_CHUNK       256
+
+/* Fastest a source can play back, relative to the mixer. */
+#define MAX_STEP        (8 * SND_MIX_ONE)
+
+struct snd_mix_src {
+    TAILQ_ENTRY(snd_mix_src) lent;
+
+    snd_mix_callback_t cb;
+    void *user;
+
+    int fmt;
+    int channels;
+    uint32_t freq;
+
+    /* Resampling state */
+    uint32_t pos;
+    uint32_t step;
+
+    int vol;
+    int pan;
+    int lgain;
+    int rgain;
+
+    volatile int playing;
+
+    /* Freed from a callback, so it goes once the mixing is done */
+    int freed;
+
+    /* Decoded data, and how many frames of it there are */
+    int16_t *pcm;
+    int pcm_frames;
+
+    /* Undecoded data, for 8-bit and ADPCM sources */
+    uint8_t *raw;
+    snd_mix_adpcm_t adpcm[2];
+};
+
+static TAILQ_HEAD(srclist, snd_mix_src) sources =
+    TAILQ_HEAD_INITIALIZER(sources);
+
+/* Held while mixing. Recursive, so callbacks can stop their own source. */
+static mutex_t mix_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+/* Set while the filter walks the sources */
+static int mix_busy = 0;
+
+static snd_stream_hnd_t mix_hnd = SND_STREAM_INVALID;
+static int mix_own_stream = 0;
+static uint32_t mix_freq = 0;
+
+/* Output buffer handed to the stream */
+static int16_t *mix_out = NULL;
+static size_t mix_out_size = 0;
+
+static int32_t mix_acc[MIX_CHUNK * 2] __attribute__((aligned(32)));
+
+/* Work out the gain for each side, so that full volume panned to the center
+   comes out at exactly unity on both. */
+static void src_update_gain(snd_mix_src_t *src) {
+    int vol = src->vol + (src->vol >> 7);
+    int l = (256 - src->pan) * 2, r = src->pan * 2;
+
+    src->lgain = (vol * (l > 256 ? 256 : l)) >> 8;
+    src->rgain = (vol * (r > 256 ? 256 : r)) >> 8;
+}
+
+static void src_update_step(snd_mix_src_t *src) {
+    uint64_t step;
+
+    if(!mix_freq)
+        return;
+
+    step = ((uint64_t)src->freq << SND_MIX_FRAC_BITS) / mix_freq;
+
+    if(!step)
+        step = 1;
+    else if(step > MAX_STEP)
+        step = MAX_STEP;
+
+    src->step = (uint32_t)step;
+}
+
+/* Called with mix_mutex held whenever the mixer's rate is set or changes. */
+static void mix_set_freq(uint32_t freq) {
+    snd_mix_src_t *src;
+
+    mix_freq = freq;
+
+    TAILQ_FOREACH(src, &sources, lent) {
+        src_update_step(src);
+    }
+}
+
+static void src_release(snd_mix_src_t *src) {
+    TAILQ_REMOVE(&sources, src, lent);
+    free(src->pcm);
+    free(src->raw);
+    free(src);
+}
+
+/* Get another batch of decoded frames from a source. */
+static int src_decode(snd_mix_src_t *src, int16_t *out, int frames) {
+    int got, ch = src->channels;
+
+    switch(src->fmt) {
+        case SND_MIX_FMT_PCM16:
+            got = src->cb(src, src->user, out, frames * ch * 2);
+            return got > 0 ? got / (ch * 2) : 0;
+
+        case SND_MIX_FMT_PCM8:
+            got = src->cb(src, src->user, src->raw, frames * ch);
+
+            if(got <= 0)
+                return 0;
+
+            got /= ch;
+            snd_mix_s8_to_s16(out, (const int8_t *)src->raw, got * ch);
+            return got;
+
+        case SND_MIX_FMT_ADPCM:
+            got = src->cb(src, src->user, src->raw, frames * ch / 2);
+
+            if(got <= 0)
+                return 0;
+
+            got = got * 2 / ch;
+            snd_mix_adpcm_decode(out, src->raw, got, ch, src->adpcm);
+            return got;
+    }
+
+    return 0;
+}
+
+/* Move on to the next batch of data, keeping the frame we're sitting on (if
+   there is one) for the interpolation. */
+static int src_refill(snd_mix_src_t *src) {
+    uint32_t ipos = src->pos >> SND_MIX_FRAC_BITS, skip = 0;
+    int have = 0, got, ch = src->channels;
+
+    if(ipos < (uint32_t)src->pcm_frames) {
+        memcpy(src->pcm, src->pcm + ipos * ch, ch * sizeof(int16_t));
+        have = 1;
+    }
+    else {
+        skip = ipos - src->pcm_frames;
+    }
+
+    got = src_decode(src, src->pcm + have * ch, SRC_FRAMES);
+
+    if(got <= 0)
+        return 0;
+
+    src->pcm_frames = have + got;
+    src->pos = (skip << SND_MIX_FRAC_BITS) | (src->pos & (SND_MIX_ONE - 1));
+    return got;
+}
+
+/* Mix frames of a source into the accumulator. */
+static void src_mix(snd_mix_src_t *src, int32_t *acc, int frames) {
+    uint32_t limit;
+    int n;
+
+    /* Not until the mixer knows its own rate */
+    if(!src->step)
+        return;
+
+    while(frames > 0 && src->playing) {
+        /* We need the frame after the current one to interpolate. */
+        if((src->pos >> SND_MIX_FRAC_BITS) + 1 >= (uint32_t)src->pcm_frames) {
+            if(!src_refill(src)) {
+                src->playing = 0;
+                break;
+            }
+
+            continue;
+        }
+
+        /* Figure out how many frames we can make out of what's buffered. */
+        limit = ((uint32_t)(src->pcm_frames - 1) << SND_MIX_FRAC_BITS) -
+                src->pos;
+        n = (limit - 1) / src->step + 1;
+
+        if(n > frames)
+            n = frames;
+
+        snd_mix_s16(acc, src->pcm, src->channels, &src->pos, src->step, n,
+                    src->lgain, src->rgain);
+        acc += n * 2;
+        frames -= n;
+    }
+}
+
+/* Make sure the output buffer can hold size bytes. */
+static int mix_out_reserve(size_t size) {
+    int16_t *buf;
+
+    if(size <= mix_out_size)
+        return 0;
+
+    if(!(buf = aligned_alloc(32, (size + 31) & ~31))) {
+        dbglog(DBG_ERROR, "snd_mix: can't allocate %u byte buffer\n",
+               (unsigned)size);
+        return -1;
+    }
+
+    free(mix_out);
+    mix_out = buf;
+    mix_out_size = size;
+    return 0;
+}
+
+/* The mixer itself, as a stream filter. */
+static void mix_filter(snd_stream_hnd_t hnd, void *obj, int hz, int channels,
+                       void **buffer, int *samplecnt) {
+    const int16_t *in = (const int16_t *)*buffer;
+    int frames, off, n;
+    snd_mix_src_t *src, *next;
+
+    (void)obj;
+
+    /* Anything else would need converting, so it's left alone */
+    if(channels != 2 || *samplecnt <= 0 || snd_stream_get_bitsize(hnd) != 16)
+        return;
+
+    mutex_lock(&mix_mutex);
+
+    /* The data from our own stream is always silence, and is already sitting
+       in the output buffer. */
+    if(in != mix_out && mix_out_reserve(*samplecnt) < 0) {
+        mutex_unlock(&mix_mutex);
+        return;
+    }
+
+    if((uint32_t)hz != mix_freq)
+        mix_set_freq(hz);
+
+    frames = *samplecnt / 4;
+    mix_busy = 1;
+
+    for(off = 0; off < frames; off += n) {
+        n = frames - off;
+
+        if(n > MIX_CHUNK)
+            n = MIX_CHUNK;
+
+        if(in == mix_out)
+            memset(mix_acc, 0, n * 2 * sizeof(int32_t));
+        else
+            snd_mix_load(mix_acc, in + off * 2, n * 2);
+
+        TAILQ_FOREACH(src, &sources, lent) {
+            if(src->playing)
+                src_mix(src, mix_acc, n);
+        }
+
+        snd_mix_store(mix_out + off * 2, mix_acc, n * 2);
+    }
+
+    mix_busy = 0;
+
+    TAILQ_FOREACH_SAFE(src, &sources, lent, next) {
+        if(src->freed)
+            src_release(src);
+    }
+
+    *buffer = mix_out;
+    mutex_unlock(&mix_mutex);
+}
+
+/* Data callback for our own stream. The filter does all of the real work. */
+static void *mix_get_data(snd_stream_hnd_t hnd, int smp_req, int *smp_recv) {
+    (void)hnd;
+
+    mutex_lock(&mix_mutex);
+
+    if(mix_out_reserve(smp_req) < 0) {
+        mutex_unlock(&mix_mutex);
+        *smp_recv = 0;
+        return NULL;
+    }
+
+    mutex_unlock(&mix_mutex);
+    *smp_recv = smp_req;
+    return mix_out;
+}
+
+snd_stream_hnd_t snd_mix_init(uint32_t freq, int bufsize) {
+    snd_stream_hnd_t hnd;
+
+    if(mix_hnd != SND_STREAM_INVALID)
+        return SND_STREAM_INVALID;
+
+    if(snd_stream_init_ex(2, bufsize) < 0)
+        return SND_STREAM_INVALID;
+
+    hnd = snd_stream_alloc(mix_get_data, bufsize);
+
+    if(hnd == SND_STREAM_INVALID)
+        return SND_STREAM_INVALID;
+
+    mix_own_stream = 1;
+
+    mutex_lock(&mix_mutex);
+    mix_set_freq(freq);
+    mutex_unlock(&mix_mutex);
+
+    snd_mix_attach(hnd);
+    snd_stream_start(hnd, freq, 1);
+
+    return hnd;
+}
+
+int snd_mix_attach(snd_stream_hnd_t hnd) {
+    int bits;
+
+    if(mix_hnd != SND_STREAM_INVALID && mix_hnd != hnd)
+        return -1;
+
+    /* The mixing is all done on 16-bit samples */
+    bits = snd_stream_get_bitsize(hnd);
+
+    if(bits && bits != 16) {
+        dbglog(DBG_ERROR, "snd_mix_attach: stream isn't 16-bit PCM\n");
+        return -1;
+    }
+
+    mix_hnd = hnd;
+
+    /* Sources allocated before this only got a step if the rate was known */
+    mutex_lock(&mix_mutex);
+
+    if(mix_freq)
+        mix_set_freq(mix_freq);
+
+    mutex_unlock(&mix_mutex);
+
+    snd_stream_filter_add(hnd, mix_filter, NULL);
+    return 0;
+}
+
+void snd_mix_shutdown(void) {
+    snd_mix_src_t *src, *next;
+
+    if(mix_hnd == SND_STREAM_INVALID)
+        return;
+
+    if(mix_own_stream)
+        snd_stream_destroy(mix_hnd);
+    else
+        snd_stream_filter_remove(mix_hnd, mix_filter, NULL);
+
+    mutex_lock(&mix_mutex);
+
+    src = TAILQ_FIRST(&sources);
+
+    while(src) {
+        next = TAILQ_NEXT(src, lent);
+        src_release(src);
+        src = next;
+    }
+
+    free(mix_out);
+    mix_out = NULL;
+    mix_out_size = 0;
+    mix_hnd = SND_STREAM_INVALID;
+    mix_own_stream = 0;
+    mix_freq = 0;
+
+    mutex_unlock(&mix_mutex);
+}
+
+snd_mix_src_t *snd_mix_src_alloc(int fmt, uint32_t freq, int stereo,
+                                 snd_mix_callback_t cb, void *user) {
+    snd_mix_src_t *src;
+    int ch = stereo ? 2 : 1;
+
+    if(!cb || fmt < SND_MIX_FMT_PCM16 || fmt > SND_MIX_FMT_ADPCM)
+        return NULL;
+
+    if(!(src = calloc(1, sizeof(snd_mix_src_t))))
+        return NULL;
+
+    /* One extra frame for the one carried over between buffers. */
+    if(!(src->pcm = malloc((SRC_FRAMES + 1) * ch * sizeof(int16_t)))) {
+        free(src);
+        return NULL;
+    }
+
+    if(fmt != SND_MIX_FMT_PCM16 && !(src->raw = malloc(SRC_FRAMES * ch))) {
+        free(src->pcm);
+        free(src);
+        return NULL;
+    }
+
+    src->cb = cb;
+    src->user = user;
+    src->fmt = fmt;
+    src->channels = ch;
+    src->freq = freq;
+    src->vol = 255;
+    src->pan = 128;
+    src_update_gain(src);
+
+    mutex_lock(&mix_mutex);
+    src_update_step(src);
+    TAILQ_INSERT_TAIL(&sources, src, lent);
+    mutex_unlock(&mix_mutex);
+
+    return src;
+}
+
+void snd_mix_src_free(snd_mix_src_t *src) {
+    mutex_lock(&mix_mutex);
+
+    /* Only a callback can get here while mixing, since it's the mixing
+       thread that holds the mutex. The mixer is still using the source. */
+    if(mix_busy) {
+        src->playing = 0;
+        src->freed = 1;
+    }
+    else {
+        src_release(src);
+    }
+
+    mutex_unlock(&mix_mutex);
+}
+
+void snd_mix_src_start(snd_mix_src_t *src) {
+    mutex_lock(&mix_mutex);
+
+    src->pos = 0;
+    src->pcm_frames = 0;
+    snd_mix_adpcm_reset(&src->adpcm[0]);
+    snd_mix_adpcm_reset(&src->adpcm[1]);
+    src->playing = 1;
+
+    mutex_unlock(&mix_mutex);
+}
+
+void snd_mix_src_stop(snd_mix_src_t *src) {
+    mutex_lock(&mix_mutex);
+    src->playing = 0;
+    mutex_unlock(&mix_mutex);
+}
+
+int snd_mix_src_playing(snd_mix_src_t *src) {
+    return src->playing;
+}
+
+void snd_mix_src_volume(snd_mix_src_t *src, int vol) {
+    mutex_lock(&mix_mutex);
+    src->vol = vol < 0 ? 0 : vol > 255 ? 255 : vol;
+    src_update_gain(src);
+    mutex_unlock(&mix_mutex);
+}
+
+void snd_mix_src_pan(snd_mix_src_t *src, int pan) {
+    mutex_lock(&mix_mutex);
+    src->pan = pan < 0 ? 0 : pan > 255 ? 255 : pan;
+    src_update_gain(src);
+    mutex_unlock(&mix_mutex);
+}
+
+void snd_mix_src_freq(snd_mix_src_t *src, uint32_t freq) {
+    mutex_lock(&mix_mutex);
+    src->freq = freq;
+    src_update_step(src);
+    mutex_unlock(&mix_mutex);
+}
@@ -14,12 +14,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/queue.h>
 #include <sys/ioctl.h>
 #include <kos/dbglog.h>
 #include <kos/fs.h>
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <dc/spu.h>
 #include <dc/sound/sound.h>
 #include <dc/sound/sfxmgr.h>
@@ -48,6 +50,24 @@ static int sfx_nextchan = 0;
 /* Our channel-in-use mask. */
 static uint64_t sfx_inuse = 0;
 
+/* What we know about the sound effect playing on each channel. Stereo effects
+   take up two channels, which are both filled in and point at each other. */
+typedef struct sfx_voice {
+    uint64_t start;     /* When it was started, in milliseconds */
+    uint32_t dur;       /* How long it should play for, or 0 if it loops */
+    uint32_t len;       /* Length in samples */
+    int prio;
+    int8_t active;
+    int8_t pair;        /* Offset to the other channel of a stereo effect */
+} sfx_voice_t;
+
+static sfx_voice_t sfx_voices[64];
+static sfx_voice_stats_t sfx_stats;
+
+/* How long we give the AICA to actually start a channel, before believing
+   what its registers say about it. */
+#define SFX_VOICE_GRACE 20
+
 /* Unload all loaded samples and free their SPU RAM */
 void snd_sfx_unload_all(void) {
     snd_effect_t *t, *n;
@@ -218,47 +238,108 @@ static int read_wav_header_buf(char *buf, wavhdr_t *wavhdr, size_t *bufidx) {
     return 0;
 }
 
-static uint8_t *read_wav_data(file_t fd, wavhdr_t *wavhdr) {
-    /* Allocate memory for WAV data */
-    uint8_t *wav_data = aligned_alloc(32, wavhdr->chunk.size);
+/* Sound effects are loaded a chunk at a time, so that we never need more main
+   RAM than a chunk (plus room to split stereo data) no matter how big the
+   effect is. This should be a multiple of 32 bytes, for the store queues. */
+#define SFX_LOAD_CHUNK  8192
 
-    if(wav_data == NULL)
-        return NULL;
+/* How the data for an effect is laid out. */
+#define SFX_LAYOUT_MONO     0   /* A single channel */
+#define SFX_LAYOUT_PCM16    1   /* Interleaved 16-bit PCM */
+#define SFX_LAYOUT_PCM8     2   /* Interleaved 8-bit PCM */
+#define SFX_LAYOUT_ADPCM    3   /* Interleaved 4-bit ADPCM */
+#define SFX_LAYOUT_PLANAR   4   /* All of the left channel, then the right */
 
-    /* Read WAV data */
-    if((size_t)fs_read(fd, wav_data, wavhdr->chunk.size) != wavhdr->chunk.size) {
-        dbglog(DBG_WARNING, "snd_sfx: file has not been fully read.\n");
-        free(wav_data);
-        return NULL;
-    }
+/* Where the data is coming from: returns the number of bytes read. */
+typedef size_t (*sfx_read_t)(void *src, void *buf, size_t size);
 
-    return wav_data;
+static size_t sfx_read_fd(void *src, void *buf, size_t size) {
+    ssize_t rv = fs_read(*(file_t *)src, buf, size);
+
+    return rv < 0 ? 0 : (size_t)rv;
 }
 
-static uint8_t *read_wav_data_buf(char *buf, wavhdr_t *wavhdr, size_t *bufidx) {
-    /* maintain buffer index during function */
-    size_t tmp_bufidx = *bufidx;
+static size_t sfx_read_mem(void *src, void *buf, size_t size) {
+    uint8_t **ptr = (uint8_t **)src;
 
-    /* Allocate memory for WAV data */
-    uint8_t *wav_data = aligned_alloc(32, wavhdr->chunk.size);
+    memcpy(buf, *ptr, size);
+    *ptr += size;
 
-    if(wav_data == NULL)
-        return NULL;
+    return size;
+}
 
-    /* Read WAV data */
-    memcpy(wav_data, buf + tmp_bufidx, wavhdr->chunk.size);
-    tmp_bufidx += wavhdr->chunk.size;
+/* Read len bytes of sample data and upload it to the effect's SPU RAM,
+   splitting stereo data into its two channels along the way. */
+static int sfx_upload(snd_effect_t *effect, int layout, size_t len,
+                      sfx_read_t rd, void *src) {
+    size_t done = 0, half = len / 2, n;
+    uint8_t *buf, *left, *right;
 
-    /* update buffer index for caller */
-    *bufidx = tmp_bufidx;
+    if(!(buf = aligned_alloc(32, SFX_LOAD_CHUNK * 2)))
+        return -1;
+
+    left = buf + SFX_LOAD_CHUNK;
+    right = left + SFX_LOAD_CHUNK / 2;
+
+    while(done < len) {
+        n = len - done;
+
+        if(n > SFX_LOAD_CHUNK)
+            n = SFX_LOAD_CHUNK;
+
+        /* Don't let a chunk straddle the two channels of planar data. */
+        if(layout == SFX_LAYOUT_PLANAR && done < half && done + n > half)
+            n = half - done;
+
+        if(rd(src, buf, n) != n) {
+            dbglog(DBG_WARNING, "snd_sfx: file has not been fully read.\n");
+            free(buf);
+            return -1;
+        }
+
+        switch(layout) {
+            case SFX_LAYOUT_MONO:
+                spu_memload_sq(effect->locl + done, buf, n);
+                break;
+
+            case SFX_LAYOUT_PCM16:
+                snd_pcm16_split_sq((uint32_t *)buf, effect->locl + done / 2,
+                                   effect->locr + done / 2, n);
+                break;
+
+            case SFX_LAYOUT_PCM8:
+            case SFX_LAYOUT_ADPCM:
+                if(layout == SFX_LAYOUT_PCM8)
+                    snd_pcm8_split((uint32_t *)buf, (uint32_t *)left,
+                                   (uint32_t *)right, n);
+                else
+                    snd_adpcm_split((uint32_t *)buf, (uint32_t *)left,
+                                    (uint32_t *)right, n);
+
+                spu_memload_sq(effect->locl + done / 2, left, n / 2);
+                spu_memload_sq(effect->locr + done / 2, right, n / 2);
+                break;
+
+            case SFX_LAYOUT_PLANAR:
+                if(done < half)
+                    spu_memload_sq(effect->locl + done, buf, n);
+                else
+                    spu_memload_sq(effect->locr + done - half, buf, n);
+                break;
+        }
+
+        done += n;
+    }
 
-    return wav_data;
+    free(buf);
+    return 0;
 }
 
-static snd_effect_t *create_snd_effect(wavhdr_t *wavhdr, uint8_t *wav_data) {
+/* Set up an effect and its SPU RAM, for len bytes of data. */
+static snd_effect_t *sfx_alloc(size_t len, uint32_t rate, uint32_t fmt,
+                               uint16_t channels) {
     snd_effect_t *effect;
-    uint32_t len, rate;
-    uint16_t channels, bitsize, fmt;
+    size_t chan_len = len / channels;
 
     effect = malloc(sizeof(snd_effect_t));
     if(effect == NULL)
@@ -266,121 +347,157 @@ static snd_effect_t *create_snd_effect(wavhdr_t *wavhdr, uint8_t *wav_data) {
 
     memset(effect, 0, sizeof(snd_effect_t));
 
-    fmt = wavhdr->fmt.format;
-    channels = wavhdr->fmt.channels;
-    rate = wavhdr->fmt.sample_rate;
-    bitsize = wavhdr->fmt.sample_size;
-    len = wavhdr->chunk.size;
-
     effect->rate = rate;
+    effect->fmt = fmt;
     effect->stereo = channels > 1;
-    effect->locl = snd_mem_malloc(len / channels);
+
+    switch(fmt) {
+        case AICA_SM_ADPCM:
+            effect->len = chan_len * 2;     /* 4-bit packed samples */
+            break;
+        case AICA_SM_8BIT:
+            effect->len = chan_len;
+            break;
+        case AICA_SM_16BIT:
+            effect->len = chan_len / 2;
+            break;
+    }
+
+    effect->locl = snd_mem_malloc(chan_len);
 
     if(!effect->locl) {
-        goto err_occurred;
+        free(effect);
+        return NULL;
     }
+
     if(channels > 1) {
-        effect->locr = snd_mem_malloc(len / channels);
+        effect->locr = snd_mem_malloc(chan_len);
+
         if(!effect->locr) {
             snd_mem_free(effect->locl);
-            goto err_occurred;
+            free(effect);
+            return NULL;
         }
     }
 
-    if(fmt == WAVE_FMT_YAMAHA_ADPCM_ITU_G723 || fmt == WAVE_FMT_YAMAHA_ADPCM) {
-        effect->fmt = AICA_SM_ADPCM;
-        effect->len = (len * 2) / channels; /* 4-bit packed samples */
-    }
-    else if(fmt == WAVE_FMT_PCM && bitsize == 8) {
-        effect->fmt = AICA_SM_8BIT;
-        effect->len = len / channels;
+    return effect;
+}
+
+static void sfx_free(snd_effect_t *effect) {
+    snd_mem_free(effect->locl);
+
+    if(effect->locr)
+        snd_mem_free(effect->locr);
+
+    free(effect);
+}
+
+/* Create a sound effect from a WAV header and the data following it. */
+static snd_effect_t *create_snd_effect(wavhdr_t *wavhdr, sfx_read_t rd,
+                                       void *src) {
+    snd_effect_t *effect;
+    uint32_t len, sample_count, fmt;
+    uint16_t channels, bitsize, format;
+    int layout;
+
+    format = wavhdr->fmt.format;
+    channels = wavhdr->fmt.channels;
+    bitsize = wavhdr->fmt.sample_size;
+    len = wavhdr->chunk.size;
+
+    if(channels != 1 && channels != 2)
+        return NULL;
+
+    if(format == WAVE_FMT_YAMAHA_ADPCM_ITU_G723) {
+        /* The channels are not interleaved in these. */
+        fmt = AICA_SM_ADPCM;
+        layout = SFX_LAYOUT_PLANAR;
     }
-    else if(fmt == WAVE_FMT_PCM && bitsize == 16) {
-        effect->fmt = AICA_SM_16BIT;
-        effect->len = (len / 2) / channels;
+    else if(format == WAVE_FMT_YAMAHA_ADPCM) {
+        fmt = AICA_SM_ADPCM;
+        layout = SFX_LAYOUT_ADPCM;
     }
-    else {
-        goto err_occurred;
+    else if(format == WAVE_FMT_PCM && bitsize == 8) {
+        fmt = AICA_SM_8BIT;
+        layout = SFX_LAYOUT_PCM8;
     }
-
-    if(channels == 1) {
-        /* Mono PCM/ADPCM */
-        spu_memload_sq(effect->locl, wav_data, len);
+    else if(format == WAVE_FMT_PCM && bitsize == 16) {
+        fmt = AICA_SM_16BIT;
+        layout = SFX_LAYOUT_PCM16;
     }
-    else if(channels == 2 && fmt == WAVE_FMT_PCM && bitsize == 16) {
-        /* Stereo 16-bit PCM */
-        snd_pcm16_split_sq((uint32_t *)wav_data, effect->locl, effect->locr, len);
+    else {
+        return NULL;
     }
-    else if(channels == 2 && fmt == WAVE_FMT_PCM && bitsize == 8) {
-        /* Stereo 8-bit PCM */
-        uint32_t *left_buf = aligned_alloc(32, len / 2), *right_buf;
 
-        if(left_buf == NULL)
-            goto err_occurred;
-
-        right_buf = aligned_alloc(32, len / 2);
-        if(right_buf == NULL) {
-            free(left_buf);
-            goto err_occurred;
-        }
+    if(channels == 1)
+        layout = SFX_LAYOUT_MONO;
 
-        snd_pcm8_split((uint32_t *)wav_data, left_buf, right_buf, len);
-        spu_memload_sq(effect->locl, left_buf, len / 2);
-        spu_memload_sq(effect->locr, right_buf, len / 2);
+    /*
+    dbglog(DBG_DEBUG, "WAVE file is %s, %luHZ, %d bits/sample, "
+        "%u bytes total, format %d\n",
+           channels == 1 ? "mono" : "stereo",
+           wavhdr->fmt.sample_rate,
+           bitsize,
+           len,
+           format);
+    */
+    sample_count = bitsize >= 8 ?
+        len / ((bitsize / 8) * channels) : (len * 2) / channels;
 
-        free(left_buf);
-        free(right_buf);
+    if(sample_count > 65534) {
+        dbglog(DBG_WARNING, "snd_sfx_load: WAVE file is over 65534 samples\n");
     }
-    else if(channels == 2 && fmt == WAVE_FMT_YAMAHA_ADPCM_ITU_G723) {
-        /* Stereo ADPCM ITU G.723 (channels are not interleaved) */
-        uint8_t *right_buf = wav_data + (len / 2);
-        int ownmem = 0;
 
-        if(((uintptr_t)right_buf) & 3) {
-            right_buf = (uint8_t *)aligned_alloc(32, len / 2);
+    effect = sfx_alloc(len, wavhdr->fmt.sample_rate, fmt, channels);
 
-            if(right_buf == NULL)
-                goto err_occurred;
+    if(!effect)
+        return NULL;
 
-            ownmem = 1;
-            memcpy(right_buf, wav_data + (len / 2), len / 2);
-        }
+    if(sfx_upload(effect, layout, len, rd, src) < 0) {
+        sfx_free(effect);
+        return NULL;
+    }
 
-        spu_memload_sq(effect->locl, wav_data, len / 2);
-        spu_memload_sq(effect->locr, right_buf, len / 2);
+    return effect;
+}
 
-        if(ownmem)
-            free(right_buf);
-    }
-    else if(channels == 2 && fmt == WAVE_FMT_YAMAHA_ADPCM) {
-        /* Stereo Yamaha ADPCM (channels are interleaved) */
-        uint32_t *left_buf = (uint32_t *)aligned_alloc(32, len / 2), *right_buf;
+/* Create a sound effect from raw data, with the channels one after another. */
+static snd_effect_t *create_raw_snd_effect(size_t len, uint32_t rate,
+                                           uint16_t bitsize, uint16_t channels,
+                                           sfx_read_t rd, void *src) {
+    snd_effect_t *effect;
+    uint32_t fmt;
 
-        if(left_buf == NULL)
-            goto err_occurred;
+    switch(bitsize) {
+        case 4:
+            fmt = AICA_SM_ADPCM;
+            break;
+        case 8:
+            fmt = AICA_SM_8BIT;
+            break;
+        case 16:
+            fmt = AICA_SM_16BIT;
+            break;
+        default:
+            return NULL;
+    }
 
-        right_buf = (uint32_t *)aligned_alloc(32, len / 2);
+    if(channels != 1 && channels != 2)
+        return NULL;
 
-        if(right_buf == NULL) {
-            free(left_buf);
-            goto err_occurred;
-        }
+    effect = sfx_alloc(len, rate, fmt, channels);
 
-        snd_adpcm_split((uint32_t *)wav_data, left_buf, right_buf, len);
-        spu_memload_sq(effect->locl, left_buf, len / 2);
-        spu_memload_sq(effect->locr, right_buf, len / 2);
+    if(!effect)
+        return NULL;
 
-        free(left_buf);
-        free(right_buf);
+    if(effect->len > 65534) {
+        dbglog(DBG_WARNING, "snd_sfx: PCM data is over 65534 samples\n");
     }
-    else {
-err_occurred:
-        if(effect->locl)
-            snd_mem_free(effect->locl);
-        if(effect->locr)
-            snd_mem_free(effect->locr);
-        free(effect);
-        effect = SFXHND_INVALID;
+
+    if(sfx_upload(effect, channels > 1 ? SFX_LAYOUT_PLANAR : SFX_LAYOUT_MONO,
+                  len, rd, src) < 0) {
+        sfx_free(effect);
+        return NULL;
     }
 
     return effect;
@@ -391,8 +508,6 @@ sfxhnd_t snd_sfx_load(const char *fn) {
     file_t fd;
     wavhdr_t wavhdr;
     snd_effect_t *effect;
-    uint8_t *wav_data;
-    uint32_t sample_count;
 
     /* Open the sound effect file */
     fd = fs_open(fn, O_RDONLY);
@@ -407,176 +522,102 @@ sfxhnd_t snd_sfx_load(const char *fn) {
         dbglog(DBG_ERROR, "snd_sfx_load: can't read wav header %s\n", fn);
         return SFXHND_INVALID;
     }
-    /*
-    dbglog(DBG_DEBUG, "WAVE file is %s, %luHZ, %d bits/sample, "
-        "%u bytes total, format %d\n", 
-           wavhdr.fmt.channels == 1 ? "mono" : "stereo", 
-           wavhdr.fmt.sample_rate, 
-           wavhdr.fmt.sample_size, 
-           wavhdr.chunk.size, 
-           wavhdr.fmt.format);
-    */
-    sample_count = wavhdr.fmt.sample_size >= 8 
-        ? wavhdr.chunk.size / ((wavhdr.fmt.sample_size / 8) * wavhdr.fmt.channels) 
-        : (wavhdr.chunk.size * 2) / wavhdr.fmt.channels;
 
-    if(sample_count > 65534) {
-        dbglog(DBG_WARNING, "snd_sfx_load: WAVE file is over 65534 samples\n");
-    }
-
-    /* Read WAV data */
-    wav_data = read_wav_data(fd, &wavhdr);
+    /* Create the sound effect, streaming the data straight into SPU RAM */
+    effect = create_snd_effect(&wavhdr, sfx_read_fd, &fd);
     fs_close(fd);
-    if(!wav_data)
-        return SFXHND_INVALID;
 
-    /* Create and initialize sound effect */
-    effect = create_snd_effect(&wavhdr, wav_data);
-    if(!effect) {
-        free(wav_data);
+    if(!effect)
         return SFXHND_INVALID;
-    }
 
     /* Finish up and return the sound effect handle */
-    free(wav_data);
     LIST_INSERT_HEAD(&snd_effects, effect, list);
 
     return (sfxhnd_t)effect;
 }
 
-sfxhnd_t snd_sfx_load_ex(const char *fn, uint32_t rate, uint16_t bitsize, uint16_t channels) {
-    sfxhnd_t effect;
-    file_t fd = fs_open(fn, O_RDONLY);
+int snd_sfx_load_bank(const char *fn, sfxhnd_t *hnds, int max) {
+    file_t fd;
+    wavhdr_t wavhdr;
+    snd_effect_t *effect;
+    off_t start, total;
+    int cnt = 0;
 
+    fd = fs_open(fn, O_RDONLY);
     if(fd <= FILEHND_INVALID) {
-        dbglog(DBG_ERROR, "snd_sfx_load_ex: can't open sfx %s\n", fn);
-        return SFXHND_INVALID;
+        dbglog(DBG_ERROR, "snd_sfx_load_bank: can't open %s\n", fn);
+        return -1;
     }
-    effect = snd_sfx_load_fd(fd, fs_total(fd), rate, bitsize, channels);
-    fs_close(fd);
-    return effect;
-}
 
-sfxhnd_t snd_sfx_load_fd(file_t fd, size_t len, uint32_t rate, uint16_t bitsize, uint16_t channels) {
-    snd_effect_t *effect;
-    size_t chan_len, read_len;
-    // uint32_t fs_rootbus_dma_ready = 0;
-    // uint32_t fs_dma_len = 0;
-    uint8_t *tmp_buff = NULL;
+    total = fs_total(fd);
 
-    chan_len = len / channels;
-    effect = malloc(sizeof(snd_effect_t));
+    while(cnt < max && (start = fs_tell(fd)) + (off_t)sizeof(wavmagic_t) <= total) {
+        if(read_wav_header(fd, &wavhdr) < 0) {
+            dbglog(DBG_ERROR, "snd_sfx_load_bank: can't read wav header %d "
+                   "in %s\n", cnt, fn);
+            goto err_occurred;
+        }
 
-    if(effect == NULL) {
-        return SFXHND_INVALID;
-    }
+        effect = create_snd_effect(&wavhdr, sfx_read_fd, &fd);
 
-    memset(effect, 0, sizeof(snd_effect_t));
+        if(!effect) {
+            dbglog(DBG_ERROR, "snd_sfx_load_bank: can't load effect %d "
+                   "in %s\n", cnt, fn);
+            goto err_occurred;
+        }
 
-    effect->rate = rate;
-    effect->stereo = channels > 1;
+        LIST_INSERT_HEAD(&snd_effects, effect, list);
+        hnds[cnt++] = (sfxhnd_t)effect;
 
-    switch(bitsize) {
-        case 4:
-            effect->fmt = AICA_SM_ADPCM;
-            effect->len = (len * 2) / channels;
-            break;
-        case 8:
-            effect->fmt = AICA_SM_8BIT;
-            effect->len = len / channels;
-            break;
-        case 16:
-            effect->fmt = AICA_SM_16BIT;
-            effect->len = (len / 2) / channels;
-            break;
-        default:
-            goto err_occurred;
+        /* Skip anything after the data chunk, to get to the next file. RIFF
+           chunks are padded out to an even size. */
+        fs_seek(fd, start + 8 + ((wavhdr.magic.totalsize + 1) & ~1), SEEK_SET);
     }
 
-    if(effect->len > 65534) {
-        dbglog(DBG_WARNING, "snd_sfx_load_ex: PCM file is over 65534 samples\n");
-    }
+    fs_close(fd);
+    return cnt;
 
-    effect->locl = snd_mem_malloc(chan_len);
+err_occurred:
+    fs_close(fd);
 
-    if(!effect->locl) {
-        goto err_occurred;
-    }
-    read_len = chan_len;
-    /* Uncomment when implementation is merged.
-    if(fs_ioctl(fd, IOCTL_FS_ROOTBUS_DMA_READY, &fs_dma_len) == 0) {
-        if(chan_len >= fs_dma_len) {
-            fs_rootbus_dma_ready = 1;
-        }
-    }
-    if(fs_rootbus_dma_ready) {
-        read_len = chan_len & ~(fs_dma_len - 1);
+    while(cnt > 0)
+        snd_sfx_unload(hnds[--cnt]);
 
-        if(fs_read(fd, (void *)(effect->locl | SPU_RAM_UNCACHED_BASE), read_len) <= 0) {
-            goto err_occurred;
-        }
-        read_len = chan_len - read_len;
-    }
-    */
-    if(read_len > 0) {
-        tmp_buff = aligned_alloc(32, read_len);
+    return -1;
+}
 
-        if(fs_read(fd, tmp_buff, read_len) <= 0) {
-            goto err_occurred;
-        }
-        spu_memload_sq(effect->locl, tmp_buff, read_len);
+sfxhnd_t snd_sfx_load_ex(const char *fn, uint32_t rate, uint16_t bitsize, uint16_t channels) {
+    sfxhnd_t effect;
+    file_t fd = fs_open(fn, O_RDONLY);
+
+    if(fd <= FILEHND_INVALID) {
+        dbglog(DBG_ERROR, "snd_sfx_load_ex: can't open sfx %s\n", fn);
+        return SFXHND_INVALID;
     }
+    effect = snd_sfx_load_fd(fd, fs_total(fd), rate, bitsize, channels);
+    fs_close(fd);
+    return effect;
+}
 
-    if(channels > 1) {
-        effect->locr = snd_mem_malloc(chan_len);
+sfxhnd_t snd_sfx_load_fd(file_t fd, size_t len, uint32_t rate, uint16_t bitsize, uint16_t channels) {
+    snd_effect_t *effect;
 
-        if(!effect->locr) {
-            goto err_occurred;
-        }
-        read_len = chan_len;
-        /* Uncomment when implementation is merged.
-        if(fs_rootbus_dma_ready) {
-            read_len = chan_len & ~(fs_dma_len - 1);
+    effect = create_raw_snd_effect(len, rate, bitsize, channels, sfx_read_fd,
+                                   &fd);
 
-            if(fs_read(fd, (void *)(effect->locr | SPU_RAM_UNCACHED_BASE), chan_len) <= 0) {
-                goto err_occurred;
-            }
-            read_len = chan_len - read_len;
-        }
-        */
-        if(read_len > 0) {
-            if(fs_read(fd, tmp_buff, read_len) <= 0) {
-                goto err_occurred;
-            }
-            spu_memload_sq(effect->locr, tmp_buff, read_len);
-        }
-    }
+    if(!effect)
+        return SFXHND_INVALID;
 
-    if(tmp_buff) {
-        free(tmp_buff);
-    }
     LIST_INSERT_HEAD(&snd_effects, effect, list);
     return (sfxhnd_t)effect;
-
-err_occurred:
-    if(effect->locl)
-        snd_mem_free(effect->locl);
-    if(effect->locr)
-        snd_mem_free(effect->locr);
-    if(tmp_buff)
-        free(tmp_buff);
-
-    free(effect);
-    return SFXHND_INVALID;
 }
 
 /* Load a sound effect from a WAV file and return a handle to it */
 sfxhnd_t snd_sfx_load_buf(char *buf) {
     wavhdr_t wavhdr;
     snd_effect_t *effect;
-    uint8_t *wav_data;
-    uint32_t sample_count;
     size_t bufidx = 0;
+    uint8_t *ptr;
 
     if(!buf) {
         dbglog(DBG_ERROR, "snd_sfx_load_buf: can't read wav data from NULL");
@@ -588,38 +629,15 @@ sfxhnd_t snd_sfx_load_buf(char *buf) {
         dbglog(DBG_ERROR, "snd_sfx_load_buf: error reading wav header from buffer %08x\n", (uintptr_t)buf);
         return SFXHND_INVALID;
     }
-    /*
-    dbglog(DBG_DEBUG, "WAVE file is %s, %luHZ, %d bits/sample, "
-        "%u bytes total, format %d\n", 
-           wavhdr.fmt.channels == 1 ? "mono" : "stereo", 
-           wavhdr.fmt.sample_rate, 
-           wavhdr.fmt.sample_size, 
-           wavhdr.chunk.size, 
-           wavhdr.fmt.format);
-    */
-    sample_count = wavhdr.fmt.sample_size >= 8 ?
-        wavhdr.chunk.size / ((wavhdr.fmt.sample_size / 8) * wavhdr.fmt.channels) :
-        (wavhdr.chunk.size * 2) / wavhdr.fmt.channels;
 
-    if(sample_count > 65534) {
-        dbglog(DBG_WARNING, "snd_sfx_load: WAVE file is over 65534 samples\n");
-    }
+    /* Create and initialize sound effect. Caller manages buffer. */
+    ptr = (uint8_t *)buf + bufidx;
+    effect = create_snd_effect(&wavhdr, sfx_read_mem, &ptr);
 
-    /* Read WAV data */
-    wav_data = read_wav_data_buf(buf, &wavhdr, &bufidx);
-    /* Caller manages buffer, don't free here */
-    if(!wav_data)
+    if(!effect)
         return SFXHND_INVALID;
 
-    /* Create and initialize sound effect */
-    effect = create_snd_effect(&wavhdr, wav_data);
-    if(!effect) {
-        free(wav_data);
-        return SFXHND_INVALID;
-    }
-
     /* Finish up and return the sound effect handle */
-    free(wav_data);
     LIST_INSERT_HEAD(&snd_effects, effect, list);
 
     return (sfxhnd_t)effect;
@@ -627,131 +645,196 @@ sfxhnd_t snd_sfx_load_buf(char *buf) {
 
 sfxhnd_t snd_sfx_load_raw_buf(char *buf, size_t len, uint32_t rate, uint16_t bitsize, uint16_t channels) {
     snd_effect_t *effect;
-    size_t chan_len, read_len;
-    uint8_t *tmp_buff = NULL;
-    size_t bufidx = 0;
+    uint8_t *ptr = (uint8_t *)buf;
 
     if(!buf) {
         dbglog(DBG_ERROR, "snd_sfx_load_raw_buf: can't read PCM buffer from NULL");
         return SFXHND_INVALID;
     }
 
-    chan_len = len / channels;
-    effect = malloc(sizeof(snd_effect_t));
+    effect = create_raw_snd_effect(len, rate, bitsize, channels, sfx_read_mem,
+                                   &ptr);
 
-    if(effect == NULL) {
+    if(!effect)
         return SFXHND_INVALID;
-    }
 
-    memset(effect, 0, sizeof(snd_effect_t));
+    LIST_INSERT_HEAD(&snd_effects, effect, list);
+    return (sfxhnd_t)effect;
+}
 
-    effect->rate = rate;
-    effect->stereo = channels > 1;
+int snd_sfx_play_chn(int chn, sfxhnd_t idx, int vol, int pan) {
+    sfx_play_data_t data = {0};
+    data.chn = chn;
+    data.idx = idx;
+    data.vol = vol;
+    data.pan = pan;
+    return snd_sfx_play_ex(&data);
+}
 
-    switch(bitsize) {
-        case 4:
-            effect->fmt = AICA_SM_ADPCM;
-            effect->len = (len * 2) / channels;
-            break;
-        case 8:
-            effect->fmt = AICA_SM_8BIT;
-            effect->len = len / channels;
-            break;
-        case 16:
-            effect->fmt = AICA_SM_16BIT;
-            effect->len = (len / 2) / channels;
-            break;
-        default:
-            goto err_occurred;
-    }
+static void voice_start(int chn, uint64_t now, uint32_t dur, uint32_t len,
+                        int prio, int pair) {
+    sfx_voice_t *v = &sfx_voices[chn];
 
-    if(effect->len > 65534) {
-        dbglog(DBG_WARNING, "snd_sfx_load_raw_buf: PCM buffer is over 65534 samples\n");
-    }
+    if(!v->active && ++sfx_stats.active > sfx_stats.peak)
+        sfx_stats.peak = sfx_stats.active;
 
-    effect->locl = snd_mem_malloc(chan_len);
+    v->start = now;
+    v->dur = dur;
+    v->len = len;
+    v->prio = prio;
+    v->active = 1;
+    v->pair = pair;
+}
 
-    if(!effect->locl) {
-        goto err_occurred;
+static void voice_end(int chn) {
+    if(sfx_voices[chn].active) {
+        sfx_voices[chn].active = 0;
+        sfx_stats.active--;
     }
+}
 
-    read_len = chan_len;
-    if(read_len > 0) {
-        tmp_buff = aligned_alloc(32, read_len);
-        memcpy(tmp_buff, buf, read_len);
-        bufidx += read_len;
+/* Check whether the sound on a channel has ended. Going by the clock is cheap,
+   so that's always done. Beyond that, a channel counts as done if it is in
+   ended, a snapshot of what the AICA said at the time asked (see
+   voices_ended()), as long as the sound was already there back then. */
+static int voice_ended(int chn, uint64_t now, uint64_t ended, uint64_t asked) {
+    sfx_voice_t *v = &sfx_voices[chn];
 
-        spu_memload_sq(effect->locl, tmp_buff, read_len);
-    }
+    if(v->dur && now - v->start >= v->dur)
+        return 1;
 
-    if(channels > 1) {
-        effect->locr = snd_mem_malloc(chan_len);
+    return (ended & (1ULL << chn)) && v->start + SFX_VOICE_GRACE <= asked;
+}
 
-        if(!effect->locr) {
-            goto err_occurred;
-        }
+/* Ask the AICA which sound effects have finished early. This goes over the G2
+   bus for every channel it looks at, so it's only done when we're short on
+   channels, and never with interrupts disabled. The voices can change under
+   us while we look, so the result is only a hint for voice_ended(). */
+static uint64_t voices_ended(uint64_t now) {
+    uint64_t ended = 0, start;
+    sfx_voice_t *v;
+    int chn;
+
+    for(chn = 0; chn < 64; chn++) {
+        v = &sfx_voices[chn];
+        start = v->start;
+
+        if(!v->active || (sfx_inuse & (1ULL << chn)) || start > now ||
+           now - start < SFX_VOICE_GRACE)
+            continue;
 
-        read_len = chan_len;
-        if(read_len > 0) {
-            memcpy(tmp_buff, buf + bufidx, read_len);
-            bufidx += read_len;
-            spu_memload_sq(effect->locr, tmp_buff, read_len);
-        }
+        if(!snd_is_playing(chn) ||
+           (v->dur && snd_get_pos(chn) + 1 >= v->len))
+            ended |= 1ULL << chn;
     }
 
-    if(tmp_buff) {
-        free(tmp_buff);
-    }
+    return ended;
+}
 
-    LIST_INSERT_HEAD(&snd_effects, effect, list);
-    return (sfxhnd_t)effect;
+/* Check if a channel can be used for a new sound effect, reclaiming it if its
+   old one is done. */
+static int voice_free(int chn, uint64_t now, uint64_t ended, uint64_t asked) {
+    sfx_voice_t *v = &sfx_voices[chn];
 
-err_occurred:
-    if(effect->locl)
-        snd_mem_free(effect->locl);
-    if(effect->locr)
-        snd_mem_free(effect->locr);
-    if(tmp_buff)
-        free(tmp_buff);
+    if(sfx_inuse & (1ULL << chn))
+        return 0;
 
-    free(effect);
-    return SFXHND_INVALID;
+    if(!v->active)
+        return 1;
+
+    if(!voice_ended(chn, now, ended, asked))
+        return 0;
+
+    voice_end(chn);
+    sfx_stats.reclaimed++;
+    return 1;
 }
 
-int snd_sfx_play_chn(int chn, sfxhnd_t idx, int vol, int pan) {
-    sfx_play_data_t data = {0};
-    data.chn = chn;
-    data.idx = idx;
-    data.vol = vol;
-    data.pan = pan;
-    return snd_sfx_play_ex(&data);
+/* Find a channel (or pair of channels, for stereo) that isn't doing anything
+   to play a new sound effect on, starting after the last one used so that the
+   release of old sounds isn't cut off. Must be called with interrupts
+   disabled. */
+static int find_free_channel(int stereo, uint64_t now, uint64_t ended,
+                             uint64_t asked) {
+    int i, chn, n = stereo ? 2 : 1;
+
+    for(i = 0; i < 64; i++) {
+        chn = (sfx_nextchan + i) % 64;
+
+        if(chn + n > 64)
+            continue;
+
+        if(voice_free(chn, now, ended, asked) &&
+           (n == 1 || voice_free(chn + 1, now, ended, asked))) {
+            sfx_nextchan = (chn + n) % 64;
+            return chn;
+        }
+    }
+
+    return -1;
 }
 
-int find_free_channel(void) {
-    int chn, moved, old;
+/* Take over the channel (or pair of channels, for stereo) with the least
+   important sound on it, when nothing is free. Must be called with interrupts
+   disabled. */
+static int steal_channel(int stereo, int prio) {
+    int i, chn, n = stereo ? 2 : 1;
+    int best = -1, best_prio = 0;
+    uint64_t best_start = 0;
+    sfx_voice_t *v;
 
-    /* This isn't perfect.. but it should be good enough. */
-    old = irq_disable();
-    chn = sfx_nextchan;
-    moved = 0;
+    /* For stereo, a pair of channels is only as cheap as the more important of
+       the two. */
+    for(chn = 0; chn + n <= 64; chn++) {
+        int p = INT_MIN;
+        uint64_t st = 0;
 
-    while(sfx_inuse & (1ULL << chn)) {
-        chn = (chn + 1) % 64;
+        for(i = chn; i < chn + n; i++) {
+            if(sfx_inuse & (1ULL << i))
+                break;
 
-        if(sfx_nextchan == chn)
-            break;
+            v = &sfx_voices[i];
 
-        moved++;
-    }
+            if(!v->active)
+                continue;
 
-    irq_restore(old);
+            if(v->prio > p)
+                p = v->prio;
 
-    if(moved && chn == sfx_nextchan) {
+            if(v->start > st)
+                st = v->start;
+        }
+
+        if(i < chn + n || p > prio)
+            continue;
+
+        if(best < 0 || p < best_prio || (p == best_prio && st < best_start)) {
+            best = chn;
+            best_prio = p;
+            best_start = st;
+        }
+    }
+
+    if(best < 0)
         return -1;
+
+    /* Take the channels over. They'll be restarted with the new sound right
+       away, but the other half of any stereo sound that we'd be cutting in two
+       needs to be stopped too. */
+    for(i = best; i < best + n; i++) {
+        v = &sfx_voices[i];
+
+        if(!v->active)
+            continue;
+
+        if(v->pair && (i + v->pair < best || i + v->pair >= best + n))
+            snd_sfx_stop(i + v->pair);
+
+        voice_end(i);
     }
 
-    sfx_nextchan = (chn + 2) % 64;  /* in case of stereo */
-    return chn;
+    sfx_stats.stolen++;
+    return best;
 }
 
 int snd_sfx_play(sfxhnd_t idx, int vol, int pan) {
@@ -764,20 +847,61 @@ int snd_sfx_play(sfxhnd_t idx, int vol, int pan) {
 }
 
 int snd_sfx_play_ex(sfx_play_data_t *data) {
+    uint32_t size, freq, dur;
+    snd_effect_t *t = (snd_effect_t *)data->idx;
+    uint64_t now, asked, ended;
+    int old, rv;
+    AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
+
+    size = t->len;
+
+    if(size >= 65535) size = 65534;
+
+    freq = data->freq > 0 ? (uint32_t)data->freq : t->rate;
+
+    /* Round up, so that we don't think a sound is over before it is. */
+    dur = data->loop ? 0 : (size * 1000 + freq - 1) / freq + 1;
+
+    old = irq_disable();
+    now = timer_ms_gettime64();
+
     if(data->chn < 0) {
-        data->chn = find_free_channel();
+        data->chn = find_free_channel(t->stereo, now, 0, 0);
+
+        /* Nothing's free going by the clock alone. Ask the AICA what's still
+           playing with interrupts enabled, then try again with that before
+           cutting off another sound. */
+        if(data->chn < 0) {
+            irq_restore(old);
+            asked = timer_ms_gettime64();
+            ended = voices_ended(asked);
+
+            old = irq_disable();
+            now = timer_ms_gettime64();
+            data->chn = find_free_channel(t->stereo, now, ended, asked);
+
+            if(data->chn < 0)
+                data->chn = steal_channel(t->stereo, data->prio);
+        }
+
         if(data->chn < 0) {
+            sfx_stats.failed++;
+            irq_restore(old);
             return -1;
         }
-    }
 
-    uint32_t size;
-    snd_effect_t *t = (snd_effect_t *)data->idx;
-    AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
+        sfx_stats.plays++;
+    }
 
-    size = t->len;
+    if(t->stereo && data->chn < 63) {
+        voice_start(data->chn, now, dur, size, data->prio, 1);
+        voice_start(data->chn + 1, now, dur, size, data->prio, -1);
+    }
+    else {
+        voice_start(data->chn, now, dur, size, data->prio, 0);
+    }
 
-    if(size >= 65535) size = 65534;
+    irq_restore(old);
 
     cmd->cmd = AICA_CMD_CHAN;
     cmd->timestamp = 0;
@@ -790,31 +914,54 @@ int snd_sfx_play_ex(sfx_play_data_t *data) {
     chan->loop = data->loop;
     chan->loopstart = data->loopstart;
     chan->loopend = data->loopend ? data->loopend : size;
-    chan->freq = data->freq > 0 ? (uint32_t)data->freq : t->rate;
+    chan->freq = freq;
     chan->vol = data->vol;
 
     if(!t->stereo) {
         chan->pan = data->pan;
-        snd_sh4_to_aica(tmp, cmd->size);
+        rv = snd_sh4_to_aica(tmp, cmd->size);
     }
     else {
-        chan->pan = 0;
+        /* Send both channels together, so they start at the same time. */
+        uint32_t batch[AICA_CMDSTR_CHANNEL_SIZE * 2];
 
-        snd_sh4_to_aica_stop();
-        snd_sh4_to_aica(tmp, cmd->size);
+        chan->pan = 0;
+        memcpy(batch, tmp, sizeof(tmp));
 
         cmd->cmd_id = data->chn + 1;
         chan->base = t->locr;
         chan->pan = 255;
-        snd_sh4_to_aica(tmp, cmd->size);
-        snd_sh4_to_aica_start();
+        memcpy(batch + AICA_CMDSTR_CHANNEL_SIZE, tmp, sizeof(tmp));
+
+        rv = snd_sh4_to_aica_batch(batch, AICA_CMDSTR_CHANNEL_SIZE * 2);
+    }
+
+    /* The AICA isn't keeping up with its queue, so the sound won't play */
+    if(rv < 0) {
+        dbglog(DBG_WARNING, "snd_sfx_play_ex: AICA queue is full\n");
+
+        old = irq_disable();
+        voice_end(data->chn);
+
+        if(t->stereo && data->chn < 63)
+            voice_end(data->chn + 1);
+
+        sfx_stats.failed++;
+        irq_restore(old);
+        return -1;
     }
 
     return data->chn;
 }
 
 void snd_sfx_stop(int chn) {
+    int old;
     AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
+
+    old = irq_disable();
+    voice_end(chn);
+    irq_restore(old);
+
     cmd->cmd = AICA_CMD_CHAN;
     cmd->timestamp = 0;
     cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
@@ -829,7 +976,9 @@ void snd_sfx_stop(int chn) {
     chan->freq = 44100;
     chan->vol = 0;
     chan->pan = 0;
-    snd_sh4_to_aica(tmp, cmd->size);
+
+    if(snd_sh4_to_aica(tmp, cmd->size) < 0)
+        dbglog(DBG_WARNING, "snd_sfx_stop: AICA queue is full\n");
 }
 
 void snd_sfx_stop_all(void) {
@@ -852,10 +1001,13 @@ int snd_sfx_chn_alloc(void) {
         if(!(sfx_inuse & (1ULL << chn)))
             break;
 
-    if(chn >= 64)
+    if(chn >= 64) {
         chn = -1;
-    else
+    }
+    else {
         sfx_inuse |= 1ULL << chn;
+        voice_end(chn);
+    }
 
     irq_restore(old);
 
@@ -869,3 +1021,23 @@ void snd_sfx_chn_free(int chn) {
     sfx_inuse &= ~(1ULL << chn);
     irq_restore(old);
 }
+
+void snd_sfx_get_voice_stats(sfx_voice_stats_t *stats) {
+    int old;
+
+    old = irq_disable();
+    *stats = sfx_stats;
+    irq_restore(old);
+}
+
+void snd_sfx_reset_voice_stats(void) {
+    int old;
+
+    old = irq_disable();
+    sfx_stats.plays = 0;
+    sfx_stats.reclaimed = 0;
+    sfx_stats.stolen = 0;
+    sfx_stats.failed = 0;
+    sfx_stats.peak = sfx_stats.active;
+    irq_restore(old);
+}
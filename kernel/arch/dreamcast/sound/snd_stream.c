@@ -19,6 +19,8 @@
 
 #include <kos/dbglog.h>
 #include <kos/mutex.h>
+#include <kos/sem.h>
+#include <kos/thread.h>
 #include <arch/cache.h>
 #include <arch/timer.h>
 #include <dc/g2bus.h>
@@ -42,6 +44,11 @@ routine for more sound data and load it up. That's about it.
 This version is capable of playing back N streams at once, with the limit
 being available CPU time and channels.
 
+Optionally, a servicing thread can take care of the polling instead of the
+user. The AICA doesn't tell us when a channel crosses a given position, so the
+thread just wakes up on a timer, tuned so that it looks at each stream at least
+twice in the time it takes to play out the stream's low watermark.
+
 */
 
 typedef struct filter {
@@ -100,6 +107,29 @@ typedef struct strchan {
     uint32_t dma_length;
     uintptr_t dma_dest;
     kthread_t *mutex_thd;
+
+    /* Refill once this many bytes (per channel) or fewer are left to play.
+       Zero means half of the buffer. */
+    size_t low_watermark;
+
+    /* Has the stream been started (and not stopped since)? */
+    volatile int playing;
+
+    /* When we last filled the buffer, and how long (in microseconds) what was
+       queued up at that point would last. Used to spot underruns. */
+    uint64_t fill_time;
+    uint32_t queued_us;
+
+    /* Has the callback come up empty since the last fill that got data? Keeps
+       one dry spell from being counted as an underrun over and over. */
+    int starved;
+
+    /* Worst result the servicing thread has had polling this stream since the
+       last call to snd_stream_poll(). */
+    int thd_result;
+
+    /* Statistics */
+    snd_stream_stats_t stats;
 } strchan_t;
 
 /* Our stream structs */
@@ -113,6 +143,18 @@ static mutex_t stream_mutex = MUTEX_INITIALIZER;
 static int max_channels = 0;
 static size_t max_buffer_size = 0;
 
+/* Servicing thread. The poll mutex is held while a stream is being serviced,
+   so that it can't be stopped or destroyed out from under the thread. It's
+   recursive so that the callbacks can still stop their own stream. */
+static kthread_t *stream_thd = NULL;
+static volatile int stream_thd_run = 0;
+static semaphore_t stream_thd_sem = SEM_INITIALIZER(0);
+static mutex_t poll_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+/* Bounds on how long the servicing thread sleeps between polls, in ms. */
+#define STREAM_THD_MIN_SLEEP    1
+#define STREAM_THD_MAX_SLEEP    100
+
 /* Check an incoming handle */
 #define CHECK_HND(x) do { \
         assert( (x) >= 0 && (x) < SND_STREAM_MAX ); \
@@ -145,6 +187,14 @@ static inline size_t bytes_to_samples(snd_stream_hnd_t hnd, size_t bytes) {
     }
 }
 
+/* How many bytes per channel can be left before we refill the buffer. */
+static inline size_t stream_watermark(const strchan_t *stream) {
+    if(!stream->low_watermark || stream->low_watermark >= stream->buffer_size)
+        return stream->buffer_size / 2;
+
+    return stream->low_watermark;
+}
+
 /* Set "get data" callback */
 void snd_stream_set_callback(snd_stream_hnd_t hnd, snd_stream_callback_t cb) {
     CHECK_HND(hnd);
@@ -393,6 +443,9 @@ snd_stream_hnd_t snd_stream_alloc(snd_stream_callback_t cb, int bufsize) {
     /* Default this for now */
     streams[hnd].buffer_size = bufsize;
 
+    /* Not known until it's started */
+    streams[hnd].bitsize = 0;
+
     /* Start off with queueing disabled */
     streams[hnd].queueing = 0;
 
@@ -440,6 +493,7 @@ void snd_stream_destroy(snd_stream_hnd_t hnd) {
         return;
     }
 
+    mutex_lock(&poll_mutex);
     mutex_lock(&stream_mutex);
     snd_stream_stop(hnd);
     snd_sfx_chn_free(streams[hnd].ch[0]);
@@ -463,6 +517,7 @@ void snd_stream_destroy(snd_stream_hnd_t hnd) {
     memset(streams + hnd, 0, sizeof(streams[0]));
 
     mutex_unlock(&stream_mutex);
+    mutex_unlock(&poll_mutex);
 }
 
 /* Shut everything down and free mem */
@@ -470,6 +525,8 @@ void snd_stream_shutdown(void) {
     /* Stop and destroy all active stream */
     int i;
 
+    snd_stream_thread_stop();
+
     for(i = 0; i < SND_STREAM_MAX; i++) {
         if(streams[i].initted)
             snd_stream_destroy(i);
@@ -500,6 +557,7 @@ void snd_stream_queue_disable(snd_stream_hnd_t hnd) {
 /* Start streaming (or if queueing is enabled, just get ready) */
 static void snd_stream_start_type(snd_stream_hnd_t hnd, uint32_t type, uint32_t freq, int st) {
     AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
+    int rv;
 
     CHECK_HND(hnd);
 
@@ -538,12 +596,20 @@ static void snd_stream_start_type(snd_stream_hnd_t hnd, uint32_t type, uint32_t
         }
     }
 
+    mutex_lock(&poll_mutex);
+
     /* As long as there's a way to get/request data, prefill buffers */
     snd_stream_fill(hnd, 0, streams[hnd].buffer_size / 2);
     snd_stream_fill(hnd, streams[hnd].buffer_size / 2, streams[hnd].buffer_size / 2);
 
     /* Start playing from the beginning */
     streams[hnd].last_write_pos = 0;
+    streams[hnd].fill_time = 0;
+    streams[hnd].starved = 0;
+    streams[hnd].thd_result = 0;
+    streams[hnd].playing = 1;
+
+    mutex_unlock(&poll_mutex);
 
     /* Make sure these are sync'd (and/or delayed) */
     snd_sh4_to_aica_stop();
@@ -563,14 +629,14 @@ static void snd_stream_start_type(snd_stream_hnd_t hnd, uint32_t type, uint32_t
     chan->freq = freq;
     chan->vol = 255;
     chan->pan = streams[hnd].channels == 2 ? 0 : 128;
-    snd_sh4_to_aica(tmp, cmd->size);
+    rv = snd_sh4_to_aica(tmp, cmd->size);
 
     if(streams[hnd].channels == 2) {
         /* Channel 1 */
         cmd->cmd_id = streams[hnd].ch[1];
         chan->base = streams[hnd].spu_ram_sch[1];
         chan->pan = 255;
-        snd_sh4_to_aica(tmp, cmd->size);
+        rv |= snd_sh4_to_aica(tmp, cmd->size);
 
         /* Start both channels simultaneously */
         cmd->cmd_id = (1ULL << streams[hnd].ch[0]) |
@@ -582,11 +648,19 @@ static void snd_stream_start_type(snd_stream_hnd_t hnd, uint32_t type, uint32_t
     }
 
     chan->cmd = AICA_CH_CMD_START | AICA_CH_START_SYNC;
-    snd_sh4_to_aica(tmp, cmd->size);
+    rv |= snd_sh4_to_aica(tmp, cmd->size);
+
+    /* Processing is held off above, so waiting for room wouldn't help */
+    if(rv < 0)
+        dbglog(DBG_WARNING, "snd_stream_start_type: AICA queue is full\n");
 
     /* Process the changes */
     if(!streams[hnd].queueing)
         snd_sh4_to_aica_start();
+
+    /* Let the servicing thread know there's something new to look after. */
+    if(stream_thd)
+        sem_signal(&stream_thd_sem);
 }
 
 void snd_stream_start(snd_stream_hnd_t hnd, uint32_t freq, int st) {
@@ -608,6 +682,36 @@ void snd_stream_queue_go(snd_stream_hnd_t hnd) {
     snd_sh4_to_aica_start();
 }
 
+/* Send a channel command for the first channel of a stream. For stereo
+   streams, it's sent for the second channel too (with the given panning), and
+   both go to the AICA in a single batch so they take effect together. */
+static void send_chan_cmd(snd_stream_hnd_t hnd, void *pkt, int right_pan) {
+    uint32_t batch[AICA_CMDSTR_CHANNEL_SIZE * 2];
+    aica_cmd_t *cmd;
+    aica_channel_t *chan;
+    int rv;
+
+    if(streams[hnd].channels != 2) {
+        rv = snd_sh4_to_aica(pkt, AICA_CMDSTR_CHANNEL_SIZE);
+    }
+    else {
+        memcpy(batch, pkt, AICA_CMDSTR_CHANNEL_SIZE * 4);
+        memcpy(batch + AICA_CMDSTR_CHANNEL_SIZE, pkt,
+               AICA_CMDSTR_CHANNEL_SIZE * 4);
+
+        cmd = (aica_cmd_t *)(batch + AICA_CMDSTR_CHANNEL_SIZE);
+        chan = (aica_channel_t *)cmd->cmd_data;
+        cmd->cmd_id = streams[hnd].ch[1];
+        chan->pan = right_pan;
+
+        rv = snd_sh4_to_aica_batch(batch, AICA_CMDSTR_CHANNEL_SIZE * 2);
+    }
+
+    if(rv < 0)
+        dbglog(DBG_WARNING, "snd_stream: AICA queue is full, channel "
+               "command dropped\n");
+}
+
 /* Stop streaming */
 void snd_stream_stop(snd_stream_hnd_t hnd) {
     AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
@@ -618,9 +722,9 @@ void snd_stream_stop(snd_stream_hnd_t hnd) {
         return;
     }
 
-    if(streams[hnd].channels == 2) {
-        snd_sh4_to_aica_stop();
-    }
+    mutex_lock(&poll_mutex);
+    streams[hnd].playing = 0;
+    mutex_unlock(&poll_mutex);
 
     /* Stop stream */
     /* Channel 0 */
@@ -629,14 +733,7 @@ void snd_stream_stop(snd_stream_hnd_t hnd) {
     cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
     cmd->cmd_id = streams[hnd].ch[0];
     chan->cmd = AICA_CH_CMD_STOP;
-    snd_sh4_to_aica(tmp, cmd->size);
-
-    if(streams[hnd].channels == 2) {
-        /* Channel 1 */
-        cmd->cmd_id = streams[hnd].ch[1];
-        snd_sh4_to_aica(tmp, cmd->size);
-        snd_sh4_to_aica_start();
-    }
+    send_chan_cmd(hnd, tmp, 0);
 }
 
 /* The DMA will chain to this to start the second DMA. */
@@ -786,29 +883,50 @@ static size_t snd_stream_fill(snd_stream_hnd_t hnd, uint32_t offset, size_t size
     return got_bytes;
 }
 
+/* Sort how long a fill took into the histogram. */
+static void stream_count_fill(strchan_t *stream, uint32_t us) {
+    int i;
+
+    for(i = 0; i < SND_STREAM_FILL_HIST_SIZE - 1; ++i) {
+        if(us < (SND_STREAM_FILL_HIST_BASE << i))
+            break;
+    }
+
+    ++stream->stats.fill_hist[i];
+    ++stream->stats.fills;
+
+    if(us > stream->stats.max_fill_us)
+        stream->stats.max_fill_us = us;
+}
+
 /* Poll streamer to load more data if necessary */
-int snd_stream_poll(snd_stream_hnd_t hnd) {
+static int stream_poll(snd_stream_hnd_t hnd) {
     uint32_t write_pos;
-    uint16_t current_play_pos;
+    uint16_t current_play_pos, play_pos;
     int needed_samples = 0;
     size_t needed_bytes = 0;
     int got_bytes = 0;
+    uint32_t total_samples;
+    uint64_t now, done;
     strchan_t *stream;
 
-    assert(hnd >= 0 && hnd < SND_STREAM_MAX);
     stream = &streams[hnd];
 
-    if(!stream->initted || (!stream->get_data && !stream->req_data)) {
-        return -1;
-    }
-
     /* The stream has been initted but not started, so we don't know stereo/mono. */
     assert(stream->channels != 0);
 
     /* Get channels position */
-    current_play_pos = g2_read_32(SPU_RAM_UNCACHED_BASE +
+    play_pos = current_play_pos = g2_read_32(SPU_RAM_UNCACHED_BASE +
                         AICA_CHANNEL(stream->ch[0]) +
                         offsetof(aica_channel_t, pos)) & 0xffff;
+    now = timer_us_gettime64();
+
+    /* If everything we had queued at the last fill should have been played
+       by now, we've run dry at some point in between. */
+    if(stream->fill_time && now - stream->fill_time > stream->queued_us) {
+        ++stream->stats.underruns;
+        stream->fill_time = 0;
+    }
 
     needed_bytes = samples_to_bytes(hnd, current_play_pos);
 
@@ -829,8 +947,9 @@ int snd_stream_poll(snd_stream_hnd_t hnd) {
         /* Round it to max sector size of supported storage devices */
         needed_samples &= ~(bytes_to_samples(hnd, 2048 / stream->channels) - 1);
         needed_bytes = samples_to_bytes(hnd, needed_samples);
-        /* Reduce data requests */
-        if(needed_bytes < (stream->buffer_size / 2)) {
+        /* Reduce data requests, by waiting until we're down to the low
+           watermark. */
+        if(needed_bytes < stream->buffer_size - stream_watermark(stream)) {
             return 0;
         }
     }
@@ -855,45 +974,196 @@ int snd_stream_poll(snd_stream_hnd_t hnd) {
     write_pos = samples_to_bytes(hnd, stream->last_write_pos);
     got_bytes = snd_stream_fill(hnd, write_pos, needed_bytes);
 
+    done = timer_us_gettime64();
+    stream_count_fill(stream, (uint32_t)(done - now));
+
     if(got_bytes == 0) {
+        /* Nothing new was queued, so the buffer will run dry. Count it now,
+           and not again when it actually does. */
+        if(!stream->starved) {
+            ++stream->stats.underruns;
+            stream->starved = 1;
+            stream->fill_time = 0;
+        }
+
         return -3;
     }
 
+    stream->starved = 0;
+
     needed_samples = bytes_to_samples(hnd, got_bytes / stream->channels);
 
     stream->last_write_pos += needed_samples;
-    write_pos = (uint32_t)bytes_to_samples(hnd, stream->buffer_size);
+    total_samples = (uint32_t)bytes_to_samples(hnd, stream->buffer_size);
 
-    if(stream->last_write_pos >= write_pos) {
-        stream->last_write_pos -= write_pos;
+    if(stream->last_write_pos >= total_samples) {
+        stream->last_write_pos -= total_samples;
     }
 
+    /* Figure out how long what's queued up now will last. */
+    needed_samples = stream->last_write_pos - play_pos;
+
+    if(needed_samples < 0)
+        needed_samples += total_samples;
+
+    stream->queued_us = (uint32_t)((uint64_t)needed_samples * 1000000 /
+                                   stream->frequency);
+    stream->fill_time = now;
+
     return 0;
 }
 
+int snd_stream_poll(snd_stream_hnd_t hnd) {
+    strchan_t *stream;
+    int rv;
+
+    assert(hnd >= 0 && hnd < SND_STREAM_MAX);
+    stream = &streams[hnd];
+
+    if(!stream->initted || (!stream->get_data && !stream->req_data)) {
+        return -1;
+    }
+
+    /* The servicing thread takes care of everything if it's running, so just
+       pass on anything that went wrong when it polled the stream. */
+    if(stream_thd) {
+        mutex_lock(&poll_mutex);
+        rv = stream->thd_result;
+        stream->thd_result = 0;
+        mutex_unlock(&poll_mutex);
+        return rv;
+    }
+
+    return stream_poll(hnd);
+}
+
+/* Servicing thread. Poll every playing stream, then sleep for as long as we
+   can get away with. */
+static void *stream_thd_func(void *arg) {
+    int i, rv, sleep_ms, playing;
+    uint32_t ms;
+    strchan_t *stream;
+
+    (void)arg;
+
+    while(stream_thd_run) {
+        sleep_ms = STREAM_THD_MAX_SLEEP;
+        playing = 0;
+
+        for(i = 0; i < SND_STREAM_MAX; ++i) {
+            stream = &streams[i];
+
+            mutex_lock(&poll_mutex);
+
+            if(stream->initted && stream->playing &&
+                    (stream->get_data || stream->req_data)) {
+                if((rv = stream_poll(i)) < stream->thd_result)
+                    stream->thd_result = rv;
+
+                /* Wake up at least twice per watermark's worth of audio. */
+                ms = bytes_to_samples(i, stream_watermark(stream)) * 500 /
+                     stream->frequency;
+
+                if(ms < (uint32_t)sleep_ms)
+                    sleep_ms = ms;
+
+                playing = 1;
+            }
+
+            mutex_unlock(&poll_mutex);
+        }
+
+        /* If nothing is playing, sleep until something gets started. A
+           timeout of 0 would also wait forever, so a watermark of under a
+           millisecond still has to give some sleep. */
+        if(!playing)
+            sleep_ms = 0;
+        else if(sleep_ms < STREAM_THD_MIN_SLEEP)
+            sleep_ms = STREAM_THD_MIN_SLEEP;
+
+        sem_wait_timed(&stream_thd_sem, sleep_ms);
+    }
+
+    return NULL;
+}
+
+int snd_stream_thread_start(prio_t prio) {
+    const kthread_attr_t attr = {
+        .prio = prio,
+        .label = "snd_stream"
+    };
+
+    if(stream_thd)
+        return 0;
+
+    stream_thd_run = 1;
+
+    if(!(stream_thd = thd_create_ex(&attr, stream_thd_func, NULL))) {
+        dbglog(DBG_ERROR, "snd_stream_thread_start: can't create thread\n");
+        stream_thd_run = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void snd_stream_thread_stop(void) {
+    if(!stream_thd)
+        return;
+
+    stream_thd_run = 0;
+    sem_signal(&stream_thd_sem);
+    thd_join(stream_thd, NULL);
+    stream_thd = NULL;
+
+    /* Don't leave any stray wakeups around for next time. */
+    while(!sem_trywait(&stream_thd_sem))
+        ;
+}
+
+int snd_stream_set_low_watermark(snd_stream_hnd_t hnd, size_t bytes) {
+    CHECK_HND(hnd);
+
+    if(bytes >= streams[hnd].buffer_size)
+        return -1;
+
+    streams[hnd].low_watermark = bytes;
+
+    /* The thread may need to wake up sooner now. */
+    if(stream_thd)
+        sem_signal(&stream_thd_sem);
+
+    return 0;
+}
+
+int snd_stream_get_bitsize(snd_stream_hnd_t hnd) {
+    CHECK_HND(hnd);
+    return streams[hnd].bitsize;
+}
+
+void snd_stream_get_stats(snd_stream_hnd_t hnd, snd_stream_stats_t *stats) {
+    CHECK_HND(hnd);
+    *stats = streams[hnd].stats;
+}
+
+void snd_stream_reset_stats(snd_stream_hnd_t hnd) {
+    CHECK_HND(hnd);
+    memset(&streams[hnd].stats, 0, sizeof(snd_stream_stats_t));
+}
+
 /* Set the volume on the streaming channels */
 void snd_stream_volume(snd_stream_hnd_t hnd, int vol) {
     AICA_CMDSTR_CHANNEL(tmp, cmd, chan);
 
     CHECK_HND(hnd);
 
-    if(streams[hnd].channels == 2) {
-        snd_sh4_to_aica_stop();
-    }
-
     cmd->cmd = AICA_CMD_CHAN;
     cmd->timestamp = 0;
     cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
     cmd->cmd_id = streams[hnd].ch[0];
     chan->cmd = AICA_CH_CMD_UPDATE | AICA_CH_UPDATE_SET_VOL;
     chan->vol = vol;
-    snd_sh4_to_aica(tmp, cmd->size);
-
-    if(streams[hnd].channels == 2) {
-        cmd->cmd_id = streams[hnd].ch[1];
-        snd_sh4_to_aica(tmp, cmd->size);
-        snd_sh4_to_aica_start();
-    }
+    send_chan_cmd(hnd, tmp, 0);
 }
 
 /* Set the panning on the streaming channels */
@@ -902,22 +1172,11 @@ void snd_stream_pan(snd_stream_hnd_t hnd, int left_pan, int right_pan) {
 
     CHECK_HND(hnd);
 
-    if(streams[hnd].channels == 2) {
-        snd_sh4_to_aica_stop();
-    }
-
     cmd->cmd = AICA_CMD_CHAN;
     cmd->timestamp = 0;
     cmd->size = AICA_CMDSTR_CHANNEL_SIZE;
     cmd->cmd_id = streams[hnd].ch[0];
     chan->cmd = AICA_CH_CMD_UPDATE | AICA_CH_UPDATE_SET_PAN;
     chan->pan = left_pan;
-    snd_sh4_to_aica(tmp, cmd->size);
-
-    if(streams[hnd].channels == 2) {
-        cmd->cmd_id = streams[hnd].ch[1];
-        chan->pan = right_pan;
-        snd_sh4_to_aica(tmp, cmd->size);
-        snd_sh4_to_aica_start();
-    }
+    send_chan_cmd(hnd, tmp, right_pan);
 }
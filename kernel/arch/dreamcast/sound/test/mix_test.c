@@ -0,0 +1,213 @@
+/* KallistiOS ##version##
+
+   mix_test.c
+
+   Checks the software mixer's kernels against plain reference loops, and the
+   ADPCM decoder against the one in libkosutils, then times the mixing loops
+   against the references.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <kos/adpcm.h>
+
+#include "snd_mix.h"
+
+#define MAX_FRAMES      4096
+
+static int failures;
+
+static void check(int ok, const char *what, int a, int b) {
+    if(!ok) {
+        printf("FAIL: %s (%d, %d)\n", what, a, b);
+        failures++;
+    }
+}
+
+/* One frame at a time, with no special cases */
+static void ref_mix_s16(int32_t *acc, const int16_t *src, int channels,
+                        uint32_t *pos, uint32_t step, int frames,
+                        int lgain, int rgain) {
+    const int16_t *s;
+    int32_t frac, a, b;
+    int i;
+
+    for(i = 0; i < frames; i++, *pos += step) {
+        s = src + (*pos >> SND_MIX_FRAC_BITS) * channels;
+        frac = (*pos & (SND_MIX_ONE - 1)) >> 1;
+        a = s[0] + (((s[channels] - s[0]) * frac) >> 15);
+        b = channels == 2 ? s[1] + (((s[3] - s[1]) * frac) >> 15) : a;
+        acc[i * 2] += a * lgain;
+        acc[i * 2 + 1] += b * rgain;
+    }
+}
+
+static void ref_store(int16_t *out, const int32_t *acc, int samples) {
+    int32_t v;
+    int i;
+
+    for(i = 0; i < samples; i++) {
+        v = acc[i] >> SND_MIX_GAIN_BITS;
+        out[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+    }
+}
+
+static int16_t *random_pcm(int samples) {
+    int16_t *p = malloc(samples * sizeof(int16_t));
+    int i;
+
+    for(i = 0; i < samples; i++)
+        p[i] = rand() - RAND_MAX / 2;
+
+    return p;
+}
+
+static void test_mix(void) {
+    static const uint32_t steps[] = {
+        SND_MIX_ONE, SND_MIX_ONE / 2, SND_MIX_ONE * 2, 89789, 1, 8 * SND_MIX_ONE
+    };
+    int16_t *src = random_pcm(MAX_FRAMES * 2 * 9);
+    int32_t acc[MAX_FRAMES * 2], ref[MAX_FRAMES * 2];
+    uint32_t pos, rpos, start;
+    int ch, s, frames, lg, rg, i;
+
+    for(ch = 1; ch <= 2; ch++) {
+        for(s = 0; s < (int)(sizeof(steps) / sizeof(steps[0])); s++) {
+            for(frames = 1; frames < MAX_FRAMES; frames += frames / 3 + 1) {
+                for(i = 0; i < frames * 2; i++)
+                    acc[i] = ref[i] = rand() - RAND_MAX / 2;
+
+                start = (rand() & 1) ? (rand() % 64) << SND_MIX_FRAC_BITS :
+                        rand() % (64 << SND_MIX_FRAC_BITS);
+                lg = rand() % 257;
+                rg = rand() % 257;
+                pos = rpos = start;
+
+                snd_mix_s16(acc, src, ch, &pos, steps[s], frames, lg, rg);
+                ref_mix_s16(ref, src, ch, &rpos, steps[s], frames, lg, rg);
+
+                check(pos == rpos, "snd_mix_s16 position", ch, frames);
+                check(!memcmp(acc, ref, frames * 2 * sizeof(int32_t)),
+                      "snd_mix_s16", ch, frames);
+            }
+        }
+    }
+
+    free(src);
+}
+
+static void test_convert(void) {
+    int8_t in8[MAX_FRAMES];
+    int16_t *in16 = random_pcm(MAX_FRAMES), out[MAX_FRAMES], rout[MAX_FRAMES];
+    int32_t acc[MAX_FRAMES];
+    int n, i;
+
+    for(i = 0; i < MAX_FRAMES; i++)
+        in8[i] = rand();
+
+    for(n = 0; n < 40; n++) {
+        snd_mix_s8_to_s16(out, in8, n);
+
+        for(i = 0; i < n; i++)
+            check(out[i] == in8[i] * 256, "snd_mix_s8_to_s16", n, i);
+
+        snd_mix_load(acc, in16, n);
+
+        for(i = 0; i < n; i++)
+            check(acc[i] == in16[i] * (1 << SND_MIX_GAIN_BITS), "snd_mix_load",
+                  n, i);
+    }
+
+    /* Loud enough to saturate often */
+    for(i = 0; i < MAX_FRAMES; i++)
+        acc[i] = (rand() - RAND_MAX / 2) * 4;
+
+    snd_mix_store(out, acc, MAX_FRAMES);
+    ref_store(rout, acc, MAX_FRAMES);
+    check(!memcmp(out, rout, sizeof(out)), "snd_mix_store", 0, 0);
+    free(in16);
+}
+
+static void test_adpcm(void) {
+    uint8_t in[MAX_FRAMES], lo[MAX_FRAMES], hi[MAX_FRAMES];
+    int16_t out[MAX_FRAMES * 2], ref[MAX_FRAMES * 2];
+    snd_mix_adpcm_t st[2];
+    kos_adpcm_state_t ks[2];
+    int frames = MAX_FRAMES, i;
+
+    for(i = 0; i < MAX_FRAMES; i++)
+        in[i] = rand();
+
+    /* Mono, low nibble first, in one go and in odd sized pieces */
+    snd_mix_adpcm_reset(st);
+    snd_mix_adpcm_decode(out, in, 1001, 1, st);
+    snd_mix_adpcm_decode(out + 1001, in + 501, frames - 1002, 1, st);
+    kos_adpcm_reset(ks);
+    kos_adpcm_decode(ks, ref, in, 1001, 1);
+    kos_adpcm_decode(ks, ref + 1001, in + 501, frames - 1002, 1);
+    check(!memcmp(out, ref, (frames - 1) * 2), "adpcm mono", 0, 0);
+
+    /* Stereo, one frame per byte, left in the high nibble */
+    for(i = 0; i < frames; i++) {
+        hi[i / 2] = (i & 1) ? hi[i / 2] | (in[i] & 0xf0) : in[i] >> 4;
+        lo[i / 2] = (i & 1) ? lo[i / 2] | (in[i] << 4) : in[i] & 15;
+    }
+
+    snd_mix_adpcm_reset(st);
+    snd_mix_adpcm_reset(st + 1);
+    snd_mix_adpcm_decode(out, in, frames, 2, st);
+    kos_adpcm_reset(ks);
+    kos_adpcm_reset(ks + 1);
+    kos_adpcm_decode(ks, ref, hi, frames, 2);
+    kos_adpcm_decode(ks + 1, ref + 1, lo, frames, 2);
+    check(!memcmp(out, ref, frames * 4), "adpcm stereo", 0, 0);
+}
+
+typedef void (*mix_fn)(int32_t *, const int16_t *, int, uint32_t *, uint32_t,
+                       int, int, int);
+
+static double bench(mix_fn fn, const int16_t *src, int ch, uint32_t step) {
+    static int32_t acc[256 * 2];
+    int total = 0, i;
+    uint32_t pos;
+    clock_t start = clock();
+
+    while(total < 20000000) {
+        pos = 0;
+
+        for(i = 0; i < 16; i++)
+            fn(acc, src, ch, &pos, step, 256, 200, 100);
+
+        total += 16 * 256;
+    }
+
+    return total / ((double)(clock() - start) / CLOCKS_PER_SEC) / 1e6;
+}
+
+int main(void) {
+    int16_t *src;
+
+    srand(1);
+    src = random_pcm(65536);
+    test_mix();
+    test_convert();
+    test_adpcm();
+
+    printf("Mframes/s          kernel  reference\n");
+    printf("mono, unity      %8.1f  %8.1f\n",
+           bench(snd_mix_s16, src, 1, SND_MIX_ONE),
+           bench(ref_mix_s16, src, 1, SND_MIX_ONE));
+    printf("stereo, unity    %8.1f  %8.1f\n",
+           bench(snd_mix_s16, src, 2, SND_MIX_ONE),
+           bench(ref_mix_s16, src, 2, SND_MIX_ONE));
+    printf("stereo, 22->44k  %8.1f  %8.1f\n",
+           bench(snd_mix_s16, src, 2, SND_MIX_ONE / 2),
+           bench(ref_mix_s16, src, 2, SND_MIX_ONE / 2));
+
+    free(src);
+    printf("%s\n", failures ? "FAILED" : "All tests passed");
+    return failures ? 1 : 0;
+}
@@ -14,6 +14,11 @@ To create a romdisk image, you will need the program "genromfs". This program wa
 for Linux but ought to compile under Cygwin. The source for this utility can be found
 on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian "genromfs".
 
+Images made with the genromfs in utils/ using -c may also contain compressed
+regular files. These are split into blocks that are compressed separately, so
+that reads only need to decompress the blocks they touch. The last few blocks
+that were read are kept decompressed in a small cache shared by all files.
+
 */
 
 #include <kos/thread.h>
@@ -44,6 +49,16 @@ on sunsite.unc.edu in /pub/Linux/system/recovery/, or as a package under Debian
 #define RD_VN_MAX 16
 #define RD_FN_MAX 16
 
+/* spec_info of a compressed regular file. Its size is the uncompressed size,
+   and its data is the block size and the offset of each block (plus one for
+   the end of the last block) from the start of the data, all big-endian,
+   followed by the blocks. Each block is in the LZ4 block format, or stored as
+   it is if it didn't get any smaller. */
+#define RD_COMP_MAGIC 0x4b5a0001
+
+/* How many decompressed blocks are cached */
+#define RD_CACHE_BLOCKS 4
+
 /* Header definitions from Linux ROMFS documentation; all integer quantities are
    expressed in big-endian notation. Unfortunately the ROMFS guys were being
    clever and made this header a variable length depending on the size of
@@ -99,8 +114,11 @@ static rdi_list_t romdisks;
 typedef struct rd_fd {
     uint32_t            index;  /* romfs image index */
     bool                dir;    /* true if a directory */
+    bool                comp;   /* true if a compressed file */
     uint32_t            ptr;    /* Current read position in bytes */
     uint32_t            size;   /* Length of file in bytes */
+    uint32_t            block_size; /* Compressed files only */
+    uint8_t             *mmap;  /* Whole file decompressed by mmap() */
     dirent_t            dirent; /* A static dirent to pass back to clients */
     rd_image_t          *mnt;   /* Which mount instance are we using? */
     TAILQ_ENTRY(rd_fd)  next;   /* Next handle in the linked list */
@@ -125,6 +143,241 @@ static inline bool romdisk_fd_invalid(rd_fd_t *fd) {
 /* We use it for both the files list and the images list. */
 static mutex_t fh_mutex;
 
+/* A decompressed block. The block is identified by where its compressed data
+   is in the image. */
+typedef struct {
+    const uint8_t   *src;       /* Compressed data, NULL if unused */
+    uint8_t         *data;      /* Decompressed data */
+    uint32_t        size;       /* Space allocated for data */
+    uint32_t        used;       /* When it was last used, for LRU */
+} rd_cache_t;
+
+static rd_cache_t rd_cache[RD_CACHE_BLOCKS];
+static uint32_t rd_cache_clock;
+
+/* Protects the block cache */
+static mutex_t cache_mutex;
+
+/********************************************************************************/
+/* Compressed files */
+
+/* Decompress an LZ4 block. This is kept simple rather than unrolled, as the
+   copies are mostly done by memcpy() anyway. Returns the decompressed size, or
+   -1 if the block is corrupt. */
+static int romdisk_lz_decompress(const uint8_t *src, size_t srclen,
+                                 uint8_t *dst, size_t dstlen) {
+    const uint8_t *ip = src, *iend = src + srclen, *match;
+    uint8_t *op = dst, *oend = dst + dstlen;
+    size_t len, off;
+    unsigned int token, b;
+
+    while(ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+
+        if(len == 15) {
+            do {
+                if(ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+            return -1;
+
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence has no match */
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if(!off || off > (size_t)(op - dst))
+            return -1;
+
+        len = token & 15;
+
+        if(len == 15) {
+            do {
+                if(ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        len += 4;
+
+        if(len > (size_t)(oend - op))
+            return -1;
+
+        match = op - off;
+
+        /* Overlapping matches repeat what was just written, so they have to
+           be copied a byte at a time. */
+        if(off >= len) {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else {
+            while(len--)
+                *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+/* Uncompressed size of a block */
+static inline uint32_t romdisk_block_len(const rd_fd_t *fd, uint32_t block) {
+    uint32_t left = fd->size - block * fd->block_size;
+
+    return left < fd->block_size ? left : fd->block_size;
+}
+
+/* Where a block's compressed data is, and how big it is */
+static const uint8_t *romdisk_block_src(const rd_fd_t *fd, uint32_t block,
+                                        uint32_t *len) {
+    const uint8_t *data = fd->mnt->image + fd->index;
+    uint32_t start = ntohl_32(data + 4 + 4 * block);
+
+    *len = ntohl_32(data + 8 + 4 * block) - start;
+    return data + start;
+}
+
+/* Decompress a block into dst */
+static int romdisk_block_read(const rd_fd_t *fd, uint32_t block, uint8_t *dst) {
+    const uint8_t *src;
+    uint32_t srclen, len = romdisk_block_len(fd, block);
+
+    src = romdisk_block_src(fd, block, &srclen);
+
+    /* Blocks that didn't compress are stored as they are */
+    if(srclen == len) {
+        memcpy(dst, src, len);
+        return 0;
+    }
+
+    if(romdisk_lz_decompress(src, srclen, dst, len) != (int)len) {
+        dbglog(DBG_ERROR, "fs_romdisk: corrupt block at %p\n", (void *)src);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Find a block in the cache, decompressing it into the least recently used
+   entry if it's not there. Must be called with cache_mutex held. */
+static const uint8_t *romdisk_cache_get(const rd_fd_t *fd, uint32_t block) {
+    const uint8_t *src;
+    rd_cache_t *c, *lru = rd_cache;
+    uint32_t srclen;
+    uint8_t *data;
+    int i;
+
+    src = romdisk_block_src(fd, block, &srclen);
+
+    for(i = 0; i < RD_CACHE_BLOCKS; i++) {
+        c = &rd_cache[i];
+
+        if(c->src == src) {
+            c->used = ++rd_cache_clock;
+            return c->data;
+        }
+
+        if(!c->src || (lru->src && c->used < lru->used))
+            lru = c;
+    }
+
+    if(lru->size < fd->block_size) {
+        if(!(data = realloc(lru->data, fd->block_size))) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        lru->data = data;
+        lru->size = fd->block_size;
+    }
+
+    lru->src = NULL;
+
+    if(romdisk_block_read(fd, block, lru->data) < 0)
+        return NULL;
+
+    lru->src = src;
+    lru->used = ++rd_cache_clock;
+
+    return lru->data;
+}
+
+/* Forget the cached blocks of an image that is going away */
+static void romdisk_cache_flush(const rd_image_t *mnt) {
+    const romdisk_hdr_t *hdr = (const romdisk_hdr_t *)mnt->image;
+    const uint8_t *end = mnt->image + ntohl_32(&hdr->full_size);
+    int i;
+
+    mutex_lock_scoped(&cache_mutex);
+
+    for(i = 0; i < RD_CACHE_BLOCKS; i++) {
+        if(rd_cache[i].src >= mnt->image && rd_cache[i].src < end)
+            rd_cache[i].src = NULL;
+    }
+}
+
+/* Read from a compressed file. Whole blocks are decompressed straight into
+   buf, and the ends of the read go through the cache. */
+static ssize_t romdisk_read_comp(rd_fd_t *fd, uint8_t *buf, size_t bytes) {
+    const uint8_t *data;
+    uint32_t block, off, len;
+    size_t done, n;
+
+    for(done = 0; done < bytes; done += n) {
+        block = fd->ptr / fd->block_size;
+        off = fd->ptr % fd->block_size;
+        len = romdisk_block_len(fd, block);
+        n = len - off;
+
+        if(n > bytes - done)
+            n = bytes - done;
+
+        if(n == len) {
+            if(romdisk_block_read(fd, block, buf + done) < 0)
+                break;
+        }
+        else {
+            mutex_lock(&cache_mutex);
+
+            if(!(data = romdisk_cache_get(fd, block))) {
+                mutex_unlock(&cache_mutex);
+                break;
+            }
+
+            memcpy(buf + done, data + off, n);
+            mutex_unlock(&cache_mutex);
+        }
+
+        fd->ptr += n;
+    }
+
+    /* Report an error only if nothing could be read */
+    if(bytes && !done)
+        return -1;
+
+    return done;
+}
+
 /* Given a filename and a starting romdisk directory listing (byte offset),
    search for the entry in the directory and return the byte offset to its
    entry. */
@@ -255,6 +508,9 @@ static void * romdisk_open(vfs_handler_t *vfs, const char *fn, int mode) {
     fd->ptr = 0;
     fd->size = ntohl_32(&fhdr->size);
     fd->mnt = mnt;
+    fd->mmap = NULL;
+    fd->comp = !fd->dir && ntohl_32(&fhdr->spec_info) == RD_COMP_MAGIC;
+    fd->block_size = fd->comp ? ntohl_32(mnt->image + fd->index) : 0;
 
     /* Lock before modifying the queue. */
     mutex_lock_scoped(&fh_mutex);
@@ -271,6 +527,7 @@ static int romdisk_close(void *h) {
     /* Lock before modifying the queue. */
     mutex_lock_scoped(&fh_mutex);
     TAILQ_REMOVE(&rd_fd_queue, fd, next);
+    free(fd->mmap);
     free(fd);
 
     return 0;
@@ -290,6 +547,9 @@ static ssize_t romdisk_read(void *h, void *buf, size_t bytes) {
     if((fd->ptr + bytes) > fd->size)
         bytes = fd->size - fd->ptr;
 
+    if(fd->comp)
+        return romdisk_read_comp(fd, buf, bytes);
+
     /* Copy out the requested amount */
     memcpy(buf, fd->mnt->image + fd->index + fd->ptr, bytes);
     fd->ptr += bytes;
@@ -439,12 +699,36 @@ static int romdisk_unlink(vfs_handler_t *vfs, const char *fn) {
 
 static void *romdisk_mmap(void *h) {
     rd_fd_t *fd = (rd_fd_t *)h;
+    uint32_t block;
 
     if(romdisk_fd_invalid(fd)) {
         errno = EINVAL;
         return NULL;
     }
 
+    /* Compressed files have to be decompressed as a whole, into a buffer
+       that lasts until the file is closed. */
+    if(fd->comp) {
+        if(fd->mmap)
+            return fd->mmap;
+
+        if(!(fd->mmap = malloc(fd->size ? fd->size : 1))) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        for(block = 0; block * fd->block_size < fd->size; block++) {
+            if(romdisk_block_read(fd, block,
+                                  fd->mmap + block * fd->block_size) < 0) {
+                free(fd->mmap);
+                fd->mmap = NULL;
+                return NULL;
+            }
+        }
+
+        return fd->mmap;
+    }
+
     /* Can't really help the loss of "const" here */
     return (void *)(fd->mnt->image + fd->index);
 }
@@ -628,6 +912,7 @@ static int initted = 0;
 static void fs_romdisk_list_remove(rd_image_t *n) {
     /* Remove it from the mount list */
     LIST_REMOVE(n, list_ent);
+    romdisk_cache_flush(n);
 
     dbglog(DBG_DEBUG, "fs_romdisk: unmounting image at %p from %s\n",
            n->image, n->vfsh->nmmgr.pathname);
@@ -660,6 +945,7 @@ void fs_romdisk_init(void) {
 
     /* Init thread mutexes */
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
 
     initted = 1;
 }
@@ -668,6 +954,7 @@ void fs_romdisk_init(void) {
 void fs_romdisk_shutdown(void) {
     rd_image_t  *n, *c;
     rd_fd_t     *i, *j;
+    int         k;
 
     if(!initted)
         return;
@@ -688,8 +975,16 @@ void fs_romdisk_shutdown(void) {
         romdisk_close(i);
     }
 
+    /* Free the block cache */
+    for(k = 0; k < RD_CACHE_BLOCKS; k++) {
+        free(rd_cache[k].data);
+    }
+
+    memset(rd_cache, 0, sizeof(rd_cache));
+
     /* Free mutex */
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&cache_mutex);
 }
 
 /* Mount a romdisk image; must have called fs_romdisk_init() earlier.
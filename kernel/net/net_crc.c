@@ -7,57 +7,99 @@
 
 #include <kos/net.h>
 
-/* Calculate a CRC-32 checksum over a given block of data. Somewhat inspired by
-   the CRC32 function in Figure 14-6 of http://www.hackersdelight.org/crc.pdf */
-uint32_t __pure net_crc32le(const uint8_t *data, int size) {
-    int i;
-    uint32_t rv = 0xFFFFFFFF;
-
-    for(i = 0; i < size; ++i) {
-        rv ^= data[i];
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
+#include "net_crc_tab.h"
+
+/* Process a block of data with the reflected CRC-32 polynomial, without any
+   pre- or post-conditioning. The unaligned head and the tail are handled a
+   byte at a time, and everything in between is run through a slicing-by-4
+   loop that consumes one aligned 32-bit word per iteration. Slicing-by-8 would
+   shave off a few more cycles per word, but its 8KiB of tables is half of the
+   SH4's operand cache, so we stick with 4KiB here. */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, int size) {
+    while(size > 0 && ((uintptr_t)data & 3)) {
+        crc = crc32_tab[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        --size;
     }
 
-    return ~rv;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    {
+        const uint32_t *words = (const uint32_t *)data;
+
+        while(size >= 8) {
+            crc ^= *words++;
+            crc = crc32_tab[3][crc & 0xFF] ^ crc32_tab[2][(crc >> 8) & 0xFF] ^
+                  crc32_tab[1][(crc >> 16) & 0xFF] ^ crc32_tab[0][crc >> 24];
+            crc ^= *words++;
+            crc = crc32_tab[3][crc & 0xFF] ^ crc32_tab[2][(crc >> 8) & 0xFF] ^
+                  crc32_tab[1][(crc >> 16) & 0xFF] ^ crc32_tab[0][crc >> 24];
+            size -= 8;
+        }
+
+        if(size >= 4) {
+            crc ^= *words++;
+            crc = crc32_tab[3][crc & 0xFF] ^ crc32_tab[2][(crc >> 8) & 0xFF] ^
+                  crc32_tab[1][(crc >> 16) & 0xFF] ^ crc32_tab[0][crc >> 24];
+            size -= 4;
+        }
+
+        data = (const uint8_t *)words;
+    }
+#endif
+
+    while(size-- > 0)
+        crc = crc32_tab[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
 }
 
-/* This one isn't quite as nice as the one above for little-endian... */
-uint32_t __pure net_crc32be(const uint8_t *data, int size) {
-    int i, j;
-    uint32_t rv = 0xFFFFFFFF, b, c;
+/* Reverse the bits of a 32-bit value. */
+static inline uint32_t bitrev32(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+    return (x >> 16) | (x << 16);
+}
 
-    for(i = 0; i < size; ++i) {
-        b = data[i];
+/* Calculate a CRC-32 checksum over a given block of data. */
+uint32_t __pure net_crc32le(const uint8_t *data, int size) {
+    return ~crc32_update(0xFFFFFFFF, data, size);
+}
 
-        for(j = 0; j < 8; ++j) {
-            c = ((rv & 0x80000000) ? 1 : 0) ^(b & 1);
-            b >>= 1;
+uint32_t __pure net_crc32le_update(uint32_t crc, const uint8_t *data,
+                                   int size) {
+    return crc32_update(crc, data, size);
+}
 
-            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
-            else    rv <<= 1;
-        }
-    }
+/* The "big-endian" variant shifts the register left with the normal
+   polynomial (0x04C11DB7), but feeds each byte in least significant bit first
+   and skips the final inversion. That is exactly the reflected algorithm with
+   its register bit-reversed, so we can share the little-endian tables and
+   just flip the register on the way in and out. */
+uint32_t __pure net_crc32be(const uint8_t *data, int size) {
+    return bitrev32(crc32_update(0xFFFFFFFF, data, size));
+}
 
-    return rv;
+uint32_t __pure net_crc32be_update(uint32_t crc, const uint8_t *data,
+                                   int size) {
+    return bitrev32(crc32_update(bitrev32(crc), data, size));
 }
 
-/* Based on code found at: http://www.ccsinfo.com/forum/viewtopic.php?t=24977 */
+/* Table-driven CRC16-CCITT (polynomial 0x1021, most significant bit first). */
 uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
-    uint16_t rv = start, tmp;
+    uint16_t rv = start;
 
-    while(size--) {
-        tmp = (rv >> 8) ^ *data++;
-        tmp ^= tmp >> 4;
-
-        rv = (rv << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
+    while(size >= 4) {
+        rv = (rv << 8) ^ crc16_tab[(rv >> 8) ^ data[0]];
+        rv = (rv << 8) ^ crc16_tab[(rv >> 8) ^ data[1]];
+        rv = (rv << 8) ^ crc16_tab[(rv >> 8) ^ data[2]];
+        rv = (rv << 8) ^ crc16_tab[(rv >> 8) ^ data[3]];
+        data += 4;
+        size -= 4;
     }
 
+    while(size-- > 0)
+        rv = (rv << 8) ^ crc16_tab[(rv >> 8) ^ *data++];
+
     return rv;
 }
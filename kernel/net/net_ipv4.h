@@ -26,6 +26,13 @@ typedef struct {
 } __packed ipv4_pseudo_hdr_t;
 
 uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
+
+/* Copy bytes from src to dst, returning the same value that net_ipv4_checksum
+   would over src. Taking the complement of the return value gives the folded
+   sum, which can be passed as the start value when checksumming another block
+   of data that precedes this one at an even offset. */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
@@ -0,0 +1,234 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_ipv4_cksum.c
+
+   The IP checksum, on its own or while copying. Nothing in here depends on
+   the rest of KOS, so it can also be built and tested on the host (see
+   test/cksum_test.c).
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "net_ipv4.h"
+
+/* Fold a 32-bit one's complement accumulator down to 16 bits. */
+static inline uint32_t cksum_fold(uint32_t sum) {
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += sum >> 16;
+    return sum & 0xFFFF;
+}
+
+/* Swap the bytes of a folded sum. This is what the sum of a block of data
+   looks like when it is moved by an odd number of bytes. */
+static inline uint32_t cksum_swap(uint32_t sum) {
+    return ((sum << 8) | (sum >> 8)) & 0xFFFF;
+}
+
+/* Add one 32-bit word worth of 16-bit words into the accumulator. */
+#define CKSUM_ADD32(sum, w) (sum) += ((w) & 0xFFFF) + ((w) >> 16)
+
+/* Largest number of bytes the word loops below may add up before folding the
+   accumulator. Each 16 bytes adds at most 8 * 0xFFFF, so this leaves plenty of
+   headroom in 32 bits. */
+#define CKSUM_BLOCK     32768
+
+/* Sum a block of data that starts on a 16-bit boundary, as 16-bit words in
+   native byte order. The result is folded, but not inverted. */
+static uint32_t cksum_even(const uint8_t *data, size_t bytes, uint32_t sum) {
+    const uint32_t *ptr;
+    size_t blk;
+    uint32_t w0, w1, w2, w3;
+
+    if(((uintptr_t)data & 2) && bytes >= 2) {
+        sum += *(const uint16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
+
+    ptr = (const uint32_t *)data;
+
+    while(bytes >= 16) {
+        blk = bytes < CKSUM_BLOCK ? bytes & ~15 : CKSUM_BLOCK;
+        bytes -= blk;
+
+        for(; blk; blk -= 16) {
+            w0 = ptr[0];
+            w1 = ptr[1];
+            w2 = ptr[2];
+            w3 = ptr[3];
+            ptr += 4;
+
+            CKSUM_ADD32(sum, w0);
+            CKSUM_ADD32(sum, w1);
+            CKSUM_ADD32(sum, w2);
+            CKSUM_ADD32(sum, w3);
+        }
+
+        sum = cksum_fold(sum);
+    }
+
+    for(; bytes >= 4; bytes -= 4) {
+        w0 = *ptr++;
+        CKSUM_ADD32(sum, w0);
+    }
+
+    data = (const uint8_t *)ptr;
+
+    if(bytes >= 2) {
+        sum += *(const uint16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
+
+    /* Handle the last byte, if we have an odd byte count */
+    if(bytes)
+        sum += *data;
+
+    return cksum_fold(sum);
+}
+
+/* Same as above, but also copies the data to dst, which must have the same
+   alignment as src modulo 2. */
+static uint32_t cksum_copy_even(uint8_t *dst, const uint8_t *src,
+                                size_t bytes, uint32_t sum) {
+    size_t blk;
+    uint32_t w0, w1, w2, w3;
+
+    if(((uintptr_t)src & 2) && bytes >= 2) {
+        w0 = *(const uint16_t *)src;
+        *(uint16_t *)dst = w0;
+        sum += w0;
+        src += 2;
+        dst += 2;
+        bytes -= 2;
+    }
+
+    if(!(((uintptr_t)dst ^ (uintptr_t)src) & 2)) {
+        const uint32_t *s = (const uint32_t *)src;
+        uint32_t *d = (uint32_t *)dst;
+
+        while(bytes >= 16) {
+            blk = bytes < CKSUM_BLOCK ? bytes & ~15 : CKSUM_BLOCK;
+            bytes -= blk;
+
+            for(; blk; blk -= 16) {
+                w0 = s[0];
+                w1 = s[1];
+                w2 = s[2];
+                w3 = s[3];
+                s += 4;
+
+                d[0] = w0;
+                d[1] = w1;
+                d[2] = w2;
+                d[3] = w3;
+                d += 4;
+
+                CKSUM_ADD32(sum, w0);
+                CKSUM_ADD32(sum, w1);
+                CKSUM_ADD32(sum, w2);
+                CKSUM_ADD32(sum, w3);
+            }
+
+            sum = cksum_fold(sum);
+        }
+
+        for(; bytes >= 4; bytes -= 4) {
+            w0 = *s++;
+            *d++ = w0;
+            CKSUM_ADD32(sum, w0);
+        }
+
+        src = (const uint8_t *)s;
+        dst = (uint8_t *)d;
+    }
+    else {
+        /* Source and destination are only 16-bit aligned relative to each
+           other, so that's the widest access we can do on both sides. */
+        const uint16_t *s = (const uint16_t *)src;
+        uint16_t *d = (uint16_t *)dst;
+
+        while(bytes >= 8) {
+            blk = bytes < CKSUM_BLOCK ? bytes & ~7 : CKSUM_BLOCK;
+            bytes -= blk;
+
+            for(; blk; blk -= 8) {
+                w0 = s[0];
+                w1 = s[1];
+                w2 = s[2];
+                w3 = s[3];
+                s += 4;
+
+                d[0] = w0;
+                d[1] = w1;
+                d[2] = w2;
+                d[3] = w3;
+                d += 4;
+
+                sum += w0 + w1 + w2 + w3;
+            }
+
+            sum = cksum_fold(sum);
+        }
+
+        src = (const uint8_t *)s;
+        dst = (uint8_t *)d;
+    }
+
+    for(; bytes >= 2; bytes -= 2) {
+        w0 = *(const uint16_t *)src;
+        *(uint16_t *)dst = w0;
+        sum += w0;
+        src += 2;
+        dst += 2;
+    }
+
+    /* Handle the last byte, if we have an odd byte count */
+    if(bytes) {
+        *dst = *src;
+        sum += *src;
+    }
+
+    return cksum_fold(sum);
+}
+
+/* Perform an IP-style checksum on a block of data */
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
+    uint32_t sum;
+
+    /* Make sure we don't do any unaligned memory accesses. If we start on an
+       odd address, sum everything after the first byte and swap the result
+       around, since every byte in there is in the opposite half of its word. */
+    if(((uintptr_t)data & 0x01) && bytes) {
+        sum = cksum_swap(cksum_even(data + 1, bytes - 1, 0)) + data[0];
+    }
+    else {
+        sum = cksum_even(data, bytes, 0);
+    }
+
+    return cksum_fold(sum + start) ^ 0xFFFF;
+}
+
+/* Copy a block of data and perform an IP-style checksum on it at once */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start) {
+    uint32_t sum;
+
+    if(((uintptr_t)dst ^ (uintptr_t)src) & 0x01) {
+        /* There's no way to line up both pointers, so do it in two passes. */
+        memcpy(dst, src, bytes);
+        return net_ipv4_checksum(dst, bytes, start);
+    }
+
+    if(((uintptr_t)src & 0x01) && bytes) {
+        *dst = *src;
+        sum = cksum_copy_even(dst + 1, src + 1, bytes - 1, 0);
+        sum = cksum_swap(sum) + src[0];
+    }
+    else {
+        sum = cksum_copy_even(dst, src, bytes, 0);
+    }
+
+    return cksum_fold(sum + start) ^ 0xFFFF;
+}
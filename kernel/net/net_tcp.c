@@ -73,22 +73,42 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Incoming packets are matched using two hash tables rather than by walking the
+   whole list of sockets. Fully-created sockets (those that have gone through
+   connect() or were created by accept()) live in a table keyed on the remote
+   address and both ports, while sockets that are only bound or are listening
+   live in a table keyed on the local port alone. The connection table is always
+   searched first, so a fully-created socket will be found before the listening
+   socket it came from. New sockets are added to the head of their hash chain,
+   so the newest socket wins if more than one could match, just like it did back
+   when this was all one list. The list of all sockets is still kept around for
+   the periodic work done in the net_thd callback.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   The base protocol is RFC 793. On top of that, the window scale and timestamp
+   options from RFC 7323 and selective acknowledgements from RFC 2018 are
+   offered on every connection and used if the other side agrees to them in the
+   SYN/SYN-ACK exchange. Window scaling lets the send and receive buffers be set
+   beyond 64KiB. Timestamps give an RTT sample with every ACK and protect
+   against wrapped sequence numbers (PAWS). Segments that arrive out of order
+   are placed directly where they belong in the receive buffer and reported
+   back with SACK blocks, so a retransmission only has to fill in the holes.
+   Likewise, when we have to retransmit, anything the other side has SACKed is
+   skipped. Everything in here works just fine over IPv4 or IPv6, and can be
+   used just fine to communicate with "normal" TCP/IP implementations.
+
+   On congestion control:
+   The retransmission timeout is computed from the smoothed RTT and its variance
+   as described in RFC 6298, and it backs off exponentially for as long as the
+   same data keeps timing out. Congestion control is NewReno (RFC 5681 and RFC
+   6582): slow start and congestion avoidance, with fast retransmit and fast
+   recovery after three duplicate ACKs. When SACK is in use, fast retransmits
+   go to the first hole the other side hasn't SACKed. On the receive side, ACKs
+   are delayed until every second full segment or the next run of the net_thd
+   callback, unless TCP_NODELAY is set. We never hold back outgoing data to
+   coalesce it (that is, there is no Nagle algorithm here), so TCP_NODELAY only
+   affects ACKs. The counters behind all of this can be read with the TCP_INFO
+   socket option.
 */
 
 typedef struct tcp_hdr {
@@ -112,8 +132,20 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    uint8_t wscale;
+    uint32_t opts;
+    uint32_t ts_recent;
 };
 
+/* A range of sequence space, used for SACK blocks. */
+struct tcp_sack_blk {
+    uint32_t left;
+    uint32_t right;
+};
+
+/* Maximum number of SACK blocks we keep track of, in each direction. */
+#define TCP_MAX_SACK    4
+
 /* Send/receive variables... */
 struct sndrec {
     uint32_t una;
@@ -124,6 +156,7 @@ struct sndrec {
     uint32_t wl2;
     uint32_t iss;
     uint16_t mss;
+    uint8_t wscale;
 };
 
 struct rcvrec {
@@ -131,10 +164,13 @@ struct rcvrec {
     uint32_t wnd;
     uint32_t up;
     uint32_t irs;
+    uint8_t wscale;
 };
 
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) hash_list;
+    int hashed;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -173,6 +209,28 @@ struct tcp_sock {
             uint64_t timer;
             condvar_t send_cv;
             condvar_t recv_cv;
+            uint32_t opts;
+            uint32_t ts_recent;
+            uint32_t rtt;
+            int rcv_sack_cnt;
+            int snd_sack_cnt;
+            struct tcp_sack_blk rcv_sack[TCP_MAX_SACK];
+            struct tcp_sack_blk snd_sack[TCP_MAX_SACK];
+            uint32_t srtt;
+            uint32_t rttvar;
+            uint32_t rto;
+            uint32_t rtt_seq;
+            uint64_t rtt_time;
+            int rtt_timing;
+            uint32_t cwnd;
+            uint32_t ssthresh;
+            uint32_t recover;
+            int in_recovery;
+            int dupacks;
+            int backoff;
+            uint32_t retransmits;
+            int ack_pending;
+            uint64_t ack_timer;
         } data;
     };
 };
@@ -183,6 +241,15 @@ static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 static int thd_cb_id = 0;
 
+/* Hash tables used to find the socket for an incoming packet. These are
+   protected by tcp_sem, just like the list above. Sizes must be powers of two.
+   See the notes at the top of the file for more information. */
+#define TCP_CONN_HASH_SIZE  64
+#define TCP_PORT_HASH_SIZE  32
+
+static struct tcp_sock_list tcp_conn_hash[TCP_CONN_HASH_SIZE];
+static struct tcp_sock_list tcp_port_hash[TCP_PORT_HASH_SIZE];
+
 /* Default starting window size for connections. This should be big enough as a
    starting point, in general. If you need to adjust it, you can do so... */
 #define TCP_DEFAULT_WINDOW  8192
@@ -190,12 +257,40 @@ static int thd_cb_id = 0;
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
+/* Largest send or receive buffer that can be set with SO_SNDBUF/SO_RCVBUF.
+   Anything over 65535 bytes relies on window scaling. */
+#define TCP_MAX_BUFFER      (1024 * 1024)
+
+/* Modes for tcp_send_data() */
+#define TCP_SEND_NEW        0   /* Send new data, as the windows allow */
+#define TCP_SEND_ALL        1   /* Go back to SND.UNA and send everything */
+#define TCP_SEND_ONE        2   /* Retransmit the first segment at SND.UNA */
+
+/* Largest amount of space TCP options can take up in a header. */
+#define TCP_MAX_OPTS_LEN    40
+
 /* Default Maximum Segment Lifetime (in milliseconds). I arbitrarily chose this
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
-#define TCP_DEFAULT_RTTO    2000
+/* Initial retransmission timeout (in milliseconds), before we have any RTT
+   samples to go on. RFC 6298 says this should be one second. */
+#define TCP_DEFAULT_RTTO    1000
+
+/* Bounds on the retransmission timeout (in milliseconds). RFC 6298 asks for a
+   minimum of one second, but that's awfully long on a LAN, so this follows
+   what most other stacks do instead. */
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* Granularity of our timers (in milliseconds). This matches how often the
+   net_thd callback is run. */
+#define TCP_TIMER_GRAN      50
+
+/* How long an ACK can be held back waiting for more data (in milliseconds).
+   Since this is checked by the net_thd callback, the actual delay can be up to
+   TCP_TIMER_GRAN longer than this. */
+#define TCP_DELACK_TIME     40
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
@@ -230,10 +325,34 @@ static int thd_cb_id = 0;
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_NODELAY       0x00000008
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERMITTED  4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TIMESTAMP       8
+
+/* Options negotiated for a connection (or present in a segment) */
+#define TCP_OPTF_MSS            0x00000001
+#define TCP_OPTF_WSCALE         0x00000002
+#define TCP_OPTF_SACK           0x00000004
+#define TCP_OPTF_TIMESTAMP      0x00000008
+#define TCP_OPTF_ALL            (TCP_OPTF_WSCALE | TCP_OPTF_SACK | \
+                                 TCP_OPTF_TIMESTAMP)
+
+/* Options parsed out of an incoming segment */
+struct tcp_opts {
+    uint32_t flags;
+    uint16_t mss;
+    uint8_t wscale;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_cnt;
+    struct tcp_sack_blk sack[TCP_MAX_SACK];
+};
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -242,6 +361,54 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
+
+static inline struct tcp_sock_list *
+tcp_conn_bucket(const struct in6_addr *raddr, uint16_t rport, uint16_t lport) {
+    uint32_t h = raddr->__s6_addr.__s6_addr32[0] ^
+                 raddr->__s6_addr.__s6_addr32[1] ^
+                 raddr->__s6_addr.__s6_addr32[2] ^
+                 raddr->__s6_addr.__s6_addr32[3] ^
+                 ((uint32_t)rport << 16) ^ lport;
+
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return &tcp_conn_hash[h & (TCP_CONN_HASH_SIZE - 1)];
+}
+
+static inline struct tcp_sock_list *tcp_port_bucket(uint16_t lport) {
+    return &tcp_port_hash[(lport ^ (lport >> 8)) & (TCP_PORT_HASH_SIZE - 1)];
+}
+
+/* Take a socket out of whichever hash table it is in, if any. The caller must
+   hold the write lock on tcp_sem. */
+static void tcp_unhash(struct tcp_sock *sock) {
+    if(sock->hashed) {
+        LIST_REMOVE(sock, hash_list);
+        sock->hashed = 0;
+    }
+}
+
+/* Put a socket into the right hash table for its current addresses. This must
+   be called any time the local port or remote address of a socket changes. The
+   caller must hold the write lock on tcp_sem. */
+static void tcp_rehash(struct tcp_sock *sock) {
+    struct tcp_sock_list *head;
+
+    tcp_unhash(sock);
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr))
+        head = tcp_conn_bucket(&sock->remote_addr.sin6_addr,
+                               sock->remote_addr.sin6_port,
+                               sock->local_addr.sin6_port);
+    else if(sock->local_addr.sin6_port)
+        head = tcp_port_bucket(sock->local_addr.sin6_port);
+    else
+        return;
+
+    LIST_INSERT_HEAD(head, sock, hash_list);
+    sock->hashed = 1;
+}
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -251,9 +418,472 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
                     uint32_t ack);
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
-static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_send_data(struct tcp_sock *sock, int mode);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
 
+/* Big-endian 32-bit values inside of TCP options aren't aligned. */
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Our timestamp clock ticks in milliseconds. */
+static inline uint32_t tcp_ts_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
+
+/* Figure out the smallest window scale that lets us advertise a whole receive
+   buffer of the given size. */
+static uint8_t tcp_wscale_for(uint32_t bufsz) {
+    uint8_t shift = 0;
+
+    while(shift < 14 && (bufsz >> shift) > 0xFFFF)
+        ++shift;
+
+    return shift;
+}
+
+/* Build the window field of an outgoing header. The window in a SYN segment is
+   never scaled. */
+static inline uint16_t tcp_adv_wnd(const struct tcp_sock *sock, int syn) {
+    uint32_t wnd = sock->data.rcv.wnd;
+
+    if(!syn)
+        wnd >>= sock->data.rcv.wscale;
+
+    return htons(wnd > 0xFFFF ? 0xFFFF : wnd);
+}
+
+/* Parse the options out of an incoming segment. Returns -1 if they are
+   malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *o) {
+    const uint8_t *opt = tcp->options;
+    int j = 0, len, i, end = TCP_GET_OFFSET(flags) - 20;
+
+    o->flags = 0;
+    o->sack_cnt = 0;
+
+    while(j < end) {
+        if(opt[j] == TCP_OPT_EOL)
+            break;
+
+        if(opt[j] == TCP_OPT_NOP) {
+            ++j;
+            continue;
+        }
+
+        if(j + 1 >= end || opt[j + 1] < 2 || j + opt[j + 1] > end)
+            return -1;
+
+        len = opt[j + 1];
+
+        switch(opt[j]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                o->mss = (opt[j + 2] << 8) | opt[j + 3];
+                o->flags |= TCP_OPTF_MSS;
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                /* RFC 7323 says to treat anything over 14 as 14. */
+                o->wscale = opt[j + 2] > 14 ? 14 : opt[j + 2];
+                o->flags |= TCP_OPTF_WSCALE;
+                break;
+
+            case TCP_OPT_SACK_PERMITTED:
+                if(len != 2)
+                    return -1;
+
+                o->flags |= TCP_OPTF_SACK;
+                break;
+
+            case TCP_OPT_SACK:
+                if((len - 2) % 8)
+                    return -1;
+
+                for(i = 0; i < (len - 2) / 8 && i < TCP_MAX_SACK; ++i) {
+                    o->sack[i].left = tcp_get32(opt + j + 2 + i * 8);
+                    o->sack[i].right = tcp_get32(opt + j + 6 + i * 8);
+                }
+
+                o->sack_cnt = i;
+                break;
+
+            case TCP_OPT_TIMESTAMP:
+                if(len != 10)
+                    return -1;
+
+                o->tsval = tcp_get32(opt + j + 2);
+                o->tsecr = tcp_get32(opt + j + 6);
+                o->flags |= TCP_OPTF_TIMESTAMP;
+                break;
+
+            /* Anything else is silently skipped. */
+        }
+
+        j += len;
+    }
+
+    return 0;
+}
+
+/* Fill in the options for a SYN or SYN-ACK. On an active open, this offers
+   everything we support. On a passive open, the options of the socket have
+   already been trimmed down to what the other side offered. */
+static int tcp_syn_opts(const struct tcp_sock *sock, uint8_t *opt) {
+    int len = 0;
+    uint32_t opts = sock->data.opts;
+
+    opt[len++] = TCP_OPT_MSS;
+    opt[len++] = 4;
+    opt[len++] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opt[len++] = TCP_DEFAULT_MSS & 0xFF;
+
+    if(opts & TCP_OPTF_WSCALE) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_WSCALE;
+        opt[len++] = 3;
+        opt[len++] = sock->data.rcv.wscale;
+    }
+
+    if(opts & TCP_OPTF_SACK) {
+        if(!(opts & TCP_OPTF_TIMESTAMP)) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+        }
+
+        opt[len++] = TCP_OPT_SACK_PERMITTED;
+        opt[len++] = 2;
+    }
+    else if(opts & TCP_OPTF_TIMESTAMP) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+    }
+
+    if(opts & TCP_OPTF_TIMESTAMP) {
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = 10;
+        tcp_put32(opt + len, tcp_ts_now());
+        tcp_put32(opt + len + 4, sock->data.ts_recent);
+        len += 8;
+    }
+
+    return len;
+}
+
+/* Fill in the options for a segment on a synchronized connection. If sack is
+   set, the blocks of out-of-order data we're holding are reported too. */
+static int tcp_seg_opts(const struct tcp_sock *sock, uint8_t *opt, int sack) {
+    int len = 0, i, n;
+
+    if(sock->data.opts & TCP_OPTF_TIMESTAMP) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = 10;
+        tcp_put32(opt + len, tcp_ts_now());
+        tcp_put32(opt + len + 4, sock->data.ts_recent);
+        len += 8;
+    }
+
+    if(sack && (sock->data.opts & TCP_OPTF_SACK) && sock->data.rcv_sack_cnt) {
+        n = MIN(sock->data.rcv_sack_cnt, (TCP_MAX_OPTS_LEN - len - 4) / 8);
+
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_SACK;
+        opt[len++] = 2 + n * 8;
+
+        for(i = 0; i < n; ++i) {
+            tcp_put32(opt + len, sock->data.rcv_sack[i].left);
+            tcp_put32(opt + len + 4, sock->data.rcv_sack[i].right);
+            len += 8;
+        }
+    }
+
+    return len;
+}
+
+/* Remember that we're holding the out-of-order data [left, right) in the
+   receive buffer. The block that changed goes first, as RFC 2018 requires. */
+static void tcp_rcv_sack_add(struct tcp_sock *sock, uint32_t left,
+                             uint32_t right) {
+    struct tcp_sack_blk *blks = sock->data.rcv_sack;
+    int i = 0, n = sock->data.rcv_sack_cnt;
+
+    /* Merge in anything this overlaps or touches. */
+    while(i < n) {
+        if(SEQ_LE(blks[i].left, right) && SEQ_GE(blks[i].right, left)) {
+            if(SEQ_LT(blks[i].left, left))
+                left = blks[i].left;
+
+            if(SEQ_GT(blks[i].right, right))
+                right = blks[i].right;
+
+            blks[i] = blks[--n];
+        }
+        else {
+            ++i;
+        }
+    }
+
+    /* If we're full, the oldest block gets forgotten. The data will simply be
+       sent again by the other side. */
+    if(n == TCP_MAX_SACK)
+        --n;
+
+    memmove(blks + 1, blks, n * sizeof(struct tcp_sack_blk));
+    blks[0].left = left;
+    blks[0].right = right;
+    sock->data.rcv_sack_cnt = n + 1;
+}
+
+/* Move RCV.NXT forward over data that is already sitting in the buffer. */
+static void tcp_rcv_advance(struct tcp_sock *sock, uint32_t sz) {
+    sock->data.rcv.nxt += sz;
+    sock->data.rcv.wnd -= sz;
+    sock->data.rcvbuf_cur_sz += sz;
+    sock->data.rcvbuf_tail += sz;
+
+    if(sock->data.rcvbuf_tail >= sock->rcvbuf_sz)
+        sock->data.rcvbuf_tail -= sock->rcvbuf_sz;
+}
+
+/* After RCV.NXT moves, pull in any out-of-order data that is now in order. */
+static void tcp_rcv_sack_absorb(struct tcp_sock *sock) {
+    struct tcp_sack_blk *blks = sock->data.rcv_sack;
+    int i = 0;
+
+    while(i < sock->data.rcv_sack_cnt) {
+        if(SEQ_LE(blks[i].left, sock->data.rcv.nxt)) {
+            if(SEQ_GT(blks[i].right, sock->data.rcv.nxt))
+                tcp_rcv_advance(sock, blks[i].right - sock->data.rcv.nxt);
+
+            memmove(blks + i, blks + i + 1, (sock->data.rcv_sack_cnt - i - 1) *
+                    sizeof(struct tcp_sack_blk));
+            --sock->data.rcv_sack_cnt;
+
+            /* Start over, since this may have made another block usable. */
+            i = 0;
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+/* Merge the SACK blocks from an incoming ACK into our scoreboard of what the
+   other side has received beyond SND.UNA. */
+static void tcp_snd_sack_update(struct tcp_sock *sock,
+                                const struct tcp_opts *o) {
+    struct tcp_sack_blk *blks = sock->data.snd_sack;
+    uint32_t left, right;
+    int i, j, n;
+
+    for(j = 0; j < o->sack_cnt; ++j) {
+        left = o->sack[j].left;
+        right = o->sack[j].right;
+        n = sock->data.snd_sack_cnt;
+
+        /* Ignore anything bogus or already acknowledged. */
+        if(SEQ_GE(left, right) || SEQ_LE(right, sock->data.snd.una) ||
+                SEQ_GT(right, sock->data.snd.nxt))
+            continue;
+
+        if(SEQ_LT(left, sock->data.snd.una))
+            left = sock->data.snd.una;
+
+        i = 0;
+
+        while(i < n) {
+            if(SEQ_LE(blks[i].left, right) && SEQ_GE(blks[i].right, left)) {
+                if(SEQ_LT(blks[i].left, left))
+                    left = blks[i].left;
+
+                if(SEQ_GT(blks[i].right, right))
+                    right = blks[i].right;
+
+                blks[i] = blks[--n];
+            }
+            else {
+                ++i;
+            }
+        }
+
+        if(n == TCP_MAX_SACK)
+            --n;
+
+        blks[n].left = left;
+        blks[n].right = right;
+        sock->data.snd_sack_cnt = n + 1;
+    }
+}
+
+/* Drop anything from the scoreboard that SND.UNA has moved past. */
+static void tcp_snd_sack_trim(struct tcp_sock *sock) {
+    struct tcp_sack_blk *blks = sock->data.snd_sack;
+    int i = 0;
+
+    while(i < sock->data.snd_sack_cnt) {
+        if(SEQ_LE(blks[i].right, sock->data.snd.una)) {
+            blks[i] = blks[--sock->data.snd_sack_cnt];
+        }
+        else {
+            if(SEQ_LT(blks[i].left, sock->data.snd.una))
+                blks[i].left = sock->data.snd.una;
+
+            ++i;
+        }
+    }
+}
+
+/* When retransmitting, skip over anything the other side has SACKed. Returns
+   the sequence number to actually send from. */
+static uint32_t tcp_snd_sack_skip(const struct tcp_sock *sock, uint32_t seq) {
+    const struct tcp_sack_blk *blks = sock->data.snd_sack;
+    int i, moved = 1;
+
+    while(moved) {
+        moved = 0;
+
+        for(i = 0; i < sock->data.snd_sack_cnt; ++i) {
+            if(SEQ_LE(blks[i].left, seq) && SEQ_GT(blks[i].right, seq)) {
+                seq = blks[i].right;
+                moved = 1;
+            }
+        }
+    }
+
+    return seq;
+}
+
+/* Trim a retransmitted segment so it stops where the next SACKed block
+   starts. */
+static uint32_t tcp_snd_sack_limit(const struct tcp_sock *sock, uint32_t seq,
+                                   uint32_t len) {
+    const struct tcp_sack_blk *blks = sock->data.snd_sack;
+    int i;
+
+    for(i = 0; i < sock->data.snd_sack_cnt; ++i) {
+        if(SEQ_GT(blks[i].left, seq) && SEQ_LT(blks[i].left, seq + len))
+            len = blks[i].left - seq;
+    }
+
+    return len;
+}
+
+/* Initial congestion window, per RFC 5681 section 3.1. */
+static uint32_t tcp_initial_cwnd(uint32_t mss) {
+    if(mss > 2190)
+        return 2 * mss;
+    else if(mss > 1095)
+        return 3 * mss;
+    else
+        return 4 * mss;
+}
+
+/* Set up the retransmission timer and congestion control state of a new
+   connection. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    sock->data.srtt = sock->data.rttvar = 0;
+    sock->data.rto = TCP_DEFAULT_RTTO;
+    sock->data.rtt_timing = 0;
+    sock->data.backoff = 0;
+    sock->data.retransmits = 0;
+    sock->data.cwnd = tcp_initial_cwnd(sock->data.snd.mss);
+    sock->data.ssthresh = TCP_MAX_BUFFER;
+    sock->data.recover = sock->data.snd.iss;
+    sock->data.in_recovery = 0;
+    sock->data.dupacks = 0;
+    sock->data.ack_pending = 0;
+}
+
+/* The current retransmission timeout, including any backoff. */
+static inline uint32_t tcp_rto(const struct tcp_sock *sock) {
+    uint32_t rto = sock->data.rto << sock->data.backoff;
+
+    return rto > TCP_MAX_RTO ? TCP_MAX_RTO : rto;
+}
+
+/* Feed a round-trip time sample (in milliseconds) into the estimator, as laid
+   out in RFC 6298 section 2. SRTT is kept scaled by 8 and RTTVAR by 4, so the
+   gains of 1/8 and 1/4 come out to simple shifts. */
+static void tcp_rtt_update(struct tcp_sock *sock, uint32_t r) {
+    int32_t delta;
+
+    sock->data.rtt = r;
+
+    if(!sock->data.srtt) {
+        sock->data.srtt = r << 3;
+        sock->data.rttvar = r << 1;
+    }
+    else {
+        delta = (int32_t)r - (int32_t)(sock->data.srtt >> 3);
+        sock->data.srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        sock->data.rttvar += delta - (sock->data.rttvar >> 2);
+    }
+
+    sock->data.rto = (sock->data.srtt >> 3) +
+                     MAX(TCP_TIMER_GRAN, sock->data.rttvar);
+
+    if(sock->data.rto < TCP_MIN_RTO)
+        sock->data.rto = TCP_MIN_RTO;
+    else if(sock->data.rto > TCP_MAX_RTO)
+        sock->data.rto = TCP_MAX_RTO;
+
+    /* A good sample means we're not backing off anymore. */
+    sock->data.backoff = 0;
+}
+
+/* Cut the slow start threshold in half of what's in flight after a loss. */
+static inline void tcp_cc_loss(struct tcp_sock *sock) {
+    uint32_t flight = sock->data.snd.nxt - sock->data.snd.una;
+
+    sock->data.ssthresh = MAX(flight / 2, 2 * (uint32_t)sock->data.snd.mss);
+}
+
+/* Open up the congestion window for newly acknowledged data, outside of fast
+   recovery. */
+static void tcp_cc_grow(struct tcp_sock *sock, uint32_t acked) {
+    uint32_t mss = sock->data.snd.mss;
+
+    if(sock->data.cwnd < sock->data.ssthresh)
+        sock->data.cwnd += MIN(acked, mss);
+    else
+        sock->data.cwnd += MAX(mss * mss / sock->data.cwnd, 1);
+
+    if(sock->data.cwnd > TCP_MAX_BUFFER)
+        sock->data.cwnd = TCP_MAX_BUFFER;
+}
+
+/* Acknowledge received data, either right away or after a while. */
+static void tcp_delack(struct tcp_sock *sock, int now) {
+    if(now || sock->data.ack_pending ||
+            (sock->intflags & TCP_IFLAG_NODELAY)) {
+        tcp_send_ack(sock);
+    }
+    else {
+        sock->data.ack_pending = 1;
+        sock->data.ack_timer = timer_ms_gettime64();
+    }
+}
+
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     struct tcp_sock *sock;
@@ -440,6 +1070,7 @@ retry:
 
 ret_remove:
     LIST_REMOVE(sock, sock_list);
+    tcp_unhash(sock);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
     free(sock);
@@ -515,6 +1146,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
             LIST_REMOVE(sock, sock_list);
+            tcp_unhash(sock);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
             free(sock);
@@ -711,14 +1343,30 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
+    /* Sockets inherit TCP_NODELAY from the listening socket. */
+    sock2->intflags = sock->intflags & TCP_IFLAG_NODELAY;
+
+    /* Only use the extensions the other side offered in its <SYN>. */
+    sock2->data.opts = lsock.opts;
+    sock2->data.ts_recent = lsock.ts_recent;
+
+    if(lsock.opts & TCP_OPTF_WSCALE) {
+        sock2->data.snd.wscale = lsock.wscale;
+        sock2->data.rcv.wscale = tcp_wscale_for(sock2->rcvbuf_sz);
+    }
+
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
+    tcp_cc_init(sock2);
     tcp_send_syn(sock2, 1);
-    sock2->data.timer = timer_ms_gettime64();
+    sock2->data.timer = sock2->data.rtt_time = timer_ms_gettime64();
+    sock2->data.rtt_seq = sock2->data.snd.iss;
+    sock2->data.rtt_timing = 1;
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
+    tcp_rehash(sock2);
     mutex_unlock(&sock2->mutex);
 
     sock->state &= ~TCP_STATE_ACCEPTING;
@@ -857,7 +1505,9 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                     return -1;
                 }
 
-                if(iter->local_addr.sin6_port == port) {
+                /* Socket ports are kept in network byte order */
+                if(iter->local_addr.sin6_port == htons(port)) {
+                    mutex_unlock(&iter->mutex);
                     ++port;
                     break;
                 }
@@ -870,6 +1520,8 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
         sock->local_addr.sin6_port = htons(port);
     }
 
+    tcp_rehash(sock);
+
     /* Release the locks, we're done */
     mutex_unlock(&sock->mutex);
     rwsem_write_unlock(&tcp_sem);
@@ -988,7 +1640,9 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                     return -1;
                 }
 
-                if(iter->local_addr.sin6_port == port) {
+                /* Socket ports are kept in network byte order */
+                if(iter->local_addr.sin6_port == htons(port)) {
+                    mutex_unlock(&iter->mutex);
                     ++port;
                     break;
                 }
@@ -1047,18 +1701,33 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.rcv.wnd = sock->rcvbuf_sz;
     sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     sock->data.net = net_default_dev;
+
+    /* Offer everything we support. Whatever the other side doesn't agree to
+       gets turned back off when the <SYN,ACK> comes in. */
+    sock->data.opts = TCP_OPTF_ALL;
+    sock->data.rcv.wscale = tcp_wscale_for(sock->rcvbuf_sz);
+    sock->data.snd.wscale = 0;
+    sock->data.ts_recent = 0;
+    sock->data.rcv_sack_cnt = sock->data.snd_sack_cnt = 0;
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.snd.mss = 536;
+    tcp_cc_init(sock);
     sock->state = TCP_STATE_SYN_SENT;
+    tcp_rehash(sock);
 
-    /* Send a <SYN> packet */
+    /* Send a <SYN> packet, and time how long it takes to get an answer. */
     if(tcp_send_syn(sock, 0) == -1) {
         rwsem_write_unlock(&tcp_sem);
         mutex_unlock(&sock->mutex);
         return -1;
     }
 
+    sock->data.timer = sock->data.rtt_time = timer_ms_gettime64();
+    sock->data.rtt_seq = sock->data.snd.iss;
+    sock->data.rtt_timing = 1;
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1276,8 +1945,9 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             sock->data.rcvbuf_head = size - tmp;
     }
 
-    /* If we've got nothing left, move the pointers back to the beginning */
-    if(!sock->data.rcvbuf_cur_sz) {
+    /* If we've got nothing left, move the pointers back to the beginning. We
+       can't do this if there's out of order data sitting past the tail. */
+    if(!sock->data.rcvbuf_cur_sz && !sock->data.rcv_sack_cnt) {
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
@@ -1440,7 +2110,7 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
     }
 
     /* Send some data! */
-    tcp_send_data(sock, 0);
+    tcp_send_data(sock, TCP_SEND_NEW);
 
 out:
     mutex_unlock(&sock->mutex);
@@ -1472,6 +2142,7 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                               void *option_value, socklen_t *option_len) {
     int tmp;
     struct tcp_sock *sock;
+    struct tcp_info info;
 
     if(!option_value || !option_len) {
         errno = EFAULT;
@@ -1539,8 +2210,38 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
-                    tmp = 1;
+                    tmp = !!(sock->intflags & TCP_IFLAG_NODELAY);
                     goto copy_int;
+
+                case TCP_INFO:
+                    memset(&info, 0, sizeof(info));
+
+                    /* Only synchronized connections have anything to say. */
+                    if(sock->state < TCP_STATE_SYN_SENT ||
+                            sock->state > TCP_STATE_TIME_WAIT)
+                        goto copy_info;
+
+                    if(sock->data.opts & TCP_OPTF_TIMESTAMP)
+                        info.tcpi_options |= TCPI_OPT_TIMESTAMPS;
+
+                    if(sock->data.opts & TCP_OPTF_SACK)
+                        info.tcpi_options |= TCPI_OPT_SACK;
+
+                    if(sock->data.opts & TCP_OPTF_WSCALE) {
+                        info.tcpi_options |= TCPI_OPT_WSCALE;
+                        info.tcpi_snd_wscale = sock->data.snd.wscale;
+                        info.tcpi_rcv_wscale = sock->data.rcv.wscale;
+                    }
+
+                    info.tcpi_backoff = sock->data.backoff;
+                    info.tcpi_rto = tcp_rto(sock) * 1000;
+                    info.tcpi_snd_mss = sock->data.snd.mss;
+                    info.tcpi_rtt = (sock->data.srtt * 1000) >> 3;
+                    info.tcpi_rttvar = (sock->data.rttvar * 1000) >> 2;
+                    info.tcpi_snd_ssthresh = sock->data.ssthresh;
+                    info.tcpi_snd_cwnd = sock->data.cwnd;
+                    info.tcpi_total_retrans = sock->data.retransmits;
+                    goto copy_info;
             }
 
             break;
@@ -1567,6 +2268,17 @@ copy_int:
         memcpy(option_value, &tmp, *option_len);
     }
 
+    goto simply_return;
+
+copy_info:
+    if(*option_len >= sizeof(struct tcp_info)) {
+        memcpy(option_value, &info, sizeof(struct tcp_info));
+        *option_len = sizeof(struct tcp_info);
+    }
+    else {
+        memcpy(option_value, &info, *option_len);
+    }
+
 simply_return:
     mutex_unlock(&sock->mutex);
     rwsem_read_unlock(&tcp_sem);
@@ -1600,17 +2312,37 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 - 1MiB */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
+
+                    /* Closed and listening sockets don't have buffers yet, so
+                       just remember the size for when they're allocated. Set
+                       it before connect() or listen() to make sure that the
+                       window scale in the <SYN> can cover all of it. */
+                    if(sock->state == TCP_STATE_CLOSED ||
+                            sock->state == TCP_STATE_LISTEN) {
+                        sock->rcvbuf_sz = tmp;
+                        goto ret_success;
+                    }
+
+                    /* Otherwise, we can only resize the buffer if it is empty
+                       and the new size fits in the scaled window. */
+                    if(sock->data.rcvbuf_cur_sz || sock->data.rcv_sack_cnt)
+                        goto ret_inval;
+
+                    if(tmp > (0xFFFF << sock->data.rcv.wscale))
+                        tmp = 0xFFFF << sock->data.rcv.wscale;
 
                     new_ptr = realloc(sock->data.rcvbuf, tmp);
                     if(!new_ptr)
                         goto ret_nomem;
 
                     sock->data.rcvbuf = new_ptr;
+                    sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
+                    sock->data.rcv.wnd = tmp;
                     sock->rcvbuf_sz = tmp;
                     goto ret_success;
 
@@ -1619,11 +2351,21 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Send buffer size must be in the range 2048 - 65535 */
+                    /* Send buffer size must be in the range 2048 - 1MiB */
                     if(tmp < 2048)
                         tmp = 2048;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_BUFFER)
+                        tmp = TCP_MAX_BUFFER;
+
+                    if(sock->state == TCP_STATE_CLOSED ||
+                            sock->state == TCP_STATE_LISTEN) {
+                        sock->sndbuf_sz = tmp;
+                        goto ret_success;
+                    }
+
+                    /* Don't pull the rug out from under unacknowledged data. */
+                    if(sock->data.sndbuf_cur_sz)
+                        goto ret_inval;
 
                     new_ptr = realloc(sock->data.sndbuf, tmp);
                     if(!new_ptr) {
@@ -1631,6 +2373,8 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                     }
 
                     sock->data.sndbuf = new_ptr;
+                    sock->data.sndbuf_head = sock->data.sndbuf_acked =
+                        sock->data.sndbuf_tail = 0;
                     sock->sndbuf_sz = tmp;
                     goto ret_success;
             }
@@ -1704,8 +2448,10 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
 
                     tmp = *((int *)option_value);
 
-                    if(tmp == 0)
-                        goto ret_inval;
+                    if(tmp)
+                        sock->intflags |= TCP_IFLAG_NODELAY;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_NODELAY;
 
                     goto ret_success;
             }
@@ -2060,9 +2806,14 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
 }
 
 static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
     uint16_t cs;
+    int sz;
+
+    /* Fill in our SYN options first, since we need to know how long they are
+       to fill in the header. */
+    sz = sizeof(tcp_hdr_t) + tcp_syn_opts(sock, hdr->options);
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
@@ -2071,165 +2822,228 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack) {
     hdr->ack = htonl(sock->data.rcv.nxt);
 
     if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(sz >> 2));
     }
     else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(sz >> 2));
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = tcp_adv_wnd(sock, 1);
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
-
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
-                         sock->hop_limit, IPPROTO_TCP,
-                         &sock->local_addr.sin6_addr,
+    return net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit,
+                         IPPROTO_TCP, &sock->local_addr.sin6_addr,
                          &sock->remote_addr.sin6_addr);
 }
 
 static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
     uint16_t cs;
+    int sz;
+
+    sz = sizeof(tcp_hdr_t) + tcp_seg_opts(sock, hdr->options, 0);
+    sock->data.ack_pending = 0;
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
     hdr->seq = htonl(sock->data.snd.nxt);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(sz >> 2));
+    hdr->wnd = tcp_adv_wnd(sock, 0);
     hdr->checksum = 0;
     hdr->urg = 0;
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+                                  sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
+    net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit,
                   IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
 }
 
 static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
     uint16_t c;
+    int sz;
+
+    /* Pure ACKs carry any SACK blocks we have. */
+    sz = sizeof(tcp_hdr_t) + tcp_seg_opts(sock, hdr->options, 1);
+    sock->data.ack_pending = 0;
 
     /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(sock->data.snd.nxt);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(sz >> 2));
+    hdr->wnd = tcp_adv_wnd(sock, 0);
+    hdr->checksum = 0;
+    hdr->urg = 0;
 
     /* Calculate the real checksum */
     c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                  &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+                                 sz, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, sz, c);
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
-                  sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
-                  &sock->remote_addr.sin6_addr);
+    net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
+                  &sock->local_addr.sin6_addr, &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
+/* Send whatever data the windows allow. In TCP_SEND_ALL mode, this starts over
+   from SND.UNA, skipping anything the other side has told us it has with SACK
+   blocks (if it hasn't told us anything, everything gets sent again).
+   TCP_SEND_ONE does the same, but stops after one segment and ignores the
+   congestion window, which is what fast retransmit wants. */
+static void tcp_send_data(struct tcp_sock *sock, int mode) {
+    uint32_t una = sock->data.snd.una, snd, wnd;
+    uint32_t end = una + sock->data.sndbuf_cur_sz;
+    uint32_t seq = mode != TCP_SEND_NEW ? una : sock->data.snd.nxt;
+    uint32_t nxt = sock->data.snd.nxt, wnd_end;
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_MAX_OPTS_LEN + TCP_DEFAULT_MSS];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    int sz, hlen, optlen, sent = 0;
     uint16_t cs;
     uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
+    uint32_t head, maxseg;
+    uint64_t now = timer_ms_gettime64();
 
-    if(!resend) {
-        seq = sock->data.snd.nxt;
-        unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
-        head = sock->data.sndbuf_head;
-    }
-    else {
-        seq = sock->data.snd.una;
-        unacked = 0;
-        head = sock->data.sndbuf_acked;
-    }
+    /* We can't have more in flight than either the other side or the network
+       will take. If the other side's window is closed, we still send a byte
+       at a time to probe it. */
+    wnd = sock->data.snd.wnd;
 
-    if(!wnd)
-        wnd = 1;
+    if(mode != TCP_SEND_ONE)
+        wnd = MIN(wnd, sock->data.cwnd);
+
+    wnd_end = una + (wnd ? wnd : 1);
+
+    /* Fill in the base packet. Only the timestamp is carried on data. */
+    optlen = tcp_seg_opts(sock, hdr->options, 0);
+    hlen = sizeof(tcp_hdr_t) + optlen;
+    buf = rawpkt + hlen;
 
-    /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(hlen >> 2));
+    hdr->wnd = tcp_adv_wnd(sock, 0);
     hdr->urg = 0;
 
+    /* The MSS doesn't include the options, so they eat into the data. */
+    maxseg = MIN(sock->data.snd.mss, TCP_DEFAULT_MSS) - optlen;
+
     /* Put on some data if we should do so */
-    while(sock->data.sndbuf_cur_sz - unacked && wnd) {
+    while(SEQ_LT(seq, end) && SEQ_LT(seq, wnd_end)) {
+        if(mode != TCP_SEND_NEW && sock->data.snd_sack_cnt) {
+            seq = tcp_snd_sack_skip(sock, seq);
+
+            if(!SEQ_LT(seq, end) || !SEQ_LT(seq, wnd_end))
+                break;
+        }
+
+        snd = MIN(end - seq, wnd_end - seq);
+
+        if(snd > maxseg)
+            snd = maxseg;
+
+        if(mode != TCP_SEND_NEW && sock->data.snd_sack_cnt)
+            snd = tcp_snd_sack_limit(sock, seq, snd);
+
+        /* Time one segment per round trip if we can't use timestamps for it.
+           Per Karn's algorithm, retransmitted segments are never timed. */
+        if(SEQ_LT(seq, nxt)) {
+            ++sock->data.retransmits;
+            sock->data.rtt_timing = 0;
+        }
+        else if(!sock->data.rtt_timing &&
+                !(sock->data.opts & TCP_OPTF_TIMESTAMP)) {
+            sock->data.rtt_timing = 1;
+            sock->data.rtt_seq = seq;
+            sock->data.rtt_time = now;
+        }
+
         hdr->seq = htonl(seq);
         hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
-        snd = wnd;
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
+        head = sock->data.sndbuf_acked + (seq - una);
 
-        if(snd > sock->data.sndbuf_cur_sz - unacked)
-            snd = sock->data.sndbuf_cur_sz - unacked;
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
 
-        /* Copy in the data */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+        sb = sock->data.sndbuf + head;
+        sz = snd + hlen;
+        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                      &sock->remote_addr.sin6_addr, sz,
+                                      IPPROTO_TCP);
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
+        /* Copy in the data. In the common case, where the data doesn't wrap
+           around the end of the buffer, sum it up on the way in. */
+        if(head + snd <= sock->sndbuf_sz) {
+            cs = ~net_ipv4_checksum_copy(buf, sb, snd, cs);
         }
         else {
             sz = sock->sndbuf_sz - head;
             memcpy(buf, sb, sz);
             memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
+            cs = ~net_ipv4_checksum(buf, snd, cs);
         }
 
-        sz = snd + sizeof(tcp_hdr_t);
-        wnd -= snd;
+        sz = snd + hlen;
         seq += snd;
-        unacked += snd;
+        sent = 1;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+        /* Finish the checksum off with the header */
+        hdr->checksum = net_ipv4_checksum(rawpkt, hlen, cs);
 
         net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
                       &sock->local_addr.sin6_addr,
                       &sock->remote_addr.sin6_addr);
+
+        if(mode == TCP_SEND_ONE)
+            break;
     }
 
-    sock->data.timer = timer_ms_gettime64();
+    if(!sent)
+        return;
+
+    /* Any data we sent carried an ACK with it. */
+    sock->data.ack_pending = 0;
+
+    /* Start the retransmission timer if it wasn't running already. It also
+       gets restarted on every retransmission. */
+    if(mode != TCP_SEND_NEW || sock->data.snd.nxt == una)
+        sock->data.timer = now;
+
+    /* When going back N, SND.NXT follows wherever we stopped. With SACK
+       information or when retransmitting just one segment, we only filled
+       holes, so it never moves backwards. */
+    if(mode == TCP_SEND_ALL && !sock->data.snd_sack_cnt)
+        nxt = seq;
+    else if(SEQ_GT(seq, nxt))
+        nxt = seq;
+
+    head = sock->data.sndbuf_acked + (nxt - una);
+
+    if(head >= sock->sndbuf_sz)
+        head -= sock->sndbuf_sz;
+
     sock->data.sndbuf_head = head;
-    sock->data.snd.nxt = seq;
+    sock->data.snd.nxt = nxt;
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2238,6 +3052,37 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* Does the given socket match an incoming packet? */
+static inline int sock_matches(const struct tcp_sock *i,
+                               const struct in6_addr *src,
+                               const struct in6_addr *dst, uint16_t sport,
+                               uint16_t dport, int domain) {
+    /* Ignore any closed sockets */
+    if(i->state == TCP_STATE_CLOSED)
+        return 0;
+
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return 0;
+
+    /* See if the remote end matches what's in the socket */
+    if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+            (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
+             i->remote_addr.sin6_port != sport))
+        return 0;
+
+    /* See if it matches the local end */
+    if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+            !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+            i->local_addr.sin6_port != dport)
+        return 0;
+
+    return 1;
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2246,40 +3091,26 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
-
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
-
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
-            continue;
-
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
-            continue;
-
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+    /* Fully-created sockets take precedence over listening ones, so look in
+       the connection table first. See the comment at the top of the file for
+       more discussion of this, if you're interested. */
+    LIST_FOREACH(i, tcp_conn_bucket(src, sport, dport), hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
+    LIST_FOREACH(i, tcp_port_bucket(dport), hash_list) {
+        if(sock_matches(i, src, dst, sport, dport, domain))
+            goto found;
     }
 
     return NULL;
+
+found:
+    if(mutex_lock_irqsafe(&i->mutex))
+        return (struct tcp_sock *) -1;
+
+    return i;
 }
 
 extern void __poll_event_trigger(int fd, short event);
@@ -2291,9 +3122,10 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
+    int j;
+    struct tcp_opts o;
     uint16_t mss = 576;
+    uint32_t opts;
 
     (void)size;
 
@@ -2305,36 +3137,15 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     if(flags & TCP_FLAG_ACK)
         return -1;
 
-    /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
-
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
+    /* Parse options now, in case we need to update the max segment size or
+       the other side wants to use any of the extensions we support. */
+    if(tcp_parse_opts(tcp, flags, &o))
+        return -1;
 
-            default:
+    if(o.flags & TCP_OPTF_MSS)
+        mss = o.mss;
 
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
-
-                j += tcp->options[j + 1];
-        }
-    }
+    opts = o.flags & TCP_OPTF_ALL;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
@@ -2350,6 +3161,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].opts = opts;
+            s->listen.queue[j].wscale = o.wscale;
+            s->listen.queue[j].ts_recent = o.tsval;
             return 0;
         }
     }
@@ -2368,6 +3182,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    s->listen.queue[s->listen.tail].opts = opts;
+    s->listen.queue[s->listen.tail].wscale = o.wscale;
+    s->listen.queue[s->listen.tail].ts_recent = o.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2389,7 +3206,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    int mss = 536;
+    struct tcp_opts o;
 
     (void)src;
 
@@ -2425,44 +3243,38 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
+        if(tcp_parse_opts(tcp, flags, &o))
+            return -1;
 
-                case TCP_OPT_MSS:
+        if(o.flags & TCP_OPTF_MSS)
+            mss = o.mss;
 
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
+        s->data.snd.mss = mss > 1460 ? 1460 : mss;
+        s->data.cwnd = tcp_initial_cwnd(s->data.snd.mss);
 
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        /* Only keep the extensions both sides asked for. Window scaling has to
+           be used in both directions or not at all. */
+        s->data.opts &= o.flags;
 
-                default:
+        if(s->data.opts & TCP_OPTF_WSCALE)
+            s->data.snd.wscale = o.wscale;
+        else
+            s->data.snd.wscale = s->data.rcv.wscale = 0;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        if(s->data.opts & TCP_OPTF_TIMESTAMP)
+            s->data.ts_recent = o.tsval;
 
-                    j += tcp->options[j + 1];
-            }
-        }
-
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
+        /* The window in a SYN is never scaled. */
         s->data.snd.wnd = htons(tcp->wnd);
 
         if(gotack) {
             s->data.snd.una = ack;
 
+            if(s->data.rtt_timing && SEQ_GT(ack, s->data.rtt_seq)) {
+                tcp_rtt_update(s, timer_ms_gettime64() - s->data.rtt_time);
+                s->data.rtt_timing = 0;
+            }
+
             /* If the ack covers our iss, then we've established the connection.
                Update the state and ack it. */
             if(SEQ_GT(ack, s->data.snd.iss)) {
@@ -2488,11 +3300,12 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, off, pos, wnd, acked;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, tmp, acksyn = 0, in_order = 1, dupack;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
+    struct tcp_opts o;
 
     (void)src;
 
@@ -2504,6 +3317,20 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
 
+    /* Grab any options from the segment. Malformed options are just ignored,
+       as opposed to throwing the whole segment away. */
+    if(tcp_parse_opts(tcp, flags, &o))
+        o.flags = o.sack_cnt = 0;
+
+    /* Protect against wrapped sequence numbers (RFC 7323 section 5). A segment
+       with a timestamp older than the last one we saw is a duplicate. */
+    if((s->data.opts & TCP_OPTF_TIMESTAMP) &&
+            (o.flags & TCP_OPTF_TIMESTAMP) && !(flags & TCP_FLAG_RST) &&
+            SEQ_LT(o.tsval, s->data.ts_recent)) {
+        tcp_send_ack(s);
+        return 0;
+    }
+
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
             bad_pkt = 1;
@@ -2533,6 +3360,12 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Remember the timestamp to echo back, if this segment covers the left
+       edge of the window. */
+    if((s->data.opts & TCP_OPTF_TIMESTAMP) && (o.flags & TCP_OPTF_TIMESTAMP) &&
+            SEQ_LE(seq, s->data.rcv.nxt))
+        s->data.ts_recent = o.tsval;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2582,22 +3415,63 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* A duplicate ACK is one that doesn't move SND.UNA or the window and
+       carries no data while we have something outstanding (RFC 5681). Figure
+       that out before the window gets updated below. */
+    wnd = (uint32_t)ntohs(tcp->wnd) << s->data.snd.wscale;
+    dupack = ack == s->data.snd.una && !sz && wnd == s->data.snd.wnd &&
+             !(flags & TCP_FLAG_FIN) && s->data.snd.nxt != s->data.snd.una &&
+             s->data.sndbuf_cur_sz;
+
     /* Check the ack number for validity */
     if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
+        acked = ack - s->data.snd.una;
+        s->data.sndbuf_acked += (int32_t)(acked - acksyn);
+        s->data.sndbuf_cur_sz -= (int32_t)(acked - acksyn);
         s->data.snd.una = ack;
+        tcp_snd_sack_trim(s);
+
+        /* Take a round-trip time sample, either from the echoed timestamp or
+           from the segment we've been timing. */
+        if((s->data.opts & TCP_OPTF_TIMESTAMP) &&
+                (o.flags & TCP_OPTF_TIMESTAMP) && o.tsecr) {
+            tcp_rtt_update(s, tcp_ts_now() - o.tsecr);
+        }
+        else if(s->data.rtt_timing && SEQ_GT(ack, s->data.rtt_seq)) {
+            tcp_rtt_update(s, timer_ms_gettime64() - s->data.rtt_time);
+            s->data.rtt_timing = 0;
+        }
+
         __poll_event_trigger(s->sock, POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
 
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
+        /* Restart the retransmission timer for whatever is still out. */
+        s->data.timer = timer_ms_gettime64();
+
+        if(s->data.in_recovery) {
+            if(SEQ_GE(ack, s->data.recover)) {
+                /* Full ACK, so we're done with fast recovery. Deflate the
+                   window back down (RFC 6582 section 3.2, step 3). */
+                s->data.cwnd = MIN(s->data.ssthresh,
+                                   MAX(s->data.snd.nxt - ack,
+                                       (uint32_t)s->data.snd.mss) +
+                                   s->data.snd.mss);
+                s->data.in_recovery = 0;
+                s->data.dupacks = 0;
+            }
+            else {
+                /* Partial ACK, so the next hole needs to be filled in. */
+                tcp_send_data(s, TCP_SEND_ONE);
+                s->data.cwnd -= MIN(acked, s->data.cwnd);
+                s->data.cwnd += s->data.snd.mss;
+            }
+        }
+        else {
+            s->data.dupacks = 0;
+            tcp_cc_grow(s, acked);
         }
     }
     else if(SEQ_GT(ack, s->data.snd.nxt)) {
@@ -2607,6 +3481,47 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Update the send window. This is done for any acceptable ACK, not just
+       ones that move SND.UNA, so a window update on its own gets noticed. */
+    if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt) &&
+            (SEQ_LT(s->data.snd.wl1, seq) || (s->data.snd.wl1 == seq &&
+                                            SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = wnd;
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+    }
+
+    /* Keep track of what the other side has beyond SND.UNA, so retransmits
+       can skip over it. */
+    if((s->data.opts & TCP_OPTF_SACK) && o.sack_cnt)
+        tcp_snd_sack_update(s, &o);
+
+    if(dupack && (s->state == TCP_STATE_ESTABLISHED ||
+                  s->state == TCP_STATE_CLOSE_WAIT)) {
+        ++s->data.dupacks;
+
+        if(s->data.in_recovery) {
+            /* Each further duplicate means another segment has left the
+               network, so inflate the window to match. */
+            s->data.cwnd += s->data.snd.mss;
+        }
+        else if(s->data.dupacks == 3 && SEQ_GT(ack, s->data.recover)) {
+            /* Fast retransmit, and go into fast recovery. */
+            tcp_cc_loss(s);
+            s->data.recover = s->data.snd.nxt;
+            s->data.in_recovery = 1;
+            tcp_send_data(s, TCP_SEND_ONE);
+            s->data.cwnd = s->data.ssthresh + 3 * s->data.snd.mss;
+        }
+    }
+
+    /* If the windows have room for more of what's waiting in the send buffer,
+       send it now rather than waiting for the next write. */
+    if((s->state == TCP_STATE_ESTABLISHED ||
+            s->state == TCP_STATE_CLOSE_WAIT) &&
+            SEQ_LT(s->data.snd.nxt, s->data.snd.una + s->data.sndbuf_cur_sz))
+        tcp_send_data(s, TCP_SEND_NEW);
+
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
         case TCP_STATE_FIN_WAIT_1:
@@ -2661,13 +3576,15 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             s->state == TCP_STATE_FIN_WAIT_2) {
         /* Next, check the data size versus our window. If its more than the
            window, truncate the data and copy out what we can. */
-        if(sz > s->data.rcv.wnd) {
-            sz = s->data.rcv.wnd;
+        off = seq - s->data.rcv.nxt;
+
+        if(off + sz > s->data.rcv.wnd) {
+            sz = s->data.rcv.wnd - off;
             bad_pkt = 1;
         }
 
         /* Copy the data out */
-        if(sz) {
+        if(sz && !off) {
             rb = s->data.rcvbuf + s->data.rcvbuf_tail;
             s->data.rcv.nxt += sz;
             s->data.rcv.wnd -= sz;
@@ -2686,11 +3603,48 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 s->data.rcvbuf_tail = sz;
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
+            /* This may have filled in a hole in front of data we already
+               have sitting in the buffer. If so, the other side wants to hear
+               about it right away (RFC 5681 section 4.2). */
+            tmp = s->data.rcv_sack_cnt;
+
+            if(tmp)
+                tcp_rcv_sack_absorb(s);
+
+            /* Signal any waiting thread and ack what we read, possibly after
+               waiting a bit to see if more shows up. */
             __poll_event_trigger(s->sock, POLLRDNORM);
             cond_signal(&s->data.recv_cv);
+            tcp_delack(s, tmp);
+        }
+        else if(sz) {
+            /* Out of order data. Put it where it belongs in the buffer, but
+               don't let the application see it until the hole in front of it
+               gets filled in. Without SACK, we still keep it, since the other
+               side may well be sending the hole again right now. */
+            pos = s->data.rcvbuf_tail + off;
+
+            if(pos >= s->rcvbuf_sz)
+                pos -= s->rcvbuf_sz;
+
+            if(pos + sz <= s->rcvbuf_sz) {
+                memcpy(s->data.rcvbuf + pos, buf, sz);
+            }
+            else {
+                tmp = s->rcvbuf_sz - pos;
+                memcpy(s->data.rcvbuf + pos, buf, tmp);
+                memcpy(s->data.rcvbuf, buf + tmp, sz - tmp);
+            }
+
+            tcp_rcv_sack_add(s, seq, seq + sz);
+            in_order = 0;
+
+            /* Send a duplicate ACK (with our SACK blocks) right away. */
             tcp_send_ack(s);
         }
+        else if(off) {
+            in_order = 0;
+        }
     }
     else if(sz) {
         /* If we get any segment text in here, there's a problem with the other
@@ -2700,7 +3654,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
     /* Finally, check the FIN bit. We don't try to ack it if the packet had too
        much data. */
-    if(!bad_pkt && (flags & TCP_FLAG_FIN)) {
+    if(!bad_pkt && in_order && (flags & TCP_FLAG_FIN)) {
         /* ACK the FIN */
         ++s->data.rcv.nxt;
         tcp_send_ack(s);
@@ -2850,30 +3804,30 @@ static void tcp_thd_cb(void *arg) {
         mutex_lock_scoped(&i->mutex);
         timer = timer_ms_gettime64();
 
+        /* Send any ACK that has been held back long enough. */
+        if(i->state >= TCP_STATE_ESTABLISHED &&
+                i->state <= TCP_STATE_TIME_WAIT && i->data.ack_pending &&
+                i->data.ack_timer + TCP_DELACK_TIME <= timer)
+            tcp_send_ack(i);
+
         switch(i->state) {
             case TCP_STATE_LISTEN:
                 break;
 
             case TCP_STATE_SYN_SENT:
-
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
-                }
-
-                break;
-
             case TCP_STATE_SYN_RECEIVED:
 
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
+                /* If our last <SYN> or <SYN,ACK> was sent more than one
+                   retransmission timeout ago and we are still in the same
+                   state, send another one and back off the timer. */
+                if(i->data.timer + tcp_rto(i) <= timer) {
+                    tcp_send_syn(i, i->state == TCP_STATE_SYN_RECEIVED);
                     i->data.timer = timer;
+                    i->data.rtt_timing = 0;
+                    ++i->data.retransmits;
+
+                    if(tcp_rto(i) < TCP_MAX_RTO)
+                        ++i->data.backoff;
                 }
 
                 break;
@@ -2892,8 +3846,23 @@ static void tcp_thd_cb(void *arg) {
             case TCP_STATE_CLOSE_WAIT:
 
                 if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
+                        i->data.timer + tcp_rto(i) <= timer) {
+                    /* The retransmission timer went off. Take that as a sign
+                       of serious congestion, and start over from slow start
+                       with one segment (RFC 5681 section 3.1). Any SACK
+                       information we had might have been reneged on, so that
+                       gets forgotten too (RFC 2018 section 8). */
+                    tcp_cc_loss(i);
+                    i->data.cwnd = i->data.snd.mss;
+                    i->data.recover = i->data.snd.nxt;
+                    i->data.in_recovery = 0;
+                    i->data.dupacks = 0;
+                    i->data.snd_sack_cnt = 0;
+
+                    if(tcp_rto(i) < TCP_MAX_RTO)
+                        ++i->data.backoff;
+
+                    tcp_send_data(i, TCP_SEND_ALL);
                 }
                 else if(!i->data.sndbuf_cur_sz &&
                         (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
@@ -2925,6 +3894,7 @@ static void tcp_thd_cb(void *arg) {
         if((i->intflags & TCP_IFLAG_CANBEDEL) &&
                 (i->state & 0x0F) == TCP_STATE_CLOSED) {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
@@ -2972,6 +3942,7 @@ int net_tcp_init(void) {
 
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
+    int j;
 
     /* Kill the thread and make sure we can grab the lock */
     if(thd_cb_id >= 0)
@@ -2991,6 +3962,7 @@ void net_tcp_shutdown(void) {
         }
         else {
             LIST_REMOVE(i, sock_list);
+            tcp_unhash(i);
             cond_destroy(&i->data.send_cv);
             cond_destroy(&i->data.recv_cv);
             mutex_destroy(&i->mutex);
@@ -3004,6 +3976,12 @@ void net_tcp_shutdown(void) {
 
     LIST_INIT(&tcp_socks);
 
+    for(j = 0; j < TCP_CONN_HASH_SIZE; ++j)
+        LIST_INIT(&tcp_conn_hash[j]);
+
+    for(j = 0; j < TCP_PORT_HASH_SIZE; ++j)
+        LIST_INIT(&tcp_port_hash[j]);
+
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
 }
@@ -54,6 +54,8 @@ TAILQ_HEAD(udp_pkt_queue, udp_pkt);
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) hash_list;
+    int hashed;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -78,6 +80,55 @@ static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
 static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Sockets that have a local port are also kept in a hash table indexed by that
+   port, so that incoming packets don't have to walk the whole list of sockets.
+   Since bind() won't let two sockets share a port, a bucket will almost always
+   hold only the one socket that could possibly match. This is protected by
+   udp_mutex, just like the list above. Must be a power of two. */
+#define UDP_HASH_SIZE       32
+
+static struct udp_sock_list udp_port_hash[UDP_HASH_SIZE];
+
+static inline struct udp_sock_list *udp_hash_bucket(uint16_t port) {
+    return &udp_port_hash[(port ^ (port >> 8)) & (UDP_HASH_SIZE - 1)];
+}
+
+/* Move a socket to the right hash bucket after its local port has changed. */
+static void udp_rehash(struct udp_sock *sock) {
+    if(sock->hashed) {
+        LIST_REMOVE(sock, hash_list);
+        sock->hashed = 0;
+    }
+
+    if(sock->local_addr.sin6_port) {
+        LIST_INSERT_HEAD(udp_hash_bucket(sock->local_addr.sin6_port), sock,
+                         hash_list);
+        sock->hashed = 1;
+    }
+}
+
+/* Is any socket other than the one given bound to the specified port? */
+static int udp_port_in_use(uint16_t port, const struct udp_sock *self) {
+    struct udp_sock *iter;
+
+    LIST_FOREACH(iter, udp_hash_bucket(port), hash_list) {
+        if(iter != self && iter->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Pick the first unused port >= 1024 for a socket that doesn't have one. */
+static uint16_t udp_pick_port(const struct udp_sock *self) {
+    uint16_t port = 1024;
+
+    while(udp_port_in_use(htons(port), self))
+        ++port;
+
+    return htons(port);
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
                             const struct sockaddr_in6 *dst, const uint8_t *data,
                             size_t size, uint32_t flags, int hops,
@@ -94,7 +145,7 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
 
@@ -167,39 +218,21 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udp_port_in_use(realaddr6.sin6_port, udpsock)) {
+            mutex_unlock(&udp_mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         udpsock->local_addr = realaddr6;
     }
     else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
         udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+        udpsock->local_addr.sin6_port = udp_pick_port(udpsock);
     }
 
     udpsock->sock = hnd->fd;
+    udp_rehash(udpsock);
 
     mutex_unlock(&udp_mutex);
 
@@ -484,22 +517,8 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     }
 
     if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr.sin6_port = htons(port);
+        udpsock->local_addr.sin6_port = udp_pick_port(udpsock);
+        udp_rehash(udpsock);
     }
 
     local_addr = udpsock->local_addr;
@@ -613,6 +632,9 @@ static void net_udp_close(net_socket_t *hnd) {
 
     LIST_REMOVE(udpsock, sock_list);
 
+    if(udpsock->hashed)
+        LIST_REMOVE(udpsock, hash_list);
+
     free(udpsock);
     mutex_unlock(&udp_mutex);
 }
@@ -1101,11 +1123,26 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
 
 extern void __poll_event_trigger(int fd, short event);
 
+/* Copy the payload of an incoming datagram into its queue entry. If check is
+   set, the checksum of the whole datagram is verified on the way through, with
+   cs being the sum of the pseudo-header. Returns nonzero on a bad checksum. */
+static int udp_copy_payload(struct udp_pkt *pkt, const uint8_t *data,
+                            int check, uint16_t cs) {
+    if(!check) {
+        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        return 0;
+    }
+
+    cs = ~net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+    return net_ipv4_checksum_copy(pkt->data, data + sizeof(udp_hdr_t),
+                                  pkt->datasize, cs) != 0;
+}
+
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, check = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1121,17 +1158,11 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* Calculate the checksum if one was computed by the sender.
            Unfortunately, with IPv4, we don't know if a zero checksum means that
            the sender didn't calculate the checksum or if it actually came out
-           as 0xFFFF. We pretty much have to assume the former option though. */
+           as 0xFFFF. We pretty much have to assume the former option though.
+           The actual check is done while copying the data out below. */
         if(hdr->checksum != 0) {
             cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDP, size);
-
-            /* If the checksum is right, we'll get zero back from the checksum
-               function */
-            if(net_ipv4_checksum(data, size, cs)) {
-                /* The checksum was wrong, bail out */
-                ++udp_stats.pkt_recv_bad_chksum;
-                return -1;
-            }
+            check = 1;
         }
     }
     else {
@@ -1164,7 +1195,7 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_hash_bucket(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1190,18 +1221,6 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         if(sock->proto != ip->protocol)
             continue;
 
-        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
-           for the socket. We have to be careful here not to reject packets with
-           full coverage that just happen to be smaller than the coverage set by
-           the userspace program. Note that failing this check DOES NOT change
-           any of the statistics counters at all, by design. */
-        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
-           cscov < sock->udp_lite.recv_cscov) {
-            /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
-            return 0;
-        }
-
         if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
             mutex_unlock(&udp_mutex);
             return -1;
@@ -1222,7 +1241,30 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        /* The checksum has to be right before the socket's own filtering
+           gets to look at the packet, just as if it was checked up front. */
+        if(udp_copy_payload(pkt, data, check, cs)) {
+            /* The checksum was wrong, bail out */
+            free(pkt->data);
+            free(pkt);
+            ++udp_stats.pkt_recv_bad_chksum;
+            mutex_unlock(&udp_mutex);
+            return -1;
+        }
+
+        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
+           for the socket. We have to be careful here not to reject packets with
+           full coverage that just happen to be smaller than the coverage set by
+           the userspace program. Note that failing this check DOES NOT change
+           any of the statistics counters at all, by design. */
+        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
+           cscov < sock->udp_lite.recv_cscov) {
+            /* Silently drop packets that fail the partial coverage check. */
+            free(pkt->data);
+            free(pkt);
+            mutex_unlock(&udp_mutex);
+            return 0;
+        }
 
         TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
 
@@ -1234,7 +1276,13 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
+    /* Nobody was there to copy the data out for, but still make sure a bad
+       packet gets counted as such. */
+    if(check && net_ipv4_checksum(data, size, cs))
+        ++udp_stats.pkt_recv_bad_chksum;
+    else
+        ++udp_stats.pkt_recv_no_sock;
+
     mutex_unlock(&udp_mutex);
 
     return -1;
@@ -1243,8 +1291,8 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
 static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, check = 0;
     struct udp_sock *sock;
     struct udp_pkt *pkt;
 
@@ -1258,17 +1306,11 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
 
     if(ip->next_header == IPPROTO_UDP) {
         /* Calculate the checksum of the packet. Note that this is optional for
-           IPv4 but required for IPv6. */
+           IPv4 but required for IPv6. The actual check is done while copying
+           the data out below. */
         cs = net_ipv6_checksum_pseudo(&ip->src_addr, &ip->dst_addr, size,
                                       IPPROTO_UDP);
-
-        /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, size, cs)) {
-            /* The checksum was wrong, bail out */
-            ++udp_stats.pkt_recv_bad_chksum;
-            return -1;
-        }
+        check = 1;
     }
     else {
         cscov = ntohs(hdr->length);
@@ -1301,7 +1343,7 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         /* If the mutex is locked, there isn't much that can be done. */
         return -1;
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_hash_bucket(hdr->dst_port), hash_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1327,18 +1369,6 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         if(sock->proto != ip->next_header)
             continue;
 
-        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
-           for the socket. We have to be careful here not to reject packets with
-           full coverage that just happen to be smaller than the coverage set by
-           the userspace program. Note that failing this check DOES NOT change
-           any of the statistics counters at all, by design. */
-        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
-           cscov < sock->udp_lite.recv_cscov) {
-            /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
-            return 0;
-        }
-
         if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
             mutex_unlock(&udp_mutex);
             return -1;
@@ -1358,7 +1388,30 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         pkt->from.sin6_addr = ip->src_addr;
         pkt->from.sin6_port = hdr->src_port;
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
+        /* The checksum has to be right before the socket's own filtering
+           gets to look at the packet, just as if it was checked up front. */
+        if(udp_copy_payload(pkt, data, check, cs)) {
+            /* The checksum was wrong, bail out */
+            free(pkt->data);
+            free(pkt);
+            ++udp_stats.pkt_recv_bad_chksum;
+            mutex_unlock(&udp_mutex);
+            return -1;
+        }
+
+        /* If this packet is UDP-Lite, make sure the checksum coverage is valid
+           for the socket. We have to be careful here not to reject packets with
+           full coverage that just happen to be smaller than the coverage set by
+           the userspace program. Note that failing this check DOES NOT change
+           any of the statistics counters at all, by design. */
+        if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
+           cscov < sock->udp_lite.recv_cscov) {
+            /* Silently drop packets that fail the partial coverage check. */
+            free(pkt->data);
+            free(pkt);
+            mutex_unlock(&udp_mutex);
+            return 0;
+        }
 
         TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
 
@@ -1370,7 +1423,13 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         return 0;
     }
 
-    ++udp_stats.pkt_recv_no_sock;
+    /* Nobody was there to copy the data out for, but still make sure a bad
+       packet gets counted as such. */
+    if(check && net_ipv4_checksum(data, size, cs))
+        ++udp_stats.pkt_recv_bad_chksum;
+    else
+        ++udp_stats.pkt_recv_no_sock;
+
     mutex_unlock(&udp_mutex);
 
     return -1;
@@ -1438,24 +1497,33 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
-    size += sizeof(udp_hdr_t);
-
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
     hdr->checksum = 0;
 
     /* Is this UDP or UDP-Lite? */
     if(proto == IPPROTO_UDP) {
-        hdr->length = htons(size);
+        hdr->length = htons(size + sizeof(udp_hdr_t));
 
         if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
-            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
-                                          proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
+            /* Sum up the payload as we copy it in, then finish off with the
+               header, so that the data only gets touched once. */
+            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr,
+                                          size + sizeof(udp_hdr_t), proto);
+            cs = ~net_ipv4_checksum_copy(buf + sizeof(udp_hdr_t), data, size,
+                                         cs);
+            size += sizeof(udp_hdr_t);
+            hdr->checksum = net_ipv4_checksum(buf, sizeof(udp_hdr_t), cs);
+        }
+        else {
+            memcpy(buf + sizeof(udp_hdr_t), data, size);
+            size += sizeof(udp_hdr_t);
         }
     }
     else {
+        memcpy(buf + sizeof(udp_hdr_t), data, size);
+        size += sizeof(udp_hdr_t);
+
         if(cscov <= size) {
             hdr->length = htons(cscov);
         }
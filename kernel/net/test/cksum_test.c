@@ -0,0 +1,219 @@
+/* KallistiOS ##version##
+
+   cksum_test.c
+
+   Checks net_ipv4_checksum() and net_ipv4_checksum_copy() against a plain
+   RFC 1071 sum, for every alignment of the source and destination and a
+   spread of lengths, then times them against the old checksum loop.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* net_ipv4.h pulls in the rest of KOS, and only these are needed */
+#define __LOCAL_NET_IPV4_H
+#define __pure  __attribute__((pure))
+
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes,
+                                  uint16_t start);
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
+
+#include "net_ipv4_cksum.c"
+
+#define MAX_BYTES   (150 * 1024)
+#define GUARD       0x5a
+
+static int failures;
+
+static void check(int ok, const char *what, size_t a, size_t b) {
+    if(!ok) {
+        printf("FAIL: %s (%zu, %zu)\n", what, a, b);
+        failures++;
+    }
+}
+
+/* RFC 1071, one 16-bit word at a time in native byte order, with the odd byte
+   at the end added on its own like the kernel does */
+static uint16_t ref_checksum(const uint8_t *data, size_t bytes,
+                             uint16_t start) {
+    uint64_t sum = start;
+    uint16_t w;
+    size_t i;
+
+    for(i = 0; i + 1 < bytes; i += 2) {
+        memcpy(&w, data + i, 2);
+        sum += w;
+    }
+
+    if(bytes & 1)
+        sum += data[bytes - 1];
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+/* The loop net_ipv4_checksum() used before, for the timings. Only its aligned
+   path is here, since the unaligned one read the wrong bytes. */
+static uint16_t old_checksum(const uint8_t *data, size_t bytes,
+                             uint16_t start) {
+    const uint16_t *ptr = (const uint16_t *)data;
+    uint32_t sum = start;
+    size_t i = bytes;
+
+    while(i > 1) {
+        sum += *ptr++;
+        i -= 2;
+
+        while(sum >> 16)
+            sum = (sum >> 16) + (sum & 0xFFFF);
+    }
+
+    if(i)
+        sum += data[bytes - 1];
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+/* An IPv4 header with its checksum field cleared, and what goes there */
+static const uint8_t ip_hdr[20] = {
+    0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+    0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7
+};
+static const uint8_t ip_hdr_cksum[2] = { 0xb8, 0x61 };
+
+static void test_vectors(void) {
+    /* The example in RFC 1071 section 3 sums to ddf2 in network order */
+    static const uint8_t rfc[8] = {
+        0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7
+    };
+    uint8_t hdr[20], out[2];
+    uint16_t cs;
+
+    cs = net_ipv4_checksum(rfc, 8, 0) ^ 0xFFFF;
+    memcpy(out, &cs, 2);
+    check(out[0] == 0xdd && out[1] == 0xf2, "RFC 1071 example", out[0],
+          out[1]);
+
+    memcpy(hdr, ip_hdr, 20);
+    cs = net_ipv4_checksum(hdr, 20, 0);
+    memcpy(out, &cs, 2);
+    check(!memcmp(out, ip_hdr_cksum, 2), "IPv4 header", out[0], out[1]);
+
+    memcpy(hdr + 10, &cs, 2);
+    check(net_ipv4_checksum(hdr, 20, 0) == 0, "IPv4 header verify", 0, 0);
+    check(net_ipv4_checksum(NULL, 0, 0) == 0xFFFF, "empty", 0, 0);
+}
+
+static int test_length(size_t n) {
+    return n < 300 || n % 997 == 0 || n == 1460 || n == 1500 ||
+           n == 32767 || n == 32768 || n == 32769 || n == 65535 ||
+           n == 65536 || n == MAX_BYTES - 8;
+}
+
+static void test_alignments(const uint8_t *data, uint8_t *buf) {
+    size_t n, sa, da, k;
+    uint16_t start, ref, cs;
+
+    for(n = 0; n <= MAX_BYTES - 8; n++) {
+        if(!test_length(n))
+            continue;
+
+        start = rand();
+
+        for(sa = 0; sa < 8; sa++) {
+            ref = ref_checksum(data + sa, n, start);
+            cs = net_ipv4_checksum(data + sa, n, start);
+            check(cs == ref, "checksum", n, sa);
+
+            for(da = 0; da < 8; da++) {
+                memset(buf, GUARD, n + 16);
+                cs = net_ipv4_checksum_copy(buf + da, data + sa, n, start);
+                check(cs == ref, "copy checksum", n, sa * 8 + da);
+                check(!memcmp(buf + da, data + sa, n), "copy data", n,
+                      sa * 8 + da);
+
+                for(k = 0; k < da; k++)
+                    check(buf[k] == GUARD, "copy before dst", n, sa * 8 + da);
+
+                for(k = da + n; k < n + 16; k++)
+                    check(buf[k] == GUARD, "copy after dst", n, sa * 8 + da);
+            }
+        }
+    }
+}
+
+/* A block can be summed after the one behind it, passing the complement of
+   the later block's checksum as the start, as the UDP and TCP senders do */
+static void test_chaining(const uint8_t *data, uint8_t *buf) {
+    size_t n, k;
+    uint16_t cs;
+
+    for(n = 0; n < 200; n++) {
+        for(k = 0; k <= n; k += 2) {
+            cs = net_ipv4_checksum_copy(buf + k, data + k, n - k, 0) ^ 0xFFFF;
+            cs = net_ipv4_checksum(data, k, cs);
+            check(cs == ref_checksum(data, n, 0), "chained", n, k);
+        }
+    }
+}
+
+typedef uint16_t (*cksum_fn)(const uint8_t *data, size_t bytes,
+                             uint16_t start);
+
+/* MB/s over 1460 byte segments, checksummed or copied and checksummed */
+static double bench(cksum_fn fn, int copy, const uint8_t *data, uint8_t *buf) {
+    volatile uint16_t sink = 0;
+    size_t total = 0, i;
+    clock_t start = clock();
+
+    while(clock() - start < CLOCKS_PER_SEC / 4) {
+        for(i = 0; i < 1000; i++) {
+            if(copy && fn)
+                sink += net_ipv4_checksum_copy(buf, data, 1460, 0);
+            else if(copy) {
+                memcpy(buf, data, 1460);
+                sink += old_checksum(buf, 1460, 0);
+            }
+            else
+                sink += fn(data, 1460, 0);
+        }
+
+        total += 1460 * 1000;
+    }
+
+    (void)sink;
+    return total / ((double)(clock() - start) / CLOCKS_PER_SEC) / 1e6;
+}
+
+int main(void) {
+    uint8_t *data = malloc(MAX_BYTES), *buf = malloc(MAX_BYTES + 16);
+    size_t i;
+
+    for(i = 0; i < MAX_BYTES; i++)
+        data[i] = rand();
+
+    test_vectors();
+    test_alignments(data, buf);
+    test_chaining(data, buf);
+
+    printf("MB/s over 1460 bytes         old      new\n");
+    printf("checksum                %8.0f %8.0f\n",
+           bench(old_checksum, 0, data, buf),
+           bench(net_ipv4_checksum, 0, data, buf));
+    printf("copy and checksum       %8.0f %8.0f\n",
+           bench(NULL, 1, data, buf), bench(net_ipv4_checksum, 1, data, buf));
+
+    free(data);
+    free(buf);
+    printf("%s\n", failures ? "FAILED" : "All tests passed");
+    return failures ? 1 : 0;
+}
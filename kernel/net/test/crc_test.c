@@ -0,0 +1,205 @@
+/* KallistiOS ##version##
+
+   crc_test.c
+
+   Checks the table driven CRCs in net_crc.c against the standard check
+   values and against the bitwise loops they replaced, for every alignment,
+   a spread of lengths and blocks split up for the _update functions. Then
+   times both.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* kos/net.h pulls in the rest of KOS, and only these are needed */
+#define __KOS_NET_H
+#define __pure  __attribute__((pure))
+
+#define NET_CRC32LE_INIT    0xFFFFFFFF
+#define NET_CRC32BE_INIT    0xFFFFFFFF
+
+uint32_t __pure net_crc32le(const uint8_t *data, int size);
+uint32_t __pure net_crc32le_update(uint32_t crc, const uint8_t *data,
+                                   int size);
+uint32_t __pure net_crc32be(const uint8_t *data, int size);
+uint32_t __pure net_crc32be_update(uint32_t crc, const uint8_t *data,
+                                   int size);
+uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start);
+
+static inline uint32_t net_crc32le_final(uint32_t crc) {
+    return ~crc;
+}
+
+#include "net_crc.c"
+
+#define MAX_BYTES   4096
+
+static int failures;
+
+static void check(int ok, const char *what, int a, int b) {
+    if(!ok) {
+        printf("FAIL: %s (%d, %d)\n", what, a, b);
+        failures++;
+    }
+}
+
+/* The old loops, a bit at a time */
+static uint32_t old_crc32le(const uint8_t *data, int size) {
+    int i, j;
+    uint32_t rv = 0xFFFFFFFF;
+
+    for(i = 0; i < size; ++i) {
+        rv ^= data[i];
+
+        for(j = 0; j < 8; ++j)
+            rv = (0xEDB88320 & (-(rv & 1))) ^ (rv >> 1);
+    }
+
+    return ~rv;
+}
+
+static uint32_t old_crc32be(const uint8_t *data, int size) {
+    int i, j;
+    uint32_t rv = 0xFFFFFFFF, b, c;
+
+    for(i = 0; i < size; ++i) {
+        b = data[i];
+
+        for(j = 0; j < 8; ++j) {
+            c = ((rv & 0x80000000) ? 1 : 0) ^ (b & 1);
+            b >>= 1;
+
+            if(c)   rv = ((rv << 1) ^ 0x04C11DB6) | c;
+            else    rv <<= 1;
+        }
+    }
+
+    return rv;
+}
+
+static uint16_t old_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
+    uint16_t rv = start, tmp;
+
+    while(size--) {
+        tmp = (rv >> 8) ^ *data++;
+        tmp ^= tmp >> 4;
+
+        rv = (rv << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
+    }
+
+    return rv;
+}
+
+static void test_vectors(void) {
+    static const uint8_t check_str[] = "123456789";
+    uint32_t crc;
+
+    /* CRC-32 and CRC-16/IBM-3740 check values, and what the old big-endian
+       loop gave */
+    crc = net_crc32le(check_str, 9);
+    check(crc == 0xCBF43926, "crc32le check", crc, 0);
+    crc = net_crc32be(check_str, 9);
+    check(crc == 0x9B63D02C, "crc32be check", crc, 0);
+    crc = net_crc16ccitt(check_str, 9, 0xFFFF);
+    check(crc == 0x29B1, "crc16ccitt check", crc, 0);
+
+    check(net_crc32le(check_str, 0) == 0, "crc32le empty", 0, 0);
+    check(net_crc32be(check_str, 0) == 0xFFFFFFFF, "crc32be empty", 0, 0);
+}
+
+static void test_old(const uint8_t *data) {
+    int n, a;
+    uint16_t start;
+
+    for(n = 0; n <= MAX_BYTES - 8; n = n < 100 ? n + 1 : n * 3 / 2) {
+        for(a = 0; a < 8; a++) {
+            start = rand();
+            check(net_crc32le(data + a, n) == old_crc32le(data + a, n),
+                  "crc32le", n, a);
+            check(net_crc32be(data + a, n) == old_crc32be(data + a, n),
+                  "crc32be", n, a);
+            check(net_crc16ccitt(data + a, n, start) ==
+                  old_crc16ccitt(data + a, n, start), "crc16ccitt", n, a);
+        }
+    }
+}
+
+static void test_update(const uint8_t *data) {
+    int n, k, a;
+    uint32_t crc;
+
+    for(n = 0; n < 64; n++) {
+        for(k = 0; k <= n; k++) {
+            a = (n + k) & 7;
+
+            crc = net_crc32le_update(NET_CRC32LE_INIT, data + a, k);
+            crc = net_crc32le_update(crc, data + a + k, n - k);
+            check(net_crc32le_final(crc) == net_crc32le(data + a, n),
+                  "crc32le_update", n, k);
+
+            crc = net_crc32be_update(NET_CRC32BE_INIT, data + a, k);
+            crc = net_crc32be_update(crc, data + a + k, n - k);
+            check(crc == net_crc32be(data + a, n), "crc32be_update", n, k);
+
+            crc = net_crc16ccitt(data + a, k, 0xFFFF);
+            crc = net_crc16ccitt(data + a + k, n - k, crc);
+            check(crc == net_crc16ccitt(data + a, n, 0xFFFF),
+                  "crc16ccitt continued", n, k);
+        }
+    }
+}
+
+typedef uint32_t (*crc_fn)(const uint8_t *data, int size);
+
+static uint32_t crc16(const uint8_t *data, int size) {
+    return net_crc16ccitt(data, size, 0xFFFF);
+}
+
+static uint32_t old_crc16(const uint8_t *data, int size) {
+    return old_crc16ccitt(data, size, 0xFFFF);
+}
+
+/* MB/s over 1514 byte frames */
+static double bench(crc_fn fn, const uint8_t *data) {
+    volatile uint32_t sink = 0;
+    size_t total = 0;
+    clock_t start = clock();
+    int i;
+
+    while(clock() - start < CLOCKS_PER_SEC / 4) {
+        for(i = 0; i < 100; i++)
+            sink += fn(data, 1514);
+
+        total += 1514 * 100;
+    }
+
+    (void)sink;
+    return total / ((double)(clock() - start) / CLOCKS_PER_SEC) / 1e6;
+}
+
+int main(void) {
+    uint8_t *data = malloc(MAX_BYTES);
+    int i;
+
+    for(i = 0; i < MAX_BYTES; i++)
+        data[i] = rand();
+
+    test_vectors();
+    test_old(data);
+    test_update(data);
+
+    printf("MB/s over 1514 bytes         old      new\n");
+    printf("crc32le                 %8.0f %8.0f\n",
+           bench(old_crc32le, data), bench(net_crc32le, data));
+    printf("crc32be                 %8.0f %8.0f\n",
+           bench(old_crc32be, data), bench(net_crc32be, data));
+    printf("crc16ccitt              %8.0f %8.0f\n",
+           bench(old_crc16, data), bench(crc16, data));
+
+    free(data);
+    printf("%s\n", failures ? "FAILED" : "All tests passed");
+    return failures ? 1 : 0;
+}
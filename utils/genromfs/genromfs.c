@@ -56,6 +56,13 @@
  * -A N,/name force named file(s) (shell globbing applied against the filenames)
  *       to be aligned on N bytes boundary
  * In both cases, N must be a power of two.
+ * -c    compress regular files (KallistiOS fs_romdisk extension, see below)
+ * -B N  compress in blocks of N bytes
+ * -L N,SIZE force uncompressed files of SIZE bytes or more to be aligned
+ *       on N bytes boundary
+ * -s    sort directories by name, for reproducible images
+ * -u    update an existing image, rewriting only what changed
+ * -j N  read and compress files on N threads
  */
 
 /*
@@ -87,6 +94,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #if defined(linux) || defined(sun)
 #    include <sys/sysmacros.h>
@@ -110,6 +118,9 @@ struct romfh {
 #define ROMFH_FIF 7
 #define ROMFH_EXEC 8
 
+/* spec of a compressed regular file, see compressnode() */
+#define ROMFS_COMP_MAGIC 0x4b5a0001
+
 struct filenode;
 
 struct filehdr {
@@ -138,6 +149,10 @@ struct filenode {
     unsigned int offset;
     unsigned int size;
     unsigned int pad;
+    char *path;             /* Path in the image of a regular file */
+    unsigned char *data;    /* Contents of a regular file */
+    unsigned char *zdata;   /* Compressed data (-c), or NULL if stored raw */
+    unsigned int zsize;
 };
 
 struct aligns {
@@ -198,6 +213,9 @@ static char bigbuf[4096];
 static char fixbuf[512];
 static int atoffs = 0;
 static int align = 16;
+static int largealign = 16;
+static unsigned int largesize = 0;
+static int sortnames = 0;
 struct aligns *alignlist = NULL;
 struct excludes *excludelist = NULL;
 int realbase;
@@ -230,6 +248,11 @@ int findalign(struct filenode *node) {
         }
     }
 
+    /* Compressed files can't be used in place, so aligning them is useless */
+    if(S_ISREG(node->modes) && !node->zdata && largesize &&
+            node->size >= largesize && largealign > i)
+        i = largealign;
+
     return i;
 }
 
@@ -377,42 +400,16 @@ int dumpnode(struct filenode *node, FILE *f) {
         dumpdataa(bigbuf, node->size, f);
     }
 #endif
+    else if(S_ISREG(node->modes) && node->zdata) {
+        ri.nextfh |= htonl(ROMFH_REG);
+        ri.spec = htonl(ROMFS_COMP_MAGIC);
+        dumpri(&ri, node, f);
+        dumpdataa(node->zdata, node->zsize, f);
+    }
     else if(S_ISREG(node->modes)) {
-        int offset, len, fd, max, avail;
         ri.nextfh |= htonl(ROMFH_REG);
         dumpri(&ri, node, f);
-        offset = 0;
-        max = node->size;
-        /* XXX warn about size mismatch */
-        fd = open(node->realname, O_RDONLY
-#ifdef O_BINARY
-                  | O_BINARY
-#endif
-                 );
-
-        if(fd) {
-            while(offset < max) {
-                avail = max - offset < sizeof(bigbuf) ? max - offset : sizeof(bigbuf);
-                len = read(fd, bigbuf, avail);
-
-                if(len <= 0)
-                    break;
-
-                dumpdata(bigbuf, len, f);
-                offset += len;
-            }
-
-            close(fd);
-        }
-
-        max = (max + 15)&~15;
-
-        while(offset < max) {
-            avail = max - offset < sizeof(bigbuf) ? max - offset : sizeof(bigbuf);
-            memset(bigbuf, 0, avail);
-            dumpdata(bigbuf, avail, f);
-            offset += avail;
-        }
+        dumpdataa(node->data, node->size, f);
     }
 #if !defined(_WIN32) || defined(__CYGWIN__)
     else if(S_ISCHR(node->modes)) {
@@ -484,7 +481,7 @@ void setnode(struct filenode *n, dev_t dev, ino_t ino, mode_t um) {
     n->modes = um;
 }
 
-struct filenode *newnode(const char *base, const char *name, int curroffset) {
+struct filenode *newnode(const char *base, const char *name, int notroot) {
     struct filenode *node;
     int len;
     char *str;
@@ -507,7 +504,7 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     strcpy(str, name);
     node->name = str;
 
-    if(!curroffset) {
+    if(!notroot) {
         len = 1;
         name = ".";
     }
@@ -540,8 +537,12 @@ struct filenode *newnode(const char *base, const char *name, int curroffset) {
     node->size = 0;
     node->devnode = 0;
     node->orig_link = NULL;
-    node->offset = curroffset;
+    node->offset = 0;
     node->pad = 0;
+    node->path = NULL;
+    node->data = NULL;
+    node->zdata = NULL;
+    node->zsize = 0;
 
     return node;
 }
@@ -574,7 +575,8 @@ struct filenode *findnode(struct filenode *node, dev_t dev, ino_t ino) {
 #define ALIGNUP16(x) (((x)+15)&~15)
 
 int spaceneeded(struct filenode *node) {
-    return 16 + ALIGNUP16(strlen(node->name) + 1) + ALIGNUP16(node->size);
+    return 16 + ALIGNUP16(strlen(node->name) + 1) +
+           ALIGNUP16(node->zdata ? node->zsize : node->size);
 }
 
 int alignnode(struct filenode *node, int curroffset, int extraspace) {
@@ -592,10 +594,425 @@ int alignnode(struct filenode *node, int curroffset, int extraspace) {
     return curroffset;
 }
 
-int processdir(int level, const char *base, const char *dirname, struct stat *sb,
-               struct filenode *dir, struct filenode *root, int curroffset) {
+/* Compression functions
+ *
+ * With -c, the data of each regular file is split into blocks which are
+ * compressed separately, so that KallistiOS' fs_romdisk can decompress only
+ * the blocks a read touches.  Such a file has ROMFS_COMP_MAGIC in its spec
+ * field, and its size is still the uncompressed size.  Its data is:
+ *
+ *   block size                  (32 bits, big-endian)
+ *   offset of each block        (32 bits, big-endian, one more than there
+ *                                are blocks, from the start of the data)
+ *   the blocks
+ *
+ * Each block is in the LZ4 block format, unless its compressed size would
+ * be the same as its uncompressed size, in which case it's stored as it is.
+ * Files that don't get smaller are stored uncompressed, as usual.  Images
+ * with compressed files can't be mounted by Linux.
+ */
+
+#define LZ_MINMATCH     4
+#define LZ_LASTLITERALS 5       /* The last bytes of a block are literals */
+#define LZ_MFLIMIT      12      /* No match can start this close to the end */
+#define LZ_MAXOFFSET    65535
+#define LZ_HASHBITS     14
+
+static int compress = 0;
+static unsigned int blocksize = 8192;
+static unsigned int comp_files, comp_total;
+static unsigned long long comp_raw, comp_size, comp_rawall, comp_sizeall;
+static unsigned long long comp_in;
+static double comp_time, decomp_time;
+static pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static unsigned char *lz_putlen(unsigned char *op, unsigned int len) {
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = len;
+    return op;
+}
+
+/* Write a sequence: literals, then a match if mlen isn't 0 */
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *lit,
+                                  unsigned int litlen, unsigned int off,
+                                  unsigned int mlen) {
+    unsigned char *token = op++;
+
+    *token = (litlen < 15 ? litlen : 15) << 4;
+
+    if(litlen >= 15)
+        op = lz_putlen(op, litlen - 15);
+
+    memcpy(op, lit, litlen);
+    op += litlen;
+
+    if(mlen) {
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        mlen -= LZ_MINMATCH;
+        *token |= mlen < 15 ? mlen : 15;
+
+        if(mlen >= 15)
+            op = lz_putlen(op, mlen - 15);
+    }
+
+    return op;
+}
+
+/* Compress len bytes of src into dst, which must have room for
+   len + len / 255 + 16 bytes.  Returns the compressed size. */
+unsigned int lz_compress(const unsigned char *src, unsigned int len,
+                         unsigned char *dst) {
+    int table[1 << LZ_HASHBITS];
+    unsigned char *op = dst;
+    unsigned int ip = 0, anchor = 0, mlen, h;
+    int ref;
+
+    memset(table, 0xff, sizeof(table));
+
+    if(len > LZ_MFLIMIT) {
+        while(ip < len - LZ_MFLIMIT) {
+            h = lz_hash(lz_read32(src + ip));
+            ref = table[h];
+            table[h] = ip;
+
+            if(ref < 0 || ip - ref > LZ_MAXOFFSET ||
+                    lz_read32(src + ref) != lz_read32(src + ip)) {
+                /* Skip faster through data that doesn't compress */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+
+            mlen = LZ_MINMATCH;
+
+            while(ip + mlen < len - LZ_LASTLITERALS &&
+                    src[ip + mlen] == src[ref + mlen])
+                mlen++;
+
+            op = lz_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+            ip += mlen;
+            anchor = ip;
+
+            if(ip < len - LZ_MFLIMIT)
+                table[lz_hash(lz_read32(src + ip - 2))] = ip - 2;
+        }
+    }
+
+    op = lz_sequence(op, src + anchor, len - anchor, 0, 0);
+    return op - dst;
+}
+
+/* Decompress an LZ4 block into dst, which has room for dstlen bytes.  This
+   is the same as the decoder in fs_romdisk.  Returns the decompressed size,
+   or -1 if the block is corrupt. */
+int lz_decompress(const unsigned char *src, unsigned int srclen,
+                  unsigned char *dst, unsigned int dstlen) {
+    const unsigned char *ip = src, *iend = src + srclen, *match;
+    unsigned char *op = dst, *oend = dst + dstlen;
+    unsigned int token, len, off, b;
+
+    while(ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+
+        if(len == 15) {
+            do {
+                if(ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        if(len > (unsigned int)(iend - ip) || len > (unsigned int)(oend - op))
+            return -1;
+
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* The last sequence has no match */
+        if(ip == iend)
+            break;
+
+        if(iend - ip < 2)
+            return -1;
+
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if(!off || off > (unsigned int)(op - dst))
+            return -1;
+
+        len = token & 15;
+
+        if(len == 15) {
+            do {
+                if(ip >= iend)
+                    return -1;
+
+                b = *ip++;
+                len += b;
+            } while(b == 255);
+        }
+
+        len += LZ_MINMATCH;
+
+        if(len > (unsigned int)(oend - op))
+            return -1;
+
+        match = op - off;
+
+        if(off >= len) {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else {
+            while(len--)
+                *op++ = *match++;
+        }
+    }
+
+    return op - dst;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Uncompressed size of a block of a file */
+static unsigned int blocklen(unsigned int size, unsigned int block) {
+    size -= block * blocksize;
+    return size < blocksize ? size : blocksize;
+}
+
+static int reused;
+static int reuseold(struct filenode *n);
+
+/* Try compressing a regular file, leaving it as it is if that doesn't help.
+   Files that are aligned with -A are expected to be mmap()ed, so those are
+   never compressed.  This runs on the worker threads. */
+int compressnode(struct filenode *node) {
+    struct aligns *pa;
+    unsigned char *raw = node->data, *data, *check;
+    unsigned int nblocks, hdrsize, pos, i, len, clen, off;
+    double start, ctime, dtime;
+
+    if(!node->size)
+        return 0;
+
+    for(pa = alignlist; pa; pa = pa->next) {
+        if(!nodematch(pa->pattern, node))
+            return 0;
+    }
+
+    /* With -u, files that haven't changed keep their old compressed data */
+    if(reuseold(node)) {
+        pthread_mutex_lock(&statlock);
+        reused++;
+        pthread_mutex_unlock(&statlock);
+        return 0;
+    }
+
+    nblocks = (node->size + blocksize - 1) / blocksize;
+    hdrsize = 4 + 4 * (nblocks + 1);
+    data = malloc(hdrsize + node->size + node->size / 255 + 16);
+    check = malloc(node->size);
+
+    if(!data || !check) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    put32(data, blocksize);
+    pos = hdrsize;
+    start = now();
+
+    for(i = 0; i < nblocks; i++) {
+        len = blocklen(node->size, i);
+        put32(data + 4 + 4 * i, pos);
+        clen = lz_compress(raw + i * blocksize, len, data + pos);
+
+        if(clen >= len) {
+            memcpy(data + pos, raw + i * blocksize, len);
+            clen = len;
+        }
+
+        pos += clen;
+    }
+
+    put32(data + 4 + 4 * nblocks, pos);
+    ctime = now() - start;
+
+    /* Make sure it all comes back out, and time how long that takes */
+    start = now();
+
+    for(i = 0; i < nblocks; i++) {
+        len = blocklen(node->size, i);
+        off = get32(data + 4 + 4 * i);
+        clen = get32(data + 8 + 4 * i) - off;
+
+        if(clen == len)
+            memcpy(check + i * blocksize, data + off, len);
+        else if(lz_decompress(data + off, clen, check + i * blocksize,
+                              len) != (int)len)
+            break;
+    }
+
+    dtime = now() - start;
+
+    if(i < nblocks || memcmp(check, raw, node->size)) {
+        fprintf(stderr, "compression failed for '%s'\n", node->realname);
+        exit(1);
+    }
+
+    free(check);
+
+    pthread_mutex_lock(&statlock);
+    comp_in += node->size;
+    comp_time += ctime;
+    decomp_time += dtime;
+    pthread_mutex_unlock(&statlock);
+
+    if(ALIGNUP16(pos) >= ALIGNUP16(node->size)) {
+        free(data);
+        return 0;
+    }
+
+    node->zdata = data;
+    node->zsize = pos;
+
+    return 0;
+}
+
+/* Add up how much the files were compressed */
+void countcompression(struct filenode **files, int count) {
+    struct filenode *n;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        n = files[i];
+        comp_total++;
+        comp_rawall += n->size;
+        comp_sizeall += n->zdata ? n->zsize : n->size;
+
+        if(n->zdata) {
+            comp_files++;
+            comp_raw += n->size;
+            comp_size += n->zsize;
+        }
+    }
+}
+
+void showcompression(FILE *f) {
+    fprintf(f, "Compressed %u of %u files in %u byte blocks\n",
+            comp_files, comp_total, blocksize);
+
+    if(comp_raw)
+        fprintf(f, "  compressed files: %llu -> %llu bytes (%.1f%%)\n",
+                comp_raw, comp_size, 100.0 * comp_size / comp_raw);
+
+    if(comp_rawall)
+        fprintf(f, "  all files:        %llu -> %llu bytes (%.1f%%)\n",
+                comp_rawall, comp_sizeall, 100.0 * comp_sizeall / comp_rawall);
+
+    if(comp_time > 0 && decomp_time > 0)
+        fprintf(f, "  compression %.1f MB/s, decompression %.1f MB/s\n",
+                comp_in / comp_time / 1e6, comp_in / decomp_time / 1e6);
+}
+
+/* Sorted order of names: . and .. first, as Linux expects, then the rest */
+static int namerank(const char *name) {
+    if(!strcmp(name, "."))
+        return 0;
+
+    return strcmp(name, "..") ? 2 : 1;
+}
+
+static int cmpnames(const void *a, const void *b) {
+    const char *x = *(char * const *)a, *y = *(char * const *)b;
+    int d = namerank(x) - namerank(y);
+
+    return d ? d : strcmp(x, y);
+}
+
+/* Names of a directory's entries, in the order they are added to the image */
+char **readnames(const char *dirname, int *count) {
     DIR *dirfd;
     struct dirent *dp;
+    char **names = NULL;
+    int n = 0, max = 0;
+
+    dirfd = opendir(dirname);
+
+    if(!dirfd) {
+        fprintf(stderr, "can't read directory '%s'\n", dirname);
+        return NULL;
+    }
+
+    while((dp = readdir(dirfd))) {
+        if(n == max) {
+            max = max ? max * 2 : 64;
+            names = realloc(names, max * sizeof(*names));
+        }
+
+        if(!names || !(names[n++] = strdup(dp->d_name))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    closedir(dirfd);
+
+    if(sortnames && n)
+        qsort(names, n, sizeof(*names), cmpnames);
+
+    *count = n;
+    return names;
+}
+
+/* Add the contents of a directory to the tree.  Offsets are worked out later,
+ * by layoutdir().
+ */
+int processdir(int level, const char *base, const char *dirname, struct stat *sb,
+               struct filenode *dir, struct filenode *root) {
+    char **names;
+    const char *name;
+    int i, count;
     struct filenode *n, *link;
     struct excludes *pe;
 
@@ -604,7 +1021,7 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
          * we add them first.  Note also that we alloc them
          * first to get to know the real name
          */
-        link = newnode(base, ".", curroffset);
+        link = newnode(base, ".", 1);
 
         if(!lstat(link->realname, sb)) {
             setnode(link, sb->st_dev, sb->st_ino, sb->st_mode);
@@ -615,28 +1032,31 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
              */
             dir->dirlist.owner = link;
 
-            curroffset = alignnode(link, curroffset, 0) + spaceneeded(link);
-            n = newnode(base, "..", curroffset);
+            n = newnode(base, "..", 1);
 
             if(!lstat(n->realname, sb)) {
                 setnode(n, sb->st_dev, sb->st_ino, sb->st_mode);
                 append(&dir->dirlist, n);
                 n->orig_link = link;
-                curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
             }
         }
     }
 
-    dirfd = opendir(dir->realname);
+    names = readnames(dir->realname, &count);
+
+    if(!names)
+        return -1;
+
+    for(i = 0; i < count; i++) {
+        name = names[i];
 
-    while((dp = readdir(dirfd))) {
         /* don't process main . and .. twice */
         if(level <= 1 &&
-                (strcmp(dp->d_name, ".") == 0
-                 || strcmp(dp->d_name, "..") == 0))
+                (strcmp(name, ".") == 0
+                 || strcmp(name, "..") == 0))
             continue;
 
-        n = newnode(base, dp->d_name, curroffset);
+        n = newnode(base, name, 1);
 
         /* Process exclude list. */
         for(pe = excludelist; pe; pe = pe->next) {
@@ -737,16 +1157,11 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
 
         if(link) {
             n->orig_link = link;
-            curroffset = alignnode(n, curroffset, 0) + spaceneeded(n);
             continue;
         }
 
-        if(S_ISREG(sb->st_mode)) {
-            curroffset = alignnode(n, curroffset, spaceneeded(n));
+        if(S_ISREG(sb->st_mode))
             n->size = sb->st_size;
-        }
-        else
-            curroffset = alignnode(n, curroffset, 0);
 
 #if !defined(_WIN32) || defined(__CYGWIN__)
         if(S_ISLNK(sb->st_mode)) {
@@ -754,29 +1169,459 @@ int processdir(int level, const char *base, const char *dirname, struct stat *sb
         }
 #endif
 
-        curroffset += spaceneeded(n);
-
         if(S_ISCHR(sb->st_mode) || S_ISBLK(sb->st_mode)) {
             n->devnode = sb->st_rdev;
         }
 
         if(S_ISDIR(sb->st_mode)) {
             if(!strcmp(n->name, "..")) {
-                curroffset = processdir(level + 1, dir->realname, dp->d_name,
-                                        sb, dir, root, curroffset);
+                if(processdir(level + 1, dir->realname, name, sb, dir, root))
+                    return -1;
             }
             else {
-                curroffset = processdir(level + 1, n->realname, dp->d_name,
-                                        sb, n, root, curroffset);
+                if(processdir(level + 1, n->realname, name, sb, n, root))
+                    return -1;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++)
+        free(names[i]);
+
+    free(names);
+    return 0;
+}
+
+/* Work out where everything in a directory goes, starting at curroffset.
+ * Returns the offset after the directory.
+ */
+int layoutdir(struct filenode *dir, int curroffset) {
+    struct filenode *n;
+
+    for(n = dir->dirlist.head; n->next; n = n->next) {
+        n->offset = curroffset;
+        n->pad = 0;
+
+        /* Regular files are aligned by their data, after the header */
+        if(S_ISREG(n->modes) && !n->orig_link)
+            curroffset = alignnode(n, curroffset,
+                                   16 + ALIGNUP16(strlen(n->name) + 1));
+        else
+            curroffset = alignnode(n, curroffset, 0);
+
+        curroffset += spaceneeded(n);
+
+        if(S_ISDIR(n->modes) && !n->orig_link)
+            curroffset = layoutdir(n, curroffset);
+    }
+
+    return curroffset;
+}
+
+/* Regular files of the previous image, for -u */
+struct oldfile {
+    char *path;
+    const unsigned char *data;
+    unsigned int spec;
+    unsigned int size;
+};
+
+static unsigned char *oldimg;
+static unsigned int oldimgsize;
+static struct oldfile *oldfiles;
+static int oldcount, oldmax;
+
+static int cmpoldfiles(const void *a, const void *b) {
+    return strcmp(((const struct oldfile *)a)->path,
+                  ((const struct oldfile *)b)->path);
+}
+
+/* Start of a header's data, or 0 if the header isn't inside the image */
+static unsigned int olddata(unsigned int off) {
+    unsigned int i;
+
+    if(off & 15 || off > oldimgsize - 32)
+        return 0;
+
+    for(i = off + 16; i < oldimgsize; i++) {
+        if(!oldimg[i])
+            return off + 16 + ALIGNUP16(i - off - 16 + 1);
+    }
+
+    return 0;
+}
+
+/* Note down the regular files in a directory of the old image */
+static int scanold(unsigned int off, const char *prefix, int depth) {
+    unsigned int data, next, type, spec, size, count = 0;
+    const char *name;
+    struct oldfile *o;
+    char *path;
+
+    while(off) {
+        if(!(data = olddata(off)) || depth > 64 || ++count > oldimgsize / 16)
+            return -1;
+
+        next = get32(oldimg + off);
+        spec = get32(oldimg + off + 4);
+        size = get32(oldimg + off + 8);
+        name = (const char *)oldimg + off + 16;
+        type = next & 7;
+
+        if(type == ROMFH_REG || (type == ROMFH_DIR && strcmp(name, ".") &&
+                                 strcmp(name, ".."))) {
+            path = malloc(strlen(prefix) + strlen(name) + 2);
+
+            if(!path) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
             }
 
-            if(curroffset < 0)
+            sprintf(path, "%s/%s", prefix, name);
+
+            if(type == ROMFH_DIR) {
+                if(scanold(spec, path, depth + 1))
+                    return -1;
+
+                free(path);
+            }
+            else if(data + (spec == ROMFS_COMP_MAGIC ? 0 : size) >
+                    oldimgsize) {
                 return -1;
+            }
+            else {
+                if(oldcount == oldmax) {
+                    oldmax = oldmax ? oldmax * 2 : 256;
+                    oldfiles = realloc(oldfiles, oldmax * sizeof(*oldfiles));
+
+                    if(!oldfiles) {
+                        fprintf(stderr, "out of memory\n");
+                        exit(1);
+                    }
+                }
+
+                o = oldfiles + oldcount++;
+                o->path = path;
+                o->data = oldimg + data;
+                o->spec = spec;
+                o->size = size;
+            }
         }
+
+        off = next & ~15;
     }
 
-    closedir(dirfd);
-    return curroffset;
+    return 0;
+}
+
+/* Read the image that -u is going to update.  Returns its volume name, or
+ * NULL if there is no usable image.
+ */
+char *readold(const char *fn) {
+    FILE *f = fopen(fn, "rb");
+    unsigned int files;
+    long len;
+
+    if(!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if(len < 32 || !(oldimg = malloc(len))) {
+        fclose(f);
+        return NULL;
+    }
+
+    if(fread(oldimg, 1, len, f) != (size_t)len ||
+            memcmp(oldimg, "-rom1fs-", 8)) {
+        fclose(f);
+        free(oldimg);
+        oldimg = NULL;
+        return NULL;
+    }
+
+    fclose(f);
+    oldimgsize = len;
+
+    /* The superblock is laid out like a header, with the volume name */
+    if(!(files = olddata(0)) || scanold(files, "", 0)) {
+        fprintf(stderr, "%s: not a usable romfs image, rebuilding it\n", fn);
+        oldcount = 0;
+    }
+
+    qsort(oldfiles, oldcount, sizeof(*oldfiles), cmpoldfiles);
+    return (char *)oldimg + 16;
+}
+
+/* Whether a file's old compressed data can be reused as it is */
+static int reuseold(struct filenode *n) {
+    struct oldfile key, *o;
+    unsigned int nblocks, i, len, off, clen;
+    unsigned char *check;
+    int same;
+
+    if(!oldcount)
+        return 0;
+
+    key.path = n->path;
+    o = bsearch(&key, oldfiles, oldcount, sizeof(*oldfiles), cmpoldfiles);
+
+    if(!o || o->spec != ROMFS_COMP_MAGIC || o->size != n->size || !n->size)
+        return 0;
+
+    nblocks = (n->size + blocksize - 1) / blocksize;
+
+    if(o->data + 8 + 4 * nblocks > oldimg + oldimgsize ||
+            get32(o->data) != blocksize)
+        return 0;
+
+    /* The offsets must all lie inside the image */
+    for(i = 0; i <= nblocks; i++) {
+        off = get32(o->data + 4 + 4 * i);
+
+        if(off > oldimgsize || o->data + off > oldimg + oldimgsize ||
+                (i && off < get32(o->data + 4 * i)))
+            return 0;
+    }
+
+    if(!(check = malloc(blocksize))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for(i = 0, same = 1; same && i < nblocks; i++) {
+        len = blocklen(n->size, i);
+        off = get32(o->data + 4 + 4 * i);
+        clen = get32(o->data + 8 + 4 * i) - off;
+
+        if(clen == len)
+            same = !memcmp(o->data + off, n->data + i * blocksize, len);
+        else
+            same = lz_decompress(o->data + off, clen, check, len) == (int)len &&
+                   !memcmp(check, n->data + i * blocksize, len);
+    }
+
+    free(check);
+
+    if(!same)
+        return 0;
+
+    n->zsize = get32(o->data + 4 + 4 * nblocks);
+
+    if(!(n->zdata = malloc(n->zsize))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    memcpy(n->zdata, o->data, n->zsize);
+    return 1;
+}
+
+/* Read a regular file, and compress it if asked to.  This runs on the worker
+ * threads.
+ */
+int preparenode(struct filenode *n) {
+    FILE *f;
+
+    /* One more byte, so that empty files still get a buffer */
+    if(!(n->data = malloc(n->size + 1))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if(!(f = fopen(n->realname, "rb"))) {
+        perror(n->realname);
+        return -1;
+    }
+
+    if(fread(n->data, 1, n->size, f) != n->size) {
+        fprintf(stderr, "'%s' changed while reading it\n", n->realname);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    return compress ? compressnode(n) : 0;
+}
+
+/* Collect the regular files in a directory, in the order they are dumped */
+static void collectfiles(struct filenode *dir, const char *prefix,
+                         struct filenode ***files, int *count, int *max) {
+    struct filenode *n;
+    char *path;
+
+    for(n = dir->dirlist.head; n->next; n = n->next) {
+        if(n->orig_link || !strcmp(n->name, ".") || !strcmp(n->name, ".."))
+            continue;
+
+        if(!S_ISREG(n->modes) && !S_ISDIR(n->modes))
+            continue;
+
+        path = malloc(strlen(prefix) + strlen(n->name) + 2);
+
+        if(!path) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        sprintf(path, "%s/%s", prefix, n->name);
+
+        if(S_ISDIR(n->modes)) {
+            collectfiles(n, path, files, count, max);
+            free(path);
+            continue;
+        }
+
+        if(*count == *max) {
+            *max = *max ? *max * 2 : 256;
+            *files = realloc(*files, *max * sizeof(**files));
+
+            if(!*files) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+
+        n->path = path;
+        (*files)[(*count)++] = n;
+    }
+}
+
+/* Files are handed out to the workers one at a time, in order */
+static struct filenode **jobfiles;
+static int jobcount, jobnext, jobfailed;
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *prepareworker(void *arg) {
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&joblock);
+        i = jobfailed ? jobcount : jobnext++;
+        pthread_mutex_unlock(&joblock);
+
+        if(i >= jobcount)
+            break;
+
+        if(preparenode(jobfiles[i])) {
+            pthread_mutex_lock(&joblock);
+            jobfailed = 1;
+            pthread_mutex_unlock(&joblock);
+        }
+    }
+
+    return NULL;
+}
+
+/* Read (and compress) all regular files, on up to jobs threads */
+int preparefiles(struct filenode **files, int count, int jobs) {
+    pthread_t *threads;
+    int i, started;
+
+    jobfiles = files;
+    jobcount = count;
+    jobnext = jobfailed = 0;
+
+    if(jobs > count)
+        jobs = count;
+
+    if(jobs <= 1) {
+        prepareworker(NULL);
+        return jobfailed ? -1 : 0;
+    }
+
+    if(!(threads = malloc(jobs * sizeof(*threads)))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for(started = 0; started < jobs; started++) {
+        if(pthread_create(threads + started, NULL, prepareworker, NULL))
+            break;
+    }
+
+    /* If no thread could be started, do the work here */
+    if(!started)
+        prepareworker(NULL);
+
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    return jobfailed ? -1 : 0;
+}
+
+/* Write a new image over the old one.  If nothing moved, only the parts
+ * that changed are written, and an unchanged image isn't touched at all.
+ * Returns the number of bytes written, or -1 on error.
+ */
+long updateimage(const char *fn, FILE *tmp) {
+    unsigned char *img;
+    unsigned int pos, len;
+    long size, written = 0;
+    FILE *f;
+
+    fflush(tmp);
+    size = ftell(tmp);
+    rewind(tmp);
+
+    if(!(img = malloc(size))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if(fread(img, 1, size, tmp) != (size_t)size) {
+        perror("temporary file");
+        return -1;
+    }
+
+    if(size == (long)oldimgsize) {
+        if(!(f = fopen(fn, "r+b"))) {
+            perror(fn);
+            return -1;
+        }
+
+        for(pos = 0; pos < oldimgsize; pos += len) {
+            len = oldimgsize - pos < 4096 ? oldimgsize - pos : 4096;
+
+            if(!memcmp(img + pos, oldimg + pos, len))
+                continue;
+
+            if(fseek(f, pos, SEEK_SET) || fwrite(img + pos, 1, len, f) != len) {
+                perror(fn);
+                fclose(f);
+                return -1;
+            }
+
+            written += len;
+        }
+    }
+    else {
+        if(!(f = fopen(fn, "wb"))) {
+            perror(fn);
+            return -1;
+        }
+
+        if(fwrite(img, 1, size, f) != (size_t)size) {
+            perror(fn);
+            fclose(f);
+            return -1;
+        }
+
+        written = size;
+    }
+
+    free(img);
+
+    if(fclose(f)) {
+        perror(fn);
+        return -1;
+    }
+
+    return written;
 }
 
 void showhelp(const char *argv0) {
@@ -790,7 +1635,13 @@ void showhelp(const char *argv0) {
     printf("  -V VOLUME              Use the specified volume name\n");
     printf("  -a ALIGN               Align regular file data to ALIGN bytes\n");
     printf("  -A ALIGN,PATTERN       Align all objects matching pattern to at least ALIGN bytes\n");
+    printf("  -L ALIGN,SIZE          Align uncompressed files of SIZE bytes or more to at least ALIGN bytes\n");
     printf("  -x PATTERN             Exclude all objects matching pattern\n");
+    printf("  -c                     Compress regular files (for KallistiOS only)\n");
+    printf("  -B SIZE                Compress in blocks of SIZE bytes (default 8192)\n");
+    printf("  -s                     Sort directories by name, for reproducible images\n");
+    printf("  -u                     Update IMAGE, reusing what hasn't changed\n");
+    printf("  -j JOBS                Read and compress files on JOBS threads\n");
     printf("  -h                     Show this help\n");
     printf("\n");
     printf("Report bugs to chexum@shadow.banki.hu\n");
@@ -810,9 +1661,14 @@ int main(int argc, char *argv[]) {
     char *p;
     struct aligns *pa, *pa2;
     struct excludes *pe, *pe2;
+    struct filenode **files = NULL;
+    int count = 0, max = 0;
+    int update = 0;
+    int jobs = 0;
+    long written;
     FILE *f;
 
-    while((c = getopt(argc, argv, "V:vd:f:ha:A:x:")) != EOF) {
+    while((c = getopt(argc, argv, "V:vd:f:ha:A:L:x:cB:suj:")) != EOF) {
         switch(c) {
             case 'd':
                 dir = optarg;
@@ -866,6 +1722,21 @@ int main(int argc, char *argv[]) {
                     pa2->next = pa;
                 }
 
+                break;
+            case 'L':
+                largealign = strtoul(optarg, &p, 0);
+
+                if(largealign < 16 || (largealign & (largealign - 1))) {
+                    fprintf(stderr, "Align has to be at least 16 bytes and a power of two\n");
+                    exit(1);
+                }
+
+                if(*p != ',' || !p[1]) {
+                    fprintf(stderr, "-L takes N,SIZE format of argument, where N and SIZE are numbers\n");
+                    exit(1);
+                }
+
+                largesize = strtoul(p + 1, NULL, 0);
                 break;
             case 'x':
                 pe = (struct excludes *)malloc(sizeof(*pe) + strlen(optarg) + 1);
@@ -881,50 +1752,140 @@ int main(int argc, char *argv[]) {
                     pe2->next = pe;
                 }
 
+                break;
+            case 'c':
+                compress = 1;
+                break;
+            case 'B':
+                blocksize = strtoul(optarg, NULL, 0);
+
+                if(blocksize < 512 || blocksize > 65536 ||
+                        (blocksize & (blocksize - 1))) {
+                    fprintf(stderr, "Block size has to be a power of two from 512 to 65536 bytes\n");
+                    exit(1);
+                }
+
+                break;
+            case 's':
+                sortnames = 1;
+                break;
+            case 'u':
+                update = 1;
+                break;
+            case 'j':
+                jobs = strtoul(optarg, NULL, 0);
+
+                if(jobs < 1) {
+                    fprintf(stderr, "Need at least one job\n");
+                    exit(1);
+                }
+
                 break;
             default:
                 exit(1);
         }
     }
 
-    if(!volname) {
-        sprintf(buf, "rom %" PRId64, (int64_t)time(NULL));
-        volname = buf;
-    }
-
     if(!outf) {
         fprintf(stderr, "%s: you must specify the destination file\n", argv[0]);
         fprintf(stderr, "Try `%s -h' for more information\n", argv[0]);
         exit(1);
     }
 
-    if(strcmp(outf, "-") == 0) {
-        f = fdopen(1, "wb");
+    if(!strcmp(outf, "-"))
+        update = 0;
+
+    /* Keep the old volume name, so that an unchanged image stays the same */
+    if(update && (p = readold(outf)) && !volname)
+        volname = p;
+
+    if(!volname) {
+        p = getenv("SOURCE_DATE_EPOCH");
+
+        if(p)
+            sprintf(buf, "rom %" PRId64, (int64_t)strtoll(p, NULL, 10));
+        else
+            sprintf(buf, "rom %" PRId64, sortnames ? (int64_t)0 :
+                    (int64_t)time(NULL));
+
+        volname = buf;
     }
-    else
-        f = fopen(outf, "wb");
 
-    if(!f) {
-        perror(outf);
-        exit(1);
+    if(!jobs) {
+#ifdef _SC_NPROCESSORS_ONLN
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+        if(jobs < 1)
+            jobs = 1;
     }
 
     realbase = strlen(dir);
     root = newnode(dir, volname, 0);
     root->parent = root;
-    lastoff = processdir(1, dir, dir, &sb, root, root, spaceneeded(root));
-    if(lastoff < 0) {
+
+    if(processdir(1, dir, dir, &sb, root, root)) {
         fprintf(stderr, "Error while processing directory.\n");
         return 1;
     }
 
-    if(verbose)
+    collectfiles(root, "", &files, &count, &max);
+
+    if(preparefiles(files, count, jobs)) {
+        fprintf(stderr, "Error while reading files.\n");
+        return 1;
+    }
+
+    countcompression(files, count);
+    lastoff = layoutdir(root, spaceneeded(root));
+
+    if(verbose) {
         shownode(0, root, stderr);
 
+        if(compress)
+            showcompression(stderr);
+    }
+
+    if(update && oldimg)
+        f = tmpfile();
+    else if(strcmp(outf, "-") == 0)
+        f = fdopen(1, "wb");
+    else
+        f = fopen(outf, "wb");
+
+    if(!f) {
+        perror(update && oldimg ? "temporary file" : outf);
+        exit(1);
+    }
+
     if(dumpall(root, lastoff, f)) {
         fprintf(stderr, "Error while dumping!\n");
         return 1;
     }
 
-		return 0;
+    if(update && oldimg) {
+        written = updateimage(outf, f);
+
+        if(written < 0)
+            return 1;
+
+        if(verbose) {
+            if(compress)
+                fprintf(stderr, "Reused the compressed data of %d of %d files\n",
+                        reused, count);
+
+            if(!written)
+                fprintf(stderr, "%s is up to date\n", outf);
+            else
+                fprintf(stderr, "Wrote %ld of %u bytes of %s\n", written,
+                        (unsigned int)ftell(f), outf);
+        }
+    }
+
+    if(fclose(f)) {
+        perror(outf);
+        return 1;
+    }
+
+    return 0;
 }
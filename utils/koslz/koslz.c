@@ -0,0 +1,251 @@
+/* KallistiOS ##version##
+
+   koslz.c
+
+   Compresses and decompresses files in the stream format of libkosutils'
+   kos/lz.h, and measures how well and how fast files compress.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <kos/lz.h>
+
+#define DEFAULT_BLOCK   8192
+
+/* How long each speed test runs for, in seconds */
+#define BENCH_TIME      0.25
+
+static void usage(void) {
+    printf("koslz - compress data for kos/lz.h\n"
+           "Usage: koslz [-b SIZE] INPUT OUTPUT     compress INPUT\n"
+           "       koslz -d INPUT OUTPUT            decompress INPUT\n"
+           "       koslz -t [-b SIZE] FILE...       test how well and how fast FILEs compress\n"
+           "Options:\n"
+           "  -b SIZE   block size, a power of two from %d to %d (default %d)\n",
+           KOS_LZ_BLOCK_MIN, KOS_LZ_BLOCK_MAX, DEFAULT_BLOCK);
+}
+
+static unsigned char *read_file(const char *fn, size_t *size) {
+    FILE *f = fopen(fn, "rb");
+    unsigned char *data;
+    long len;
+
+    if(!f) {
+        perror(fn);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    /* One more byte, so that empty files still get a buffer */
+    if(!(data = malloc(len + 1))) {
+        fprintf(stderr, "%s: out of memory\n", fn);
+        fclose(f);
+        return NULL;
+    }
+
+    if(fread(data, 1, len, f) != (size_t)len) {
+        perror(fn);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+
+    fclose(f);
+    *size = len;
+    return data;
+}
+
+static int write_stdio(void *data, const uint8_t *buf, size_t size) {
+    return fwrite(buf, 1, size, (FILE *)data) == size ? 0 : -1;
+}
+
+/* Output into a memory buffer that is big enough */
+typedef struct {
+    unsigned char *buf;
+    size_t size;
+} membuf_t;
+
+static int write_mem(void *data, const uint8_t *buf, size_t size) {
+    membuf_t *m = (membuf_t *)data;
+
+    memcpy(m->buf + m->size, buf, size);
+    m->size += size;
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int convert(int decompress, size_t block_size, const char *in,
+                   const char *out) {
+    kos_lz_stream_t s;
+    unsigned char *data, *work;
+    size_t size;
+    FILE *f;
+    int rv;
+
+    if(!(data = read_file(in, &size)))
+        return 1;
+
+    if(!(f = fopen(out, "wb"))) {
+        perror(out);
+        free(data);
+        return 1;
+    }
+
+    if(decompress) {
+        work = malloc(KOS_LZ_DEC_WORK_SIZE(KOS_LZ_BLOCK_MAX));
+        rv = kos_lz_dec_start(&s, work, KOS_LZ_DEC_WORK_SIZE(KOS_LZ_BLOCK_MAX),
+                              write_stdio, f);
+        rv = rv || kos_lz_dec_write(&s, data, size) || kos_lz_dec_finish(&s);
+    }
+    else {
+        work = malloc(KOS_LZ_ENC_WORK_SIZE(block_size));
+        rv = kos_lz_enc_start(&s, block_size, work, write_stdio, f);
+        rv = rv || kos_lz_enc_write(&s, data, size) || kos_lz_enc_finish(&s);
+    }
+
+    if(fclose(f))
+        rv = 1;
+
+    if(rv) {
+        fprintf(stderr, "%s: %s failed\n", in,
+                decompress ? "decompression" : "compression");
+        remove(out);
+    }
+
+    free(work);
+    free(data);
+    return rv ? 1 : 0;
+}
+
+/* Compress a file as one stream, then decompress it, as many times as fit in
+   BENCH_TIME, and print the results. */
+static int bench(size_t block_size, const char *fn, size_t *total,
+                 size_t *total_comp, double *ctime, double *dtime) {
+    kos_lz_stream_t s;
+    unsigned char *data, *enc_work, *dec_work;
+    membuf_t comp, check;
+    double start, c, d;
+    size_t size;
+    int i, n;
+
+    if(!(data = read_file(fn, &size)))
+        return 1;
+
+    comp.buf = malloc(KOS_LZ_BOUND(size) + size / KOS_LZ_BLOCK_MIN * 4 + 16);
+    check.buf = malloc(size + 1);
+    enc_work = malloc(KOS_LZ_ENC_WORK_SIZE(block_size));
+    dec_work = malloc(KOS_LZ_DEC_WORK_SIZE(block_size));
+
+    start = now();
+
+    for(n = 0; !n || now() - start < BENCH_TIME; n++) {
+        comp.size = 0;
+        kos_lz_enc_start(&s, block_size, enc_work, write_mem, &comp);
+        kos_lz_enc_write(&s, data, size);
+        kos_lz_enc_finish(&s);
+    }
+
+    c = (now() - start) / n;
+    start = now();
+
+    for(i = 0; !i || now() - start < BENCH_TIME; i++) {
+        check.size = 0;
+        kos_lz_dec_start(&s, dec_work, KOS_LZ_DEC_WORK_SIZE(block_size),
+                         write_mem, &check);
+
+        if(kos_lz_dec_write(&s, comp.buf, comp.size) ||
+                kos_lz_dec_finish(&s))
+            break;
+    }
+
+    d = (now() - start) / (i ? i : 1);
+
+    if(check.size != size || memcmp(check.buf, data, size)) {
+        fprintf(stderr, "%s: decompressed data doesn't match\n", fn);
+        return 1;
+    }
+
+    printf("%-32s %10zu %10zu %6.1f%% %9.1f %9.1f\n", fn, size, comp.size,
+           size ? 100.0 * comp.size / size : 0.0,
+           size / c / 1e6, size / d / 1e6);
+
+    *total += size;
+    *total_comp += comp.size;
+    *ctime += c;
+    *dtime += d;
+
+    free(dec_work);
+    free(enc_work);
+    free(check.buf);
+    free(comp.buf);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t block_size = DEFAULT_BLOCK, total = 0, total_comp = 0;
+    double ctime = 0, dtime = 0;
+    int decompress = 0, test = 0, i, rv = 0;
+
+    for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if(!strcmp(argv[i], "-d")) {
+            decompress = 1;
+        }
+        else if(!strcmp(argv[i], "-t")) {
+            test = 1;
+        }
+        else if(!strcmp(argv[i], "-b") && i + 1 < argc) {
+            block_size = strtoul(argv[++i], NULL, 0);
+
+            if(block_size < KOS_LZ_BLOCK_MIN || block_size > KOS_LZ_BLOCK_MAX ||
+                    (block_size & (block_size - 1))) {
+                fprintf(stderr, "Block size has to be a power of two from %d to %d\n",
+                        KOS_LZ_BLOCK_MIN, KOS_LZ_BLOCK_MAX);
+                return 1;
+            }
+        }
+        else {
+            usage();
+            return !strcmp(argv[i], "-h") ? 0 : 1;
+        }
+    }
+
+    if(test) {
+        if(i == argc) {
+            usage();
+            return 1;
+        }
+
+        printf("%-32s %10s %10s %7s %9s %9s\n", "file", "size", "packed",
+               "ratio", "comp MB/s", "dec MB/s");
+
+        for(; i < argc; i++)
+            rv |= bench(block_size, argv[i], &total, &total_comp, &ctime,
+                        &dtime);
+
+        if(total)
+            printf("%-32s %10zu %10zu %6.1f%% %9.1f %9.1f\n", "total", total,
+                   total_comp, 100.0 * total_comp / total, total / ctime / 1e6,
+                   total / dtime / 1e6);
+
+        return rv;
+    }
+
+    if(argc - i != 2) {
+        usage();
+        return 1;
+    }
+
+    return convert(decompress, block_size, argv[i], argv[i + 1]);
+}
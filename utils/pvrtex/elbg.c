@@ -24,6 +24,7 @@
  */
 
 #include <string.h>
+#include <pthread.h>
 
 #include "libavutil/avassert.h"
 #include "libavutil/common.h"
@@ -31,6 +32,8 @@
 #include "elbg.h"
 
 #define DELTA_ERR_MAX 0.1  ///< Precision of the ELBG algorithm (as percentage error)
+#define MIN_JOB_WORK  (1 << 16)  ///< Fewest distances worth handing to a thread
+#define MAX_JOBS      64
 
 /**
  * In the ELBG jargon, a cell is the set of points that are closest to a
@@ -58,6 +61,8 @@ typedef struct ELBGContext {
     AVLFG *rand_state;
     int *scratchbuf;
     cell *cell_buffer;
+    int *best_dist;
+    int threads;
 
     /* Sizes for the buffers above. Pointers without such a field
      * are not allocated by us and only valid for the duration
@@ -69,23 +74,30 @@ typedef struct ELBGContext {
     unsigned scratchbuf_allocated;
     unsigned cell_buffer_allocated;
     unsigned temp_points_allocated;
+    unsigned best_dist_allocated;
 } ELBGContext;
 
-static inline int distance_limited(int *a, int *b, int dim, int limit)
+/**
+ * A range of points to assign to their nearest codebook entry on one thread.
+ */
+typedef struct {
+    ELBGContext *elbg;
+    int start, end;
+} assign_job;
+
+static inline int distance_limited(const int *av_restrict a, const int *av_restrict b,
+                                   int dim, int limit)
 {
-    //Changing the conditional allows for auto-vectorization, and does not seem to
-    //have any affect on final result
+    //Not exiting early once limit is reached allows for auto-vectorization, and
+    //does not affect the final result. The points are at most INT_SCALE (255), so
+    //the squares and their sum fit in 32 bits, which doubles the vector width
+    //compared to squaring in 64 bits.
     int i, dist=0;
     for (i=0; i<dim; i++) {
-        int64_t distance = a[i] - b[i];
-
-        distance *= distance;
-//      if (dist >= limit - distance)
-//          return limit;
-        dist += distance;
+        int distance = a[i] - b[i];
+        dist += distance * distance;
     }
 
-//  return dist;
     return dist > limit ? limit : dist;
 }
 
@@ -364,6 +376,87 @@ static void do_shiftings(ELBGContext *elbg)
         }
 }
 
+/**
+ * Find the first of the nearest codebook entries to each point in a job,
+ * and its distance. Palettes (one RGBA pixel per point) get their own copy
+ * with a constant dim, where distance_limited() becomes a single vector
+ * operation instead of a loop. Unrolling larger vectors doesn't help.
+ */
+static av_always_inline void assign_range(ELBGContext *elbg, int start, int end, int dim)
+{
+    int guess = 0;
+
+    for (int i = start; i < end; i++) {
+        const int *point = elbg->points + i * dim;
+        int best_idx = 0;
+
+        /* Neighbouring points tend to share an entry, so start with the
+           distance to the last one found as the limit. Adding one keeps
+           equally near entries before it in the running. */
+        int best_dist = distance_limited(point, elbg->codebook + guess * dim,
+                                         dim, INT_MAX);
+        if (best_dist < INT_MAX)
+            best_dist++;
+
+        for (int k = 0; k < elbg->num_cb; k++) {
+            int dist = distance_limited(point, elbg->codebook + k * dim,
+                                        dim, best_dist);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best_idx = k;
+            }
+        }
+        elbg->nearest_cb[i] = guess = best_idx;
+        elbg->best_dist[i] = best_dist;
+    }
+}
+
+static void *assign_job_run(void *arg)
+{
+    assign_job *job = arg;
+    ELBGContext *elbg = job->elbg;
+
+    if (elbg->dim == 4)
+        assign_range(elbg, job->start, job->end, 4);
+    else
+        assign_range(elbg, job->start, job->end, elbg->dim);
+
+    return NULL;
+}
+
+static void assign_points(ELBGContext *elbg, int numpoints)
+{
+    assign_job jobs[MAX_JOBS];
+    pthread_t tids[MAX_JOBS];
+    int started[MAX_JOBS];
+    int64_t work = (int64_t)numpoints * elbg->num_cb;
+    int num_jobs = FFMIN(elbg->threads, MAX_JOBS);
+
+    if (num_jobs > work / MIN_JOB_WORK)
+        num_jobs = work / MIN_JOB_WORK;
+    if (num_jobs < 1)
+        num_jobs = 1;
+
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].elbg = elbg;
+        jobs[i].start = (int64_t)numpoints * i / num_jobs;
+        jobs[i].end = (int64_t)numpoints * (i + 1) / num_jobs;
+    }
+
+    /* The first job runs here, and any that can't get a thread do too */
+    for (int i = 1; i < num_jobs; i++)
+        started[i] = !pthread_create(&tids[i], NULL, assign_job_run, &jobs[i]);
+
+    assign_job_run(&jobs[0]);
+
+    for (int i = 1; i < num_jobs; i++) {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            assign_job_run(&jobs[i]);
+    }
+}
+
 static void do_elbg(ELBGContext *av_restrict elbg, int *points, int numpoints,
                     int max_steps)
 {
@@ -384,21 +477,21 @@ static void do_elbg(ELBGContext *av_restrict elbg, int *points, int numpoints,
 
         elbg->error = 0;
 
-        /* This loop evaluate the actual Voronoi partition. It is the most
-           costly part of the algorithm. */
+        /* This evaluates the actual Voronoi partition. It is the most
+           costly part of the algorithm, so it's split across threads. */
+        assign_points(elbg, numpoints);
+
+        /* The threads each found the first of the nearest entries, but when
+           several are equally near, the serial search kept the one the
+           previous point picked. Resolve that here, in order, so the result
+           doesn't depend on the number of threads. */
         for (i=0; i < numpoints; i++) {
-            int best_dist = distance_limited(elbg->points   + i * elbg->dim,
-                                             elbg->codebook + best_idx * elbg->dim,
-                                             elbg->dim, INT_MAX);
-            for (int k = 0; k < elbg->num_cb; k++) {
-                int dist = distance_limited(elbg->points   + i * elbg->dim,
-                                            elbg->codebook + k * elbg->dim,
-                                            elbg->dim, best_dist);
-                if (dist < best_dist) {
-                    best_dist = dist;
-                    best_idx = k;
-                }
-            }
+            int best_dist = elbg->best_dist[i];
+            if (elbg->nearest_cb[i] != best_idx &&
+                distance_limited(elbg->points   + i * elbg->dim,
+                                 elbg->codebook + best_idx * elbg->dim,
+                                 elbg->dim, INT_MAX) != best_dist)
+                best_idx = elbg->nearest_cb[i];
             elbg->nearest_cb[i] = best_idx;
             elbg->error = (elbg->error >= INT_MAX - best_dist) ? INT_MAX : elbg->error + best_dist;
             elbg->utility[elbg->nearest_cb[i]] = (elbg->utility[elbg->nearest_cb[i]] >= INT_MAX - best_dist) ?
@@ -477,6 +570,8 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     elbg->codebook   = codebook;
     elbg->num_cb     = num_cb;
     elbg->dim        = dim;
+    if (elbg->threads < 1)
+        elbg->threads = 1;
 
 #define ALLOCATE_IF_NECESSARY(field, new_elements, multiplicator)            \
     if (elbg->field ## _allocated < new_elements) {                          \
@@ -498,6 +593,7 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     ALLOCATE_IF_NECESSARY(utility_inc, num_cb,    1)
     ALLOCATE_IF_NECESSARY(size_part,   num_cb,    1)
     ALLOCATE_IF_NECESSARY(cell_buffer, numpoints, 1)
+    ALLOCATE_IF_NECESSARY(best_dist,   numpoints, 1)
     ALLOCATE_IF_NECESSARY(scratchbuf,  dim,       5)
     if (numpoints > 24LL * elbg->num_cb) {
         /* The first step in the recursion in init_elbg() needs a buffer with
@@ -515,6 +611,18 @@ int avpriv_elbg_do(ELBGContext **elbgp, int *points, int dim, int numpoints,
     return 0;
 }
 
+int avpriv_elbg_set_threads(ELBGContext **elbgp, int threads)
+{
+    ELBGContext *const elbg = *elbgp ? *elbgp : av_mallocz(sizeof(*elbg));
+
+    if (!elbg)
+        return AVERROR(ENOMEM);
+    *elbgp = elbg;
+
+    elbg->threads = threads;
+    return 0;
+}
+
 av_cold void avpriv_elbg_free(ELBGContext **elbgp)
 {
     ELBGContext *elbg = *elbgp;
@@ -528,6 +636,7 @@ av_cold void avpriv_elbg_free(ELBGContext **elbgp)
     av_freep(&elbg->utility_inc);
     av_freep(&elbg->scratchbuf);
     av_freep(&elbg->temp_points);
+    av_freep(&elbg->best_dist);
 
     av_freep(elbgp);
 }
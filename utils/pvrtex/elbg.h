@@ -51,6 +51,17 @@ int avpriv_elbg_do(struct ELBGContext **ctx, int *points, int dim,
                    int numpoints, int *codebook, int num_cb, int num_steps,
                    int *closest_cb, AVLFG *rand_state, uintptr_t flags);
 
+/**
+ * Set the number of threads used to assign points to codebook entries.
+ * The result is the same for any number of threads.
+ *
+ * @param ctx  A pointer to a pointer to an already allocated ELBGContext
+ *             or a pointer to NULL, as for avpriv_elbg_do().
+ * @param threads Number of threads to use, 1 to not create any.
+ * @return < 0 in case of error, 0 otherwise
+ */
+int avpriv_elbg_set_threads(struct ELBGContext **ctx, int threads);
+
 /**
  * Free an ELBGContext and reset the pointer to it.
  */
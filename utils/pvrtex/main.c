@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "stb_image_write.h"
 #include "pvr_texture_encoder.h"
@@ -14,6 +15,7 @@
 #include "mycommon.h"
 #include "file_pvr.h"
 #include "file_tex.h"
+#include "texcache.h"
 
 extern int LoadPalette(const char *fname, PvrTexEncoder *pte);
 
@@ -22,7 +24,14 @@ extern int LoadPalette(const char *fname, PvrTexEncoder *pte);
 
 char const * program_name;
 
+//Name of the texture being converted by this thread in batch mode, prefixed to messages
+static _Thread_local const char *job_name;
+
 int log_level = LOG_PROGRESS;
+
+//Log level set by the batch job this thread is running, or -1 to use log_level
+static _Thread_local int job_log_level = -1;
+
 void pteLogLocV(unsigned level, const char *file, unsigned line, const char *fmt, va_list args) {
 	static const char * logtypes[] = {
 		[LOG_ALL] = "ALL",
@@ -34,17 +43,24 @@ void pteLogLocV(unsigned level, const char *file, unsigned line, const char *fmt
 		[LOG_NONE] = "NONE"
 	};
 
-	if (level > log_level)
+	int max_level = job_log_level >= 0 ? job_log_level : log_level;
+	if (level > max_level)
 		return;
 
-	if (log_level == LOG_DEBUG) {
+	//Keep messages from batch jobs on different threads from mixing
+	flockfile(stderr);
+
+	if (max_level == LOG_DEBUG) {
 		if (level >= LOG_DEBUG)
 			level = LOG_DEBUG;
 		if (file == NULL)
 			file = "unk";
 		fprintf(stderr, "[%s, ln %i] %s: ", file, line, logtypes[level]);
 	}
+	if (job_name)
+		fprintf(stderr, "[%s] ", job_name);
 	vfprintf(stderr, fmt, args);
+	funlockfile(stderr);
 }
 
 void pteLogLoc(unsigned level, const char *file, unsigned line, const char *fmt, ...) {
@@ -55,7 +71,10 @@ void pteLogLoc(unsigned level, const char *file, unsigned line, const char *fmt,
 }
 
 void ErrorExitV(const char *fmt, va_list args) {
-	fprintf(stderr, "Error: ");
+	if (job_name)
+		fprintf(stderr, "Error in batch job %s: ", job_name);
+	else
+		fprintf(stderr, "Error: ");
 	vfprintf(stderr, fmt, args);
 
 	fprintf(stderr, "\nUsage:\t%s -i inputimage -o output.pvr -f format [options]\n", program_name);
@@ -169,11 +188,91 @@ int GetOptMap(const OptionMap *map, size_t mapsize, const char *name, int defaul
 	return default_value;
 }
 
-int main(int argc, char **argv) {
-	program_name = (char*)basename(argv[0]);
+//Totals for a batch, shared by the worker threads
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned hits, misses;
+	double read_time, encode_time, write_time, cache_time;
+} ConvertStats;
+
+typedef struct {
+	const char *cachedir;	//Directory to cache results in, NULL to not cache
+	unsigned threads;	//Default number of compression threads, 0 for one per CPU
+	ConvertStats *stats;	//If not NULL, cache results and times are added to this
+} ConvertContext;
+
+typedef struct {
+	int option;
+	const char *arg;
+} KeyOption;
 
+static int RunBatch(const char *manifest, const char *cachedir, unsigned workers);
+
+//Returns the extension of a file name, or "" if it has none
+static const char *GetExtension(const char *fname) {
+	const char *ext = strrchr(fname, '.');
+	return ext ? ext : "";
+}
+
+static void KeyAddExtension(TexCacheKey *key, const char *fname) {
+	char ext[16] = "";
+	const char *src = GetExtension(fname);
+	for(size_t i = 0; i < sizeof(ext) - 1 && src[i]; i++)
+		ext[i] = tolower(src[i]);
+	tcKeyAddString(key, ext);
+}
+
+//Hashes everything that affects the converted texture, so that it can be found in the cache
+static void MakeCacheKey(TexCacheKey *key, const KeyOption *opts, unsigned opt_cnt,
+		const char **fnames, unsigned fname_cnt, const char *palfile, const char *outname, const char *prevname) {
+	tcKeyInit(key);
+
+	//Changes to pvrtex can change the result, so entries from other builds are never used
+	tcKeyAddString(key, "pvrtex " PVRTEX_VERSION " " __DATE__ " " __TIME__);
+
+	//Different options set different things, so the order they're given in doesn't matter,
+	//except for repeats of the same option. Sort them by option, keeping repeats in order,
+	//so that the same options written in another order find the same result.
+	KeyOption sorted[opt_cnt + 1];
+	for(unsigned i = 0; i < opt_cnt; i++) {
+		unsigned j = i;
+		for(; j > 0 && sorted[j - 1].option > opts[i].option; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = opts[i];
+	}
+
+	for(unsigned i = 0; i < opt_cnt; i++) {
+		char optname[16];
+		snprintf(optname, sizeof(optname), "%d", sorted[i].option);
+		tcKeyAddString(key, optname);
+		tcKeyAddString(key, sorted[i].arg);
+	}
+
+	//Only the types of the output files matter, not their names
+	tcKeyAddString(key, strlen(outname) ? "out" : "no out");
+	KeyAddExtension(key, outname);
+	tcKeyAddString(key, strlen(prevname) ? "preview" : "no preview");
+	KeyAddExtension(key, prevname);
+
+	for(unsigned i = 0; i < fname_cnt; i++) {
+		tcKeyAddString(key, "in");
+		KeyAddExtension(key, fnames[i]);
+		tcKeyAddFile(key, fnames[i]);
+	}
+	if (palfile) {
+		tcKeyAddString(key, "palette");
+		KeyAddExtension(key, palfile);
+		tcKeyAddFile(key, palfile);
+	}
+
+	tcKeyFinish(key);
+}
+
+//Converts one texture, as described by command line arguments
+static int ConvertTexture(int argc, char **argv, const ConvertContext *ctx) {
 	PvrTexEncoder pte;
 	pteInit(&pte);
+	pte.threads = ctx->threads;
 
 	struct optparse_long longopts[] = {
 		{"help", 'h', OPTPARSE_NONE},
@@ -203,6 +302,9 @@ int main(int argc, char **argv) {
 		{"normal-style", 1, OPTPARSE_REQUIRED},
 		{"flip-v", 2, OPTPARSE_NONE},
 		{"flip-y", 2, OPTPARSE_NONE},
+		{"jobs", 'j', OPTPARSE_REQUIRED},
+		{"batch", 3, OPTPARSE_REQUIRED},
+		{"cache", 4, OPTPARSE_REQUIRED},
 		{0}
 	};
 
@@ -212,6 +314,12 @@ int main(int argc, char **argv) {
 	const char *outname = "";
 	const char *prevname = "";
 	const char *palfile = NULL;
+	const char *batchname = NULL;
+	const char *cachedir = ctx->cachedir;
+
+	//Options that affect the resulting texture, in the order given
+	KeyOption key_opts[argc];
+	unsigned key_opt_cnt = 0;
 
 	//Parse command line parameters
 	struct optparse options;
@@ -280,7 +388,11 @@ int main(int argc, char **argv) {
 			ErrorExit("Option -%c not supported yet\n", option);
 			break;
 		case 'v':
-			log_level = LOG_INFO;
+			//In a batch, this only applies to the one texture
+			if (job_name)
+				job_log_level = LOG_INFO;
+			else
+				log_level = LOG_INFO;
 
 			//If someone runs this with only -v as a parameter, they probably want the version
 			if (argc != 2)
@@ -343,17 +455,39 @@ int main(int argc, char **argv) {
 		case 'P':
 			palfile = options.optarg;
 			break;
+		case 'j':
+			if ((sscanf(options.optarg, "%u", &pte.threads) != 1) || (pte.threads < 1) || (pte.threads > 256))  {
+				ErrorExit("invalid job count (should be [1, 256])\n");
+			}
+			break;
 		case 1:
 			pte.normal_style = GetOptMap(normal_style_options, ARR_SIZE(normal_style_options), options.optarg, -0, "invalid normal style method\n");
 			break;
 		case 2:
 			pte.flip_v = true;
 			break;
+		case 3:
+			ErrorExitOn(job_name != NULL, "--batch can't be used in a batch file\n");
+			batchname = options.optarg;
+			break;
+		case 4:
+			cachedir = options.optarg;
+			break;
 		default:
 			ErrorExit("%s\n", options.errmsg);
 		}
+
+		//File names are left out of the cache key, since their contents are hashed instead
+		if (option != 3 && option != 4 && !strchr("iopPvj", option)) {
+			key_opts[key_opt_cnt].option = option;
+			key_opts[key_opt_cnt].arg = options.optarg;
+			key_opt_cnt++;
+		}
 	}
 
+	if (batchname)
+		return RunBatch(batchname, cachedir, pte.threads);
+
 	bool have_output = strlen(outname) > 0;
 	bool have_preview = strlen(prevname) > 0;
 	bool already_have_pal_file = false;
@@ -377,6 +511,41 @@ int main(int argc, char **argv) {
 	ErrorExitOn(!have_output && !have_preview, "No output or preview file name specified, nothing to do\n");
 	ErrorExitOn(fname_cnt == 0, "No input files specified\n");
 
+	//Files written, for the cache
+	char palname[1024];
+	snprintf(palname, sizeof(palname), "%s.pal", outname);
+	bool may_write_pal = have_output && !only_want_pal && (output_file_type == EXT_TEX || output_file_type == EXT_DT);
+	TexCacheFiles cache_files = {
+		.out = have_output ? outname : NULL,
+		.pal = may_write_pal ? palname : NULL,
+		.preview = have_preview ? prevname : NULL,
+	};
+	const char *texname = have_output ? outname : prevname;
+
+	double cache_time = 0, read_time = 0, encode_time = 0, write_time = 0;
+	double start = SecondsNow();
+
+	TexCacheKey key;
+	if (cachedir) {
+		MakeCacheKey(&key, key_opts, key_opt_cnt, fnames, fname_cnt, palfile, outname, prevname);
+
+		if (tcRestore(cachedir, &key, &cache_files)) {
+			cache_time = SecondsNow() - start;
+			pteLog(LOG_COMPLETION, "Using cached result %s for \"%s\"\n", key.hex, texname);
+
+			if (ctx->stats) {
+				pthread_mutex_lock(&ctx->stats->lock);
+				ctx->stats->hits++;
+				ctx->stats->cache_time += cache_time;
+				pthread_mutex_unlock(&ctx->stats->lock);
+			}
+			pteFree(&pte);
+			return 0;
+		}
+		cache_time = SecondsNow() - start;
+		start = SecondsNow();
+	}
+
 	pteLog(LOG_PROGRESS, "Reading input...\n");
 	pteLoadFromFiles(&pte, fnames, fname_cnt);
 
@@ -454,8 +623,14 @@ int main(int argc, char **argv) {
 		LoadPalette(palfile, &pte);
 	}
 
+	read_time = SecondsNow() - start;
+	start = SecondsNow();
+
 	pteEncodeTexture(&pte);
 
+	encode_time = SecondsNow() - start;
+	start = SecondsNow();
+
 	//Make preview
 	if (have_preview) {
 		const char *prevextension = strrchr(prevname, '.');
@@ -492,6 +667,8 @@ int main(int argc, char **argv) {
 
 			if (!already_have_pal_file && pteIsPalettized(&pte))
 				fTexWritePaletteAppendPal(&pte, outname);
+			else
+				cache_files.pal = NULL;
 		} else if (output_file_type == EXT_DT) {
 			pteLog(LOG_COMPLETION, "Writing .DT to \"%s\"...\n", outname);
 			void fDtWrite(const PvrTexEncoder *pte, const char *outfname);
@@ -499,6 +676,8 @@ int main(int argc, char **argv) {
 
 			if (!already_have_pal_file && pteIsPalettized(&pte))
 				fTexWritePaletteAppendPal(&pte, outname);
+			else
+				cache_files.pal = NULL;
 		} else {
 			ErrorExit("Unsupported output file type for \"%s\"\n", outname);
 		}
@@ -506,7 +685,202 @@ int main(int argc, char **argv) {
 		pteLog(LOG_COMPLETION, "No output file specified\n");
 	}
 
+	write_time = SecondsNow() - start;
+
+	if (cachedir) {
+		start = SecondsNow();
+		tcStore(cachedir, &key, &cache_files);
+		cache_time += SecondsNow() - start;
+	}
+
+	pteLog(LOG_INFO, "Time for \"%s\": read %.3fs, encode %.3fs, write %.3fs, cache %.3fs\n",
+		texname, read_time, encode_time, write_time, cache_time);
+
+	if (ctx->stats) {
+		pthread_mutex_lock(&ctx->stats->lock);
+		ctx->stats->misses++;
+		ctx->stats->read_time += read_time;
+		ctx->stats->encode_time += encode_time;
+		ctx->stats->write_time += write_time;
+		ctx->stats->cache_time += cache_time;
+		pthread_mutex_unlock(&ctx->stats->lock);
+	}
+
 	pteFree(&pte);
 
 	return 0;
 }
+
+typedef struct {
+	char name[64];	//manifest:line, for messages
+	int argc;
+	char **argv;
+} BatchJob;
+
+typedef struct {
+	BatchJob *jobs;
+	unsigned job_cnt;
+	unsigned next_job;
+	pthread_mutex_t lock;
+	ConvertContext ctx;
+} Batch;
+
+//Splits a line of a batch file into arguments. Arguments are separated by whitespace,
+//and can be put in double quotes to include spaces. Modifies line.
+static int SplitArguments(char *line, char **args, int max_args) {
+	int cnt = 0;
+	char *p = line;
+
+	while (1) {
+		while (isspace((unsigned char)*p))
+			p++;
+		if (*p == '\0' || *p == '#')
+			break;
+		ErrorExitOn(cnt >= max_args, "Too many arguments\n");
+
+		if (*p == '"') {
+			args[cnt++] = ++p;
+			while (*p && *p != '"')
+				p++;
+			ErrorExitOn(*p != '"', "Missing closing quote\n");
+		} else {
+			args[cnt++] = p;
+			while (*p && !isspace((unsigned char)*p))
+				p++;
+		}
+		if (*p)
+			*p++ = '\0';
+	}
+
+	return cnt;
+}
+
+static void *BatchWorker(void *param) {
+	Batch *batch = param;
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		unsigned idx = batch->next_job++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (idx >= batch->job_cnt)
+			break;
+
+		BatchJob *job = batch->jobs + idx;
+		job_name = job->name;
+		ConvertTexture(job->argc, job->argv, &batch->ctx);
+		job_name = NULL;
+		job_log_level = -1;
+	}
+
+	return NULL;
+}
+
+/*
+	Converts every texture listed in a batch file. Each line of the file has the
+	arguments for one texture, like a normal pvrtex command line.
+
+	Textures are converted in parallel by a pool of worker threads. With more than one
+	worker, each texture is compressed on a single thread, unless the line has its own
+	--jobs option.
+*/
+static int RunBatch(const char *manifest, const char *cachedir, unsigned workers) {
+	double start = SecondsNow();
+
+	ErrorExitOn(FileSize(manifest) < 0, "Can't open batch file \"%s\"\n", manifest);
+	void *data = NULL;
+	size_t size = Slurp(manifest, &data);
+	char *text = malloc(size + 1);
+	assert(text);
+	memcpy(text, data, size);
+	text[size] = '\0';
+	free(data);
+
+	Batch batch;
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+
+	ConvertStats stats;
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_init(&stats.lock, NULL);
+
+	//Make a job for every line with arguments
+	unsigned line_num = 0;
+	char *line = text;
+	while (line && *line) {
+		char *next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		line_num++;
+
+		#define MAX_BATCH_ARGS	64
+		char *args[MAX_BATCH_ARGS + 2];
+		args[0] = (char*)program_name;
+
+		char name[64];
+		snprintf(name, sizeof(name), "%s:%u", manifest, line_num);
+		job_name = name;
+		int cnt = SplitArguments(line, args + 1, MAX_BATCH_ARGS);
+		job_name = NULL;
+
+		if (cnt > 0) {
+			batch.jobs = realloc(batch.jobs, (batch.job_cnt + 1) * sizeof(BatchJob));
+			assert(batch.jobs);
+
+			BatchJob *job = batch.jobs + batch.job_cnt++;
+			memcpy(job->name, name, sizeof(name));
+			job->argc = cnt + 1;
+			job->argv = malloc((cnt + 2) * sizeof(char*));
+			assert(job->argv);
+			memcpy(job->argv, args, (cnt + 1) * sizeof(char*));
+			job->argv[cnt + 1] = NULL;
+		}
+
+		line = next;
+	}
+
+	if (workers == 0)
+		workers = CPUCount();
+	if (workers > batch.job_cnt)
+		workers = batch.job_cnt;
+
+	batch.ctx.cachedir = cachedir;
+	batch.ctx.threads = workers > 1 ? 1 : 0;
+	batch.ctx.stats = &stats;
+
+	pteLog(LOG_PROGRESS, "Converting %u textures with %u threads...\n", batch.job_cnt, workers);
+
+	//This thread is one of the workers
+	pthread_t *threads = calloc(workers, sizeof(pthread_t));
+	assert(threads);
+	unsigned started = 0;
+	for(unsigned i = 1; i < workers; i++, started++) {
+		if (pthread_create(&threads[i], NULL, BatchWorker, &batch) != 0)
+			break;
+	}
+	BatchWorker(&batch);
+	for(unsigned i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+
+	pteLog(LOG_COMPLETION, "Batch done in %.2f seconds: %u textures, %u from cache, %u converted\n",
+		SecondsNow() - start, batch.job_cnt, stats.hits, stats.misses);
+	pteLog(LOG_COMPLETION, "Time in each stage over all threads: read %.2fs, encode %.2fs, write %.2fs, cache %.2fs\n",
+		stats.read_time, stats.encode_time, stats.write_time, stats.cache_time);
+
+	for(unsigned i = 0; i < batch.job_cnt; i++)
+		free(batch.jobs[i].argv);
+	free(batch.jobs);
+	free(threads);
+	free(text);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_mutex_destroy(&stats.lock);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	program_name = (char*)basename(argv[0]);
+
+	ConvertContext ctx = { NULL, 0, NULL };
+	return ConvertTexture(argc, argv, &ctx);
+}
@@ -1,3 +1,5 @@
+#include <time.h>
+#include <unistd.h>
 #include "mycommon.h"
 
 unsigned RoundUpPow2(unsigned val) {
@@ -30,3 +32,14 @@ unsigned RoundNearest(unsigned val, unsigned round) {
 	val /= round;
 	return val * round;
 }
+
+double SecondsNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned CPUCount(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
@@ -37,4 +37,8 @@ extern unsigned RoundUpPow2(unsigned val);
 extern unsigned RoundDownPow2(unsigned val);
 unsigned RoundNearest(unsigned val, unsigned round);
 int SelectNearest(int down, int val, int up);
+//Monotonic time in seconds, for measuring how long things take
+double SecondsNow(void);
+//Number of CPUs available, at least 1
+unsigned CPUCount(void);
 void ErrorExit(const char *fmt, ...);
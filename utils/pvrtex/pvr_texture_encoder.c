@@ -54,6 +54,23 @@ void pteInit(PvrTexEncoder *pte) {
 	pte->mip_shift_correction = true;
 }
 
+//Runs the compressor, and logs how long it took for comparing settings and thread counts
+static vqcResults pteRunCompressor(PvrTexEncoder *pte, VQCompressor *vqc, int quality, const char *what) {
+	unsigned threads = pte->threads ? pte->threads : CPUCount();
+	unsigned point_cnt = vqc->point_cnt;
+	unsigned cb_size = vqc->cb_size;
+
+	vqcSetThreads(vqc, threads);
+
+	double start = SecondsNow();
+	vqcResults result = vqcCompress(vqc, quality);
+	double secs = SecondsNow() - start;
+
+	pteLog(LOG_INFO, "Generated %u entry %s from %u vectors in %.3f seconds (%.0f vectors/s, %u threads)\n",
+		cb_size, what, point_cnt, secs, secs > 0 ? point_cnt / secs : 0.0, threads);
+	return result;
+}
+
 void pteFree(PvrTexEncoder *pte) {
 	assert(pte);
 	SAFE_FREE(&pte->pvr_codebook);
@@ -378,7 +395,7 @@ void pteGeneratePalette(PvrTexEncoder *pte) {
 	}
 
 	//Do compression and save resulting palette
-	vqcResults result = vqcCompress(&vqc, 8);
+	vqcResults result = pteRunCompressor(pte, &vqc, 8, "palette");
 	assert(result.codebook);
 	pte->palette = result.codebook;
 	free(result.indices);
@@ -536,7 +553,7 @@ void pteCompress(PvrTexEncoder *pte) {
 
 	//Do compression and save results
 	pteLog(LOG_DEBUG, "Doing compression %u...\n", vqc.point_cnt); fflush(stdout);
-	vqcResults result = vqcCompress(&vqc, 200);
+	vqcResults result = pteRunCompressor(pte, &vqc, 200, "codebook");
 	pteLog(LOG_DEBUG, "Done!\n"); fflush(stdout);
 	assert(result.indices);
 	assert(result.codebook);
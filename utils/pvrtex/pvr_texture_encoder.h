@@ -107,6 +107,10 @@ typedef struct PvrTexEncoder {
 	//the top left.
 	bool flip_v;
 
+	//Number of threads to use for compression, 0 means one per CPU.
+	//The result is the same for any number of threads.
+	unsigned threads;
+
 	//Unprocessed source images specified by user
 	unsigned src_img_cnt;
 	pteImage src_imgs[PVR_MAX_MIPMAPS];
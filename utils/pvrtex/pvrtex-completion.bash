@@ -9,8 +9,8 @@ _pvrtex_completions()
 	_init_completion || return
 	
 	case $prev in
-		--help|--version|--no-mip-shift|--max-color|--perfect-mip|--high-weight|--dither|--stride|--bilinear|--nearest|\
-		-!(-*)[hvCSMHdsbn])
+		--help|--version|--no-mip-shift|--max-color|--perfect-mip|--high-weight|--dither|--stride|--bilinear|--nearest|--jobs|\
+		-!(-*)[hvCSMHdsbnj])
 			return
 			;;
 		-i|--in)
@@ -25,6 +25,14 @@ _pvrtex_completions()
 			_filedir "@(dt|tex|pvr)"
 			return
 			;;
+		--batch)
+			_filedir
+			return
+			;;
+		--cache)
+			_filedir -d
+			return
+			;;
 		-p|--preview)
 			_filedir "@(png|jpg|bmp|tga)"
 			return
@@ -56,7 +64,7 @@ _pvrtex_completions()
 		*)
 			
 			#This is the suggestion if not suggesting for one of the above. It suggests supported options.
-			COMPREPLY=($(compgen -W "--in --out --preview --format --compress --mipmap --perfect-mip --max-color --no-mip-shift --high-weight --high-weight --dither --stride --resize --mip-resize --edge --bilinear --nearest --normal-style --flip-v" -- "$cur"))
+			COMPREPLY=($(compgen -W "--in --out --preview --format --compress --mipmap --perfect-mip --max-color --no-mip-shift --high-weight --high-weight --dither --stride --resize --mip-resize --edge --bilinear --nearest --normal-style --flip-v --jobs --batch --cache" -- "$cur"))
 			return
 			;;
 		
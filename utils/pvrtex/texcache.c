@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libavutil/md5.h"
+#include "libavutil/mem.h"
+#include "texcache.h"
+#include "mycommon.h"
+#include "pvr_texture_encoder.h"
+
+//Names of the files in a cache entry directory
+#define TC_OUT_NAME	"out"
+#define TC_PAL_NAME	"out.pal"
+#define TC_PREVIEW_NAME	"preview"
+
+//Room for a cache entry directory path, and for the path of a file in it
+#define TC_PATH_LEN	4096
+#define TC_FILE_PATH_LEN	(TC_PATH_LEN + 16)
+
+void tcKeyInit(TexCacheKey *key) {
+	assert(key);
+
+	memset(key, 0, sizeof(*key));
+	key->md5 = av_md5_alloc();
+	assert(key->md5);
+	av_md5_init(key->md5);
+	key->valid = true;
+}
+
+void tcKeyAddString(TexCacheKey *key, const char *str) {
+	assert(key && key->md5);
+
+	if (str == NULL)
+		str = "";
+	uint32_t len = strlen(str);
+	av_md5_update(key->md5, (const uint8_t*)&len, sizeof(len));
+	av_md5_update(key->md5, (const uint8_t*)str, len);
+}
+
+void tcKeyAddFile(TexCacheKey *key, const char *fname) {
+	assert(key && key->md5);
+	assert(fname);
+
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		key->valid = false;
+		return;
+	}
+
+	uint8_t buf[64*1024];
+	size_t amt;
+	uint64_t total = 0;
+	while ((amt = fread(buf, 1, sizeof(buf), f)) > 0) {
+		av_md5_update(key->md5, buf, amt);
+		total += amt;
+	}
+	if (ferror(f))
+		key->valid = false;
+	fclose(f);
+
+	//Size goes after the data, so the next item can't be mistaken for part of this file
+	av_md5_update(key->md5, (const uint8_t*)&total, sizeof(total));
+}
+
+void tcKeyFinish(TexCacheKey *key) {
+	assert(key && key->md5);
+
+	uint8_t digest[16];
+	av_md5_final(key->md5, digest);
+	av_freep(&key->md5);
+
+	for(int i = 0; i < 16; i++)
+		snprintf(key->hex + i*2, 3, "%02x", digest[i]);
+}
+
+static bool CopyFile(const char *src, const char *dst) {
+	FILE *in = fopen(src, "rb");
+	if (in == NULL)
+		return false;
+	FILE *out = fopen(dst, "wb");
+	if (out == NULL) {
+		fclose(in);
+		return false;
+	}
+
+	char buf[64*1024];
+	size_t amt;
+	bool ok = true;
+	while ((amt = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, amt, out) != amt) {
+			ok = false;
+			break;
+		}
+	}
+	if (ferror(in))
+		ok = false;
+
+	fclose(in);
+	if (fclose(out) != 0)
+		ok = false;
+	return ok;
+}
+
+static bool FileExists(const char *fname) {
+	struct stat st;
+	return stat(fname, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool tcRestore(const char *cachedir, const TexCacheKey *key, const TexCacheFiles *files) {
+	assert(cachedir);
+	assert(key);
+	assert(files);
+
+	if (!key->valid)
+		return false;
+
+	char out[TC_FILE_PATH_LEN], pal[TC_FILE_PATH_LEN], preview[TC_FILE_PATH_LEN];
+	snprintf(out, sizeof(out), "%s/%s/" TC_OUT_NAME, cachedir, key->hex);
+	snprintf(pal, sizeof(pal), "%s/%s/" TC_PAL_NAME, cachedir, key->hex);
+	snprintf(preview, sizeof(preview), "%s/%s/" TC_PREVIEW_NAME, cachedir, key->hex);
+
+	//Make sure the entry has everything that's wanted before writing anything
+	if (files->out && !FileExists(out))
+		return false;
+	if (files->preview && !FileExists(preview))
+		return false;
+
+	if (files->out && !CopyFile(out, files->out))
+		return false;
+	//The key doesn't say whether a palette was written (it depends on the automatically
+	//selected format), so it's whatever the entry has
+	if (files->pal && FileExists(pal) && !CopyFile(pal, files->pal))
+		return false;
+	if (files->preview && !CopyFile(preview, files->preview))
+		return false;
+
+	return true;
+}
+
+static void RemoveEntryDir(const char *dir) {
+	char fname[TC_FILE_PATH_LEN];
+	static const char *names[] = { TC_OUT_NAME, TC_PAL_NAME, TC_PREVIEW_NAME };
+
+	for(size_t i = 0; i < ARR_SIZE(names); i++) {
+		snprintf(fname, sizeof(fname), "%s/%s", dir, names[i]);
+		unlink(fname);
+	}
+	rmdir(dir);
+}
+
+void tcStore(const char *cachedir, const TexCacheKey *key, const TexCacheFiles *files) {
+	assert(cachedir);
+	assert(key);
+	assert(files);
+
+	if (!key->valid)
+		return;
+
+	if (mkdir(cachedir, 0777) != 0 && errno != EEXIST) {
+		pteLog(LOG_WARNING, "Can't create cache directory \"%s\" (%s)\n", cachedir, strerror(errno));
+		return;
+	}
+
+	//Fill in a temporary directory and rename it into place once complete, so other
+	//pvrtex processes never see a partial entry
+	char tmpdir[TC_PATH_LEN], entry[TC_PATH_LEN], fname[TC_FILE_PATH_LEN];
+	snprintf(tmpdir, sizeof(tmpdir), "%s/%s.XXXXXX", cachedir, key->hex);
+	snprintf(entry, sizeof(entry), "%s/%s", cachedir, key->hex);
+	if (mkdtemp(tmpdir) == NULL) {
+		pteLog(LOG_WARNING, "Can't create cache entry in \"%s\" (%s)\n", cachedir, strerror(errno));
+		return;
+	}
+
+	bool ok = true;
+	if (ok && files->out) {
+		snprintf(fname, sizeof(fname), "%s/" TC_OUT_NAME, tmpdir);
+		ok = CopyFile(files->out, fname);
+	}
+	if (ok && files->pal) {
+		snprintf(fname, sizeof(fname), "%s/" TC_PAL_NAME, tmpdir);
+		ok = CopyFile(files->pal, fname);
+	}
+	if (ok && files->preview) {
+		snprintf(fname, sizeof(fname), "%s/" TC_PREVIEW_NAME, tmpdir);
+		ok = CopyFile(files->preview, fname);
+	}
+
+	//If the entry already exists, another job converted the same texture
+	//first, and its copy is just as good.
+	if (!ok || rename(tmpdir, entry) != 0)
+		RemoveEntryDir(tmpdir);
+}
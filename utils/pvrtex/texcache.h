@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+	Content addressed cache of converted textures.
+
+	The key is an MD5 hash of everything that can affect the result: the pvrtex
+	version, the options, and the contents of the input files. Each cache entry
+	is a directory named after the key, holding a copy of every file the
+	conversion wrote.
+*/
+
+#define TC_KEY_HEX_LEN	32
+
+typedef struct {
+	struct AVMD5 *md5;
+	bool valid;	//false if an input couldn't be read, so the result shouldn't be cached
+	char hex[TC_KEY_HEX_LEN + 1];
+} TexCacheKey;
+
+//Files written by a conversion. Any of these may be NULL if not written.
+typedef struct {
+	const char *out;	//texture, or palette for .PAL output
+	const char *pal;	//palette written next to the texture
+	const char *preview;
+} TexCacheFiles;
+
+void tcKeyInit(TexCacheKey *key);
+//Add a string to the key. Strings are length prefixed, so "ab", "c" and "a", "bc" give different keys
+void tcKeyAddString(TexCacheKey *key, const char *str);
+//Add the contents of a file to the key
+void tcKeyAddFile(TexCacheKey *key, const char *fname);
+//Finish the key and fill in key->hex
+void tcKeyFinish(TexCacheKey *key);
+
+//Copies the files of a cached conversion to their destinations. Returns false if there
+//is no complete entry for the key, in which case the texture should be converted.
+bool tcRestore(const char *cachedir, const TexCacheKey *key, const TexCacheFiles *files);
+
+//Adds the files written by a conversion to the cache. Failing to store is not an error,
+//the texture will just be converted again next time.
+void tcStore(const char *cachedir, const TexCacheKey *key, const TexCacheFiles *files);
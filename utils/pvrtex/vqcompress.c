@@ -17,6 +17,7 @@ void vqcInit(VQCompressor *c, vqcFormat input_format, unsigned channels, unsigne
 	c->pix_per_cb = pix_per_cb;
 	c->cb_size = cb_size;
 	c->dimensions = pix_per_cb * channels;
+	c->threads = 1;
 	for(int i = 0; i < VQC_MAX_CHANNELS; i++)
 		c->gamma[i] = 1.0f;
 }
@@ -110,6 +111,11 @@ void vqcSetARGBGamma(VQCompressor *c, float rgb, float alpha) {
 	}
 }
 
+void vqcSetThreads(VQCompressor *c, unsigned threads) {
+	assert(c);
+	c->threads = threads ? threads : 1;
+}
+
 vqcResults vqcCompress(VQCompressor *c, int quality) {
 	assert(c);
 	assert(c->cb_size);
@@ -129,7 +135,9 @@ vqcResults vqcCompress(VQCompressor *c, int quality) {
 	struct ELBGContext *elbgcxt = 0;
 	struct AVLFG randcxt;
 	av_lfg_init(&randcxt, 1);
-	int errval = avpriv_elbg_do(&elbgcxt, c->data, c->dimensions, c->point_cnt, int_codebook, c->cb_size, quality, result.indices, &randcxt, 0);
+	int errval = avpriv_elbg_set_threads(&elbgcxt, c->threads);
+	assert(errval == 0);
+	errval = avpriv_elbg_do(&elbgcxt, c->data, c->dimensions, c->point_cnt, int_codebook, c->cb_size, quality, result.indices, &randcxt, 0);
 	assert(errval == 0);
 	avpriv_elbg_free(&elbgcxt);
 
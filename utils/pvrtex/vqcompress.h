@@ -14,6 +14,7 @@ typedef struct {
 	unsigned cb_size;	//number of entries in cb
 
 	unsigned dimensions;	//pix_per_cb * channels
+	unsigned threads;	//number of threads to compress with, result is the same for any
 
 	//channels can have different gammas (alpha could be 1.0, while RGB could be 2.2)
 	float gamma[VQC_MAX_CHANNELS];
@@ -33,6 +34,7 @@ void vqcAddPoints(VQCompressor *c, const void *src, size_t pixel_cnt);
 void vqcSetChannelGamma(VQCompressor *c, unsigned channel, float val);
 void vqcSetRGBAGamma(VQCompressor *c, float rgb, float alpha);
 void vqcSetARGBGamma(VQCompressor *c, float rgb, float alpha);
+void vqcSetThreads(VQCompressor *c, unsigned threads);
 vqcResults vqcCompress(VQCompressor *c, int quality);
 
 
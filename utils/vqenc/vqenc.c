@@ -18,7 +18,10 @@
 #include <math.h>
 #include <unistd.h>
 #include <errno.h>
+#include <float.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
 #include "get_image.h"
 #include "vq_internal.h"
 #include "vq_types.h"
@@ -33,6 +36,15 @@ static int use_debug = 0;
 static int use_hq = 0;
 static int use_kmg = 0;
 static int use_alpha = 0;
+static int use_fast = 0;
+static int use_jobs = 0;
+
+/* don't bother starting a thread for fewer quads than this */
+#define MIN_JOB_QUADS   1024
+#define MAX_JOBS        64
+
+/* four floats, loaded from wherever they happen to be */
+typedef float v4sf __attribute__((vector_size(16), aligned(4)));
 
 #define PACK1555(a, r, g, b) ( (a ? 0x8000 : 0) | ((r>>3)<<10) | ((g>>3)<<5) | ((b >>3)))
 #define PACK4444(a, r, g, b) ( ((a>>4) << 12) | ((r>>4)<<8) | ((g>>4)<<4) | ((b>>4)) )
@@ -88,7 +100,33 @@ static int quads_in_map(int res) {
     return (across * across) >> 2;
 }
 
-static double delta_e(fquad_t *a, fquad_t *b) {
+/* the codebook, ready for searching during a pass over the quads */
+typedef struct search_t {
+    context_t *cb;
+
+    /* for --fast only: the codes sorted along the principal axis of
+       the codebook, so that most of them needn't be looked at */
+    float axis[16];
+    float proj[256];
+    uint8 order[256];
+} search_t;
+
+/* a part of the quads, searched by one thread */
+typedef struct job_t {
+    search_t *search;
+    fquad_t *quads;
+    int nquads;
+
+    /* closest code of each quad, and the squared distance to it */
+    int *idx;
+    double *dist;
+
+    /* for --fast, the statistics of this part are kept here instead */
+    code_t codes[256];
+} job_t;
+
+/* squared distance between two quads, giving up once it reaches limit */
+static double delta_e2(fquad_t *a, fquad_t *b, double limit) {
     int i;
     fquad_t sub;
     double total;
@@ -101,67 +139,358 @@ static double delta_e(fquad_t *a, fquad_t *b) {
         total += (sub.p[i].r * sub.p[i].r);
         total += (sub.p[i].g * sub.p[i].g);
         total += (sub.p[i].b * sub.p[i].b);
+
+        if(total >= limit)
+            break;
     }
 
-    return sqrt(total);
+    return total;
 }
 
-/* returns the closest (most similar) codebook entry to the given quad */
-static int find(context_t *cb, fquad_t *q) {
+/* returns the closest (most similar) codebook entry to the given quad,
+   and the squared distance to it */
+static int find(context_t *cb, fquad_t *q, double *dist) {
     int code, close_entry;
-    double close_dist;
+    double close_dist, close_sqrt;
 
     close_entry = 0;
-    close_dist = delta_e(&cb->codes[0].value, q);
+    close_dist = delta_e2(&cb->codes[0].value, q, DBL_MAX);
+    close_sqrt = sqrt(close_dist);
 
     for(code = 1; code < cb->in_use; code++) {
 
         /* hope not to get sued for this variable's name */
         double d;
 
-        d = delta_e(&cb->codes[code].value, q);
+        d = delta_e2(&cb->codes[code].value, q, close_dist);
 
-        if(d < close_dist) {
+        /* two sums can be different, yet have the same root */
+        if(d < close_dist && sqrt(d) < close_sqrt) {
             close_entry = code;
             close_dist = d;
+            close_sqrt = sqrt(d);
 
-            if(d < 0.0001) {
+            if(close_sqrt < 0.0001) {
                 /* close enough */
-                return close_entry;
+                break;
+            }
+        }
+
+    }
+
+    *dist = close_dist;
+    return close_entry;
+}
+
+/* squared distance in single precision, skipping the second half when the
+   first is already too far */
+static inline float delta_e2_fast(const fquad_t *a, const fquad_t *b,
+                                  float limit) {
+    v4sf d0, d1, d2, d3, sum;
+
+    d0 = *(const v4sf *)&a->p[0] - *(const v4sf *)&b->p[0];
+    d1 = *(const v4sf *)&a->p[1] - *(const v4sf *)&b->p[1];
+    sum = d0 * d0 + d1 * d1;
+
+    if(sum[0] + sum[1] + sum[2] + sum[3] >= limit)
+        return limit;
+
+    d2 = *(const v4sf *)&a->p[2] - *(const v4sf *)&b->p[2];
+    d3 = *(const v4sf *)&a->p[3] - *(const v4sf *)&b->p[3];
+    sum += d2 * d2 + d3 * d3;
+
+    return sum[0] + sum[1] + sum[2] + sum[3];
+}
+
+static inline float project(const float *axis, const fquad_t *q) {
+    const float *v = &q->p[0].r;
+    float total = 0.0f;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        total += axis[i] * v[i];
+
+    return total;
+}
+
+/* the same as find(), but walking out from where the quad falls along
+   the axis; no code further away along it than the best one so far can
+   be any closer */
+static int find_fast(const search_t *s, fquad_t *q, double *dist) {
+    int lo, hi, mid, n, close_entry;
+    float pq, d, close_dist;
+
+    n = s->cb->in_use;
+    pq = project(s->axis, q);
+
+    lo = 0;
+    hi = n;
+
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+
+        if(s->proj[mid] < pq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    hi = lo;
+    lo--;
+    close_entry = 0;
+    close_dist = FLT_MAX;
+
+    while((lo >= 0 || hi < n) && close_dist >= 1e-8f) {
+        if(hi < n) {
+            d = s->proj[hi] - pq;
+
+            if(d * d >= close_dist) {
+                hi = n;
+            }
+            else {
+                d = delta_e2_fast(&s->cb->codes[s->order[hi]].value, q,
+                                  close_dist);
+
+                if(d < close_dist) {
+                    close_entry = s->order[hi];
+                    close_dist = d;
+                }
+
+                hi++;
             }
         }
 
+        if(lo >= 0) {
+            d = pq - s->proj[lo];
+
+            if(d * d >= close_dist) {
+                lo = -1;
+            }
+            else {
+                d = delta_e2_fast(&s->cb->codes[s->order[lo]].value, q,
+                                  close_dist);
+
+                if(d < close_dist) {
+                    close_entry = s->order[lo];
+                    close_dist = d;
+                }
+
+                lo--;
+            }
+        }
     }
 
+    *dist = close_dist;
     return close_entry;
 }
 
-static void place(context_t *cb, fquad_t *quads, int nquads) {
+static int find_quad(const search_t *s, fquad_t *q, double *dist) {
+    if(use_fast)
+        return find_fast(s, q, dist);
+    else
+        return find(s->cb, q, dist);
+}
+
+static const search_t *sort_search;
+
+static int compare_proj(const void *a, const void *b) {
+    float pa = sort_search->proj[*(const uint8 *)a];
+    float pb = sort_search->proj[*(const uint8 *)b];
+
+    if(pa != pb)
+        return pa < pb ? -1 : 1;
+
+    return (int)*(const uint8 *)a - (int)*(const uint8 *)b;
+}
+
+/* find the principal axis of the codebook (by power iteration on the
+   covariance of its entries) and sort the codes along it */
+static void prepare_search(search_t *s, context_t *cb) {
+    float mean[16], cov[16][16], next[16], proj[256];
+    float len, *v;
+    int i, j, k, n;
+
+    s->cb = cb;
+
+    if(!use_fast)
+        return;
+
+    n = cb->in_use;
+    memset(mean, 0, sizeof(mean));
+    memset(cov, 0, sizeof(cov));
+
+    for(k = 0; k < n; k++) {
+        v = &cb->codes[k].value.p[0].r;
+
+        for(i = 0; i < 16; i++)
+            mean[i] += v[i] / n;
+    }
+
+    for(k = 0; k < n; k++) {
+        v = &cb->codes[k].value.p[0].r;
+
+        for(i = 0; i < 16; i++)
+            for(j = 0; j < 16; j++)
+                cov[i][j] += (v[i] - mean[i]) * (v[j] - mean[j]);
+    }
+
+    for(i = 0; i < 16; i++)
+        s->axis[i] = 0.25f;
+
+    for(k = 0; k < 16; k++) {
+        len = 0.0f;
+
+        for(i = 0; i < 16; i++) {
+            next[i] = 0.0f;
+
+            for(j = 0; j < 16; j++)
+                next[i] += cov[i][j] * s->axis[j];
+
+            len += next[i] * next[i];
+        }
+
+        /* all the codes are the same; any axis will do */
+        if(len < 1e-12f)
+            break;
+
+        len = sqrtf(len);
+
+        for(i = 0; i < 16; i++)
+            s->axis[i] = next[i] / len;
+    }
+
+    for(k = 0; k < n; k++) {
+        s->order[k] = k;
+        s->proj[k] = project(s->axis, &cb->codes[k].value);
+    }
+
+    sort_search = s;
+    qsort(s->order, n, 1, compare_proj);
+    memcpy(proj, s->proj, n * sizeof(float));
+
+    for(k = 0; k < n; k++)
+        s->proj[k] = proj[s->order[k]];
+}
+
+static void update_code(code_t *e, fquad_t *q, double dist) {
+    add_quad(&e->pos_sum, q);
+    e->pos_count++;
+
+    /* see if we have something better in hand */
+    if(dist > e->max_dist) {
+        e->max_dist = dist;
+        copy_quad(&e->max_dist_vec, q);
+    }
+}
+
+static void *run_job(void *arg) {
+    job_t *job = (job_t *)arg;
+    double dist;
     int i, idx;
+
+    for(i = 0; i < job->nquads; i++) {
+        idx = find_quad(job->search, &job->quads[i], &dist);
+
+        if(use_fast) {
+            update_code(&job->codes[idx], &job->quads[i], sqrt(dist));
+        }
+        else {
+            job->idx[i] = idx;
+            job->dist[i] = dist;
+        }
+    }
+
+    return NULL;
+}
+
+static void place(search_t *s, fquad_t *quads, int nquads) {
+    context_t *cb = s->cb;
+    pthread_t threads[MAX_JOBS];
+    int started[MAX_JOBS];
+    int *idx = NULL;
+    double *dist = NULL;
+    job_t *jobs;
     code_t *e;
-    double dist;
-    fquad_t *that;
+    int i, j, njobs, first;
 
-    that = quads;
+    njobs = nquads / MIN_JOB_QUADS;
 
-    for(i = 0; i < nquads; i++) {
-        /* find averages of all codebook entries */
-        idx = find(cb, that);
-        e = &cb->codes[idx];
+    if(njobs > use_jobs)
+        njobs = use_jobs;
+
+    if(njobs > MAX_JOBS)
+        njobs = MAX_JOBS;
+
+    if(njobs < 1)
+        njobs = 1;
+
+    jobs = (job_t *)calloc(njobs, sizeof(job_t));
 
-        add_quad(&e->pos_sum, that);
-        e->pos_count++;
+    if(!use_fast) {
+        idx = (int *)malloc(nquads * sizeof(int));
+        dist = (double *)malloc(nquads * sizeof(double));
+    }
+
+    if(!jobs || (!use_fast && (!idx || !dist))) {
+        fprintf(stderr, "FATAL: out of memory\n");
+        exit(1);
+    }
 
-        /* see if we have something better in hand */
-        dist = delta_e(&e->value, that);
+    /* split the quads evenly, and search them all at once */
+    for(i = 0, first = 0; i < njobs; i++) {
+        jobs[i].search = s;
+        jobs[i].quads = quads + first;
+        jobs[i].nquads = nquads / njobs + (i < nquads % njobs);
 
-        if(dist > e->max_dist) {
-            e->max_dist = dist;
-            copy_quad(&e->max_dist_vec, that);
+        if(!use_fast) {
+            jobs[i].idx = idx + first;
+            jobs[i].dist = dist + first;
         }
 
-        that++;
+        first += jobs[i].nquads;
+    }
+
+    for(i = 1; i < njobs; i++)
+        started[i] = !pthread_create(&threads[i], NULL, run_job, &jobs[i]);
+
+    run_job(&jobs[0]);
+
+    for(i = 1; i < njobs; i++) {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        else
+            run_job(&jobs[i]);
     }
+
+    if(use_fast) {
+        /* merge the statistics of each part, in order */
+        for(i = 0; i < njobs; i++) {
+            for(j = 0; j < cb->in_use; j++) {
+                e = &jobs[i].codes[j];
+
+                if(!e->pos_count)
+                    continue;
+
+                add_quad(&cb->codes[j].pos_sum, &e->pos_sum);
+                cb->codes[j].pos_count += e->pos_count;
+
+                if(e->max_dist > cb->codes[j].max_dist) {
+                    cb->codes[j].max_dist = e->max_dist;
+                    copy_quad(&cb->codes[j].max_dist_vec, &e->max_dist_vec);
+                }
+            }
+        }
+    }
+    else {
+        /* find averages of all codebook entries, in the same order as a
+           single thread would, so that the result is exactly the same */
+        for(i = 0; i < nquads; i++)
+            update_code(&cb->codes[idx[i]], &quads[i], sqrt(dist[i]));
+    }
+
+    free(jobs);
+    free(idx);
+    free(dist);
 }
 
 static void clean_codebook(context_t *cb) {
@@ -339,13 +668,14 @@ static int *twiddle_twiddle(int length) {
     return ptr;
 }
 
-static int write_linear(FILE *out, context_t *cb, mipmap_t *m, int res) {
+static int write_linear(FILE *out, search_t *s, mipmap_t *m, int res) {
     int i, nquads;
+    double dist;
 
     nquads = quads_in_map(res);
 
     for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &m->map[res][i]);
+        uint8 c = find_quad(s, &m->map[res][i], &dist);
 
         if(fputc(c, out) == EOF)
             return -1;
@@ -354,10 +684,11 @@ static int write_linear(FILE *out, context_t *cb, mipmap_t *m, int res) {
     return 0;
 }
 
-static int write_twiddled(FILE *out, context_t *cb, mipmap_t *m, int res) {
+static int write_twiddled(FILE *out, search_t *s, mipmap_t *m, int res) {
     int *twididx, *twiddled;
     int i, width, nquads;
     fquad_t *map;
+    double dist;
 
     width = map_width(res);
     nquads = quads_in_map(res);
@@ -367,7 +698,7 @@ static int write_twiddled(FILE *out, context_t *cb, mipmap_t *m, int res) {
     map = m->map[res];
 
     for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &map[*twididx++]);
+        uint8 c = find_quad(s, &map[*twididx++], &dist);
 
         if(fputc(c, out) == EOF)
             return -1;
@@ -393,6 +724,7 @@ static int save_codebook(FILE *out, context_t *cb) {
 static int save(const char *filename, context_t *cb, mipmap_t *m, image_t *img) {
     int ok, res;
     FILE    *fp;
+    search_t search;
 
     fp = fopen(filename, "wb");
 
@@ -451,15 +783,17 @@ static int save(const char *filename, context_t *cb, mipmap_t *m, image_t *img)
         }
     }
 
+    prepare_search(&search, cb);
+
     for(res = 0; res < MAX_MIPMAP; res++) {
         /* write each valid map down, if output is required
          * as twiddled, mess it up before saving to disk
          */
         if(m->map[res] != NULL) {
             if(use_twiddle)
-                ok = write_twiddled(fp, cb, m, res);
+                ok = write_twiddled(fp, &search, m, res);
             else
-                ok = write_linear(fp, cb, m, res);
+                ok = write_linear(fp, &search, m, res);
 
             if(ok < 0) {
                 fprintf(stderr, "FATAL: error writing index data to %s\n", filename);
@@ -490,6 +824,8 @@ static void banner(const char *progname) {
     printf("\t-k, --kmg\twrite a KMG for output\n");
     printf("\t-a, --alpha\tuse alpha channel (and output ARGB4444)\n");
     printf("\t-b, --amask\tuse 1-bit alpha mask (and output ARGB1555)\n");
+    printf("\t-f, --fast\tfaster search (output differs slightly)\n");
+    printf("\t-jN, --jobs=N\tuse N threads (default: one per CPU)\n");
 }
 
 static int mipmap_index(int s) {
@@ -660,12 +996,14 @@ static int build_mipmap(mipmap_t *m, image_t *i) {
 
 static void place_quads(context_t *cb, mipmap_t *m) {
     int i, j, quads;
+    search_t search;
 
     /* run three times to get better quality;
      * this is not required for most of textures
      */
 
     reset_codebook(cb);
+    prepare_search(&search, cb);
 
     for(j = 0; j < (use_hq ? 3 : 1); j++) {
         for(i = 0; i < MAX_MIPMAP; i++) {
@@ -675,7 +1013,7 @@ static void place_quads(context_t *cb, mipmap_t *m) {
              */
             if(m->map[i] != NULL) {
                 quads = quads_in_map(i);
-                place(cb, m->map[i], quads);
+                place(&search, m->map[i], quads);
             }
         }
     }
@@ -717,6 +1055,9 @@ static int encode(const char *infile) {
     mipmap_t    mipmap;
     context_t   context;
     const char  *outfile;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     if(use_verbose) {
         printf("encoding %s.. ", infile);
@@ -774,7 +1115,9 @@ static int encode(const char *infile) {
     split(&context);
 
     if(use_verbose) {
-        printf("\n");
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf(" %.3fs\n", (end.tv_sec - start.tv_sec) +
+               (end.tv_nsec - start.tv_nsec) / 1e9);
     }
 
     ok = save(outfile, &context, &mipmap, &image);
@@ -801,6 +1144,10 @@ static int process_long_options(char *arg) {
         use_alpha = 1;
     else if(! strcmp(arg, "amask"))
         use_alpha = 2;
+    else if(! strcmp(arg, "fast"))
+        use_fast = 1;
+    else if(! strncmp(arg, "jobs=", 5) && atoi(arg + 5) > 0)
+        use_jobs = atoi(arg + 5);
     else
         return -EINVAL;
 
@@ -845,6 +1192,17 @@ static int process_option(char *arg) {
             use_alpha = 2;
             return 0;
 
+        case 'f':
+            use_fast = 1;
+            return 0;
+
+        case 'j':
+            if(atoi(arg + 1) <= 0)
+                break;
+
+            use_jobs = atoi(arg + 1);
+            return 0;
+
         case '-':
             return process_long_options(arg + 1);
     }
@@ -894,5 +1252,7 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    use_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
     return process(argc, argv);
 }
@@ -29,6 +29,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <kos/adpcm.h>
 
 /* WAV Header */
 typedef struct wavhdr {
@@ -54,102 +57,22 @@ typedef struct wavhdr_chunk {
 /* Holds flags */
 static int interleaved = 0;
 static int no_header = 0;
+static int quality = 0;
+static int verbose = 0;
 
 /* Output Formats */
 #define WAVE_FMT_PCM                   0x01 /* PCM */
 #define WAVE_FMT_YAMAHA_ADPCM_ITU_G723 0x14 /* ITU G.723 Yamaha ADPCM (KallistiOS) */
 #define WAVE_FMT_YAMAHA_ADPCM          0x20 /* Yamaha ADPCM (interleaved) */
 
-#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
-
-static inline int16_t ymz_step(uint8_t step, int16_t *history, int16_t *step_size) {
-    static const int step_table[8] = {
-        230, 230, 230, 230, 307, 409, 512, 614
-    };
-
-    int sign = step & 8;
-    int delta = step & 7;
-    int diff = ((1 + (delta << 1)) * *step_size) >> 3;
-    int newval = *history;
-    int nstep = (step_table[delta] * *step_size) >> 8;
-
-    /* Only found in the official AICA encoder
-       but it's possible all chips (including ADPCM-B) does this. */
-    diff = CLAMP(diff, 0, 32767);
-    if(sign > 0)
-        newval -= diff;
-    else
-        newval += diff;
-
-    *step_size = CLAMP(nstep, 127, 24576);
-    *history = newval = CLAMP(newval, -32768, 32767);
-    return newval;
-}
+/* Frames of PCM that are encoded at a time */
+#define CHUNK_FRAMES 65536
 
 void adpcm2pcm(int16_t *outbuffer, uint8_t *buffer, size_t bytes) {
-    long i;
-    int16_t step_size = 127;
-    int16_t history = 0;
-    uint8_t nibble = 4;
-    size_t num_samples = bytes * 2;  /* Each ADPCM byte contains two 4-bit samples */
-
-    for(i = 0; i < num_samples; i++) {
-        int8_t step = (*(int8_t *)buffer) << nibble;
-        step >>= 4;
-        if(!nibble)
-            buffer++;
-        nibble ^= 4;
-        history = history * 254 / 256; // High pass
-        *outbuffer++ = ymz_step(step, &history, &step_size);
-    }
-}
-
-void pcm2adpcm(uint8_t *outbuffer, int16_t *buffer, size_t bytes) {
-    long i;
-    int16_t step_size = 127;
-    int16_t history = 0;
-    uint8_t buf_sample = 0, nibble = 0;
-    uint32_t adpcm_sample;
-    size_t num_samples = bytes / 2; /* Divide by 2 to get the number of 16-bit samples */
-
-    for(i = 0;i < num_samples;i++) {
-        /* We remove a few bits_per_sample of accuracy to reduce some noise. */
-        int step = ((*buffer++) & -8) - history;
-        adpcm_sample = (abs(step) << 16) / (step_size << 14);
-        adpcm_sample = CLAMP(adpcm_sample, 0, 7);
-        if(step < 0)
-            adpcm_sample |= 8;
-        if(!nibble)
-            *outbuffer++ = buf_sample | (adpcm_sample<<4);
-        else
-            buf_sample = (adpcm_sample & 15);
-        nibble ^= 1;
-        ymz_step(adpcm_sample, &history, &step_size);
-    }
-}
-
-void deinterleave(void *buffer, size_t bytes) {
-    uint16_t *buf;
-    uint16_t *left, *right;
-    int i;
-
-    buf = (uint16_t *)buffer;
-    left = malloc(bytes);
-    if(!left) {
-        fprintf(stderr, "deinterleave: Memory allocation failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    right = left + bytes / 4;
-
-    for(i = 0; i < bytes / 4; i++) {
-        left[i] = buf[i * 2 + 0];
-        right[i] = buf[i * 2 + 1];
-    }
+    kos_adpcm_state_t state;
 
-    memcpy(buf, left, bytes / 2);
-    memcpy(buf + bytes / 4, right, bytes / 2);
-
-    free(left);
+    kos_adpcm_reset(&state);
+    kos_adpcm_decode(&state, outbuffer, buffer, bytes * 2, 1);
 }
 
 void deinterleave_adpcm(void *buffer, size_t bytes) {
@@ -166,12 +89,12 @@ void deinterleave_adpcm(void *buffer, size_t bytes) {
     right = left + bytes / 2;
 
     for(i = 0; i < bytes; i++) {
-        if(i % 2 == 0) { /* Set high nibble */
-            left[i / 2] = (buf[i] & 0xF0);
-            right[i / 2] = (buf[i] & 0x0F) << 4;
-        } else { /* Set low nibble to complete the byte */
-            left[i / 2] |= ((buf[i] >> 4) & 0x0F);
-            right[i / 2] |= (buf[i] & 0x0F);
+        if(i % 2 == 0) { /* Set low nibble, the first sample */
+            left[i / 2] = (buf[i] >> 4) & 0x0F;
+            right[i / 2] = buf[i] & 0x0F;
+        } else { /* Set high nibble to complete the byte */
+            left[i / 2] |= buf[i] & 0xF0;
+            right[i / 2] |= (buf[i] & 0x0F) << 4;
         }
     }
 
@@ -333,14 +256,64 @@ cleanup:
     return result;
 }
 
+/* One channel of one chunk, which may be encoded on its own thread */
+typedef struct encjob {
+    kos_adpcm_state_t enc, dec;
+    const int16_t *pcm;
+    int stride;
+    size_t count, avail;
+    uint8_t *out;
+    int16_t *check;
+    double signal, noise;
+} encjob_t;
+
+static void *encode_channel(void *data) {
+    encjob_t *j = (encjob_t *)data;
+    size_t i;
+    double d;
+
+    if(quality)
+        kos_adpcm_search(&j->enc, j->out, j->pcm, j->count, j->avail,
+                         j->stride, quality);
+    else
+        kos_adpcm_encode(&j->enc, j->out, j->pcm, j->count, j->stride);
+
+    /* Decode it again to see how close it got */
+    if(verbose) {
+        kos_adpcm_decode(&j->dec, j->check, j->out, j->count, 1);
+
+        for(i = 0; i < j->count; i++) {
+            d = j->pcm[i * j->stride];
+            j->signal += d * d;
+            d -= j->check[i];
+            j->noise += d * d;
+        }
+    }
+
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Convert a file a chunk at a time, so that only a little of it is ever in
+   memory. Stereo files have their channels encoded on two threads. */
 int wav2adpcm(const char *infile, const char *outfile) {
     wavhdr_t wavhdr;
     wavhdr_chunk_t wavhdr_chunk;
     FILE *in, *out = NULL;
-    size_t pcmsize, adpcmsize;
+    size_t frames, adpcmsize, have = 0, done = 0, want, count, half;
     int16_t *pcmbuf = NULL;
     uint8_t *adpcmbuf = NULL;
-    int result = 0;
+    encjob_t jobs[2];
+    pthread_t thread;
+    long dataoff = 0;
+    double start, signal = 0, noise = 0;
+    int result = 0, channels, threaded, c;
 
     in = fopen(infile, "rb");
     if(!in) {
@@ -354,12 +327,6 @@ int wav2adpcm(const char *infile, const char *outfile) {
         return -1;
     }
 
-    // printf("Header size, %d bytes\n", wavhdr.hdrsize);
-    // printf("Format: %#x\n", wavhdr.format);
-    // printf("Channels: %d\n", wavhdr.channels);
-    // printf("Freq: %d\n", wavhdr.freq);
-    // printf("Bit depth: %d\n", wavhdr.bits_per_sample);
-
     /* If the input is the desired output format, just copy */
     if(wavhdr.format == WAVE_FMT_YAMAHA_ADPCM ||
        wavhdr.format == WAVE_FMT_YAMAHA_ADPCM_ITU_G723) {
@@ -371,38 +338,21 @@ int wav2adpcm(const char *infile, const char *outfile) {
         return -1;
     }
 
-    pcmsize = wavhdr_chunk.datasize;
-    adpcmsize = pcmsize / 4;
+    /* Each channel gets a whole number of bytes, two samples each */
+    channels = wavhdr.channels;
+    frames = (wavhdr_chunk.datasize / (2 * channels)) & ~(size_t)1;
+    adpcmsize = channels * frames / 2;
 
-    pcmbuf = malloc(pcmsize);
-    adpcmbuf = malloc(adpcmsize);
-    if(!pcmbuf || !adpcmbuf) {
+    pcmbuf = malloc((CHUNK_FRAMES + KOS_ADPCM_DEPTH_MAX) * 2 * channels);
+    adpcmbuf = malloc(CHUNK_FRAMES / 2 * channels);
+    jobs[0].check = malloc(CHUNK_FRAMES * 2 * channels);
+    jobs[1].check = jobs[0].check + CHUNK_FRAMES;
+    if(!pcmbuf || !adpcmbuf || !jobs[0].check) {
         fprintf(stderr, "Memory allocation failed.\n");
         result = -1;
         goto cleanup;
     }
 
-    if(fread(pcmbuf, pcmsize, 1, in) != 1) {
-        fprintf(stderr, "Cannot read data.\n");
-        result = -1;
-        goto cleanup;
-    }
-    fclose(in);
-    in = NULL;
-
-    if(wavhdr.channels == 1)
-        pcm2adpcm(adpcmbuf, pcmbuf, pcmsize);
-    else {
-        /* For stereo we just deinterleave the input and store the
-           left and right channel of the ADPCM data separately. */
-        deinterleave(pcmbuf, pcmsize);
-        pcm2adpcm(adpcmbuf, pcmbuf, pcmsize / 2);
-        pcm2adpcm(adpcmbuf + adpcmsize / 2, pcmbuf + pcmsize / 4,  pcmsize / 2);
-
-        if(interleaved)
-            interleave_adpcm(adpcmbuf, adpcmsize);
-    }
-
     out = fopen(outfile, "wb");
     if(!out) {
         fprintf(stderr, "Cannot open output file for writing.\n");
@@ -410,15 +360,7 @@ int wav2adpcm(const char *infile, const char *outfile) {
         goto cleanup;
     }
 
-    if(no_header) {
-        /* Just write the body */
-        if(fwrite(adpcmbuf, adpcmsize, 1, out) != 1) {
-            fprintf(stderr, "Cannot write ADPCM data.\n");
-            result = -1;
-            goto cleanup;
-        }
-    }
-    else {
+    if(!no_header) {
         /* Build header */
         wavhdr.hdrsize = 0x10;
         wavhdr.format = interleaved ? WAVE_FMT_YAMAHA_ADPCM : WAVE_FMT_YAMAHA_ADPCM_ITU_G723;
@@ -426,23 +368,109 @@ int wav2adpcm(const char *infile, const char *outfile) {
         wavhdr.block_align = (wavhdr.channels * wavhdr.bits_per_sample) / 8;
         wavhdr.byte_per_sec = (wavhdr.freq * wavhdr.channels * wavhdr.bits_per_sample) / 8;
         wavhdr.totalsize = adpcmsize + sizeof(wavhdr) + sizeof(wavhdr_chunk) - 8;
-        
+
         memcpy(wavhdr_chunk.hdr3, "data", 4);
         wavhdr_chunk.datasize = adpcmsize;
 
-        /* Write the whole file */
         if(fwrite(&wavhdr, sizeof(wavhdr), 1, out) != 1 ||
-           fwrite(&wavhdr_chunk, sizeof(wavhdr_chunk), 1, out) != 1 ||
-           fwrite(adpcmbuf, adpcmsize, 1, out) != 1) {
+           fwrite(&wavhdr_chunk, sizeof(wavhdr_chunk), 1, out) != 1) {
             fprintf(stderr, "Cannot write ADPCM data.\n");
             result = -1;
             goto cleanup;
         }
+
+        dataoff = sizeof(wavhdr) + sizeof(wavhdr_chunk);
+    }
+
+    for(c = 0; c < channels; c++) {
+        kos_adpcm_reset(&jobs[c].enc);
+        kos_adpcm_reset(&jobs[c].dec);
+        jobs[c].signal = jobs[c].noise = 0;
+    }
+
+    start = now();
+
+    while(done < frames) {
+        /* Keep a few frames after the chunk, for the search to look at */
+        want = frames - done;
+        if(want > CHUNK_FRAMES + KOS_ADPCM_DEPTH_MAX)
+            want = CHUNK_FRAMES + KOS_ADPCM_DEPTH_MAX;
+
+        if(want > have) {
+            if(fread(pcmbuf + have * channels, 2 * channels, want - have, in) != want - have) {
+                fprintf(stderr, "Cannot read data.\n");
+                result = -1;
+                goto cleanup;
+            }
+
+            have = want;
+        }
+
+        count = frames - done < CHUNK_FRAMES ? frames - done : CHUNK_FRAMES;
+        half = count / 2;
+
+        for(c = 0; c < channels; c++) {
+            jobs[c].pcm = pcmbuf + c;
+            jobs[c].stride = channels;
+            jobs[c].count = count;
+            jobs[c].avail = have;
+            jobs[c].out = adpcmbuf + c * half;
+        }
+
+        threaded = channels == 2 &&
+                   !pthread_create(&thread, NULL, encode_channel, &jobs[1]);
+        encode_channel(&jobs[0]);
+
+        if(threaded)
+            pthread_join(thread, NULL);
+        else if(channels == 2)
+            encode_channel(&jobs[1]);
+
+        if(channels == 2 && interleaved)
+            interleave_adpcm(adpcmbuf, count);
+
+        if(channels == 1 || interleaved) {
+            if(fwrite(adpcmbuf, half * channels, 1, out) != 1) {
+                fprintf(stderr, "Cannot write ADPCM data.\n");
+                result = -1;
+                goto cleanup;
+            }
+        }
+        else {
+            /* The left channel comes first, then all of the right one */
+            if(fseek(out, dataoff + done / 2, SEEK_SET) ||
+               fwrite(adpcmbuf, half, 1, out) != 1 ||
+               fseek(out, dataoff + frames / 2 + done / 2, SEEK_SET) ||
+               fwrite(adpcmbuf + half, half, 1, out) != 1) {
+                fprintf(stderr, "Cannot write ADPCM data.\n");
+                result = -1;
+                goto cleanup;
+            }
+        }
+
+        memmove(pcmbuf, pcmbuf + count * channels, (have - count) * 2 * channels);
+        have -= count;
+        done += count;
+    }
+
+    if(verbose) {
+        for(c = 0; c < channels; c++) {
+            signal += jobs[c].signal;
+            noise += jobs[c].noise;
+        }
+
+        printf("%s: SNR %.2f dB, %.1fx realtime\n", infile,
+               noise > 0 ? 10 * log10(signal / noise) : INFINITY,
+               (double)frames / wavhdr.freq / (now() - start));
     }
 
 cleanup:
     if(in) fclose(in);
-    if(out) fclose(out);
+    if(out && fclose(out) && !result) {
+        fprintf(stderr, "Cannot write ADPCM data.\n");
+        result = -1;
+    }
+    if(jobs[0].check) free(jobs[0].check);
     if(adpcmbuf) free(adpcmbuf);
     if(pcmbuf) free(pcmbuf);
 
@@ -574,17 +602,22 @@ void usage() {
            "    wav2adpcm -f <infile.wav> <outfile.wav>       (From ADPCM)\n"
            "    wav2adpcm -n -i -t <infile.wav> <outfile.wav> (To ADPCM interleaved without a header)\n"
            "    wav2adpcm -n -f <infile.wav> <outfile.wav>    (From ADPCM without a header)\n"
+           "    wav2adpcm -v -q 4 -t <infile.wav> <outfile.wav> (To ADPCM with less noise)\n"
            "\n"
            "Options:\n"
            "    -t    Convert 16-bit WAV to AICA ADPCM.\n"
            "    -f    Convert AICA ADPCM back to 16-bit WAV.\n"
            "    -i    Optional parameter to output interleaved adpcm data (use with -t).\n"
            "    -n    Optional parameter to output headerless pcm/adpcm data (use with -t or -f).\n"
+           "    -q N  Search N samples ahead for the codes with the least noise, from 1 to %d.\n"
+           "          Higher is slower. 0, the default, is the fast encoder (use with -t).\n"
+           "    -v    Print the signal to noise ratio and the speed (use with -t).\n"
            "    -h    Prints this usage information.\n"
            "\n"
            "Note:\n"
            "If you are having trouble with your input WAV file, you can preprocess it using ffmpeg:\n"
-           "    ffmpeg -i input.wav -ac 1 -acodec pcm_s16le output.wav\n"
+           "    ffmpeg -i input.wav -ac 1 -acodec pcm_s16le output.wav\n",
+           KOS_ADPCM_DEPTH_MAX
           );
 }
 
@@ -617,6 +650,26 @@ int main(int argc, char **argv) {
             }
             interleaved = 1;
         }
+        else if(!strcmp(argv[i], "-q") && i + 1 < argc) {
+            if(t_flag_pos) {
+                fprintf(stderr, "-q flag must come before -t\n");
+                usage();
+                return -1;
+            }
+            quality = atoi(argv[++i]);
+            if(quality < 0 || quality > KOS_ADPCM_DEPTH_MAX) {
+                fprintf(stderr, "-q has to be from 0 to %d\n", KOS_ADPCM_DEPTH_MAX);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "-v")) {
+            if(t_flag_pos) {
+                fprintf(stderr, "-v flag must come before -t\n");
+                usage();
+                return -1;
+            }
+            verbose = 1;
+        }
         else if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "-f")) {
             if(t_flag_pos) {
                 fprintf(stderr, "Only one of -t or -f is allowed\n");
@@ -633,9 +686,9 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    /* Ensure -i is only used with -t */
-    if(interleaved && strcmp(argv[t_flag_pos], "-t") != 0) {
-        fprintf(stderr, "-i flag can only be used with -t\n");
+    /* Ensure -i, -q and -v are only used with -t */
+    if((interleaved || quality || verbose) && strcmp(argv[t_flag_pos], "-t") != 0) {
+        fprintf(stderr, "-i, -q and -v flags can only be used with -t\n");
         usage();
         return -1;
     }